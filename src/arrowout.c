@@ -0,0 +1,469 @@
+/* Arrow IPC output API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "htslib/kstring.h"
+#include "config.h"
+#include "jfile.h"
+#include "arrowout.h"
+
+/*
+ * Flatbuffers Builder
+ * The metadata of each IPC message is one flatbuffer. It is built front to back here: a table is written before
+ * the objects it refers to, whose offsets are patched once they are written, as offsets of flatbuffers are
+ * unsigned and must point forward. Refer to Message.fbs and Schema.fbs of Arrow for the tables.
+ */
+
+typedef struct {
+    uint8_t *a;
+    size_t n, m;
+} arw_buf_t;
+
+/*@abstract  Append @p l zero bytes after padding the buffer with zeros to a multiple of @p align.
+@return      Position of the appended bytes if success, -1 otherwise.
+ */
+static long buf_alloc(arw_buf_t *b, size_t l, size_t align) {
+    size_t p = (b->n + align - 1) / align * align, m;
+    uint8_t *a;
+    if (p + l > b->m) {
+        for (m = b->m ? b->m : 1024; m < p + l; m <<= 1) ;
+        if (NULL == (a = (uint8_t*) realloc(b->a, m))) { return -1; }
+        b->a = a; b->m = m;
+    }
+    memset(b->a + b->n, 0, p + l - b->n);
+    b->n = p + l;
+    return (long) p;
+}
+
+/*@abstract  Append @p l bytes of @p x.
+@return      0 if success, -1 otherwise.
+ */
+static int buf_push(arw_buf_t *b, const void *x, size_t l) {
+    long p;
+    if ((p = buf_alloc(b, l, 1)) < 0) { return -1; }
+    memcpy(b->a + p, x, l);
+    return 0;
+}
+
+#define buf_set(b, p, x, l) memcpy((b)->a + (p), (x), (l))
+
+/*@abstract  Set the offset at @p at to refer to the object at @p to.
+ */
+static void fb_ref(arw_buf_t *b, long at, long to) {
+    uint32_t v = to - at;
+    buf_set(b, at, &v, 4);
+}
+
+/*@abstract  Write a table and its vtable with all fields zeroed.
+@param n     Num of fields.
+@param sz    Sizes of the fields, 1, 2, 4 or 8, 0 for absent fields. Offsets of other objects are of size 4.
+@param f     Positions of the fields, set by this function (-1 for absent fields).
+@return      Position of the table if success, -1 otherwise.
+ */
+static long fb_table(arw_buf_t *b, int n, const int *sz, long *f) {
+    uint16_t off[16], u;
+    int32_t so;
+    long vt, t;
+    int i, l = 4;       // the table begins with the signed offset to its vtable.
+    if (n > 16) { return -1; }
+    for (i = 0; i < n; i++) {
+        if (sz[i] <= 0) { off[i] = 0; continue; }
+        l = (l + sz[i] - 1) / sz[i] * sz[i];
+        off[i] = l; l += sz[i];
+    }
+    if ((vt = buf_alloc(b, 4 + 2 * n, 2)) < 0) { return -1; }
+    u = 4 + 2 * n; buf_set(b, vt, &u, 2);
+    u = l; buf_set(b, vt + 2, &u, 2);
+    if (n) { buf_set(b, vt + 4, off, 2 * n); }
+    if ((t = buf_alloc(b, l, 8)) < 0) { return -1; }
+    so = t - vt; buf_set(b, t, &so, 4);
+    for (i = 0; i < n; i++) { f[i] = off[i] ? t + off[i] : -1; }
+    return t;
+}
+
+/*@abstract  Write a vector of @p n zeroed elements of size @p esz, aligned to @p align (4 or 8).
+@return      Position of the vector (its length) if success, -1 otherwise. Elements begin at position + 4.
+ */
+static long fb_vec(arw_buf_t *b, uint32_t n, size_t esz, size_t align) {
+    long p;
+    if (buf_alloc(b, 0, 4) < 0) { return -1; }
+    if (8 == align && 0 == b->n % 8 && buf_alloc(b, 4, 4) < 0) { return -1; }
+    if ((p = buf_alloc(b, 4 + n * esz, 4)) < 0) { return -1; }
+    buf_set(b, p, &n, 4);
+    return p;
+}
+
+/*@abstract  Write a NUL-terminated string.
+@return      Position of the string if success, -1 otherwise.
+ */
+static long fb_str(arw_buf_t *b, const char *s) {
+    uint32_t l = strlen(s);
+    long p;
+    if ((p = buf_alloc(b, 4 + l + 1, 4)) < 0) { return -1; }
+    buf_set(b, p, &l, 4);
+    buf_set(b, p + 4, s, l);
+    return p;
+}
+
+#define ARW_METADATA_V5   4     // MetadataVersion::V5
+#define ARW_HDR_SCHEMA    1     // MessageHeader::Schema
+#define ARW_HDR_BATCH     3     // MessageHeader::RecordBatch
+#define ARW_TYPE_INT      2     // Type::Int
+#define ARW_TYPE_UTF8     5     // Type::Utf8
+
+/*@abstract  Reset the buffer and write the root Message table.
+@param ht    Type of the header.
+@param bl    Length of the message body.
+@return      Position of the offset of the header if success, -1 otherwise.
+ */
+static long fb_message(arw_buf_t *b, uint8_t ht, int64_t bl) {
+    int sz[4] = {2, 1, 4, 8};    // version, header_type, header, bodyLength
+    int16_t ver = ARW_METADATA_V5;
+    long f[4], t;
+    b->n = 0;
+    if (buf_alloc(b, 4, 4) < 0 || (t = fb_table(b, 4, sz, f)) < 0) { return -1; }
+    fb_ref(b, 0, t);
+    buf_set(b, f[0], &ver, 2); buf_set(b, f[1], &ht, 1); buf_set(b, f[3], &bl, 8);
+    return f[2];
+}
+
+/*
+ * Arrow Stream Writer
+ */
+
+#define ARW_U32   1
+#define ARW_I64   2
+#define ARW_UTF8  3
+
+/*@abstract  One column of the current record batch.
+@param data  Values, or bytes of the strings.
+@param offs  Int32 offsets of the strings, whose first value is 0.
+ */
+typedef struct {
+    const char *name;
+    int type;
+    arw_buf_t data, offs;
+} arw_col_t;
+
+typedef struct {
+    FILE *fp;
+    arw_col_t *col;
+    int ncol;
+    arw_buf_t meta;
+} arw_t;
+
+static int arw_close(arw_t *a, int flush);
+
+/*@abstract  Num of rows of one column in the current record batch.
+ */
+static size_t arw_col_nrow(arw_col_t *c) {
+    if (ARW_UTF8 == c->type) { return c->offs.n / 4 - 1; }
+    return c->data.n / (ARW_U32 == c->type ? 4 : 8);
+}
+
+/*@abstract  Empty the columns for the next record batch.
+@return      0 if success, -1 otherwise.
+ */
+static int arw_reset(arw_t *a) {
+    int32_t zero = 0;
+    int i;
+    for (i = 0; i < a->ncol; i++) {
+        a->col[i].data.n = a->col[i].offs.n = 0;
+        if (ARW_UTF8 == a->col[i].type && buf_push(&a->col[i].offs, &zero, 4) < 0) { return -1; }
+    }
+    return 0;
+}
+
+/*@abstract  Write the metadata in a->meta as one message, i.e., continuation marker, length and the flatbuffer.
+@return      0 if success, -1 otherwise.
+ */
+static int arw_write_meta(arw_t *a) {
+    int32_t v[2];
+    if (buf_alloc(&a->meta, 0, 8) < 0) { return -1; }
+    v[0] = -1; v[1] = a->meta.n;
+    if (fwrite(v, 4, 2, a->fp) != 2 || fwrite(a->meta.a, 1, a->meta.n, a->fp) != a->meta.n) { return -1; }
+    return 0;
+}
+
+/*@abstract  Write the Schema message.
+@return      0 if success, -1 otherwise.
+ */
+static int arw_schema(arw_t *a) {
+    int sz_s[2] = {0, 4};                 // endianness (little by default), fields
+    int sz_f[6] = {4, 1, 1, 4, 0, 4};     // name, nullable, type_type, type, dictionary, children
+    int sz_i[2] = {4, 1};                 // bitWidth, is_signed
+    arw_buf_t *b = &a->meta;
+    long h, t, v, p, fs[2], ff[6], fi[2];
+    int32_t w;
+    uint8_t tt, sg;
+    int i;
+    if ((h = fb_message(b, ARW_HDR_SCHEMA, 0)) < 0 || (t = fb_table(b, 2, sz_s, fs)) < 0) { return -1; }
+    fb_ref(b, h, t);
+    if ((v = fb_vec(b, a->ncol, 4, 4)) < 0) { return -1; }
+    fb_ref(b, fs[1], v);
+    for (i = 0; i < a->ncol; i++) {
+        if ((t = fb_table(b, 6, sz_f, ff)) < 0) { return -1; }
+        fb_ref(b, v + 4 + 4 * i, t);
+        tt = ARW_UTF8 == a->col[i].type ? ARW_TYPE_UTF8 : ARW_TYPE_INT;
+        buf_set(b, ff[2], &tt, 1);
+        if ((p = fb_str(b, a->col[i].name)) < 0) { return -1; }
+        fb_ref(b, ff[0], p);
+        if (ARW_TYPE_INT == tt) {
+            if ((p = fb_table(b, 2, sz_i, fi)) < 0) { return -1; }
+            w = ARW_U32 == a->col[i].type ? 32 : 64; sg = ARW_I64 == a->col[i].type;
+            buf_set(b, fi[0], &w, 4); buf_set(b, fi[1], &sg, 1);
+        } else if ((p = fb_table(b, 0, NULL, NULL)) < 0) { return -1; }
+        fb_ref(b, ff[3], p);
+        if ((p = fb_vec(b, 0, 4, 4)) < 0) { return -1; }
+        fb_ref(b, ff[5], p);
+    }
+    return arw_write_meta(a);
+}
+
+/*@abstract  Write the rows pushed so far as one RecordBatch message, nothing is written if there is no row.
+@return      0 if success, -1 otherwise.
+ */
+static int arw_flush(arw_t *a) {
+    static const uint8_t pad[8] = {0};
+    int sz_r[3] = {8, 4, 4};              // length, nodes, buffers
+    arw_buf_t *b = &a->meta, *d[2];
+    long h, t, v, u, f[3];
+    int64_t nrow, x[2], off = 0;
+    size_t l;
+    int i, j, k, nbuf = 0, nd;
+    if (0 == a->ncol || 0 == (nrow = arw_col_nrow(a->col))) { return 0; }
+    for (i = 0; i < a->ncol; i++) {
+        if (arw_col_nrow(a->col + i) != (size_t) nrow) { return -1; }
+        nbuf += ARW_UTF8 == a->col[i].type ? 3 : 2;
+    }
+    for (i = 0; i < a->ncol; i++) {
+        off += (a->col[i].data.n + 7) / 8 * 8;
+        if (ARW_UTF8 == a->col[i].type) { off += (a->col[i].offs.n + 7) / 8 * 8; }
+    }
+    if ((h = fb_message(b, ARW_HDR_BATCH, off)) < 0 || (t = fb_table(b, 3, sz_r, f)) < 0) { return -1; }
+    fb_ref(b, h, t);
+    buf_set(b, f[0], &nrow, 8);
+    if ((v = fb_vec(b, a->ncol, 16, 8)) < 0) { return -1; }
+    fb_ref(b, f[1], v);
+    x[0] = nrow; x[1] = 0;                // FieldNode: length, null_count
+    for (i = 0; i < a->ncol; i++) { buf_set(b, v + 4 + 16 * i, x, 16); }
+    if ((u = fb_vec(b, nbuf, 16, 8)) < 0) { return -1; }
+    fb_ref(b, f[2], u);
+    for (i = 0, k = 0, off = 0; i < a->ncol; i++) {
+        x[0] = off; x[1] = 0;             // Buffer: offset, length. The validity bitmap is omitted as no null.
+        buf_set(b, u + 4 + 16 * k++, x, 16);
+        d[0] = &a->col[i].offs; d[1] = &a->col[i].data;
+        for (j = ARW_UTF8 == a->col[i].type ? 0 : 1; j < 2; j++) {
+            x[0] = off; x[1] = d[j]->n;
+            buf_set(b, u + 4 + 16 * k++, x, 16);
+            off += (d[j]->n + 7) / 8 * 8;
+        }
+    }
+    if (arw_write_meta(a) < 0) { return -1; }
+    for (i = 0; i < a->ncol; i++) {
+        d[0] = &a->col[i].offs; d[1] = &a->col[i].data;
+        for (j = ARW_UTF8 == a->col[i].type ? 0 : 1; j < 2; j++) {
+            nd = d[j]->n;
+            l = (nd + 7) / 8 * 8 - nd;
+            if (fwrite(d[j]->a, 1, nd, a->fp) != (size_t) nd || fwrite(pad, 1, l, a->fp) != l) { return -1; }
+        }
+    }
+    return arw_reset(a);
+}
+
+/*@abstract  Create the stream and write its schema.
+@param names, types  Names and types of the columns.
+@param n     Num of columns.
+@return      Pointer of arw_t if success, NULL otherwise.
+ */
+static arw_t* arw_open(const char *fn, const char **names, const int *types, int n) {
+    arw_t *a;
+    int i;
+    if (NULL == (a = (arw_t*) calloc(1, sizeof(arw_t)))) { return NULL; }
+    if (NULL == (a->col = (arw_col_t*) calloc(n, sizeof(arw_col_t)))) { goto fail; }
+    a->ncol = n;
+    for (i = 0; i < n; i++) { a->col[i].name = names[i]; a->col[i].type = types[i]; }
+    if (NULL == (a->fp = fopen(fn, "wb"))) { goto fail; }
+    if (arw_reset(a) < 0 || arw_schema(a) < 0) { goto fail; }
+    return a;
+  fail:
+    fprintf(stderr, "[E::%s] failed to create '%s'.\n", __func__, fn);
+    arw_close(a, 0);
+    return NULL;
+}
+
+/*@abstract  Flush the rows if @p flush, write the end-of-stream marker, close the stream and free the structure.
+@return      0 if success, -1 otherwise.
+ */
+static int arw_close(arw_t *a, int flush) {
+    int32_t eos[2] = {-1, 0};
+    int i, ret = 0;
+    if (NULL == a) { return 0; }
+    if (a->fp) {
+        if (flush && (arw_flush(a) < 0 || fwrite(eos, 4, 2, a->fp) != 2)) { ret = -1; }
+        if (fclose(a->fp) != 0) { ret = -1; }
+    }
+    if (a->col) {
+        for (i = 0; i < a->ncol; i++) { free(a->col[i].data.a); free(a->col[i].offs.a); }
+        free(a->col);
+    }
+    free(a->meta.a);
+    free(a);
+    return ret;
+}
+
+#define arw_u32(a, i, v) arw_push_val(a, i, v, 4)
+#define arw_i64(a, i, v) arw_push_val(a, i, v, 8)
+
+static int arw_push_val(arw_t *a, int i, int64_t v, size_t l) {
+    if (4 == l) {
+        uint32_t u = v;
+        return buf_push(&a->col[i].data, &u, 4);
+    }
+    return buf_push(&a->col[i].data, &v, 8);
+}
+
+static int arw_str(arw_t *a, int i, const char *s) {
+    int32_t o;
+    if (buf_push(&a->col[i].data, s, strlen(s)) < 0) { return -1; }
+    o = a->col[i].data.n;
+    return buf_push(&a->col[i].offs, &o, 4);
+}
+
+/*
+ * Arrow IPC Output API
+ */
+
+/*@abstract  The counts of one SNP in one tmp mtx file.
+ */
+typedef struct {
+    uint32_t *smp, *val;
+    size_t n, m;
+} arw_blk_t;
+
+/*@abstract  Read the records of the next SNP.
+@return      1 if a SNP is read, 0 if the end of file, -1 otherwise.
+ */
+static int blk_read(jfile_t *fp, arw_blk_t *b, kstring_t *s) {
+    uint32_t *p;
+    char *q;
+    b->n = 0;
+    for (ks_clear(s); jf_getln(fp, s) >= 0; ks_clear(s)) {
+        if (0 == ks_len(s)) { return 1; }    // empty line, meaning ending of a SNP.
+        if (b->n >= b->m) {
+            b->m = b->m ? b->m << 1 : 1024;
+            if (NULL == (p = (uint32_t*) realloc(b->smp, b->m * sizeof(uint32_t)))) { return -1; }
+            b->smp = p;
+            if (NULL == (p = (uint32_t*) realloc(b->val, b->m * sizeof(uint32_t)))) { return -1; }
+            b->val = p;
+        }
+        b->smp[b->n] = strtoul(ks_str(s), &q, 10);
+        b->val[b->n] = strtoul(q, NULL, 10);
+        if (b->smp[b->n] < 1) { return -1; }
+        b->smp[b->n++]--;                   // to 0-based.
+    }
+    return b->n ? -1 : 0;
+}
+
+int csp_arrow_write_tag(const char *fn, jfile_t **ad, jfile_t **dp, jfile_t **oth, int n, size_t ns) {
+    const char *names[5] = {"snp_idx", "cell_idx", "ad", "dp", "oth"};
+    const int types[5] = {ARW_U32, ARW_U32, ARW_U32, ARW_U32, ARW_U32};
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    jfile_t **in[3];
+    arw_blk_t blk[3];
+    arw_t *a;
+    size_t k = 0, x[3];
+    uint32_t c;
+    int i = 0, j, r, ret = -1;
+    memset(blk, 0, sizeof(blk));
+    in[0] = ad; in[1] = dp; in[2] = oth;
+    if (NULL == (a = arw_open(fn, names, types, 5))) { return -1; }
+    for (; i < n; i++) {
+        for (j = 0; j < 3; j++) {
+            if (jf_open(in[j][i], "rb") <= 0) { goto clean; }
+        }
+        while ((r = blk_read(ad[i], blk, s)) > 0) {
+            if (blk_read(dp[i], blk + 1, s) <= 0 || blk_read(oth[i], blk + 2, s) <= 0) { goto clean; }
+            x[0] = x[1] = x[2] = 0;
+            for (;;) {           // merge the three sorted records of the SNP.
+                c = UINT32_MAX;
+                for (j = 0; j < 3; j++) {
+                    if (x[j] < blk[j].n && blk[j].smp[x[j]] < c) { c = blk[j].smp[x[j]]; }
+                }
+                if (UINT32_MAX == c) { break; }
+                if (arw_u32(a, 0, k) < 0 || arw_u32(a, 1, c) < 0) { goto clean; }
+                for (j = 0; j < 3; j++) {
+                    if (x[j] < blk[j].n && blk[j].smp[x[j]] == c) {
+                        if (arw_u32(a, j + 2, blk[j].val[x[j]++]) < 0) { goto clean; }
+                    } else if (arw_u32(a, j + 2, 0) < 0) { goto clean; }
+                }
+            }
+            k++;
+            if (arw_col_nrow(a->col) >= CSP_ARROW_BATCH && arw_flush(a) < 0) { goto clean; }
+        }
+        if (r < 0 || blk_read(dp[i], blk + 1, s) != 0 || blk_read(oth[i], blk + 2, s) != 0) { goto clean; }
+        for (j = 0; j < 3; j++) { jf_close(in[j][i]); }
+    }
+    if (k == ns) { ret = 0; }
+  clean:
+    if (i < n) {
+        for (j = 0; j < 3; j++) {
+            if (jf_isopen(in[j][i])) { jf_close(in[j][i]); }
+        }
+    }
+    if (arw_close(a, ret >= 0) < 0) { ret = -1; }
+    for (j = 0; j < 3; j++) { free(blk[j].smp); free(blk[j].val); }
+    ks_free(s);
+    if (ret < 0) { fprintf(stderr, "[E::%s] failed to write '%s'.\n", __func__, fn); }
+    return ret;
+}
+
+int csp_arrow_write_snp(const char *fn, jfile_t **site, int n, size_t ns) {
+#define ARW_NSITE  7
+    const char *names[ARW_NSITE] = {"chrom", "pos", "ref", "alt", "AD", "DP", "OTH"};
+    const int types[ARW_NSITE] = {ARW_UTF8, ARW_I64, ARW_UTF8, ARW_UTF8, ARW_U32, ARW_U32, ARW_U32};
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    char *f[ARW_NSITE], *p;
+    arw_t *a;
+    size_t k = 0;
+    int i = 0, j, in_snp = 0, ret = -1;
+    if (NULL == (a = arw_open(fn, names, types, ARW_NSITE))) { return -1; }
+    for (; i < n; i++) {
+        if (jf_open(site[i], "rb") <= 0) { goto clean; }
+        for (ks_clear(s); jf_getln(site[i], s) >= 0; ks_clear(s)) {
+            if (0 == ks_len(s)) {         // empty line, meaning ending of a SNP.
+                if (! in_snp) { goto clean; }
+                k++; in_snp = 0;
+                if (arw_col_nrow(a->col + ARW_NSITE - 1) >= CSP_ARROW_SNP_BATCH && arw_flush(a) < 0) { goto clean; }
+                continue;
+            }
+            if (in_snp) { continue; }     // only the first line of a SNP, i.e., its info, is used.
+            for (j = 0, p = ks_str(s); j < ARW_NSITE; j++) {
+                f[j] = p;
+                if (j < ARW_NSITE - 1) {
+                    if (NULL == (p = strchr(p, '\t'))) { goto clean; }
+                    *p++ = '\0';
+                }
+            }
+            if (arw_str(a, 0, f[0]) < 0 || arw_i64(a, 1, strtol(f[1], NULL, 10)) < 0 || \
+                arw_str(a, 2, f[2]) < 0 || arw_str(a, 3, f[3]) < 0) { goto clean; }
+            for (j = 4; j < ARW_NSITE; j++) {
+                if (arw_u32(a, j, strtoul(f[j], NULL, 10)) < 0) { goto clean; }
+            }
+            in_snp = 1;
+        }
+        jf_close(site[i]);
+    }
+    if (k == ns && ! in_snp) { ret = 0; }
+  clean:
+    if (i < n && jf_isopen(site[i])) { jf_close(site[i]); }
+    if (arw_close(a, ret >= 0) < 0) { ret = -1; }
+    ks_free(s);
+    if (ret < 0) { fprintf(stderr, "[E::%s] failed to write '%s'.\n", __func__, fn); }
+    return ret;
+#undef ARW_NSITE
+}
@@ -0,0 +1,42 @@
+/* Arrow IPC output API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#ifndef CSP_ARROWOUT_H
+#define CSP_ARROWOUT_H
+
+#include <stdio.h>
+#include "jfile.h"
+
+/*
+ * Arrow IPC Output API
+ * The counts of one output set are written into two files of the Arrow IPC streaming format, refer to
+ * doc/arrow.rst for the schemas. The writer is native, i.e., no Arrow library is needed.
+ * Only little-endian hosts are supported.
+ */
+
+#define CSP_ARROW_BATCH       (1 << 20)   // min num of rows of each record batch of the counts, a SNP is never split.
+#define CSP_ARROW_SNP_BATCH   (1 << 16)   // num of rows of each record batch of the SNPs.
+
+/*@abstract    Write the Arrow stream of the counts from the tmp mtx files of the threads.
+@param fn      Filename of the stream.
+@param ad, dp, oth  Arrays of tmp mtx files, one for each thread, whose records are "<sample>\t<value>" and each
+                    SNP ends with an empty line.
+@param n       Size of the arrays.
+@param ns      Num of SNPs.
+@return        0 if success, -1 otherwise.
+@note          Each row is one (SNP, cell) pair with any non-zero count.
+ */
+int csp_arrow_write_tag(const char *fn, jfile_t **ad, jfile_t **dp, jfile_t **oth, int n, size_t ns);
+
+/*@abstract    Write the Arrow stream of the SNPs from the tmp site files of the threads.
+@param fn      Filename of the stream.
+@param site    Array of tmp site files, one for each thread. Each SNP is one line of
+               "<chrom>\t<pos>\t<ref>\t<alt>\t<AD>\t<DP>\t<OTH>", optionally followed by other lines,
+               and ends with an empty line.
+@param n       Size of the array.
+@param ns      Num of SNPs.
+@return        0 if success, -1 otherwise.
+ */
+int csp_arrow_write_snp(const char *fn, jfile_t **site, int n, size_t ns);
+
+#endif
@@ -0,0 +1,233 @@
+/* Binary sparse matrix API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include "config.h"
+#include "kvec.h"
+#include "bmtx.h"
+
+/*
+ * Binary Sparse Matrix API
+ * All integers are written in the byte order of the host, i.e. little-endian on the supported platforms.
+ */
+
+#define bmtx_fwrite(p, x, size) (fwrite(x, 1, size, (p)->fp) == (size) ? ((p)->off += (size), 0) : -1)
+
+/*@abstract  Ensure the size of a buffer.
+@return      0 if success, -1 otherwise.
+ */
+static int bmtx_buf_resize(uint8_t **buf, size_t *m, size_t size) {
+    uint8_t *t;
+    if (size <= *m) { return 0; }
+    if (NULL == (t = (uint8_t*) realloc(*buf, size))) { return -1; }
+    *buf = t; *m = size;
+    return 0;
+}
+
+static void bmtx_free(csp_bmtx_t *p) {
+    if (NULL == p) { return; }
+    kv_destroy(p->idx);
+    kv_destroy(p->rp); kv_destroy(p->col); kv_destroy(p->val);
+    free(p->buf); free(p->zbuf);
+    free(p);
+}
+
+csp_bmtx_t* csp_bmtx_create(const char *fn, uint32_t nsnp, uint32_t nsmp, uint64_t nnz, int nval) {
+    csp_bmtx_t *p;
+    uint32_t u[4] = {CSP_BMTX_VERSION, 1, nsnp, nsmp};     // flags: bit 0 means chunks are zlib-compressed.
+    if (nval < 1 || nval > CSP_BMTX_MAX_NVAL) { return NULL; }
+    u[1] |= (uint32_t) (nval - 1) << 8;                    // flags: bits 8-15 are num of values minus 1.
+    if (NULL == (p = (csp_bmtx_t*) calloc(1, sizeof(csp_bmtx_t)))) { return NULL; }
+    kv_init(p->idx); kv_init(p->rp); kv_init(p->col); kv_init(p->val);
+    p->is_w = 1; p->nsnp = nsnp; p->nsmp = nsmp; p->nnz = nnz; p->nval = nval;
+    kv_push(uint32_t, p->rp, 0);
+    if (NULL == (p->fp = fopen(fn, "wb"))) {
+        fprintf(stderr, "[E::%s] failed to open '%s'.\n", __func__, fn);
+        bmtx_free(p);
+        return NULL;
+    }
+    if (bmtx_fwrite(p, CSP_BMTX_MAGIC, 8) < 0 || bmtx_fwrite(p, u, sizeof(u)) < 0 || bmtx_fwrite(p, &nnz, 8) < 0) {
+        fprintf(stderr, "[E::%s] failed to write header to '%s'.\n", __func__, fn);
+        fclose(p->fp); bmtx_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+/*@abstract  Compress and write the current chunk, which ends before SNP @p send, then start the next one.
+@return      0 if success, -1 otherwise.
+ */
+static int bmtx_flush(csp_bmtx_t *p, uint32_t send) {
+    csp_bmtx_idx_t e;
+    uLongf zlen;
+    size_t nrp, nnz, len;
+    for (; p->scur + 1 < send; p->scur++) { kv_push(uint32_t, p->rp, kv_size(p->col)); }  // empty SNPs.
+    nnz = kv_size(p->col);
+    if (send <= p->sbeg && 0 == nnz) { return 0; }
+    kv_push(uint32_t, p->rp, nnz);
+    nrp = kv_size(p->rp);
+    len = (nrp + nnz + nnz * p->nval) * sizeof(uint32_t);
+    if (bmtx_buf_resize(&p->buf, &p->mbuf, len) < 0) { return -1; }
+    memcpy(p->buf, p->rp.a, nrp * sizeof(uint32_t));
+    if (nnz) {
+        memcpy(p->buf + nrp * sizeof(uint32_t), p->col.a, nnz * sizeof(uint32_t));
+        memcpy(p->buf + (nrp + nnz) * sizeof(uint32_t), p->val.a, nnz * p->nval * sizeof(uint32_t));
+    }
+    zlen = compressBound(len);
+    if (bmtx_buf_resize(&p->zbuf, &p->mzbuf, zlen) < 0) { return -1; }
+    if (compress2(p->zbuf, &zlen, p->buf, len, Z_DEFAULT_COMPRESSION) != Z_OK) { return -1; }
+    e.off = p->off; e.clen = zlen; e.sbeg = p->sbeg; e.send = send; e.nnz = nnz;
+    if (bmtx_fwrite(p, p->zbuf, zlen) < 0) { return -1; }
+    kv_push(csp_bmtx_idx_t, p->idx, e);
+    p->sbeg = p->scur = send;
+    kv_size(p->rp) = 0; kv_size(p->col) = 0; kv_size(p->val) = 0;
+    kv_push(uint32_t, p->rp, 0);
+    return 0;
+}
+
+int csp_bmtx_pushv(csp_bmtx_t *p, uint32_t snp, uint32_t smp, const uint32_t *val) {
+    int i;
+    if (snp < p->scur || snp >= p->nsnp) { return -1; }
+    if (snp > p->scur && kv_size(p->val) >= CSP_BMTX_CHUNK_NNZ && bmtx_flush(p, p->scur + 1) < 0) { return -1; }
+    for (; p->scur < snp; p->scur++) { kv_push(uint32_t, p->rp, kv_size(p->col)); }
+    kv_push(uint32_t, p->col, smp);
+    for (i = 0; i < p->nval; i++) { kv_push(uint32_t, p->val, val[i]); }
+    return 0;
+}
+
+int csp_bmtx_push(csp_bmtx_t *p, uint32_t snp, uint32_t smp, uint32_t val) {
+    if (p->nval != 1) { return -1; }
+    return csp_bmtx_pushv(p, snp, smp, &val);
+}
+
+/*@abstract  Write the last chunk, the index and the tail.
+@return      0 if success, -1 otherwise.
+ */
+static int bmtx_finish(csp_bmtx_t *p) {
+    csp_bmtx_idx_t *e;
+    uint64_t ioff, nnz = 0;
+    uint32_t n;
+    size_t i;
+    if (bmtx_flush(p, p->nsnp) < 0) { return -1; }
+    ioff = p->off;
+    for (i = 0; i < kv_size(p->idx); i++) {
+        e = &kv_A(p->idx, i);
+        if (bmtx_fwrite(p, &e->off, 8) < 0 || bmtx_fwrite(p, &e->clen, 4) < 0 || bmtx_fwrite(p, &e->sbeg, 4) < 0 || \
+            bmtx_fwrite(p, &e->send, 4) < 0 || bmtx_fwrite(p, &e->nnz, 4) < 0) { return -1; }
+        nnz += e->nnz;
+    }
+    n = kv_size(p->idx);
+    if (bmtx_fwrite(p, &ioff, 8) < 0 || bmtx_fwrite(p, &n, 4) < 0 || bmtx_fwrite(p, CSP_BMTX_IDX_MAGIC, 4) < 0) { return -1; }
+    if (nnz != p->nnz) {
+        fprintf(stderr, "[E::%s] num of records (%ld) is not equal to the header (%ld).\n", __func__, (long) nnz, (long) p->nnz);
+        return -1;
+    }
+    return 0;
+}
+
+int csp_bmtx_close(csp_bmtx_t *p) {
+    int ret = 0;
+    if (NULL == p) { return 0; }
+    if (p->is_w && bmtx_finish(p) < 0) { ret = -1; }
+    if (p->fp && fclose(p->fp) != 0) { ret = -1; }
+    bmtx_free(p);
+    return ret;
+}
+
+csp_bmtx_t* csp_bmtx_open(const char *fn) {
+    csp_bmtx_t *p;
+    csp_bmtx_idx_t e;
+    char magic[8];
+    uint32_t u[4], n, i;
+    uint64_t ioff;
+    if (NULL == (p = (csp_bmtx_t*) calloc(1, sizeof(csp_bmtx_t)))) { return NULL; }
+    kv_init(p->idx); kv_init(p->rp); kv_init(p->col); kv_init(p->val);
+    if (NULL == (p->fp = fopen(fn, "rb"))) {
+        fprintf(stderr, "[E::%s] failed to open '%s'.\n", __func__, fn);
+        goto fail;
+    }
+    if (fread(magic, 1, 8, p->fp) != 8 || memcmp(magic, CSP_BMTX_MAGIC, 8) || fread(u, 4, 4, p->fp) != 4 || \
+        fread(&p->nnz, 8, 1, p->fp) != 1) { goto fmt_fail; }
+    if (u[0] != CSP_BMTX_VERSION) {
+        fprintf(stderr, "[E::%s] unsupported version %u of '%s'.\n", __func__, u[0], fn);
+        goto fail;
+    }
+    p->nsnp = u[2]; p->nsmp = u[3]; p->nval = ((u[1] >> 8) & 0xff) + 1;
+    if (fseeko(p->fp, -CSP_BMTX_TAIL_SIZE, SEEK_END) != 0 || fread(&ioff, 8, 1, p->fp) != 1 || \
+        fread(&n, 4, 1, p->fp) != 1 || fread(magic, 1, 4, p->fp) != 4 || memcmp(magic, CSP_BMTX_IDX_MAGIC, 4)) { goto fmt_fail; }
+    if (fseeko(p->fp, ioff, SEEK_SET) != 0) { goto fmt_fail; }
+    for (i = 0; i < n; i++) {
+        if (fread(&e.off, 8, 1, p->fp) != 1 || fread(&e.clen, 4, 1, p->fp) != 1 || fread(&e.sbeg, 4, 1, p->fp) != 1 || \
+            fread(&e.send, 4, 1, p->fp) != 1 || fread(&e.nnz, 4, 1, p->fp) != 1) { goto fmt_fail; }
+        kv_push(csp_bmtx_idx_t, p->idx, e);
+    }
+    return p;
+  fmt_fail:
+    fprintf(stderr, "[E::%s] '%s' is truncated or not a binary sparse matrix.\n", __func__, fn);
+  fail:
+    if (p->fp) { fclose(p->fp); }
+    bmtx_free(p);
+    return NULL;
+}
+
+int csp_bmtx_read(csp_bmtx_t *p, int i, csp_bmtx_chunk_t *c) {
+    csp_bmtx_idx_t *e;
+    uLongf len;
+    size_t nrp;
+    if (i < 0 || i >= kv_size(p->idx)) { return -1; }
+    e = &kv_A(p->idx, i);
+    nrp = e->send - e->sbeg + 1;
+    len = (nrp + (size_t) e->nnz * (1 + p->nval)) * sizeof(uint32_t);
+    if (bmtx_buf_resize(&p->zbuf, &p->mzbuf, e->clen) < 0 || bmtx_buf_resize(&p->buf, &p->mbuf, len) < 0) { return -1; }
+    if (fseeko(p->fp, e->off, SEEK_SET) != 0 || fread(p->zbuf, 1, e->clen, p->fp) != e->clen) { return -1; }
+    if (uncompress(p->buf, &len, p->zbuf, e->clen) != Z_OK || \
+        len != (nrp + (size_t) e->nnz * (1 + p->nval)) * sizeof(uint32_t)) { return -1; }
+    c->sbeg = e->sbeg; c->send = e->send; c->nnz = e->nnz; c->nval = p->nval;
+    c->rp = (uint32_t*) p->buf;
+    c->col = c->rp + nrp;
+    c->val = c->col + e->nnz;
+    return 0;
+}
+
+int csp_bmtx_to_mtx(const char *in, const char *out) {
+    csp_bmtx_t *p = NULL;
+    csp_bmtx_chunk_t c;
+    FILE *fp = NULL;
+    uint32_t r, j;
+    int i, k;
+    if (NULL == (p = csp_bmtx_open(in))) { goto fail; }
+    if (NULL == out) { fp = stdout; }
+    else if (NULL == (fp = fopen(out, "w"))) {
+        fprintf(stderr, "[E::%s] failed to open '%s'.\n", __func__, out);
+        goto fail;
+    }
+    if (1 == p->nval) { fputs(CSP_MTX_HEADER, fp); }
+    else { fprintf(fp, "%%%d values of each record\n", p->nval); }
+    fprintf(fp, "%u\t%u\t%lu\n", p->nsnp, p->nsmp, (unsigned long) p->nnz);
+    for (i = 0; i < kv_size(p->idx); i++) {
+        if (csp_bmtx_read(p, i, &c) < 0) {
+            fprintf(stderr, "[E::%s] failed to read chunk %d of '%s'.\n", __func__, i, in);
+            goto fail;
+        }
+        for (r = 0; r < c.send - c.sbeg; r++) {
+            for (j = c.rp[r]; j < c.rp[r + 1]; j++) { 
+                fprintf(fp, "%u\t%u", c.sbeg + r + 1, c.col[j] + 1);
+                for (k = 0; k < c.nval; k++) { fprintf(fp, "\t%u", c.val[(size_t) j * c.nval + k]); }
+                fputc('\n', fp);
+            }
+        }
+    }
+    if (fp != stdout && fclose(fp) != 0) { fp = NULL; goto fail; }
+    csp_bmtx_close(p);
+    return 0;
+  fail:
+    if (fp && fp != stdout) { fclose(fp); }
+    if (p) { csp_bmtx_close(p); }
+    return -1;
+}
@@ -0,0 +1,140 @@
+/* Binary sparse matrix API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#ifndef CSP_BMTX_H
+#define CSP_BMTX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "kvec.h"
+
+/*
+ * Binary Sparse Matrix API
+ * A binary alternative of the MatrixMarket mtx files of AD/DP/OTH, refer to doc/bmtx.rst for the layout.
+ * Rows (SNPs) are split into chunks, each a zlib-compressed CSR block, and the footer indexes the SNP range
+ * and offset of each chunk so that chunks could be loaded separately.
+ */
+
+#define CSP_BMTX_MAGIC      "CSPBMTX\1"
+#define CSP_BMTX_IDX_MAGIC  "BIDX"
+#define CSP_BMTX_VERSION    1
+#define CSP_BMTX_HDR_SIZE   32
+#define CSP_BMTX_TAIL_SIZE  16
+#define CSP_BMTX_CHUNK_NNZ  (1 << 20)  // a chunk is closed at the first SNP boundary after this num of values.
+#define CSP_BMTX_MAX_NVAL   256        // max num of values of each record, stored in bits 8-15 of the flags.
+
+/*@abstract    Index entry of one chunk.
+@param off     Offset of the compressed chunk in the file.
+@param clen    Size of the compressed chunk in bytes.
+@param sbeg    Index of the first SNP (row) of the chunk, 0-based.
+@param send    Index of the last SNP of the chunk plus 1.
+@param nnz     Num of records in the chunk.
+ */
+typedef struct {
+    uint64_t off;
+    uint32_t clen;
+    uint32_t sbeg, send;
+    uint32_t nnz;
+} csp_bmtx_idx_t;
+
+/*@abstract    One decompressed chunk in CSR layout.
+@param sbeg, send, nnz  Same as csp_bmtx_idx_t.
+@param rp      Row pointers, size send - sbeg + 1. Records of SNP sbeg + i are col/val[rp[i]] to col/val[rp[i+1]-1].
+@param col     Index of the sample (column) of each record, 0-based.
+@param val     Value(s) of each record, record j has values val[j * nval] to val[(j + 1) * nval - 1].
+@param nval    Num of values of each record, 1 for AD/DP/OTH.
+
+@note          The arrays point into the buffer of the csp_bmtx_t and are valid until the next chunk is read.
+ */
+typedef struct {
+    uint32_t sbeg, send, nnz;
+    uint32_t *rp, *col, *val;
+    int nval;
+} csp_bmtx_chunk_t;
+
+/*@abstract    Binary sparse matrix file, opened either for writing or for reading.
+@param fp      File handler.
+@param is_w    1 if opened for writing, 0 for reading.
+@param nsnp    Num of SNPs (rows).
+@param nsmp    Num of samples (columns).
+@param nnz     Num of records.
+@param nval    Num of values of each record.
+@param idx     Index of chunks.
+@param sbeg    Writing: index of the first SNP of the current chunk.
+@param scur    Writing: index of the SNP being pushed.
+@param rp, col, val  Writing: the current chunk. Reading: unused.
+@param buf     Buffer of the uncompressed chunk.
+@param zbuf    Buffer of the compressed chunk.
+ */
+typedef struct {
+    FILE *fp;
+    int is_w;
+    uint32_t nsnp, nsmp;
+    uint64_t nnz, off;
+    int nval;
+    kvec_t(csp_bmtx_idx_t) idx;
+    uint32_t sbeg, scur;
+    kvec_t(uint32_t) rp, col, val;
+    uint8_t *buf, *zbuf;
+    size_t mbuf, mzbuf;
+} csp_bmtx_t;
+
+/*@abstract    Create a binary sparse matrix file for writing.
+@param fn      Filename.
+@param nsnp    Num of SNPs.
+@param nsmp    Num of samples.
+@param nnz     Num of records.
+@param nval    Num of values of each record, 1 to CSP_BMTX_MAX_NVAL.
+@return        Pointer of csp_bmtx_t if success, NULL otherwise.
+
+@note          The records should be pushed by csp_bmtx_push() (or csp_bmtx_pushv() if @p nval > 1) and the file 
+               should be closed by csp_bmtx_close().
+ */
+csp_bmtx_t* csp_bmtx_create(const char *fn, uint32_t nsnp, uint32_t nsmp, uint64_t nnz, int nval);
+
+/*@abstract    Push one record.
+@param p       Pointer of csp_bmtx_t opened for writing.
+@param snp     Index of the SNP, 0-based. Records should be pushed by ascending SNPs.
+@param smp     Index of the sample, 0-based.
+@param val     Value of the record.
+@return        0 if success, -1 otherwise.
+ */
+int csp_bmtx_push(csp_bmtx_t *p, uint32_t snp, uint32_t smp, uint32_t val);
+
+/*@abstract    Push one record of p->nval values.
+@param val     Array of p->nval values.
+@return        0 if success, -1 otherwise.
+ */
+int csp_bmtx_pushv(csp_bmtx_t *p, uint32_t snp, uint32_t smp, const uint32_t *val);
+
+/*@abstract    Open a binary sparse matrix file for reading, the header and the index are loaded.
+@param fn      Filename.
+@return        Pointer of csp_bmtx_t if success, NULL otherwise.
+ */
+csp_bmtx_t* csp_bmtx_open(const char *fn);
+
+/*@abstract    Read one chunk.
+@param p       Pointer of csp_bmtx_t opened for reading.
+@param i       Index of the chunk, 0-based, less than kv_size(p->idx).
+@param c       Pointer of csp_bmtx_chunk_t to be filled.
+@return        0 if success, -1 otherwise.
+ */
+int csp_bmtx_read(csp_bmtx_t *p, int i, csp_bmtx_chunk_t *c);
+
+/*@abstract    Close the file and free the structure.
+@param p       Pointer of csp_bmtx_t.
+@return        0 if success, -1 otherwise.
+@note          For writing, the last chunk, the index and the tail are written before closing.
+ */
+int csp_bmtx_close(csp_bmtx_t *p);
+
+/*@abstract    Convert a binary sparse matrix file into a MatrixMarket mtx file.
+@param in      Filename of the binary file.
+@param out     Filename of the mtx file, NULL for stdout.
+@return        0 if success, -1 otherwise.
+@note          Records of more than one value are written with the values separated by tabs, which is not
+               MatrixMarket any more.
+ */
+int csp_bmtx_to_mtx(const char *in, const char *out);
+
+#endif
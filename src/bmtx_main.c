@@ -0,0 +1,30 @@
+/* Convert the binary sparse matrix files into mtx files
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "config.h"
+#include "bmtx.h"
+
+static void print_usage(FILE *fp) {
+    fprintf(fp, "\n");
+    fprintf(fp, "Usage: %s-bmtx <in.bmtx> [out.mtx]\n", CSP_NAME);
+    fprintf(fp, "\n");
+    fprintf(fp, "Convert the binary AD/DP/OTH matrix of %s (--binMtx) into MatrixMarket format.\n", CSP_NAME);
+    fprintf(fp, "Records of the sparse genotypes (--sparseGT) are written with GT, PL and ALL in separate columns.\n");
+    fprintf(fp, "The mtx is written to stdout if out.mtx is missing.\n");
+    fprintf(fp, "\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3 || 0 == strcmp(argv[1], "-h") || 0 == strcmp(argv[1], "--help")) {
+        print_usage(stderr);
+        return 1;
+    }
+    if (csp_bmtx_to_mtx(argv[1], argc > 2 ? argv[2] : NULL) < 0) {
+        fprintf(stderr, "[E::%s] failed to convert '%s'.\n", __func__, argv[1]);
+        return 1;
+    }
+    return 0;
+}
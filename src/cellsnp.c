@@ -28,6 +28,7 @@
 #include <time.h>
 #include "thpool.h"
 #include "htslib/sam.h"
+#include "htslib/faidx.h"
 #include "config.h"
 #include "csp.h"
 #include "jfile.h"
@@ -44,13 +45,18 @@
  */
 static void gll_set_default(global_settings *gs) {
     if (gs) {
+        int i;
         gs->in_fn_file = NULL; gs->in_fns = NULL; gs->nin = 0;
         gs->out_dir = NULL; 
         gs->out_vcf_base = NULL; gs->out_vcf_cells = NULL; gs->out_samples = NULL;
-        gs->out_mtx_ad = NULL; gs->out_mtx_dp = NULL; gs->out_mtx_oth = NULL;
+        for (i = 0; i < CSP_NTAG; i++) {
+            gs->out_mtx[i] = NULL; gs->disc_mtx[i] = NULL; gs->out_csc[i] = NULL; gs->disc_csc[i] = NULL;
+            gs->out_grp[i] = NULL; gs->disc_grp[i] = NULL;
+        }
+        gs->out_tags = csp_mtx_tags_parse(CSP_OUT_TAGS);
         gs->is_genotype = 0; gs->is_out_zip = 0;
         gs->snp_list_file = NULL; csp_snplist_init(gs->pl);
-        gs->barcode_file = NULL; gs->nbarcode = 0; gs->barcodes = NULL; 
+        gs->barcode_file = NULL; gs->nbarcode = 0; gs->barcodes = NULL; gs->hbc = NULL;
         gs->sid_list_file = NULL; gs->sample_ids = NULL; gs->nsid = 0;
         char *chrom_tmp[] = CSP_CHROM_ALL;
         gs->chroms = (char**) calloc(CSP_NCHROM, sizeof(char*));
@@ -62,7 +68,21 @@ static void gll_set_default(global_settings *gs) {
         gs->min_len = CSP_MIN_LEN; gs->min_mapq = CSP_MIN_MAPQ;
         //gs->max_flag = -1;
         gs->rflag_filter = -1; gs->rflag_require = CSP_INCL_FMASK;
-        gs->plp_max_depth = CSP_PLP_MAX_DEPTH; gs->no_orphan = CSP_NO_ORPHAN;
+        gs->plp_max_depth = CSP_PLP_MAX_DEPTH; gs->no_orphan = CSP_NO_ORPHAN; gs->plp_engine = CSP_PLP_ENGINE;
+        gs->io_hint = 0; gs->max_open = CSP_MAX_OPEN; gs->hdr_cache = NULL;
+        gs->refseq = NULL; gs->targets = NULL; gs->tgt = NULL; gs->dense_len = CSP_DENSE_LEN;
+        gs->cell_cap = CSP_CELL_CAP; gs->qual_cap = CSP_QUAL_CAP;
+        gs->cell_shards = CSP_CELL_SHARDS;
+        gs->discover = 0; gs->kn_off = NULL; gs->bin_mtx = 0;
+        gs->out_bcf = 0; gs->bcf_hdr_base = NULL; gs->bcf_hdr_cells = NULL;
+        gs->out_hdf5 = 0; gs->out_h5 = NULL; gs->disc_h5 = NULL;
+        gs->sparse_gt = 0; gs->out_mtx_gt = NULL; gs->disc_mtx_gt = NULL;
+        gs->out_arrow = 0; gs->out_arw_tag = NULL; gs->out_arw_snp = NULL; gs->disc_arw_tag = NULL; gs->disc_arw_snp = NULL;
+        gs->cell_major = 0; gs->cell_major_mem = CSP_CELL_MAJOR_MEM;
+        gs->grp_file = NULL; gs->groups = NULL; gs->ngroup = 0; gs->sg_grp = NULL; gs->cell_mtx = 0;
+        gs->out_groups = NULL; gs->disc_groups = NULL;
+        gs->bin_depth = 0; gs->out_bin = NULL; gs->out_bins = NULL;
+        gs->disc_vcf_base = NULL; gs->disc_vcf_cells = NULL; gs->disc_samples = NULL;
     }
 }
 
@@ -98,8 +118,40 @@ static void print_usage(FILE *fp) {
 "\n"
 "Optional arguments:\n"
 "  --genotype           If use, do genotyping in addition to counting.\n"
-"  --gzip               If use, the output files will be zipped into BGZF format.\n"
+"  --sparseGT           If use with --genotype, output GT/PL/ALL only for the cells with reads as a\n"
+"                       sparse matrix (cellSNP.tag.GT.tsv, or .bmtx with --binMtx) in the order of\n"
+"                       AD/DP, instead of the vcf CELLS.\n"
+"  --gzip               If use, the output files will be zipped into BGZF format. The vcf files are\n"
+"                       indexed as they are written (*.vcf.gz.tbi).\n"
+"  --binMtx             If use, output the sparse matrices in a chunked binary format (*.bmtx) instead\n"
+"                       of mtx; convert back with %s-bmtx.\n"
+"  --outTags STR        Comma separated tags of the output sparse matrices, among AD, DP, OTH,\n"
+"                       REF and the base counts A, C, G, T, N. Only these are written [%s]\n"
+"  --cellMajor          If use, also output each sparse matrix sorted by cells (cellSNP.tag.*.cell.mtx,\n"
+"                       or .cell.bmtx whose rows are cells with --binMtx) for per-cell access.\n"
+"  --cellMajorMem INT   Max memory in MB for sorting the records by cells with --cellMajor [%d]\n"
+"  --cellGroups FILE    A file of barcode (sample ID in mode 3) and group per line. If use, output\n"
+"                       the sparse matrices of the groups (cellSNP.group.tag.*.mtx and\n"
+"                       cellSNP.groups.tsv) summed from the UMI-collapsed counts of their cells,\n"
+"                       instead of the cell-level ones.\n"
+"  --cellMtx            If use with --cellGroups, also output the cell-level sparse matrices.\n"
+"  --binDepth INT       If use, also output the read counts (UMIs if UMI is used) of each cell in\n"
+"                       genomic bins of INT bp (cellSNP.bin.mtx, bins in cellSNP.bins.bed), counted\n"
+"                       by the start pos of the reads. Only for mode 2 and --discover.\n"
+"  --bcf                If use, output the vcf BASE and CELLS in BCF format (cellSNP.*.bcf), whose\n"
+"                       header has the contigs of the first input file, and index them (*.bcf.csi).\n"
+"  --hdf5               If use, also output the counts (and genotypes) as sparse matrices in one HDF5\n"
+"                       file (%s), see doc/hdf5.rst. Needs a build with WITH_HDF5=1.\n"
+"  --arrow              If use, also output the counts and the SNPs as Arrow IPC streams\n"
+"                       (%s and %s), see doc/arrow.rst.\n"
 "  --printSkipSNPs      If use, the SNPs skipped when loading VCF will be printed.\n"
+"  --ioHint             If use, open local input files with I/O hints of the access pattern\n"
+"                       (sequential for mode 2, random for mode 1&3).\n"
+"  --maxOpen INT        Max number of input files each subprocess keeps open at the same time\n"
+"                       for mode 1&3, 0 means auto by the limit of open files (ulimit -n) [%d]\n"
+"  --hdrCache DIR       Dir to cache headers of input files, keyed by their order and checked by inode,\n"
+"                       size and mtime, so that repeated runs on the same files skip header parsing [NULL]\n", CSP_NAME, CSP_OUT_TAGS, CSP_CELL_MAJOR_MEM, CSP_OUT_H5, CSP_OUT_ARW_TAG, CSP_OUT_ARW_SNP, CSP_MAX_OPEN);
+    fprintf(fp,
 "  -p, --nproc INT      Number of subprocesses [%d]\n", CSP_NTHREAD);
     fprintf(fp,
 "  --chrom STR          The chromosomes to use, comma separated [1 to %d]\n", CSP_NCHROM);
@@ -114,6 +166,29 @@ static void print_usage(FILE *fp) {
 "  --minMAF FLOAT       Minimum minor allele frequency [%.2f]\n", CSP_MIN_MAF);
     fprintf(fp,
 "  --doubletGL          If use, keep doublet GT likelihood, i.e., GT=0.5 and GT=1.5.\n"
+"  --plpEngine STR      Pileup engine for mode 2: htslib, stream. The stream engine reads each\n"
+"                       read once into a sliding window of positions [htslib]\n"
+"  --refseq FILE        Reference FASTA (faidx-indexed) for mode 2. If use, positions where all reads\n"
+"                       match the reference are skipped and REF is taken from the reference [NULL]\n"
+"  --targets FILE       BED file of target regions for mode 2. If use, only reads and positions\n"
+"                       overlapping the targets are pileup-ed [NULL]\n");
+    fprintf(fp,
+"  --denseLen INT       Contigs no longer than INT, e.g. chrM, are pileup-ed by counting reads into\n"
+"                       dense arrays in mode 2, 0 means never. Not used with --genotype [%d]\n", CSP_DENSE_LEN);
+    fprintf(fp,
+"  --cellCap INT        Max num of reads counted for each cell in each SNP, a random subset is kept\n"
+"                       if exceeded, before UMI collapsing. 0 means no cap [%d]\n", CSP_CELL_CAP);
+    fprintf(fp,
+"  --qualCap INT        Max num of base qualities kept for each allele of each cell in each SNP for\n"
+"                       genotyping, a random subset is kept if exceeded, 0 means no cap [%d]\n", CSP_QUAL_CAP);
+    fprintf(fp,
+"  --cellShards INT     Split the cells (input files in mode 3) into INT shards in mode 1 and 3, so that\n"
+"                       threads could share one SNP, each for one shard. For small SNP lists [%d]\n", CSP_CELL_SHARDS);
+    fprintf(fp,
+"  --discover           If use with -R, pileup whole chromosomes (--chrom, plus the chromosomes of the\n"
+"                       SNPs) in one pass: all given SNPs are output to OUTDIR whatever --minCOUNT and\n"
+"                       --minMAF, and other sites passing them to OUTDIR/%s\n", CSP_OUT_DISC_DIR);
+    fprintf(fp,
 "\n"
 "Read filtering:\n");
     fprintf(fp,
@@ -157,6 +232,7 @@ static inline int cmp_barcodes(const void *x, const void *y) {
                More careful and personalized check would be performed by each running mode.
  */
 static int check_global_args(global_settings *gs) {
+    faidx_t *fai = NULL;
     int i;
     if (gs->in_fn_file) {
         if (gs->in_fns) { 
@@ -199,6 +275,10 @@ static int check_global_args(global_settings *gs) {
             fprintf(stderr, "[E::%s] could not read barcode file '%s'\n", __func__, gs->barcode_file); 
             return -2;
         } else { qsort(gs->barcodes, gs->nbarcode, sizeof(char*), cmp_barcodes); }
+        if (csp_index_barcodes(gs) < 0) {
+            fprintf(stderr, "[E::%s] could not build index for barcodes.\n", __func__); 
+            return -2;
+        }
     } else if ((NULL == gs->cell_tag) ^ (NULL == gs->barcode_file)) {
         fprintf(stderr, "[E::%s] should not specify barcodes or cell-tag alone.\n", __func__); 
         return -1;
@@ -227,11 +307,16 @@ static int check_global_args(global_settings *gs) {
     }
     /* 1. In current version, one and only one of pos_list and chrom(s) would exist and work. Prefer pos_list. 
        2. Sometimes, snp_list_file and chroms are both not NULL as the chroms has been set to default value when
-          global_settings structure was just created. In this case, free chroms and save snp_list_file. */
+          global_settings structure was just created. In this case, free chroms and save snp_list_file.
+       3. Both are kept in the combined mode (--discover). */
     if (NULL == gs->snp_list_file || 0 == strcmp(gs->snp_list_file, "None") || 0 == strcmp(gs->snp_list_file, "none")) { 
         if (NULL == gs->chroms) { fprintf(stderr, "[E::%s] should specify -R/--regionsVCF or --chrom option.\n", __func__); return -1; }
         if (gs->snp_list_file) { free(gs->snp_list_file); gs->snp_list_file = NULL; }
-    } else if (gs->chroms) { str_arr_destroy(gs->chroms, gs->nchrom); gs->chroms = NULL; gs->nchrom = 0; }
+    } else if (gs->chroms && ! gs->discover) { str_arr_destroy(gs->chroms, gs->nchrom); gs->chroms = NULL; gs->nchrom = 0; }
+    if (gs->discover && NULL == gs->snp_list_file) {
+        fprintf(stderr, "[W::%s] --discover is only used with -R/--regionsVCF, ignored.\n", __func__);
+        gs->discover = 0;
+    }
     if (gs->umi_tag) {
         if (0 == strcmp(gs->umi_tag, "Auto")) {
             if (gs->barcodes) { free(gs->umi_tag); gs->umi_tag = strdup("UR"); }
@@ -240,9 +325,144 @@ static int check_global_args(global_settings *gs) {
     }
     //if (gs->max_flag < 0) { gs->max_flag = gs->umi_tag ? CSP_MAX_FLAG_WITH_UMI : CSP_MAX_FLAG_WITHOUT_UMI; }
     if (gs->rflag_filter < 0) gs->rflag_filter = use_umi(gs) ? CSP_EXCL_FMASK_UMI : CSP_EXCL_FMASK_NOUMI;
+    if (gs->max_open < 0) { fprintf(stderr, "[E::%s] --maxOpen should not be negative.\n", __func__); return -1; }
+    if (gs->refseq) {
+        if (gs->snp_list_file && ! gs->discover) {
+            fprintf(stderr, "[W::%s] --refseq is only used in mode 2, ignored.\n", __func__);
+            free(gs->refseq); gs->refseq = NULL;
+        } else if (NULL == (fai = fai_load(gs->refseq))) {  // also build the index here if missing, rather than in each thread.
+            fprintf(stderr, "[E::%s] could not load reference FASTA '%s'\n", __func__, gs->refseq);
+            return -2;
+        } else { fai_destroy(fai); }
+    }
+    if (gs->dense_len < 0) { fprintf(stderr, "[E::%s] --denseLen should not be negative.\n", __func__); return -1; }
+    if (gs->cell_cap < 0) { fprintf(stderr, "[E::%s] --cellCap should not be negative.\n", __func__); return -1; }
+    if (gs->qual_cap < 0) { fprintf(stderr, "[E::%s] --qualCap should not be negative.\n", __func__); return -1; }
+    if (gs->dense_len > 0 && (gs->is_genotype || gs->plp_max_depth > 0 || gs->cell_cap > 0 || gs->discover)) {
+        fprintf(stderr, "[W::%s] the dense engine does not support genotyping, max depth, cell cap or --discover, --denseLen ignored.\n", __func__);
+        gs->dense_len = 0;
+    }
+    if (gs->cell_shards < 1) { fprintf(stderr, "[E::%s] --cellShards should be positive.\n", __func__); return -1; }
+    if (gs->cell_shards > 1 && (NULL == gs->snp_list_file || gs->discover)) {
+        fprintf(stderr, "[W::%s] --cellShards is only used in mode 1 and 3, ignored.\n", __func__);
+        gs->cell_shards = 1;
+    }
+    if (gs->targets && gs->snp_list_file) {
+        fprintf(stderr, "[W::%s] --targets is only used in mode 2 without --discover, ignored.\n", __func__);
+        free(gs->targets); gs->targets = NULL;
+    }
+    if (gs->bin_depth < 0) { fprintf(stderr, "[E::%s] --binDepth should not be negative.\n", __func__); return -1; }
+    if (gs->bin_depth > 0 && gs->snp_list_file && ! gs->discover) {   // fetch modes only read the reads covering SNPs.
+        fprintf(stderr, "[W::%s] --binDepth is only used in mode 2 and the combined mode, ignored.\n", __func__);
+        gs->bin_depth = 0;
+    }
+    if (gs->sparse_gt && ! gs->is_genotype) {
+        fprintf(stderr, "[W::%s] --sparseGT is only used with --genotype, ignored.\n", __func__);
+        gs->sparse_gt = 0;
+    }
+    i = CSP_TAG_MASK(CSP_TAG_AD) | CSP_TAG_MASK(CSP_TAG_DP) | CSP_TAG_MASK(CSP_TAG_OTH);
+    if ((gs->out_hdf5 || gs->out_arrow) && (gs->out_tags & i) != i) {
+        fprintf(stderr, "[E::%s] --hdf5 and --arrow need AD, DP and OTH in --outTags.\n", __func__);
+        return -1;
+    }
+    if (gs->cell_major_mem <= 0) { fprintf(stderr, "[E::%s] --cellMajorMem should be positive.\n", __func__); return -1; }
+    if (gs->grp_file) {
+        if (csp_load_groups(gs) < 0) {
+            fprintf(stderr, "[E::%s] could not load the groups from '%s'.\n", __func__, gs->grp_file);
+            return -2;
+        }
+        if (! gs->cell_mtx && (gs->out_hdf5 || gs->out_arrow || gs->cell_major)) {
+            fprintf(stderr, "[E::%s] --hdf5, --arrow and --cellMajor need --cellMtx with --cellGroups.\n", __func__);
+            return -1;
+        }
+    } else if (gs->cell_mtx) {
+        fprintf(stderr, "[W::%s] --cellMtx is only used with --cellGroups, ignored.\n", __func__);
+        gs->cell_mtx = 0;
+    }
+#ifndef WITH_HDF5
+    if (gs->out_hdf5) {
+        fprintf(stderr, "[E::%s] --hdf5 is not supported by this build, rebuild with 'make WITH_HDF5=1'.\n", __func__);
+        return -2;
+    }
+#endif
     return 0;
 }
 
+/*@abstract    Drop the chroms without target regions.
+@param gs      Pointer to the global settings, whose targets have been loaded.
+@return        Num of chroms kept if success, -1 otherwise.
+ */
+static int restrict_chroms(global_settings *gs) {
+    int i, n;
+    for (i = n = 0; i < gs->nchrom; i++) {
+        if (csp_regidx_get(gs->tgt, gs->chroms[i])) { gs->chroms[n++] = gs->chroms[i]; }
+        else {
+            fprintf(stderr, "[W::%s] chrom %s has no target regions, skipped.\n", __func__, gs->chroms[i]);
+            free(gs->chroms[i]);
+        }
+    }
+    gs->nchrom = n;
+    return n;
+}
+
+/*@abstract    Whether two chrom names are the same, with "chr" prefix ignored. */
+static int same_chrom(const char *a, const char *b) {
+    if (0 == strncmp(a, "chr", 3)) { a += 3; }
+    if (0 == strncmp(b, "chr", 3)) { b += 3; }
+    return 0 == strcmp(a, b);
+}
+
+static int cmp_snp_cid_pos(const void *x, const void *y) {
+    const csp_snp_t *a = *(const csp_snp_t**) x, *b = *(const csp_snp_t**) y;
+    if (a->cid != b->cid) { return a->cid < b->cid ? -1 : 1; }
+    return a->pos < b->pos ? -1 : (a->pos > b->pos);
+}
+
+/*@abstract    Index the given SNPs by chroms for the combined mode.
+@param gs      Pointer to the global settings, whose SNPs have been loaded.
+@return        Num of SNPs kept if success, -1 otherwise.
+
+@note          1. The chroms of SNPs that are not in gs->chroms are appended to it, so every SNP is pileup-ed.
+               2. gs->pl is sorted by chrom and pos, and gs->kn_off is set. Only the first SNP of each pos is
+                  kept, as one pos is output once.
+ */
+static long index_known_snps(global_settings *gs) {
+    csp_snp_t *p;
+    const char *last = NULL;
+    char **a;
+    size_t i, j, n = csp_snplist_size(gs->pl);
+    int k, c = -1;
+    for (i = 0; i < n; i++) {
+        p = csp_snplist_A(gs->pl, i);
+        if (NULL == last || strcmp(last, p->chr)) {
+            for (k = 0; k < gs->nchrom && ! same_chrom(gs->chroms[k], p->chr); k++);
+            if (k >= gs->nchrom) {
+                if (NULL == (a = (char**) realloc(gs->chroms, (gs->nchrom + 1) * sizeof(char*)))) { return -1; }
+                gs->chroms = a;
+                if (NULL == (gs->chroms[gs->nchrom] = strdup(p->chr))) { return -1; }
+                gs->nchrom++;
+            }
+            c = k; last = p->chr;
+        }
+        p->cid = c;
+    }
+    qsort(gs->pl.a, n, sizeof(csp_snp_t*), cmp_snp_cid_pos);
+    for (i = j = 0; i < n; i++) {
+        p = csp_snplist_A(gs->pl, i);
+        if (j > 0 && csp_snplist_A(gs->pl, j - 1)->cid == p->cid && csp_snplist_A(gs->pl, j - 1)->pos == p->pos) { 
+            csp_snp_destroy(p); 
+            continue; 
+        }
+        csp_snplist_A(gs->pl, j++) = p;
+    }
+    if (j < n) { fprintf(stderr, "[W::%s] %ld SNPs at duplicate positions are skipped.\n", __func__, (long) (n - j)); }
+    gs->pl.n = j;
+    if (NULL == (gs->kn_off = (size_t*) calloc(gs->nchrom + 1, sizeof(size_t)))) { return -1; }
+    for (i = 0; i < j; i++) { gs->kn_off[csp_snplist_A(gs->pl, i)->cid + 1]++; }
+    for (k = 0; k < gs->nchrom; k++) { gs->kn_off[k + 1] += gs->kn_off[k]; }
+    return (long) j;
+}
+
 /*@abstract    Output headers to files (vcf, mtx etc.)
 @param fs      Pointer of jfile_t that the header will be writen into.
 @param fm      File mode; if NULL, use default file mode inside jfile_t.
@@ -269,6 +489,168 @@ static inline char* format_fn(char *fn, int is_zip, kstring_t *s) {
     } else { return fn; }
 }
 
+/*@abstract    Create one set of output files and write their headers.
+@param gs      Pointer to the global settings.
+@param dir     Dir of the output files.
+@param mtx     Array of the sparse matrices indexed by CSP_TAG_*, only the tags in gs->out_tags are set.
+@param csc     Array of the cell-major matrices indexed as @p mtx, only set with --cellMajor.
+@param grp     Array of the group-level matrices indexed as @p mtx, only set with --cellGroups.
+@param groups  Pointer of the file of group names, only set with --cellGroups.
+@param bin, bins  Pointers of the matrix of the read counts in bins and the file of bins, only set with --binDepth.
+               NULL for the set of discovered sites.
+@param samples, vcf_base, vcf_cells, h5, mtx_gt, arw_tag, arw_snp  Pointers of output files, set by this function.
+@param s       Pointer of kstring_t used as buffer.
+@return        0 if success, -1 otherwise.
+
+@note          The files are set to the appending mode after the headers are written. The combined mode has one more
+               set for the discovered sites.
+ */
+static int prepare_outputs(global_settings *gs, const char *dir, jfile_t **mtx, jfile_t **csc, jfile_t **grp,
+                           jfile_t **groups, jfile_t **bin, jfile_t **bins, jfile_t **samples, jfile_t **vcf_base,
+                           jfile_t **vcf_cells, jfile_t **h5, jfile_t **mtx_gt, jfile_t **arw_tag, jfile_t **arw_snp,
+                           kstring_t *s) 
+{
+    char name[64];
+    int k, t;
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (! (gs->out_tags & CSP_TAG_MASK(t))) { continue; }
+        if (gs->ngroup > 0) {
+            if (NULL == (grp[t] = jf_init())) { fprintf(stderr, "[E::%s] fail to create jfile_t.\n", __func__); return -1; }
+            grp[t]->is_zip = 0; grp[t]->is_tmp = 0;
+            snprintf(name, sizeof(name), gs->bin_mtx ? CSP_OUT_BGRP_FMT : CSP_OUT_GRP_FMT, csp_mtx_tag_name(t));
+            grp[t]->fn = format_fn(join_path(dir, name), grp[t]->is_zip, s); ks_clear(s);
+            if (! gs->cell_mtx) { continue; }        // cell-level matrices are optional with --cellGroups.
+        }
+        if (NULL == (mtx[t] = jf_init())) { fprintf(stderr, "[E::%s] fail to create jfile_t.\n", __func__); return -1; }
+        mtx[t]->is_zip = 0; mtx[t]->is_tmp = 0;
+        snprintf(name, sizeof(name), gs->bin_mtx ? CSP_OUT_BMTX_FMT : CSP_OUT_MTX_FMT, csp_mtx_tag_name(t));
+        mtx[t]->fn = format_fn(join_path(dir, name), mtx[t]->is_zip, s); ks_clear(s);
+        if (! gs->cell_major) { continue; }          // written as a whole, refer to csp_merge_csc().
+        if (NULL == (csc[t] = jf_init())) { fprintf(stderr, "[E::%s] fail to create jfile_t.\n", __func__); return -1; }
+        csc[t]->is_zip = 0; csc[t]->is_tmp = 0;
+        snprintf(name, sizeof(name), gs->bin_mtx ? CSP_OUT_BCSC_FMT : CSP_OUT_CSC_FMT, csp_mtx_tag_name(t));
+        csc[t]->fn = format_fn(join_path(dir, name), csc[t]->is_zip, s); ks_clear(s);
+    }
+    if (NULL == (*samples = jf_init()) || \
+        NULL == (*vcf_base = jf_init()) || (csp_out_cells(gs) && NULL == (*vcf_cells = jf_init())) || \
+        (gs->out_hdf5 && NULL == (*h5 = jf_init())) || (gs->sparse_gt && NULL == (*mtx_gt = jf_init())) || \
+        (gs->out_arrow && (NULL == (*arw_tag = jf_init()) || NULL == (*arw_snp = jf_init())))) {
+        fprintf(stderr, "[E::%s] fail to create jfile_t.\n", __func__);
+        return -1;
+    }
+    (*vcf_base)->is_zip = gs->out_bcf ? 0 : gs->is_out_zip; (*vcf_base)->is_tmp = 0;     // BCF is always in BGZF.
+    (*vcf_base)->fn = format_fn(join_path(dir, gs->out_bcf ? CSP_OUT_BCF_BASE : CSP_OUT_VCF_BASE), (*vcf_base)->is_zip, s); ks_clear(s);
+    (*samples)->is_zip = 0; (*samples)->is_tmp = 0;
+    (*samples)->fn = format_fn(join_path(dir, CSP_OUT_SAMPLES), (*samples)->is_zip, s); ks_clear(s);
+    if (gs->ngroup > 0) {
+        if (NULL == (*groups = jf_init())) { fprintf(stderr, "[E::%s] fail to create jfile_t.\n", __func__); return -1; }
+        (*groups)->is_zip = 0; (*groups)->is_tmp = 0;
+        (*groups)->fn = format_fn(join_path(dir, CSP_OUT_GROUPS), (*groups)->is_zip, s); ks_clear(s);
+    }
+    if (bin && gs->bin_depth > 0) {            // the bins are written by csp_pileup() with the contig lengths.
+        if (NULL == (*bin = jf_init()) || NULL == (*bins = jf_init())) {
+            fprintf(stderr, "[E::%s] fail to create jfile_t.\n", __func__);
+            return -1;
+        }
+        (*bin)->is_zip = 0; (*bin)->is_tmp = 0;
+        (*bin)->fn = format_fn(join_path(dir, gs->bin_mtx ? CSP_OUT_BBIN : CSP_OUT_BIN), (*bin)->is_zip, s); ks_clear(s);
+        (*bins)->is_zip = 0; (*bins)->is_tmp = 0;
+        (*bins)->fn = format_fn(join_path(dir, CSP_OUT_BINS), (*bins)->is_zip, s); ks_clear(s);
+    }
+    if (csp_out_cells(gs)) { 
+        (*vcf_cells)->is_zip = gs->out_bcf ? 0 : gs->is_out_zip; (*vcf_cells)->is_tmp = 0;
+        (*vcf_cells)->fn = format_fn(join_path(dir, gs->out_bcf ? CSP_OUT_BCF_CELLS : CSP_OUT_VCF_CELLS), (*vcf_cells)->is_zip, s); ks_clear(s);
+    } // no need to set is_tmp for these out files.
+    if (gs->out_hdf5) {                        // written as a whole, refer to csp_merge_h5().
+        (*h5)->is_zip = 0; (*h5)->is_tmp = 0;
+        (*h5)->fn = format_fn(join_path(dir, CSP_OUT_H5), (*h5)->is_zip, s); ks_clear(s);
+    }
+    if (gs->sparse_gt) {
+        (*mtx_gt)->is_zip = 0; (*mtx_gt)->is_tmp = 0;
+        (*mtx_gt)->fn = format_fn(join_path(dir, gs->bin_mtx ? CSP_OUT_BMTX_GT : CSP_OUT_MTX_GT), (*mtx_gt)->is_zip, s); ks_clear(s);
+    }
+    if (gs->out_arrow) {                       // written as a whole, refer to csp_merge_arrow().
+        (*arw_tag)->is_zip = 0; (*arw_tag)->is_tmp = 0;
+        (*arw_tag)->fn = format_fn(join_path(dir, CSP_OUT_ARW_TAG), (*arw_tag)->is_zip, s); ks_clear(s);
+        (*arw_snp)->is_zip = 0; (*arw_snp)->is_tmp = 0;
+        (*arw_snp)->fn = format_fn(join_path(dir, CSP_OUT_ARW_SNP), (*arw_snp)->is_zip, s); ks_clear(s);
+    }
+    /* output headers to files. */
+    if (! gs->bin_mtx) {                       // binary matrices are written as a whole, refer to merge_mtx_bin().
+        kputs(CSP_MTX_HEADER, s);
+        for (t = 0; t < CSP_NTAG; t++) {
+            if (mtx[t] && output_headers(mtx[t], "wb", ks_str(s), ks_len(s)) < 0) {
+                fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, mtx[t]->fn);
+                return -1;
+            }
+            if (grp[t] && output_headers(grp[t], "wb", ks_str(s), ks_len(s)) < 0) {
+                fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, grp[t]->fn);
+                return -1;
+            }
+        }
+        if (bin && *bin && output_headers(*bin, "wb", ks_str(s), ks_len(s)) < 0) {
+            fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, (*bin)->fn);
+            return -1;
+        } ks_clear(s);
+        if (gs->sparse_gt) {
+            kputs(CSP_GT_HEADER, s);
+            if (output_headers(*mtx_gt, "wb", ks_str(s), ks_len(s)) < 0) {
+                fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, (*mtx_gt)->fn);
+                return -1;
+            } ks_clear(s);
+        }
+    }
+    if (use_barcodes(gs)) {                     // output samples.
+        for (k = 0; k < gs->nbarcode; k++) { kputs(gs->barcodes[k], s); kputc('\n', s); }
+    } else if (use_sid(gs)) {
+        for (k = 0; k < gs->nsid; k++) { kputs(gs->sample_ids[k], s); kputc('\n', s); }
+    } // else: should not come here!
+    if (output_headers(*samples, "wb", ks_str(s), ks_len(s)) < 0) {
+        fprintf(stderr, "[E::%s] fail to write samples to '%s'\n", __func__, (*samples)->fn);
+        return -1;
+    } ks_clear(s);
+    if (gs->ngroup > 0) {                       // output groups.
+        for (k = 0; k < gs->ngroup; k++) { kputs(gs->groups[k], s); kputc('\n', s); }
+        if (output_headers(*groups, "wb", ks_str(s), ks_len(s)) < 0) {
+            fprintf(stderr, "[E::%s] fail to write groups to '%s'\n", __func__, (*groups)->fn);
+            return -1;
+        } ks_clear(s);
+    }
+    if (! gs->out_bcf) {                       // BCF headers need the contigs of input files, refer to csp_bcf_init().
+        kputs(CSP_VCF_BASE_HEADER, s);             // output header to vcf base.
+        kputs("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n", s);
+        if (output_headers(*vcf_base, "wb", ks_str(s), ks_len(s)) < 0) {
+            fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, (*vcf_base)->fn);
+            return -1;
+        } ks_clear(s);
+        if (csp_out_cells(gs)) {
+            kputs(CSP_VCF_CELLS_HEADER, s);           // output header to vcf cells.
+            kputs(CSP_VCF_CELLS_CONTIG, s);
+            kputs("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT", s);
+            if (use_barcodes(gs) && gs->barcodes) {
+                for (k = 0; k < gs->nbarcode; k++) { kputc_('\t', s); kputs(gs->barcodes[k], s); }
+            } else if (use_sid(gs) && gs->sample_ids) {
+                for (k = 0; k < gs->nsid; k++) { kputc_('\t', s); kputs(gs->sample_ids[k], s); }
+            } else { fprintf(stderr, "[E::%s] neither barcodes or sample IDs exist.\n", __func__); return -1; }
+            kputc('\n', s);
+            if (output_headers(*vcf_cells, "wb", ks_str(s), ks_len(s)) < 0) {
+                fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, (*vcf_cells)->fn);
+                return -1;
+            }
+        }
+    }
+    /* set file modes. */
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (mtx[t]) { mtx[t]->fm = "ab"; }
+        if (grp[t]) { grp[t]->fm = "ab"; }
+    }
+    if (bin && *bin) { (*bin)->fm = "ab"; }
+    (*vcf_base)->fm = "ab";
+    if (csp_out_cells(gs)) { (*vcf_cells)->fm = "ab"; }
+    if (gs->sparse_gt) { (*mtx_gt)->fm = "ab"; }
+    return 0;
+}
+
 int main(int argc, char **argv) {
     /* timing */
     time_t start_time, end_time;
@@ -281,7 +663,8 @@ int main(int argc, char **argv) {
     global_settings gs;
     gll_set_default(&gs);
     kstring_t ks = KS_INITIALIZE, *s = &ks;
-    int c, k, ret, print_time = 0, print_skip_snp = 0;
+    char *disc_dir = NULL;
+    int c, ret, print_time = 0, print_skip_snp = 0;
     struct option lopts[] = {
         {"help", no_argument, NULL, 'h'},
         {"version", no_argument, NULL, 'V'},
@@ -320,7 +703,29 @@ int main(int argc, char **argv) {
         {"printSkipSNPs", no_argument, NULL, 13},
         {"inclFLAG", required_argument, NULL, 14},
         {"exclFLAG", required_argument, NULL, 15},
-        {"countORPHAN", no_argument, NULL, 16}
+        {"countORPHAN", no_argument, NULL, 16},
+        {"ioHint", no_argument, NULL, 17},
+        {"maxOpen", required_argument, NULL, 18},
+        {"hdrCache", required_argument, NULL, 19},
+        {"plpEngine", required_argument, NULL, 20},
+        {"refseq", required_argument, NULL, 21},
+        {"targets", required_argument, NULL, 22},
+        {"denseLen", required_argument, NULL, 23},
+        {"cellCap", required_argument, NULL, 24},
+        {"qualCap", required_argument, NULL, 25},
+        {"cellShards", required_argument, NULL, 26},
+        {"discover", no_argument, NULL, 27},
+        {"binMtx", no_argument, NULL, 28},
+        {"bcf", no_argument, NULL, 29},
+        {"hdf5", no_argument, NULL, 30},
+        {"sparseGT", no_argument, NULL, 31},
+        {"arrow", no_argument, NULL, 32},
+        {"outTags", required_argument, NULL, 33},
+        {"cellMajor", no_argument, NULL, 34},
+        {"cellMajorMem", required_argument, NULL, 35},
+        {"cellGroups", required_argument, NULL, 36},
+        {"cellMtx", no_argument, NULL, 37},
+        {"binDepth", required_argument, NULL, 38}
     };
     if (1 == argc) { print_usage(stderr); goto fail; }
     while ((c = getopt_long(argc, argv, "hVs:S:O:R:b:i:I:p:", lopts, NULL)) != -1) {
@@ -387,6 +792,47 @@ int main(int argc, char **argv) {
                         goto fail;
                     } else { break; }
             case 16: gs.no_orphan = 0; break;
+            case 17: gs.io_hint = 1; break;
+            case 18: gs.max_open = atoi(optarg); break;
+            case 19: 
+                    if (gs.hdr_cache) free(gs.hdr_cache);
+                    gs.hdr_cache = strdup(optarg); break;
+            case 20:
+                    if (0 == strcmp(optarg, "htslib")) { gs.plp_engine = CSP_PLP_ENGINE_HTSLIB; }
+                    else if (0 == strcmp(optarg, "stream")) { gs.plp_engine = CSP_PLP_ENGINE_STREAM; }
+                    else {
+                        fprintf(stderr, "[E::%s] could not parse --plpEngine '%s'\n", __func__, optarg);
+                        goto fail;
+                    } 
+                    break;
+            case 21: 
+                    if (gs.refseq) free(gs.refseq);
+                    gs.refseq = strdup(optarg); break;
+            case 22: 
+                    if (gs.targets) free(gs.targets);
+                    gs.targets = strdup(optarg); break;
+            case 23: gs.dense_len = atoi(optarg); break;
+            case 24: gs.cell_cap = atoi(optarg); break;
+            case 25: gs.qual_cap = atoi(optarg); break;
+            case 26: gs.cell_shards = atoi(optarg); break;
+            case 27: gs.discover = 1; break;
+            case 28: gs.bin_mtx = 1; break;
+            case 29: gs.out_bcf = 1; break;
+            case 30: gs.out_hdf5 = 1; break;
+            case 31: gs.sparse_gt = 1; break;
+            case 32: gs.out_arrow = 1; break;
+            case 33:
+                    if ((gs.out_tags = csp_mtx_tags_parse(optarg)) < 0) {
+                        fprintf(stderr, "[E::%s] could not parse --outTags '%s'\n", __func__, optarg);
+                        goto fail;
+                    } else { break; }
+            case 34: gs.cell_major = 1; break;
+            case 35: gs.cell_major_mem = atoi(optarg); break;
+            case 36: 
+                    if (gs.grp_file) free(gs.grp_file);
+                    gs.grp_file = strdup(optarg); break;
+            case 37: gs.cell_mtx = 1; break;
+            case 38: gs.bin_depth = atoi(optarg); break;
             default:  fprintf(stderr,"Invalid option: '%c'\n", c); goto fail;													
         }
     }
@@ -411,74 +857,20 @@ int main(int argc, char **argv) {
         goto fail;
     }
     /* prepare output files. */
-    if (NULL == (gs.out_mtx_ad = jf_init()) || NULL == (gs.out_mtx_dp = jf_init()) || \
-        NULL == (gs.out_mtx_oth = jf_init()) || NULL == (gs.out_samples = jf_init()) || \
-        NULL == (gs.out_vcf_base = jf_init()) || (gs.is_genotype && NULL == (gs.out_vcf_cells = jf_init()))) {
-        fprintf(stderr, "[E::%s] fail to create jfile_t.\n", __func__);
-        goto fail;
-    }
-    gs.out_mtx_ad->is_zip = 0; gs.out_mtx_ad->is_tmp = 0;
-    gs.out_mtx_ad->fn = format_fn(join_path(gs.out_dir, CSP_OUT_MTX_AD), gs.out_mtx_ad->is_zip, s); ks_clear(s);
-    gs.out_mtx_dp->is_zip = 0; gs.out_mtx_dp->is_tmp = 0;
-    gs.out_mtx_dp->fn = format_fn(join_path(gs.out_dir, CSP_OUT_MTX_DP), gs.out_mtx_dp->is_zip, s); ks_clear(s); 
-    gs.out_mtx_oth->is_zip = 0; gs.out_mtx_oth->is_tmp = 0;
-    gs.out_mtx_oth->fn = format_fn(join_path(gs.out_dir, CSP_OUT_MTX_OTH), gs.out_mtx_oth->is_zip, s); ks_clear(s);
-    gs.out_vcf_base->is_zip = gs.is_out_zip; gs.out_vcf_base->is_tmp = 0;
-    gs.out_vcf_base->fn = format_fn(join_path(gs.out_dir, CSP_OUT_VCF_BASE), gs.out_vcf_base->is_zip, s); ks_clear(s);
-    gs.out_samples->is_zip = 0; gs.out_samples->is_tmp = 0;
-    gs.out_samples->fn = format_fn(join_path(gs.out_dir, CSP_OUT_SAMPLES), gs.out_samples->is_zip, s); ks_clear(s);
-    if (gs.is_genotype) { 
-        gs.out_vcf_cells->is_zip = gs.is_out_zip; gs.out_vcf_cells->is_tmp = 0;
-        gs.out_vcf_cells->fn = format_fn(join_path(gs.out_dir, CSP_OUT_VCF_CELLS), gs.out_vcf_cells->is_zip, s); ks_clear(s);
-    } // no need to set is_tmp for these out files.
-    /* output headers to files. */
-    kputs(CSP_MTX_HEADER, s);
-    if (output_headers(gs.out_mtx_ad, "wb", ks_str(s), ks_len(s)) < 0) {   // output header to mtx_AD
-        fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, gs.out_mtx_ad->fn);
-        goto fail;
-    }
-    if (output_headers(gs.out_mtx_dp, "wb", ks_str(s), ks_len(s)) < 0) {   // output header to mtx_DP
-        fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, gs.out_mtx_dp->fn);
-        goto fail;
-    }
-    if (output_headers(gs.out_mtx_oth, "wb", ks_str(s), ks_len(s)) < 0) {  // output header to mtx_OTH
-        fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, gs.out_mtx_oth->fn);
-        goto fail;
-    } ks_clear(s);
-    if (use_barcodes(&gs)) {                     // output samples.
-        for (k = 0; k < gs.nbarcode; k++) { kputs(gs.barcodes[k], s); kputc('\n', s); }
-    } else if (use_sid(&gs)) {
-        for (k = 0; k < gs.nsid; k++) { kputs(gs.sample_ids[k], s); kputc('\n', s); }
-    } // else: should not come here!
-    if (output_headers(gs.out_samples, "wb", ks_str(s), ks_len(s)) < 0) {
-        fprintf(stderr, "[E::%s] fail to write samples to '%s'\n", __func__, gs.out_samples->fn);
-        goto fail;
-    } ks_clear(s);
-    kputs(CSP_VCF_BASE_HEADER, s);             // output header to vcf base.
-    kputs("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n", s);
-    if (output_headers(gs.out_vcf_base, "wb", ks_str(s), ks_len(s)) < 0) {
-        fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, gs.out_vcf_base->fn);
-        goto fail;
-    } ks_clear(s);
-    if (gs.is_genotype) {
-        kputs(CSP_VCF_CELLS_HEADER, s);           // output header to vcf cells.
-        kputs(CSP_VCF_CELLS_CONTIG, s);
-        kputs("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT", s);
-        if (use_barcodes(&gs) && gs.barcodes) {
-            for (k = 0; k < gs.nbarcode; k++) { kputc_('\t', s); kputs(gs.barcodes[k], s); }
-        } else if (use_sid(&gs) && gs.sample_ids) {
-            for (k = 0; k < gs.nsid; k++) { kputc_('\t', s); kputs(gs.sample_ids[k], s); }
-        } else { fprintf(stderr, "[E::%s] neither barcodes or sample IDs exist.\n", __func__); goto fail; }
-        kputc('\n', s);
-        if (output_headers(gs.out_vcf_cells, "wb", ks_str(s), ks_len(s)) < 0) {
-            fprintf(stderr, "[E::%s] fail to write header to '%s'\n", __func__, gs.out_vcf_cells->fn);
+    if (prepare_outputs(&gs, gs.out_dir, gs.out_mtx, gs.out_csc, gs.out_grp, &gs.out_groups, &gs.out_bin, &gs.out_bins, 
+                        &gs.out_samples, &gs.out_vcf_base, &gs.out_vcf_cells, &gs.out_h5, 
+                        &gs.out_mtx_gt, &gs.out_arw_tag, &gs.out_arw_snp, s) < 0) { goto fail; }
+    if (gs.discover) {
+        if (NULL == (disc_dir = join_path(gs.out_dir, CSP_OUT_DISC_DIR))) { goto fail; }
+        if (0 != access(disc_dir, F_OK) && 0 != mkdir(disc_dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH)) {
+            fprintf(stderr, "[E::%s] could not create '%s'.\n", __func__, disc_dir);
             goto fail;
         }
+        if (prepare_outputs(&gs, disc_dir, gs.disc_mtx, gs.disc_csc, gs.disc_grp, &gs.disc_groups, NULL, NULL, 
+                            &gs.disc_samples, &gs.disc_vcf_base, &gs.disc_vcf_cells, &gs.disc_h5, 
+                            &gs.disc_mtx_gt, &gs.disc_arw_tag, &gs.disc_arw_snp, s) < 0) { goto fail; }
+        free(disc_dir); disc_dir = NULL;
     }
-    /* set file modes. */
-    gs.out_mtx_ad->fm = gs.out_mtx_dp->fm = gs.out_mtx_oth->fm = "ab";
-    gs.out_vcf_base->fm = "ab";
-    if (gs.is_genotype) { gs.out_vcf_cells->fm = "ab"; }
     /* run based on the mode of input. 
         Mode1: pileup a list of SNPs for a single BAM/SAM file with barcodes.
         Mode2: pileup whole chromosome(s) for one or multiple BAM/SAM files
@@ -490,7 +882,14 @@ int main(int argc, char **argv) {
             fprintf(stderr, "[E::%s] get SNP list from '%s' failed.\n", __func__, gs.snp_list_file);
             print_time = 1; goto fail;
         } else { fprintf(stderr, "[I::%s] fetching %ld candidate variants ...\n", __func__, csp_snplist_size(gs.pl)); }
-        if (gs.barcodes) { 
+        if (gs.discover) {
+            if (index_known_snps(&gs) < 0) {
+                fprintf(stderr, "[E::%s] failed to index the SNPs by chromosomes.\n", __func__);
+                print_time = 1; goto fail;
+            }
+            fprintf(stderr, "[I::%s] combined mode: pileup %d whole chromosomes for given SNPs and discovered sites.\n", __func__, gs.nchrom);
+            if (run_mode2(&gs) < 0) { fprintf(stderr, "[E::%s] running combined mode failed.\n", __func__); print_time = 1; goto fail; }
+        } else if (gs.barcodes) { 
             fprintf(stderr, "[I::%s] mode 1: fetch given SNPs in %d single cells.\n", __func__, gs.nbarcode); 
             if (run_mode1(&gs) < 0) { fprintf(stderr, "[E::%s] running mode 1 failed.\n", __func__); print_time = 1; goto fail; } 
         } else { 
@@ -498,6 +897,17 @@ int main(int argc, char **argv) {
             if (run_mode3(&gs) < 0) { fprintf(stderr, "[E::%s] running mode 3 failed.\n", __func__); print_time = 1; goto fail; } 
         }
     } else if (gs.chroms) { 
+        if (gs.targets) {
+            fprintf(stderr, "[I::%s] loading the BED file of target regions ...\n", __func__);
+            if (NULL == (gs.tgt = csp_regidx_load(gs.targets))) {
+                fprintf(stderr, "[E::%s] get target regions from '%s' failed.\n", __func__, gs.targets);
+                print_time = 1; goto fail;
+            }
+            if (restrict_chroms(&gs) <= 0) {
+                fprintf(stderr, "[E::%s] none of the chromosomes has target regions.\n", __func__);
+                print_time = 1; goto fail;
+            }
+        }
         if (gs.barcodes) { fprintf(stderr, "[I::%s] mode2: pileup %d whole chromosomes in %d single cells.\n", __func__, gs.nchrom, gs.nbarcode); }
         else { fprintf(stderr, "[I::%s] mode2: pileup %d whole chromosomes in one bulk sample.\n", __func__, gs.nchrom); }
         if (run_mode2(&gs) < 0) { fprintf(stderr, "[E::%s] running mode 2 failed.\n", __func__); print_time = 1; goto fail; }
@@ -519,6 +929,7 @@ int main(int argc, char **argv) {
     return 0;
   fail:
     if (s) { ks_free(s); }
+    if (disc_dir) { free(disc_dir); }
     gll_setting_free(&gs);
     if (print_time) {
         fprintf(stderr, "[E::%s] Quiting...\n", __func__);
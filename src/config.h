@@ -35,10 +35,26 @@ typedef struct _gll_settings global_settings;
 
 #define CSP_OUT_VCF_CELLS   "cellSNP.cells.vcf"
 #define CSP_OUT_VCF_BASE    "cellSNP.base.vcf"
+#define CSP_OUT_BCF_CELLS   "cellSNP.cells.bcf"
+#define CSP_OUT_BCF_BASE    "cellSNP.base.bcf"
 #define CSP_OUT_SAMPLES     "cellSNP.samples.tsv"
-#define CSP_OUT_MTX_AD      "cellSNP.tag.AD.mtx"
-#define CSP_OUT_MTX_DP      "cellSNP.tag.DP.mtx"
-#define CSP_OUT_MTX_OTH     "cellSNP.tag.OTH.mtx"
+#define CSP_OUT_MTX_FMT     "cellSNP.tag.%s.mtx"     // formatted with the name of the tag, e.g., AD.
+#define CSP_OUT_BMTX_FMT    "cellSNP.tag.%s.bmtx"
+#define CSP_OUT_CSC_FMT     "cellSNP.tag.%s.cell.mtx"   // cell-major copies, refer to csc.h.
+#define CSP_OUT_BCSC_FMT    "cellSNP.tag.%s.cell.bmtx"
+#define CSP_OUT_GRP_FMT     "cellSNP.group.tag.%s.mtx"  // group-level matrices of --cellGroups.
+#define CSP_OUT_BGRP_FMT    "cellSNP.group.tag.%s.bmtx"
+#define CSP_OUT_GROUPS      "cellSNP.groups.tsv"
+#define CSP_OUT_BIN         "cellSNP.bin.mtx"       // read counts of the cells in genomic bins of --binDepth.
+#define CSP_OUT_BBIN        "cellSNP.bin.bmtx"
+#define CSP_OUT_BINS        "cellSNP.bins.bed"
+#define CSP_OUT_TAGS        "AD,DP,OTH"              // default tags of the sparse matrices, refer to CSP_TAG_* in mplp.h.
+#define CSP_OUT_H5          "cellSNP.h5"
+#define CSP_OUT_MTX_GT      "cellSNP.tag.GT.tsv"
+#define CSP_OUT_BMTX_GT     "cellSNP.tag.GT.bmtx"
+#define CSP_OUT_ARW_TAG     "cellSNP.tag.arrows"
+#define CSP_OUT_ARW_SNP     "cellSNP.snp.arrows"
+#define CSP_OUT_DISC_DIR    "discover"     // sub-dir of the outputs of discovered sites in the combined mode.
 
 /* default values of pileup */
 // default excluding flag mask, reads with any flag mask bit set would be filtered.
@@ -50,6 +66,31 @@ typedef struct _gll_settings global_settings;
 #define CSP_PLP_MAX_DEPTH   0
 // if discard orphan reads
 #define CSP_NO_ORPHAN   1
+// pileup engines of Mode 2. htslib: bam_mplp_auto() of htslib; stream: read-centric streaming engine.
+#define CSP_PLP_ENGINE_HTSLIB  0
+#define CSP_PLP_ENGINE_STREAM  1
+#define CSP_PLP_ENGINE  CSP_PLP_ENGINE_HTSLIB
+// default max num of input files each thread keeps open at the same time, 0 means auto by the ulimit.
+#define CSP_MAX_OPEN    0
+// contigs no longer than it are pileup-ed by the dense engine in Mode 2, 0 means never.
+#define CSP_DENSE_LEN   0
+// max size in bytes of the counter array of the dense engine, the contig is processed in blocks of positions to fit it.
+#define CSP_DENSE_MAX_MEM  (1 << 29)
+// max num of reads sampled for each cell in each pos before UMI collapsing, 0 means no cap.
+#define CSP_CELL_CAP    0
+// max num of quals kept for each base of each cell in each pos for genotyping, 0 means no cap.
+#define CSP_QUAL_CAP    0
+// num of cell (sample in Mode 3) shards each SNP is split into among threads in Mode 1 and 3, 1 means no sharding.
+#define CSP_CELL_SHARDS 1
+// num of SNPs each block of threads processes in one round when using cell shards.
+#define CSP_SHARD_NSNP  16
+// max size in MB of the records of the cell-major matrices sorted in memory at the same time.
+#define CSP_CELL_MAJOR_MEM  1024
+
+// reads with at least this num of CIGAR ops, e.g. long reads, have their CIGAR indexes cached in fetch modes.
+#define CSP_CIGAR_IDX_MIN  32
+// max num of reads whose CIGAR indexes are cached by each thread in fetch modes.
+#define CSP_CIGAR_CACHE_MAX  8192
 
 // if the tmp files to be zipped: 0: no, 1: yes.
 #define CSP_TMP_ZIP 1
@@ -78,6 +119,24 @@ typedef struct _gll_settings global_settings;
 #define CSP_MTX_HEADER "%%MatrixMarket matrix coordinate integer general\n"           \
     "%\n"
 
+#define CSP_GT_HEADER "%sparse genotypes of covered (SNP, cell) pairs\n"             \
+    "%SNP\tCELL\tGT\tPL\tALL\n"
+
 #define CSP_VCF_BASE_HEADER "##fileformat=VCFv4.2\n"
 
+// header lines of BCF BASE besides the contigs, as the INFO fields have to be defined in BCF.
+// the fileformat and PASS lines are added by bcf_hdr_init().
+#define CSP_BCF_BASE_HEADER "##source=cellSNP_v" CSP_VERSION "\n"				\
+    "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"total counts for ALT and REF\">\n" 	\
+    "##INFO=<ID=AD,Number=1,Type=Integer,Description=\"total counts for ALT\">\n"		\
+    "##INFO=<ID=OTH,Number=1,Type=Integer,Description=\"total counts for other bases from REF and ALT\">\n"
+
+#define CSP_BCF_CELLS_HEADER CSP_BCF_BASE_HEADER	\
+    "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n"						\
+    "##FORMAT=<ID=AD,Number=1,Type=Integer,Description=\"total counts for ALT\">\n"				\
+    "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"total counts for ALT and REF\">\n"			\
+    "##FORMAT=<ID=OTH,Number=1,Type=Integer,Description=\"total counts for other bases from REF and ALT\">\n"		\
+    "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"List of Phred-scaled genotype likelihoods\">\n"	\
+    "##FORMAT=<ID=ALL,Number=5,Type=Integer,Description=\"total counts for all bases in order of A,C,G,T,N\">\n"
+
 #endif
@@ -0,0 +1,187 @@
+/* Cell-major sparse matrix output API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "config.h"
+#include "kvec.h"
+#include "bmtx.h"
+#include "csc.h"
+
+/*
+ * Cell-major Output API
+ */
+
+csp_csc_spill_t* csp_csc_spill_init(const char *fn, int nsmp) {
+    csp_csc_spill_t *p;
+    int i;
+    if (NULL == fn || nsmp <= 0) { return NULL; }
+    if (NULL == (p = (csp_csc_spill_t*) calloc(1, sizeof(csp_csc_spill_t)))) { return NULL; }
+    p->nsmp = nsmp;
+    p->nbkt = nsmp < CSP_CSC_NBKT ? nsmp : CSP_CSC_NBKT;
+    p->wbkt = (nsmp + p->nbkt - 1) / p->nbkt;
+    p->nbkt = (nsmp + p->wbkt - 1) / p->wbkt;
+    if (NULL == (p->fn = strdup(fn))) { goto fail; }
+    if (NULL == (p->buf = (csp_csc_buf_t*) calloc(p->nbkt, sizeof(csp_csc_buf_t))) || \
+        NULL == (p->blk = (csp_csc_blks_t*) calloc(p->nbkt, sizeof(csp_csc_blks_t)))) { goto fail; }
+    for (i = 0; i < p->nbkt; i++) { kv_init(p->buf[i]); kv_init(p->blk[i]); }
+    if (NULL == (p->fp = fopen(fn, "w+b"))) {
+        fprintf(stderr, "[E::%s] failed to open '%s'.\n", __func__, fn);
+        goto fail;
+    }
+    return p;
+  fail:
+    csp_csc_spill_destroy(p);
+    return NULL;
+}
+
+void csp_csc_spill_destroy(csp_csc_spill_t *p) {
+    int i;
+    if (NULL == p) { return; }
+    if (p->fp) { fclose(p->fp); remove(p->fn); }
+    for (i = 0; p->buf && i < p->nbkt; i++) { kv_destroy(p->buf[i]); }
+    for (i = 0; p->blk && i < p->nbkt; i++) { kv_destroy(p->blk[i]); }
+    free(p->buf); free(p->blk);
+    free(p->fn);
+    free(p);
+}
+
+/*@abstract  Write the buffered records of bucket @p b as one block.
+@return      0 if success, -1 otherwise.
+ */
+static int csc_spill_block(csp_csc_spill_t *p, int b) {
+    csp_csc_blk_t e;
+    size_t n = kv_size(p->buf[b]);
+    if (0 == n) { return 0; }
+    if (fwrite(p->buf[b].a, sizeof(csp_csc_rec_t), n, p->fp) != n) {
+        fprintf(stderr, "[E::%s] failed to write '%s'.\n", __func__, p->fn);
+        return -1;
+    }
+    e.off = p->off; e.n = n;
+    kv_push(csp_csc_blk_t, p->blk[b], e);
+    p->off += n * sizeof(csp_csc_rec_t);
+    kv_size(p->buf[b]) = 0;
+    return 0;
+}
+
+int csp_csc_spill_push(csp_csc_spill_t *p, uint32_t snp, uint32_t smp, uint32_t val) {
+    csp_csc_rec_t r;
+    int b;
+    if (smp >= p->nsmp) { return -1; }
+    b = smp / p->wbkt;
+    r.snp = snp; r.smp = smp; r.val = val;
+    kv_push(csp_csc_rec_t, p->buf[b], r);
+    if (kv_size(p->buf[b]) >= CSP_CSC_BLK) { return csc_spill_block(p, b); }
+    return 0;
+}
+
+int csp_csc_spill_flush(csp_csc_spill_t *p) {
+    int i;
+    for (i = 0; i < p->nbkt; i++) {
+        if (csc_spill_block(p, i) < 0) { return -1; }
+        kv_destroy(p->buf[i]); kv_init(p->buf[i]);
+    }
+    if (fflush(p->fp) != 0) { fprintf(stderr, "[E::%s] failed to flush '%s'.\n", __func__, p->fn); return -1; }
+    return 0;
+}
+
+/*@abstract  Load the records of the samples [@p sbeg, @p send) in bucket @p b of all spill files.
+@param v     Pointer of the buffer, the records are appended in the order of SNPs.
+@return      0 if success, -1 otherwise.
+ */
+static int csc_load(csp_csc_spill_t **sp, const size_t *soff, int n, int b, int sbeg, int send, csp_csc_buf_t *v) {
+    csp_csc_blk_t *e;
+    csp_csc_rec_t *r;
+    size_t j, k, m;
+    int i;
+    for (i = 0; i < n; i++) {
+        if (b >= sp[i]->nbkt) { continue; }
+        for (j = 0; j < kv_size(sp[i]->blk[b]); j++) {
+            e = &kv_A(sp[i]->blk[b], j);
+            if (kv_size(*v) + e->n > kv_max(*v)) { kv_resize(csp_csc_rec_t, *v, kv_size(*v) + e->n); }
+            if (NULL == v->a) { return -1; }
+            r = v->a + kv_size(*v);
+            if (fseeko(sp[i]->fp, e->off, SEEK_SET) != 0 || fread(r, sizeof(csp_csc_rec_t), e->n, sp[i]->fp) != e->n) {
+                fprintf(stderr, "[E::%s] failed to read '%s'.\n", __func__, sp[i]->fn);
+                return -1;
+            }
+            for (k = m = 0; k < e->n; k++) {        // keep the records in range only.
+                if (r[k].smp < sbeg || r[k].smp >= send) { continue; }
+                r[m] = r[k]; r[m++].snp += soff[i];
+            }
+            kv_size(*v) += m;
+        }
+    }
+    return 0;
+}
+
+int csp_csc_merge(jfile_t *out, csp_csc_spill_t **sp, const size_t *soff, int n, size_t ns, int nsmp, size_t nr,
+                  int is_bin, size_t mem)
+{
+    csp_csc_buf_t v, w;
+    csp_bmtx_t *bm = NULL;
+    csp_csc_rec_t *r;
+    size_t *cnt = NULL, nb, k, nw = 0;
+    int wbkt, nbkt, b, npart, sbeg, send, smax, c;
+    kv_init(v); kv_init(w);
+    if (n <= 0 || NULL == sp[0]) { return -1; }
+    wbkt = sp[0]->wbkt; nbkt = sp[0]->nbkt;
+    if (NULL == (cnt = (size_t*) malloc((wbkt + 1) * sizeof(size_t)))) { goto fail; }
+    if (is_bin) {
+        if (NULL == (bm = csp_bmtx_create(out->fn, nsmp, ns, nr, 1))) { goto fail; }
+    } else {
+        if (jf_open(out, "wb") <= 0) { fprintf(stderr, "[E::%s] failed to open '%s'.\n", __func__, out->fn); goto fail; }
+        jf_puts(CSP_MTX_HEADER, out);
+        jf_printf(out, "%ld\t%d\t%ld\n", ns, nsmp, nr);
+    }
+    for (b = 0; b < nbkt; b++) {
+        /* split the bucket into parts of the cell range if its records exceed the memory budget. */
+        for (nb = 0, c = 0; c < n; c++) {
+            for (k = 0; b < sp[c]->nbkt && k < kv_size(sp[c]->blk[b]); k++) { nb += kv_A(sp[c]->blk[b], k).n; }
+        }
+        if (0 == nb) { continue; }
+        npart = mem > 0 ? (nb * 2 * sizeof(csp_csc_rec_t) + mem - 1) / mem : 1;
+        if (npart > wbkt) { npart = wbkt; }
+        smax = (b + 1) * wbkt < nsmp ? (b + 1) * wbkt : nsmp;
+        for (sbeg = b * wbkt; sbeg < smax; sbeg = send) {
+            send = sbeg + (wbkt + npart - 1) / npart;
+            if (send > smax) { send = smax; }
+            kv_size(v) = 0;
+            if (csc_load(sp, soff, n, b, sbeg, send, &v) < 0) { goto fail; }
+            /* stable counting sort by cells, the records of each cell keep the order of SNPs. */
+            memset(cnt, 0, (send - sbeg + 1) * sizeof(size_t));
+            for (k = 0; k < kv_size(v); k++) { cnt[kv_A(v, k).smp - sbeg + 1]++; }
+            for (c = 1; c <= send - sbeg; c++) { cnt[c] += cnt[c - 1]; }
+            if (kv_size(v) > kv_max(w)) { kv_resize(csp_csc_rec_t, w, kv_size(v)); }
+            if (kv_size(v) > 0 && NULL == w.a) { goto fail; }
+            for (k = 0; k < kv_size(v); k++) { w.a[cnt[kv_A(v, k).smp - sbeg]++] = kv_A(v, k); }
+            for (k = 0; k < kv_size(v); k++) {
+                r = w.a + k;
+                if (is_bin) {
+                    if (csp_bmtx_push(bm, r->smp, r->snp, r->val) < 0) { goto fail; }
+                } else { jf_printf(out, "%ld\t%u\t%u\n", (long) r->snp + 1, r->smp + 1, r->val); }
+            }
+            nw += kv_size(v);
+        }
+    }
+    if (nw != nr) {
+        fprintf(stderr, "[E::%s] num of records (%ld) is not equal to the header (%ld).\n", __func__, (long) nw, (long) nr);
+        goto fail;
+    }
+    if (is_bin) {
+        if (csp_bmtx_close(bm) < 0) { bm = NULL; goto fail; }
+        bm = NULL;
+    } else if (jf_close(out) < 0) { goto fail; }
+    kv_destroy(v); kv_destroy(w); free(cnt);
+    return 0;
+  fail:
+    fprintf(stderr, "[E::%s] failed to write cell-major matrix '%s'.\n", __func__, out->fn);
+    if (bm) { csp_bmtx_close(bm); }
+    if (! is_bin && jf_isopen(out)) { jf_close(out); }
+    kv_destroy(v); kv_destroy(w); free(cnt);
+    return -1;
+}
@@ -0,0 +1,107 @@
+/* Cell-major sparse matrix output API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#ifndef CSP_CSC_H
+#define CSP_CSC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "kvec.h"
+#include "jfile.h"
+
+/*
+ * Cell-major Output API
+ * With --cellMajor, each thread also spills the records of each matrix into buckets of cell ranges while
+ * writing them in SNP-major order. A bucket is written as blocks into one spill file of the thread, the blocks
+ * of each bucket keep the order of SNPs. At the end, the buckets are sorted by cells one by one, in pieces of
+ * cell ranges if a bucket is larger than the memory budget, and appended to the cell-major file.
+ */
+
+#define CSP_CSC_NBKT  64       // max num of buckets (cell ranges) of each spill file.
+#define CSP_CSC_BLK   1024     // num of records of each block written to the spill file.
+
+/*@abstract    One record of the spill file.
+@param snp     Index of the SNP in the thread, 0-based.
+@param smp     Index of the sample, 0-based.
+@param val     Value of the record.
+ */
+typedef struct {
+    uint32_t snp, smp, val;
+} csp_csc_rec_t;
+
+/*@abstract    One block of a bucket in the spill file.
+@param off     Offset of the block in the file.
+@param n       Num of records of the block.
+ */
+typedef struct {
+    uint64_t off;
+    uint32_t n;
+} csp_csc_blk_t;
+
+typedef kvec_t(csp_csc_rec_t) csp_csc_buf_t;
+typedef kvec_t(csp_csc_blk_t) csp_csc_blks_t;
+
+/*@abstract    Spill file of one matrix of one thread.
+@param fn      Filename.
+@param fp      File handler, opened for both writing and reading.
+@param nsmp    Num of samples.
+@param nbkt    Num of buckets.
+@param wbkt    Num of samples of each bucket, i.e., bucket i has the samples [i * wbkt, (i + 1) * wbkt).
+@param buf     Buffers of the buckets, flushed into a block when CSP_CSC_BLK records are pushed.
+@param blk     Blocks of the buckets.
+@param off     Current size of the file.
+ */
+typedef struct {
+    char *fn;
+    FILE *fp;
+    int nsmp, nbkt, wbkt;
+    csp_csc_buf_t *buf;
+    csp_csc_blks_t *blk;
+    uint64_t off;
+} csp_csc_spill_t;
+
+/*@abstract    Create a spill file.
+@param fn      Filename.
+@param nsmp    Num of samples.
+@return        Pointer of csp_csc_spill_t if success, NULL otherwise.
+@note          The pointer should be freed by csp_csc_spill_destroy(), which also removes the file.
+ */
+csp_csc_spill_t* csp_csc_spill_init(const char *fn, int nsmp);
+
+/*@abstract    Remove the spill file and free the structure.
+@param p       Pointer of csp_csc_spill_t.
+ */
+void csp_csc_spill_destroy(csp_csc_spill_t *p);
+
+/*@abstract    Push one record.
+@param p       Pointer of csp_csc_spill_t.
+@param snp     Index of the SNP in the thread, 0-based. Records should be pushed by ascending SNPs.
+@param smp     Index of the sample, 0-based.
+@param val     Value of the record.
+@return        0 if success, -1 otherwise.
+ */
+int csp_csc_spill_push(csp_csc_spill_t *p, uint32_t snp, uint32_t smp, uint32_t val);
+
+/*@abstract    Write the buffered records, called when all records have been pushed.
+@param p       Pointer of csp_csc_spill_t.
+@return        0 if success, -1 otherwise.
+ */
+int csp_csc_spill_flush(csp_csc_spill_t *p);
+
+/*@abstract    Merge the spill files of the threads into one cell-major matrix.
+@param out     The output file, only its filename is used if @p is_bin.
+@param sp      Array of spill files, one for each thread, in the order of SNPs.
+@param soff    Array of the num of SNPs output by the threads before each thread.
+@param n       Size of @p sp and @p soff.
+@param ns      Num of SNPs.
+@param nsmp    Num of samples.
+@param nr      Num of records.
+@param is_bin  1: write the transposed matrix (rows are samples) in the binary format of bmtx.h;
+               0: write MatrixMarket mtx of SNPs x samples with the records sorted by samples and then SNPs.
+@param mem     Max size in bytes of the records sorted in memory at the same time.
+@return        0 if success, -1 otherwise.
+ */
+int csp_csc_merge(jfile_t *out, csp_csc_spill_t **sp, const size_t *soff, int n, size_t ns, int nsmp, size_t nr,
+                  int is_bin, size_t mem);
+
+#endif
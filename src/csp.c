@@ -4,13 +4,24 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include "htslib/sam.h"
+#include "htslib/vcf.h"
 #include "htslib/kstring.h"
 #include "config.h"
+#include "bmtx.h"
+#include "csc.h"
+#include "h5out.h"
+#include "arrowout.h"
 #include "mplp.h"
 #include "jfile.h"
 #include "jstring.h"
 #include "jsam.h"
+#include "jnumeric.h"
 #include "csp.h"
 
 /*
@@ -18,18 +29,25 @@
  */
 void gll_setting_free(global_settings *gs) { 
     if (gs) {
+        int i;
         if (gs->in_fn_file) { free(gs->in_fn_file); gs->in_fn_file = NULL; }
         if (gs->in_fns) { str_arr_destroy(gs->in_fns, gs->nin); gs->in_fns = NULL; }
         if (gs->out_dir) { free(gs->out_dir); gs->out_dir = NULL; }
         if (gs->out_vcf_base) { jf_destroy(gs->out_vcf_base); gs->out_vcf_base = NULL; }
         if (gs->out_vcf_cells) { jf_destroy(gs->out_vcf_cells); gs->out_vcf_cells = NULL; } 
         if (gs->out_samples) { jf_destroy(gs->out_samples); gs->out_samples = NULL; }    
-        if (gs->out_mtx_ad) { jf_destroy(gs->out_mtx_ad); gs->out_mtx_ad = NULL; }
-        if (gs->out_mtx_dp) { jf_destroy(gs->out_mtx_dp); gs->out_mtx_dp = NULL; }
-        if (gs->out_mtx_oth) { jf_destroy(gs->out_mtx_oth); gs->out_mtx_oth = NULL; } 
+        for (i = 0; i < CSP_NTAG; i++) {
+            if (gs->out_mtx[i]) { jf_destroy(gs->out_mtx[i]); gs->out_mtx[i] = NULL; }
+            if (gs->disc_mtx[i]) { jf_destroy(gs->disc_mtx[i]); gs->disc_mtx[i] = NULL; }
+            if (gs->out_csc[i]) { jf_destroy(gs->out_csc[i]); gs->out_csc[i] = NULL; }
+            if (gs->disc_csc[i]) { jf_destroy(gs->disc_csc[i]); gs->disc_csc[i] = NULL; }
+            if (gs->out_grp[i]) { jf_destroy(gs->out_grp[i]); gs->out_grp[i] = NULL; }
+            if (gs->disc_grp[i]) { jf_destroy(gs->disc_grp[i]); gs->disc_grp[i] = NULL; }
+        }
         if (gs->snp_list_file) { free(gs->snp_list_file); gs->snp_list_file = NULL; }
         csp_snplist_destroy(gs->pl);
         if (gs->barcode_file) { free(gs->barcode_file); gs->barcode_file = NULL; }
+        if (gs->hbc) { csp_map_bi_destroy(gs->hbc); gs->hbc = NULL; }
         if (gs->barcodes) { str_arr_destroy(gs->barcodes, gs->nbarcode); gs->barcodes = NULL; }
         if (gs->sid_list_file) { free(gs->sid_list_file); gs->sid_list_file = NULL; }
         if (gs->sample_ids) { str_arr_destroy(gs->sample_ids, gs->nsid); gs->sample_ids = NULL; }
@@ -37,6 +55,31 @@ void gll_setting_free(global_settings *gs) {
         if (gs->cell_tag) { free(gs->cell_tag); gs->cell_tag = NULL; }
         if (gs->umi_tag) { free(gs->umi_tag); gs->umi_tag = NULL; }
         if (gs->tp) { thpool_destroy(gs->tp); gs->tp = NULL; }
+        if (gs->hdr_cache) { free(gs->hdr_cache); gs->hdr_cache = NULL; }
+        if (gs->refseq) { free(gs->refseq); gs->refseq = NULL; }
+        if (gs->targets) { free(gs->targets); gs->targets = NULL; }
+        if (gs->tgt) { csp_regidx_destroy(gs->tgt); gs->tgt = NULL; }
+        if (gs->disc_vcf_base) { jf_destroy(gs->disc_vcf_base); gs->disc_vcf_base = NULL; }
+        if (gs->disc_vcf_cells) { jf_destroy(gs->disc_vcf_cells); gs->disc_vcf_cells = NULL; }
+        if (gs->disc_samples) { jf_destroy(gs->disc_samples); gs->disc_samples = NULL; }
+        if (gs->kn_off) { free(gs->kn_off); gs->kn_off = NULL; }
+        if (gs->bcf_hdr_base) { bcf_hdr_destroy(gs->bcf_hdr_base); gs->bcf_hdr_base = NULL; }
+        if (gs->bcf_hdr_cells) { bcf_hdr_destroy(gs->bcf_hdr_cells); gs->bcf_hdr_cells = NULL; }
+        if (gs->out_h5) { jf_destroy(gs->out_h5); gs->out_h5 = NULL; }
+        if (gs->disc_h5) { jf_destroy(gs->disc_h5); gs->disc_h5 = NULL; }
+        if (gs->out_mtx_gt) { jf_destroy(gs->out_mtx_gt); gs->out_mtx_gt = NULL; }
+        if (gs->disc_mtx_gt) { jf_destroy(gs->disc_mtx_gt); gs->disc_mtx_gt = NULL; }
+        if (gs->out_arw_tag) { jf_destroy(gs->out_arw_tag); gs->out_arw_tag = NULL; }
+        if (gs->out_arw_snp) { jf_destroy(gs->out_arw_snp); gs->out_arw_snp = NULL; }
+        if (gs->disc_arw_tag) { jf_destroy(gs->disc_arw_tag); gs->disc_arw_tag = NULL; }
+        if (gs->disc_arw_snp) { jf_destroy(gs->disc_arw_snp); gs->disc_arw_snp = NULL; }
+        if (gs->grp_file) { free(gs->grp_file); gs->grp_file = NULL; }
+        if (gs->groups) { str_arr_destroy(gs->groups, gs->ngroup); gs->groups = NULL; }
+        if (gs->sg_grp) { free(gs->sg_grp); gs->sg_grp = NULL; }
+        if (gs->out_groups) { jf_destroy(gs->out_groups); gs->out_groups = NULL; }
+        if (gs->disc_groups) { jf_destroy(gs->disc_groups); gs->disc_groups = NULL; }
+        if (gs->out_bin) { jf_destroy(gs->out_bin); gs->out_bin = NULL; }
+        if (gs->out_bins) { jf_destroy(gs->out_bins); gs->out_bins = NULL; }
     }
 }
 
@@ -47,6 +90,9 @@ void gll_setting_print(FILE *fp, global_settings *gs, char *prefix) {
         fprintf(fp, "%snum of input files = %d\n", prefix, gs->nin);
         fprintf(fp, "%sout_dir = %s\n", prefix, gs->out_dir);
         fprintf(fp, "%sis_out_zip = %d, is_genotype = %d\n", prefix, gs->is_out_zip, gs->is_genotype);
+        fprintf(fp, "%sout_tags = ", prefix);
+        for (i = 0; i < CSP_NTAG; i++) { if (gs->out_tags & CSP_TAG_MASK(i)) fprintf(fp, "%s ", csp_mtx_tag_name(i)); }
+        fputc('\n', fp);
         fprintf(fp, "%snum_of_pos = %lu\n", prefix, csp_snplist_size(gs->pl));
         fprintf(fp, "%snum_of_barcodes = %d, num_of_samples = %d\n", prefix, gs->nbarcode, gs->nsid);
         fprintf(fp, "%s%d chroms: ", prefix, gs->nchrom);
@@ -58,14 +104,98 @@ void gll_setting_print(FILE *fp, global_settings *gs, char *prefix) {
         fprintf(fp, "%smin_len = %d, min_mapq = %d\n", prefix, gs->min_len, gs->min_mapq);
         //fprintf(fp, "%smax_flag = %d\n", prefix, gs->max_flag);
         fprintf(fp, "%srflag_filter = %d, rflag_require = %d\n", prefix, gs->rflag_filter, gs->rflag_require);
-        fprintf(fp, "%splp_max_depth = %d, no_orphan = %d\n", prefix, gs->plp_max_depth, gs->no_orphan);
+        fprintf(fp, "%splp_max_depth = %d, no_orphan = %d, plp_engine = %d\n", prefix, gs->plp_max_depth, gs->no_orphan, gs->plp_engine);
+        fprintf(fp, "%sio_hint = %d, max_open = %d\n", prefix, gs->io_hint, gs->max_open);
+        fprintf(fp, "%shdr_cache = %s\n", prefix, gs->hdr_cache ? gs->hdr_cache : "NULL");
+        fprintf(fp, "%srefseq = %s\n", prefix, gs->refseq ? gs->refseq : "NULL");
+        fprintf(fp, "%stargets = %s, dense_len = %d\n", prefix, gs->targets ? gs->targets : "NULL", gs->dense_len);
+        fprintf(fp, "%scell_cap = %d, qual_cap = %d\n", prefix, gs->cell_cap, gs->qual_cap);
+        fprintf(fp, "%scell_shards = %d, discover = %d\n", prefix, gs->cell_shards, gs->discover);
+        fprintf(fp, "%sbin_mtx = %d, out_bcf = %d, out_hdf5 = %d, sparse_gt = %d, out_arrow = %d\n", prefix, gs->bin_mtx, 
+                gs->out_bcf, gs->out_hdf5, gs->sparse_gt, gs->out_arrow);
+        fprintf(fp, "%scell_major = %d, cell_major_mem = %d\n", prefix, gs->cell_major, gs->cell_major_mem);
+        fprintf(fp, "%sgrp_file = %s, num_of_groups = %d, cell_mtx = %d\n", prefix, gs->grp_file ? gs->grp_file : "NULL", gs->ngroup, gs->cell_mtx);
+        fprintf(fp, "%sbin_depth = %d\n", prefix, gs->bin_depth);
+    }
+}
+
+int csp_index_barcodes(global_settings *gs) {
+    csp_map_bi_iter k;
+    int i, r;
+    if (gs->hbc) { csp_map_bi_destroy(gs->hbc); gs->hbc = NULL; }
+    if (NULL == (gs->hbc = csp_map_bi_init())) { return -1; }
+    if (csp_map_bi_resize(gs->hbc, gs->nbarcode) < 0) { return -1; }
+    for (i = 0; i < gs->nbarcode; i++) {
+        k = csp_map_bi_put(gs->hbc, gs->barcodes[i], &r);
+        if (r < 0) { return -1; }
+        csp_map_bi_val(gs->hbc, k) = i;
+    }
+    return 0;
+}
+
+int csp_load_groups(global_settings *gs) {
+    csp_map_bi_t *hn = NULL, *hg = NULL;
+    csp_map_bi_iter k;
+    char **lines = NULL, **names, *p, *q;
+    int nline = 0, nsg, nskip = 0, i, r, ret;
+    names = use_barcodes(gs) ? gs->barcodes : gs->sample_ids;
+    nsg = use_barcodes(gs) ? gs->nbarcode : gs->nsid;
+    if (NULL == (lines = hts_readlines(gs->grp_file, &nline))) {
+        fprintf(stderr, "[E::%s] could not read '%s'.\n", __func__, gs->grp_file);
+        return -1;
+    }
+    if (NULL == (gs->sg_grp = (int*) malloc(nsg * sizeof(int))) || \
+        NULL == (gs->groups = (char**) calloc(nline, sizeof(char*)))) { goto fail; }
+    for (i = 0; i < nsg; i++) { gs->sg_grp[i] = -1; }
+    if (NULL == (hn = csp_map_bi_init()) || NULL == (hg = csp_map_bi_init())) { goto fail; }
+    for (i = 0; i < nsg; i++) {
+        k = csp_map_bi_put(hn, names[i], &r);
+        if (r < 0) { goto fail; }
+        csp_map_bi_val(hn, k) = i;
+    }
+    for (i = 0; i < nline; i++) {
+        for (p = lines[i]; *p && *p != '\t' && *p != ' '; p++) {}
+        for (q = p; *q == '\t' || *q == ' '; q++) {}
+        if (p == lines[i] || '\0' == *q) {
+            fprintf(stderr, "[E::%s] line %d of '%s' should be a barcode and its group.\n", __func__, i + 1, gs->grp_file);
+            goto fail;
+        }
+        *p = '\0';
+        for (p = q + strlen(q); p > q && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r'); p--) { p[-1] = '\0'; }
+        if ((k = csp_map_bi_get(hn, lines[i])) == csp_map_bi_end(hn)) { nskip++; continue; }
+        if (gs->sg_grp[r = csp_map_bi_val(hn, k)] >= 0) {
+            fprintf(stderr, "[E::%s] line %d of '%s': barcode '%s' is already in group '%s'.\n", __func__, i + 1, 
+                    gs->grp_file, lines[i], gs->groups[gs->sg_grp[r]]);
+            goto fail;
+        }
+        if ((k = csp_map_bi_get(hg, q)) == csp_map_bi_end(hg)) {
+            if (NULL == (gs->groups[gs->ngroup] = strdup(q))) { goto fail; }
+            k = csp_map_bi_put(hg, gs->groups[gs->ngroup], &ret);
+            if (ret < 0) { goto fail; }
+            csp_map_bi_val(hg, k) = gs->ngroup++;
+        }
+        gs->sg_grp[r] = csp_map_bi_val(hg, k);
     }
+    if (nskip) { fprintf(stderr, "[W::%s] %d lines of '%s' are not in the sample list, skipped.\n", __func__, nskip, gs->grp_file); }
+    if (0 == gs->ngroup) { fprintf(stderr, "[E::%s] no groups in '%s'.\n", __func__, gs->grp_file); goto fail; }
+    csp_map_bi_destroy(hn); csp_map_bi_destroy(hg);
+    str_arr_destroy(lines, nline);
+    return 0;
+  fail:
+    if (hn) { csp_map_bi_destroy(hn); }
+    if (hg) { csp_map_bi_destroy(hg); }
+    str_arr_destroy(lines, nline);
+    return -1;
 }
 
 /*
  * Mpileup processing
  */
 int csp_mplp_prepare(csp_mplp_t *mplp, global_settings *gs) {
+    return csp_mplp_prepare_part(mplp, 0, use_barcodes(gs) ? gs->nbarcode : gs->nsid, gs);
+}
+
+int csp_mplp_prepare_part(csp_mplp_t *mplp, int beg, int end, global_settings *gs) {
     char **sgnames;
     int i, nsg;
     csp_plp_t *plp;
@@ -86,7 +216,16 @@ int csp_mplp_prepare(csp_mplp_t *mplp, global_settings *gs) {
     if (use_barcodes(gs)) { sgnames = gs->barcodes; nsg = gs->nbarcode; }
     else if (use_sid(gs)) { sgnames = gs->sample_ids; nsg = gs->nsid; }
     else { fprintf(stderr, "[E::%s] failed to set sample names.\n", __func__); return -1; }  // should not come here!
+    if (beg < 0 || end > nsg || beg >= end) { fprintf(stderr, "[E::%s] invalid range of sample groups.\n", __func__); return -1; }
+    sgnames += beg; nsg = end - beg;
     if (csp_mplp_set_sg(mplp, sgnames, nsg) < 0) { fprintf(stderr, "[E::%s] failed to set sample names.\n", __func__); return -1; }
+    if (gs->ngroup > 0) {
+        mplp->grp = gs->sg_grp + beg; mplp->ngrp = gs->ngroup;
+        if (NULL == mplp->gbc && NULL == (mplp->gbc = (size_t*) calloc(gs->ngroup * 5, sizeof(size_t)))) {
+            fprintf(stderr, "[E::%s] could not allocate the counts of groups.\n", __func__);
+            return -1;
+        }
+    }
     /* init plp for each sample group in mplp->hsg and init HashMap plp->hug for UMI grouping. */
     for (i = 0; i < nsg; i++) {
         if (NULL == (plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[i]))) { 
@@ -116,42 +255,163 @@ int csp_mplp_prepare(csp_mplp_t *mplp, global_settings *gs) {
           do mplp statistics.
  */
 int csp_mplp_push(csp_pileup_t *pileup, csp_mplp_t *mplp, int sid, global_settings *gs) {
-    csp_map_sg_iter k;
-    csp_map_ug_iter u;
     csp_plp_t *plp = NULL;
-    char **s;
-    int r, idx;
     /* Push one csp_pileup_t into csp_mplp_t.
     *  The pileup->cb, pileup->umi could not be NULL as the pileuped read has passed filtering.
     */
+    if (! use_barcodes(gs) && ! use_sid(gs)) { return -1; }  // should not come here!
+    if (NULL == (plp = csp_mplp_get_plp(mplp, pileup->cb, sid, gs))) { return 1; }
+    return csp_plp_push(plp, mplp, pileup->umi, pileup->base, pileup->qual, gs);
+}
+
+inline csp_plp_t* csp_mplp_get_plp(csp_mplp_t *mplp, const char *cb, int sid, global_settings *gs) {
+    csp_map_sg_iter k;
     if (use_barcodes(gs)) { 
-        if ((k = csp_map_sg_get(mplp->hsg, pileup->cb)) == csp_map_sg_end(mplp->hsg)) { return 1; }
-        plp = csp_map_sg_val(mplp->hsg, k);
+        if ((k = csp_map_sg_get(mplp->hsg, cb)) == csp_map_sg_end(mplp->hsg)) { return NULL; }
+        return csp_map_sg_val(mplp->hsg, k);
     } else if (use_sid(gs)) { 
-        plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[sid]);
-    } else { return -1; }  // should not come here!
+        return csp_map_sg_val(mplp->hsg, mplp->hsg_iter[sid]);
+    } else { return NULL; }
+}
+
+/* set the read of a buffered unit, whose @p plp and @p uoff have been set. */
+static inline int csp_plp_unit_set(csp_mplp_t *mplp, csp_plp_unit_t *u, const char *umi, int copy_umi, int8_t base, int8_t qual) {
+    size_t l;
+    u->base = base; u->qual = qual; u->umi = NULL;
+    if (NULL == umi) { u->uoff = CSP_PU_NO_UOFF; }
+    else if (! copy_umi) { u->uoff = CSP_PU_NO_UOFF; u->umi = umi; }
+    else {
+        l = strlen(umi) + 1;       // keep the '\0'.
+        if (CSP_PU_NO_UOFF != u->uoff && strlen(mplp->rs.s + u->uoff) + 1 >= l) {  // reuse the space of the replaced UMI.
+            memcpy(mplp->rs.s + u->uoff, umi, l);
+        } else {
+            u->uoff = mplp->rs.l;
+            if (kputsn(umi, l, &mplp->rs) < 0) { return -1; }
+        }
+    }
+    mplp->rbc[seq_nt16_idx2int(base)]++;
+    return 0;
+}
+
+/*@note   1. If @p copy_umi is set, the UMI is copied into the string buffer of @p mplp as the read may be
+             overwritten before being pushed, otherwise only the pointer is kept.
+          2. If gs->cell_cap > 0, at most gs->cell_cap reads of each sample group are buffered, chosen from all reads 
+             of the sample group at the pos by reservoir sampling (Algorithm R), so that the memory of a pos is bounded 
+             however deep it is. A replaced read is overwritten in place, together with its UMI if the new one fits.
+ */
+int csp_mplp_buf_push(csp_mplp_t *mplp, csp_plp_t *plp, const char *umi, int copy_umi, int8_t base, int8_t qual, global_settings *gs) {
+    csp_plp_unit_t *p, u;
+    size_t r;
+    if (gs->cell_cap > 0) {
+        if (plp->rstamp != mplp->stamp) { plp->rstamp = mplp->stamp; plp->nraw = 0; csp_list_ri_reset(plp->ri); }
+        if (plp->nraw++ >= (size_t) gs->cell_cap) {
+            mplp->ncap++;
+            if ((r = csp_mplp_rand(mplp, plp->nraw)) >= (size_t) gs->cell_cap) { return 0; }
+            p = &csp_list_pu_A(mplp->ru, csp_list_ri_A(plp->ri, r));
+            mplp->rbc[seq_nt16_idx2int(p->base)]--;
+            return csp_plp_unit_set(mplp, p, umi, copy_umi, base, qual);
+        }
+        csp_list_ri_push(plp->ri, csp_list_pu_size(mplp->ru));
+    }
+    u.plp = plp; u.uoff = CSP_PU_NO_UOFF;
+    if (csp_plp_unit_set(mplp, &u, umi, copy_umi, base, qual) < 0) { return -1; }
+    csp_list_pu_push(mplp->ru, u);
+    return 0;
+}
+
+/*@note   1. Without UMI, the raw counts are exactly the counts used by csp_mplp_stat(), so the filters are exact.
+          2. With UMI, the collapsed count of each base is no more than the raw one, and so is the second 
+             largest count, i.e., the count of the infered alt allele. Hence the pos fails --minCOUNT if the raw 
+             total count fails it, and fails --minMAF (> 0) if the raw count of the infered alt is 0.
+          3. A base is counted in the collapsed counts only if some read carries it, so a pos where all raw
+             reads match @p ref_idx has no read supporting any alt allele whether UMI is used or not.
+          4. With the per-cell cap (gs->cell_cap), @p bc are counts of the sampled reads, which are not in proportion
+             to the full counts as only deep cells are sampled, so it is treated the same as UMI.
+ */
+int csp_mplp_precheck(size_t *bc, int8_t ref_idx, global_settings *gs) {
+    size_t tc;
+    int8_t rid, aid;
+    tc = bc[0] + bc[1] + bc[2] + bc[3] + bc[4];
+    if (tc < gs->min_count) { return 1; }
+    if (ref_idx >= 0 && bc[ref_idx] == tc) { return 1; }
+    if (gs->min_maf <= 0) { return 0; }
+    csp_infer_allele(bc, &rid, &aid);
+    if (use_umi(gs) || gs->cell_cap > 0) {
+        if (0 == bc[aid] && gs->min_count > 0) { return 1; }
+    } else if (bc[aid] < tc * gs->min_maf) { return 1; }
+    return 0;
+}
+
+int csp_mplp_buf_flush(csp_mplp_t *mplp, global_settings *gs) {
+    csp_plp_unit_t *u;
+    const char *umi;
+    size_t i;
+    for (i = 0; i < csp_list_pu_size(mplp->ru); i++) {
+        u = &csp_list_pu_A(mplp->ru, i);
+        umi = CSP_PU_NO_UOFF == u->uoff ? u->umi : mplp->rs.s + u->uoff;
+        if (csp_plp_push(u->plp, mplp, umi, u->base, u->qual, gs) < 0) { return -1; }
+    }
+    return 0;
+}
+
+/*@note   1. Quals are only used for genotyping, so they are not kept otherwise.
+          2. If gs->qual_cap > 0, at most gs->qual_cap quals are kept for each base by reservoir sampling (Algorithm R),
+             @p plp->bc[idx] being the num of quals seen so far. csp_mplp_stat() scales the sampled quals up to 
+             @p plp->bc[idx] so the qual matrix is still an unbiased estimate.
+ */
+static inline void csp_plp_push_qual(csp_plp_t *plp, csp_mplp_t *mplp, int idx, int8_t qual, global_settings *gs) {
+    size_t r;
+    if (! gs->is_genotype) { return; }
+    if (gs->qual_cap <= 0 || csp_list_qu_size(plp->qu[idx]) < (size_t) gs->qual_cap) { csp_list_qu_push(plp->qu[idx], qual); return; }
+    mplp->nsamp++;
+    if ((r = csp_mplp_rand(mplp, plp->bc[idx])) < (size_t) gs->qual_cap) { csp_list_qu_A(plp->qu[idx], r) = qual; }
+}
+
+int csp_plp_push(csp_plp_t *plp, csp_mplp_t *mplp, const char *umi, int8_t base, int8_t qual, global_settings *gs) {
+    csp_map_ug_iter u;
+    char **s;
+    int r, idx;
+    mplp->pushed = 1;
     if (use_umi(gs)) {
-        u = csp_map_ug_get(plp->hug, pileup->umi);
+        u = csp_map_ug_get(plp->hug, umi);
         if (u == csp_map_ug_end(plp->hug)) {
             s = csp_pool_ps_get(mplp->su);
-            *s = strdup(pileup->umi);
+            *s = strdup(umi);
             u = csp_map_ug_put(plp->hug, *s, &r);
             if (r < 0) { return -2; }
             /* An example for pushing base & qual into HashMap of umi group.
             csp_list_uu_t *ul = csp_pool_ul_get(mplp->pl);
             csp_umi_unit_t *uu = csp_pool_uu_get(mplp->pu);
-            uu->base = pileup->base; uu->qual = pileup->qual;
+            uu->base = base; uu->qual = qual;
             csp_list_uu_push(ul, uu);
             csp_map_ug_val(plp->hug, u) = ul;
              */
-            idx = seq_nt16_idx2int(pileup->base);
+            idx = seq_nt16_idx2int(base);
             plp->bc[idx]++;
-            csp_list_qu_push(plp->qu[idx], pileup->qual);
+            csp_plp_push_qual(plp, mplp, idx, qual, gs);
         } // else: do nothing.
     } else {
-        idx = seq_nt16_idx2int(pileup->base);
+        idx = seq_nt16_idx2int(base);
         plp->bc[idx]++;
-        csp_list_qu_push(plp->qu[idx], pileup->qual);
+        csp_plp_push_qual(plp, mplp, idx, qual, gs);
+    }
+    return 0;
+}
+
+/*@note   The quals may be sampled, refer to csp_plp_push_qual(), in which case the qual vectors are scaled up to
+          @p plp->bc of the base.
+ */
+int csp_plp_qmat(csp_plp_t *plp, double *qvec) {
+    int j, k;
+    size_t l, n;
+    double f;
+    for (j = 0; j < 5; j++) {
+        if (0 == (n = csp_list_qu_size(plp->qu[j]))) { continue; }
+        f = n < plp->bc[j] ? (double) plp->bc[j] / n : 1.0;
+        for (l = 0; l < n; l++) {
+            if (get_qual_vector(csp_list_qu_A(plp->qu[j], l), 45, 0.25, qvec) < 0) { return -1; }
+            for (k = 0; k < 4; k++) plp->qmat[j][k] += f * qvec[k];
+        }
     }
     return 0;
 }
@@ -160,44 +420,52 @@ int csp_mplp_push(csp_pileup_t *pileup, csp_mplp_t *mplp, int sid, global_settin
             TODO: store results of all reads in one UMI group (maybe could do consistency correction in each UMI group) and then 
             do mplp statistics.
  */
-int csp_mplp_stat(csp_mplp_t *mplp, global_settings *gs) {
+/*@abstract    Statistics of csp_mplp_stat() and csp_mplp_stat_all().
+@param filter  If apply --minCOUNT and --minMAF.
+ */
+static int csp_mplp_stat_(csp_mplp_t *mplp, int filter, global_settings *gs) {
     csp_plp_t *plp = NULL;
-    int i, j, k;
-    size_t l;
+    size_t *gbc;
+    int i, j;
+    mplp->pushed = 1;
     for (i = 0; i < mplp->nsg; i++) {
         plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[i]);
         for (j = 0; j < 5; j++) { 
             plp->tc += plp->bc[j]; 
             mplp->bc[j] += plp->bc[j];
         }
+        if (mplp->grp && mplp->grp[i] >= 0) {        // groups of --cellGroups, from the UMI-collapsed counts.
+            gbc = mplp->gbc + mplp->grp[i] * 5;
+            for (j = 0; j < 5; j++) { gbc[j] += plp->bc[j]; }
+        }
     }
     for (i = 0; i < 5; i++) { mplp->tc += mplp->bc[i]; }
-    if (mplp->tc < gs->min_count) { return 1; }
+    if (filter && mplp->tc < gs->min_count) { return 1; }
     csp_infer_allele(mplp->bc, &mplp->inf_rid, &mplp->inf_aid);   // must be called after mplp->bc are completely calculated.
-    if (mplp->bc[mplp->inf_aid] < mplp->tc * gs->min_maf) { return 1; }
-    if (mplp->ref_idx < 0 || mplp->alt_idx < 0) {  // ref or alt is not valid. Refer to csp_mplp_t.
+    if (filter && mplp->bc[mplp->inf_aid] < mplp->tc * gs->min_maf) { return 1; }
+    if (gs->refseq && mplp->ref_idx >= 0 && mplp->alt_idx < 0) {  // ref is from the reference genome, infer alt only.
+        mplp->alt_idx = mplp->inf_rid == mplp->ref_idx ? mplp->inf_aid : mplp->inf_rid;
+    } else if (mplp->ref_idx < 0 || mplp->alt_idx < 0) {  // ref or alt is not valid. Refer to csp_mplp_t.
         mplp->ref_idx = mplp->inf_rid;
         mplp->alt_idx = mplp->inf_aid;
     }
     mplp->ad = mplp->bc[mplp->alt_idx]; mplp->dp = mplp->bc[mplp->ref_idx] + mplp->ad; mplp->oth = mplp->tc - mplp->dp;
+    /* AD, DP and OTH of each sample group are only read by the cells vcf, the matrices compute the tags selected by
+       --outTags from the base counts, refer to csp_mtx_value(). */
+    if (! gs->is_genotype) { return 0; }
     for (i = 0; i < mplp->nsg; i++) {
         plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[i]);
-        plp->ad = plp->bc[mplp->alt_idx]; if (plp->ad) mplp->nr_ad++;
-        plp->dp = plp->bc[mplp->ref_idx] + plp->ad; if (plp->dp) mplp->nr_dp++;
-        plp->oth = plp->tc - plp->dp; if (plp->oth) mplp->nr_oth++;
-        if (gs->is_genotype) {
-            for (j = 0; j < 5; j++) {
-                for (l = 0; l < csp_list_qu_size(plp->qu[j]); l++) {
-                    if (get_qual_vector(csp_list_qu_A(plp->qu[j], l), 45, 0.25, mplp->qvec) < 0) { return -1; }
-                    for (k = 0; k < 4; k++) plp->qmat[j][k] += mplp->qvec[k];
-                }
-            }
-            if (qual_matrix_to_geno(plp->qmat, plp->bc, mplp->ref_idx, mplp->alt_idx, gs->double_gl, plp->gl, &plp->ngl) < 0) { return -1; }
-        }
+        plp->ad = plp->bc[mplp->alt_idx]; plp->dp = plp->bc[mplp->ref_idx] + plp->ad; plp->oth = plp->tc - plp->dp;
+        if (csp_plp_qmat(plp, mplp->qvec) < 0) { return -1; }
+        if (qual_matrix_to_geno(plp->qmat, plp->bc, mplp->ref_idx, mplp->alt_idx, gs->double_gl, plp->gl, &plp->ngl) < 0) { return -1; }
     }
     return 0;
 }
 
+int csp_mplp_stat(csp_mplp_t *mplp, global_settings *gs) { return csp_mplp_stat_(mplp, 1, gs); }
+
+int csp_mplp_stat_all(csp_mplp_t *mplp, global_settings *gs) { return csp_mplp_stat_(mplp, 0, gs); }
+
 /*
 * BAM/SAM/CRAM File API
  */
@@ -209,24 +477,395 @@ inline void csp_bam_fs_destroy(csp_bam_fs* p) {
         if (p->idx) { hts_idx_destroy(p->idx); }
         if (p->hdr) { sam_hdr_destroy(p->hdr); }
         if (p->fp)  { hts_close(p->fp); }
+        if (p->tids) { free(p->tids); }
+        free(p);
+    }
+}
+
+int csp_bam_fs_set_tids(csp_bam_fs *p, const char **names, int n) {
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    int i, nfound = 0;
+    if (p->tids) { free(p->tids); p->tids = NULL; p->ntid = 0; }
+    if (n <= 0) { return 0; }
+    if (NULL == (p->tids = (int*) malloc(n * sizeof(int)))) { return -1; }
+    for (i = 0; i < n; i++) {
+        if ((p->tids[i] = csp_sam_hdr_name2id(p->hdr, names[i], s)) < -1) { ks_free(s); return -1; }
+        else if (p->tids[i] >= 0) { nfound++; }
+        ks_clear(s);
+    }
+    p->ntid = n;
+    ks_free(s);
+    return nfound;
+}
+
+/* load header and index of the @p idx-th input file. @p hit is set to 1 if the header comes from cache, 0 otherwise. */
+static csp_bam_fs* csp_bam_fs_load(int idx, const char *fn, const char *cache, int keep_fp, int hint, int *hit) {
+    csp_bam_fs *bs = NULL;
+    int fmt = -1;
+    *hit = 0;
+    if (NULL == (bs = csp_bam_fs_init())) { fprintf(stderr, "[E::%s] failed to create csp_bam_fs.\n", __func__); return NULL; }
+    if (cache && (bs->hdr = csp_hdr_cache_load(cache, idx, fn, &fmt))) { *hit = 1; }
+    if (bs->hdr && cram == fmt && ! keep_fp) { return bs; }   // the CRAM index is loaded with each handle later.
+    if (NULL == (bs->fp = csp_hts_open(fn, "rb", hint))) {
+        fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, fn);
+        goto fail;
+    }
+    if (NULL == bs->hdr) {
+        if (NULL == (bs->hdr = sam_hdr_read(bs->fp))) {
+            fprintf(stderr, "[E::%s] failed to read header for %s.\n", __func__, fn);
+            goto fail;
+        }
+        if (cache && csp_hdr_cache_save(cache, idx, fn, bs->hdr, hts_get_format(bs->fp)->format) < 0) {
+            fprintf(stderr, "[W::%s] failed to save header of %s into cache.\n", __func__, fn);
+        }
+    }
+    if (! keep_fp && cram == hts_get_format(bs->fp)->format) {   // the CRAM index could not outlive bs->fp.
+        hts_close(bs->fp); bs->fp = NULL;
+        return bs;
+    }
+    if (NULL == (bs->idx = sam_index_load(bs->fp, fn))) {
+        fprintf(stderr, "[E::%s] failed to load index for %s.\n", __func__, fn);
+        goto fail;
+    }
+    if (! keep_fp) { hts_close(bs->fp); bs->fp = NULL; }
+    return bs;
+  fail:
+    csp_bam_fs_destroy(bs);
+    return NULL;
+}
+
+/* shared state of the tasks loading input files; each task keeps taking the next unloaded file. */
+typedef struct {
+    global_settings *gs;
+    csp_bam_fs **bfs;
+    const char *cache;
+    int keep_fp, hint;
+    int n;                    // num of input files.
+    int next, ndone, nhit;    // next file to load; num of files loaded; num of header cache hits.
+    int step, nprint;         // progress is reported every @p step files.
+    int ret;                  // 0 if success, -1 if any error.
+    pthread_mutex_t lock;
+} csp_bam_fs_loader_t;
+
+static void csp_load_bam_fs_core(void *args) {
+    csp_bam_fs_loader_t *p = (csp_bam_fs_loader_t*) args;
+    csp_bam_fs *bs;
+    int i, hit;
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        if (p->ret < 0 || p->next >= p->n) { pthread_mutex_unlock(&p->lock); break; }
+        i = p->next++;
+        pthread_mutex_unlock(&p->lock);
+        bs = csp_bam_fs_load(i, p->gs->in_fns[i], p->cache, p->keep_fp, p->hint, &hit);
+        pthread_mutex_lock(&p->lock);
+        if (NULL == bs) { p->ret = -1; }
+        else {
+            p->bfs[i] = bs; p->ndone++; p->nhit += hit;
+            if (p->step > 0 && p->ndone >= p->nprint) {
+                fprintf(stderr, "[I::%s] %d/%d input files loaded.\n", __func__, p->ndone, p->n);
+                p->nprint += p->step;
+            }
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/*@note          4. The returned array should be freed by csp_bam_fs_destroy() on each element and free().
+ */
+csp_bam_fs** csp_load_bam_fs(global_settings *gs, int keep_fp, int hint) {
+#define CSP_LOAD_PROGRESS_MIN 20     // min num of input files to report loading progress.
+    csp_bam_fs_loader_t ld;
+    int i, ntask;
+    memset(&ld, 0, sizeof(ld));
+    ld.gs = gs; ld.keep_fp = keep_fp; ld.hint = hint; ld.n = gs->nin;
+    if (gs->hdr_cache) {
+        if (mkdir(gs->hdr_cache, 0755) < 0 && errno != EEXIST) {
+            fprintf(stderr, "[W::%s] failed to create header cache dir '%s', cache disabled.\n", __func__, gs->hdr_cache);
+        } else { ld.cache = gs->hdr_cache; }
+    }
+    if (ld.n >= CSP_LOAD_PROGRESS_MIN) { ld.step = ld.nprint = ld.n / 10; }
+    if (NULL == (ld.bfs = (csp_bam_fs**) calloc(ld.n, sizeof(csp_bam_fs*)))) {
+        fprintf(stderr, "[E::%s] could not initialize csp_bam_fs array.\n", __func__);
+        return NULL;
+    }
+    pthread_mutex_init(&ld.lock, NULL);
+    ntask = gs->tp ? min2(gs->nthread, ld.n) : 0;
+    for (i = 0; i < ntask; i++) {
+        if (thpool_add_work(gs->tp, csp_load_bam_fs_core, &ld) < 0) {
+            fprintf(stderr, "[W::%s] failed to add loading task to the thread pool.\n", __func__);
+            break;
+        }
+    }
+    if (i > 0) { thpool_wait(gs->tp); }
+    else { csp_load_bam_fs_core(&ld); }   // no thread pool, load in the current thread.
+    pthread_mutex_destroy(&ld.lock);
+    if (ld.ret < 0 || ld.ndone < ld.n) { goto fail; }
+    if (ld.step > 0 || ld.cache) {
+        fprintf(stderr, "[I::%s] loaded headers and indexes of %d input files (%d header cache hits).\n", __func__, ld.n, ld.nhit);
+    }
+    return ld.bfs;
+  fail:
+    for (i = 0; i < ld.n; i++) { csp_bam_fs_destroy(ld.bfs[i]); }
+    free(ld.bfs);
+    return NULL;
+#undef CSP_LOAD_PROGRESS_MIN
+}
+
+csp_fp_cache_t* csp_fp_cache_init(char **fns, int n, int m, int hint) {
+    csp_fp_cache_t *p;
+    if (n <= 0 || m <= 0) { return NULL; }
+    if (NULL == (p = (csp_fp_cache_t*) calloc(1, sizeof(csp_fp_cache_t)))) { return NULL; }
+    p->fps = (htsFile**) calloc(n, sizeof(htsFile*));
+    p->idxs = (hts_idx_t**) calloc(n, sizeof(hts_idx_t*));
+    p->prev = (int*) malloc(n * sizeof(int));
+    p->next = (int*) malloc(n * sizeof(int));
+    if (NULL == p->fps || NULL == p->idxs || NULL == p->prev || NULL == p->next) { csp_fp_cache_destroy(p); return NULL; }
+    p->head = p->tail = -1;
+    p->n = n; p->m = min2(m, n); p->nopen = p->ncram = 0;
+    p->fns = fns; p->hint = hint;
+    return p;
+}
+
+void csp_fp_cache_destroy(csp_fp_cache_t *p) {
+    if (p) {
+        int i;
+        if (p->fps) {
+            for (i = 0; i < p->n; i++) { if (p->fps[i]) hts_close(p->fps[i]); }
+            free(p->fps);
+        }
+        if (p->idxs) {
+            for (i = 0; i < p->n; i++) { if (p->idxs[i]) hts_idx_destroy(p->idxs[i]); }
+            free(p->idxs);
+        }
+        free(p->prev); free(p->next);
         free(p);
     }
 }
 
+/* remove the i-th file from the LRU list. */
+static inline void csp_fp_cache_unlink(csp_fp_cache_t *p, int i) {
+    if (p->prev[i] >= 0) { p->next[p->prev[i]] = p->next[i]; } else { p->head = p->next[i]; }
+    if (p->next[i] >= 0) { p->prev[p->next[i]] = p->prev[i]; } else { p->tail = p->prev[i]; }
+}
+
+/* push the i-th file to the front of the LRU list. */
+static inline void csp_fp_cache_push_front(csp_fp_cache_t *p, int i) {
+    p->prev[i] = -1; p->next[i] = p->head;
+    if (p->head >= 0) { p->prev[p->head] = i; } else { p->tail = i; }
+    p->head = i;
+}
+
+htsFile* csp_fp_cache_get(csp_fp_cache_t *p, int i) {
+    int j;
+    if (p->fps[i]) {
+        if (p->head != i) { csp_fp_cache_unlink(p, i); csp_fp_cache_push_front(p, i); }
+        return p->fps[i];
+    }
+    if (p->nopen >= p->m) {     // evict the least recently used one, a CRAM file only if all open files are CRAM.
+        j = p->tail;
+        if (p->ncram < p->nopen) { while (p->idxs[j]) { j = p->prev[j]; } }
+        csp_fp_cache_unlink(p, j);
+        if (p->idxs[j]) { hts_idx_destroy(p->idxs[j]); p->idxs[j] = NULL; p->ncram--; }
+        hts_close(p->fps[j]); p->fps[j] = NULL;
+        p->nopen--;
+    }
+    if (NULL == (p->fps[i] = csp_hts_open(p->fns[i], "rb", p->hint))) { return NULL; }
+    if (cram == hts_get_format(p->fps[i])->format && NULL == (p->idxs[i] = sam_index_load(p->fps[i], p->fns[i]))) {
+        fprintf(stderr, "[E::%s] failed to load index for %s.\n", __func__, p->fns[i]);
+        hts_close(p->fps[i]); p->fps[i] = NULL;
+        return NULL;
+    }
+    if (p->idxs[i]) { p->ncram++; }
+    csp_fp_cache_push_front(p, i);
+    p->nopen++;
+    return p->fps[i];
+}
+
+/*@note          If gs->max_open is not set, the value is derived from the soft limit of open files (ulimit -n), 
+                 after reserving some descriptors for output and tmp files.
+ */
+int csp_fp_cache_cap(global_settings *gs, int nthread) {
+#define CSP_FD_RESERVE 32            // descriptors reserved for the main thread, e.g. output files.
+#define CSP_FD_RESERVE_THREAD 8      // descriptors reserved for each thread, e.g. tmp output files.
+    struct rlimit rl;
+    long m;
+    if (nthread <= 0) { nthread = 1; }
+    if (gs->max_open > 0) { m = gs->max_open; }
+    else if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY) { m = gs->nin; }
+    else { m = ((long) rl.rlim_cur - CSP_FD_RESERVE - (long) CSP_FD_RESERVE_THREAD * nthread) / nthread; }
+    return (int) max2(1, min2(m, gs->nin));
+#undef CSP_FD_RESERVE
+#undef CSP_FD_RESERVE_THREAD
+}
+
 /* 
 * Thread API
 */
 
+csp_vidx_t* csp_vidx_init(void) {
+    csp_vidx_t *x;
+    if (NULL == (x = (csp_vidx_t*) calloc(1, sizeof(csp_vidx_t)))) { return NULL; }
+    kv_init(x->a);
+    if (NULL == (x->hn = csp_map_bi_init())) { free(x); return NULL; }
+    return x;
+}
+
+void csp_vidx_destroy(csp_vidx_t *x) {
+    if (NULL == x) { return; }
+    kv_destroy(x->a);
+    if (x->names) { str_arr_destroy(x->names, x->nname); }
+    csp_map_bi_destroy(x->hn);
+    free(x);
+}
+
+int csp_vidx_open(csp_vidx_t *x, const char *fn) {
+    struct stat st;
+    if (0 == stat(fn, &st)) { x->base = st.st_size; }
+    else if (ENOENT == errno) { x->base = 0; }
+    else { return -1; }
+    if (0 == kv_size(x->a)) { x->off0 = x->base << 16; }
+    return 0;
+}
+
+int csp_vidx_tid(csp_vidx_t *x, const char *chr) {
+    csp_map_bi_iter k;
+    char **a;
+    int r;
+    if ((k = csp_map_bi_get(x->hn, chr)) != csp_map_bi_end(x->hn)) { return csp_map_bi_val(x->hn, k); }
+    if (x->nname >= x->mname) {
+        x->mname = x->mname ? x->mname << 1 : 32;
+        if (NULL == (a = (char**) realloc(x->names, x->mname * sizeof(char*)))) { return -1; }
+        x->names = a;
+    }
+    if (NULL == (x->names[x->nname] = strdup(chr))) { return -1; }
+    k = csp_map_bi_put(x->hn, x->names[x->nname], &r);   // keys are owned by x->names.
+    if (r < 0) { free(x->names[x->nname]); return -1; }
+    csp_map_bi_val(x->hn, k) = x->nname;
+    return x->nname++;
+}
+
+int csp_vidx_push(csp_vidx_t *x, int tid, hts_pos_t beg, BGZF *fp) {
+    csp_vidx_rec_t r;
+    r.tid = tid; r.beg = beg;
+    r.off = bgzf_tell(fp) + (x->base << 16);    // the BGZF stream opened for appending starts from block address 0.
+    kv_push(csp_vidx_rec_t, x->a, r);
+    return 0;
+}
+
+int csp_vidx_save(csp_vidx_t **x, const uint64_t *shift, int n, const char *fn, bcf_hdr_t *hdr) {
+    hts_idx_t *idx = NULL;
+    csp_vidx_rec_t *r;
+    uint8_t *done = NULL, *meta = NULL;
+    uint64_t off, sh;
+    int32_t conf[7] = {2, 1, 2, 0, '#', 0, 0};     // tbx_conf_vcf, and the length of contig names.
+    hts_pos_t lbeg = 0, max_end = 0, s;
+    size_t j, l;
+    int i, k, ltid = -1, nctg, n_lvls = 5, fmt = hdr ? HTS_FMT_CSI : HTS_FMT_TBI;
+    nctg = hdr ? hdr->n[BCF_DT_CTG] : x[0]->nname;
+    if (NULL == (done = (uint8_t*) calloc(nctg + 1, sizeof(uint8_t)))) { goto fail; }
+    for (i = 0; i < n; i++) {        // each contig should be one block of increasing positions.
+        for (j = 0; j < kv_size(x[i]->a); j++) {
+            r = &kv_A(x[i]->a, j);
+            if (r->tid < 0 || r->tid >= nctg) { goto fail; }
+            if (r->tid != ltid) {
+                if (done[r->tid]) { goto unsorted; }
+                done[r->tid] = 1; ltid = r->tid;
+            } else if (r->beg < lbeg) { goto unsorted; }
+            lbeg = r->beg;
+            if (r->beg + 1 > max_end) { max_end = r->beg + 1; }
+        }
+    }
+    if (hdr) {                       // as bcf_idx_init(), but by the positions as contig lengths may be missing.
+        for (k = 0, s = 1LL << 14; max_end + 256 > s; k++, s <<= 3) ;
+        if (k > n_lvls) { n_lvls = k; }
+    }
+    off = x[0]->off0 + ((shift ? shift[0] : 0) << 16);
+    if (NULL == (idx = hts_idx_init(hdr ? nctg : 0, fmt, off, 14, n_lvls))) { goto fail; }
+    for (i = 0; i < n; i++) {
+        sh = (shift ? shift[i] : 0) << 16;
+        for (j = 0; j < kv_size(x[i]->a); j++) {
+            r = &kv_A(x[i]->a, j);
+            off = r->off + sh;
+            if (hts_idx_push(idx, r->tid, r->beg, r->beg + 1, off, 1) < 0) { goto fail; }
+        }
+    }
+    if (hts_idx_finish(idx, off) < 0) { goto fail; }
+    if (NULL == hdr) {
+        for (k = 0, l = 0; k < nctg; k++) { l += strlen(x[0]->names[k]) + 1; }
+        conf[6] = l;
+        if (NULL == (meta = (uint8_t*) malloc(sizeof(conf) + l))) { goto fail; }
+        memcpy(meta, conf, sizeof(conf));
+        for (k = 0, l = sizeof(conf); k < nctg; k++) {
+            strcpy((char*) meta + l, x[0]->names[k]);
+            l += strlen(x[0]->names[k]) + 1;
+        }
+        if (hts_idx_set_meta(idx, l, meta, 0) < 0) { goto fail; }
+        meta = NULL;                 // owned by idx now.
+    }
+    if (hts_idx_save_as(idx, fn, NULL, fmt) < 0) { goto fail; }
+    hts_idx_destroy(idx);
+    free(done);
+    return 0;
+  unsorted:
+    fprintf(stderr, "[W::%s] records of '%s' are not sorted, skip indexing it.\n", __func__, fn);
+    free(done);
+    return 0;
+  fail:
+    fprintf(stderr, "[E::%s] failed to index '%s'.\n", __func__, fn);
+    if (idx) { hts_idx_destroy(idx); }
+    free(done); free(meta);
+    return -1;
+}
+
+/*@abstract  Close the files and free the BCF writer.
+@return      0 if success, -1 otherwise.
+ */
+static int bcfw_destroy(csp_bcfw_t *w) {
+    int ret = 0;
+    if (NULL == w) { return 0; }
+    if (w->fb && hts_close(w->fb) < 0) { ret = -1; }
+    if (w->fc && hts_close(w->fc) < 0) { ret = -1; }
+    if (w->rb) { bcf_destroy1(w->rb); }
+    if (w->rc) { bcf_destroy1(w->rc); }
+    free(w->gt);
+    free(w);
+    return ret;
+}
+
 /*@note      The pointer returned successfully by thdata_init() should be freed
              by thdata_destroy() when no longer used.
  */
 inline thread_data* thdata_init(void) { return (thread_data*) calloc(1, sizeof(thread_data)); }
 
-inline void thdata_destroy(thread_data *p) { free(p); }
+inline void thdata_destroy(thread_data *p) { 
+    int i;
+    if (p) { 
+        thdata_destroy(p->disc); bcfw_destroy(p->bw); 
+        csp_vidx_destroy(p->ib); csp_vidx_destroy(p->ic);
+        for (i = 0; i < CSP_NTAG; i++) { csp_csc_spill_destroy(p->csc[i]); }
+        free(p); 
+    }
+}
 
 inline void thdata_print(FILE *fp, thread_data *p) {
     fprintf(fp, "\tm = %ld, n = %ld\n", p->m, p->n);
-    fprintf(fp, "\ti = %d, ret = %d\n", p->i, p->ret);
+    fprintf(fp, "\ti = %d, ret = %d, max_open = %d\n", p->i, p->ret, p->max_open);
+}
+
+void thdata_report_cap(thread_data **td, int n, global_settings *gs) {
+    size_t cap_reads = 0, cap_sites = 0, samp_sites = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        cap_reads += td[i]->cap_reads; cap_sites += td[i]->cap_sites; samp_sites += td[i]->samp_sites;
+    }
+    if (gs->cell_cap > 0) {
+        fprintf(stderr, "[I::%s] --cellCap %d dropped %ld reads at %ld positions.\n", __func__, 
+                gs->cell_cap, (long) cap_reads, (long) cap_sites);
+    }
+    if (gs->qual_cap > 0 && gs->is_genotype) {
+        fprintf(stderr, "[I::%s] --qualCap %d sampled the qualities at %ld positions.\n", __func__, 
+                gs->qual_cap, (long) samp_sites);
+    }
 }
 
 /*
@@ -295,6 +934,127 @@ int merge_mtx(jfile_t *out, jfile_t **in, const int n, size_t *ns, size_t *nr, i
     return i;
 }
 
+/*@note      The tmp files are the same as merge_mtx(), one "sample\tvalue" line for each record and an empty 
+             line at the end of each SNP.
+ */
+int merge_mtx_bin(const char *fn, jfile_t **in, const int n, size_t ns, int nsmp, size_t nr) {
+    csp_bmtx_t *bm = NULL;
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    unsigned long smp, val;
+    size_t k = 0;
+    char *p;
+    int i = 0;
+    if (NULL == (bm = csp_bmtx_create(fn, ns, nsmp, nr, 1))) { goto fail; }
+    for (; i < n; i++) {
+        if (jf_open(in[i], "rb") <= 0) { goto fail; }
+        while (jf_getln(in[i], s) >= 0) {
+            if (0 == ks_len(s)) { k++; continue; }    // empty line, meaning ending of a SNP.
+            smp = strtoul(ks_str(s), &p, 10);
+            val = strtoul(p, NULL, 10);
+            if (smp < 1 || smp > (unsigned long) nsmp || csp_bmtx_push(bm, k, smp - 1, val) < 0) { goto fail; }
+            ks_clear(s);
+        }
+        jf_close(in[i]);
+    }
+    ks_free(s);
+    if (k != ns) { csp_bmtx_close(bm); return -1; }
+    return csp_bmtx_close(bm);
+  fail:
+    ks_free(s);
+    if (i < n && jf_isopen(in[i])) { jf_close(in[i]); }
+    if (bm) { csp_bmtx_close(bm); }
+    return -1;
+}
+
+int csp_merge_mtx(jfile_t *out, jfile_t **in, const int n, size_t ns, int nsmp, size_t nr, global_settings *gs) {
+    size_t ns_merge, nr_merge;
+    int ret;
+    if (gs->bin_mtx) {
+        if (merge_mtx_bin(out->fn, in, n, ns, nsmp, nr) < 0) { goto fail; }
+        return 0;
+    }
+    if (jf_open(out, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open '%s'.\n", __func__, out->fn); return -1; }
+    jf_printf(out, "%ld\t%d\t%ld\n", ns, nsmp, nr);
+    merge_mtx(out, in, n, &ns_merge, &nr_merge, &ret);
+    if (ret < 0 || ns_merge != ns || nr_merge != nr) { goto fail; }
+    jf_close(out);
+    return 0;
+  fail:
+    fprintf(stderr, "[E::%s] failed to merge mtx '%s'.\n", __func__, out->fn);
+    if (jf_isopen(out)) { jf_close(out); }
+    return -1;
+}
+
+int csp_merge_csc(jfile_t **out, thread_data **td, const int n, int nsmp, global_settings *gs) {
+    csp_csc_spill_t **sp = NULL;
+    size_t *soff = NULL, nr;
+    int i, t;
+    if (NULL == (sp = (csp_csc_spill_t**) malloc(n * sizeof(csp_csc_spill_t*))) || \
+        NULL == (soff = (size_t*) malloc((n + 1) * sizeof(size_t)))) { goto fail; }
+    for (soff[0] = 0, i = 0; i < n; i++) { soff[i + 1] = soff[i] + td[i]->ns; }
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (NULL == out[t]) { continue; }
+        for (nr = 0, i = 0; i < n; i++) {
+            if (NULL == (sp[i] = td[i]->csc[t]) || csp_csc_spill_flush(sp[i]) < 0) { goto fail; }
+            nr += td[i]->nr[t];
+        }
+        if (csp_csc_merge(out[t], sp, soff, n, soff[n], nsmp, nr, gs->bin_mtx, (size_t) gs->cell_major_mem << 20) < 0) { goto fail; }
+    }
+    free(sp); free(soff);
+    return 0;
+  fail:
+    fprintf(stderr, "[E::%s] failed to merge the cell-major matrices.\n", __func__);
+    free(sp); free(soff);
+    return -1;
+}
+
+/*@abstract  Merge the tmp sparse genotype files into a binary sparse matrix file.
+@return      0 if success, -1 otherwise.
+ */
+static int merge_gt_bin(const char *fn, jfile_t **in, const int n, size_t ns, int nsmp, size_t nr, int npl) {
+    csp_bmtx_t *bm = NULL;
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    uint32_t val[11];           // GT, at most 5 PL and 5 ALL.
+    unsigned long smp;
+    size_t k = 0;
+    char *p, *q;
+    int i = 0, j, nval = 1 + npl + 5;
+    if (NULL == (bm = csp_bmtx_create(fn, ns, nsmp, nr, nval))) { goto fail; }
+    for (; i < n; i++) {
+        if (jf_open(in[i], "rb") <= 0) { goto fail; }
+        while (jf_getln(in[i], s) >= 0) {
+            if (0 == ks_len(s)) { k++; continue; }    // empty line, meaning ending of a SNP.
+            smp = strtoul(ks_str(s), &p, 10);
+            if (smp < 1 || *p++ != '\t' || strlen(p) < 4) { goto fail; }
+            val[0] = (p[0] == '1') + (p[2] == '1');    // 0/0, 1/0 or 1/1.
+            for (p += 3, j = 1; j < nval; j++, p = q) {
+                val[j] = strtoul(p + 1, &q, 10);
+                if (q == p + 1) { goto fail; }
+            }
+            if (csp_bmtx_pushv(bm, k, smp - 1, val) < 0) { goto fail; }
+            ks_clear(s);
+        }
+        jf_close(in[i]);
+    }
+    ks_free(s);
+    if (k != ns) { csp_bmtx_close(bm); return -1; }
+    return csp_bmtx_close(bm);
+  fail:
+    ks_free(s);
+    if (i < n && jf_isopen(in[i])) { jf_close(in[i]); }
+    if (bm) { csp_bmtx_close(bm); }
+    return -1;
+}
+
+int csp_merge_gt(jfile_t *out, jfile_t **in, const int n, size_t ns, int nsmp, size_t nr, global_settings *gs) {
+    if (! gs->bin_mtx) { return csp_merge_mtx(out, in, n, ns, nsmp, nr, gs); }
+    if (merge_gt_bin(out->fn, in, n, ns, nsmp, nr, csp_npl(gs)) < 0) {
+        fprintf(stderr, "[E::%s] failed to merge sparse genotypes '%s'.\n", __func__, out->fn);
+        return -1;
+    }
+    return 0;
+}
+
 int merge_vcf(jfile_t *out, jfile_t **in, const int n, int *ret) {
 #define TMP_BUFSIZE 1048576
     size_t lr, lw;
@@ -318,6 +1078,122 @@ int merge_vcf(jfile_t *out, jfile_t **in, const int n, int *ret) {
 #undef TMP_BUFSIZE
 }
 
+/*@abstract  Merge the tmp text vcf files line by line into the compressed @p out and record its index.
+@return      0 if success, -1 otherwise.
+ */
+static int merge_vcf_idx(jfile_t *out, jfile_t **in, const int n, csp_vidx_t *x) {
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    char *p;
+    long pos;
+    int i = 0, tid;
+    if (csp_vidx_open(x, out->fn) < 0 || jf_open(out, NULL) <= 0) { goto fail; }
+    for (; i < n; i++) {
+        if (jf_open(in[i], "rb") <= 0) { goto fail; }
+        for (ks_clear(s); jf_getln(in[i], s) >= 0; ks_clear(s)) {
+            if (NULL == (p = strchr(ks_str(s), '\t'))) { goto fail; }
+            *p = '\0';
+            tid = csp_vidx_tid(x, ks_str(s));
+            *p = '\t';
+            pos = strtol(p + 1, NULL, 10);
+            if (tid < 0 || pos < 1) { goto fail; }
+            jf_puts(ks_str(s), out); jf_putc('\n', out);
+            if (jf_flush(out) < 0 || csp_vidx_push(x, tid, pos - 1, out->zfp) < 0) { goto fail; }
+        }
+        jf_close(in[i]);
+    }
+    ks_free(s);
+    return jf_close(out) < 0 ? -1 : 0;
+  fail:
+    ks_free(s);
+    if (i < n && jf_isopen(in[i])) { jf_close(in[i]); }
+    return -1;
+}
+
+int csp_merge_vcf(jfile_t *out, jfile_t **in, const int n, thread_data **td, int is_cells, global_settings *gs) {
+#define TMP_BUFSIZE 1048576
+    FILE *fo = NULL, *fi = NULL;
+    char *buf = NULL;
+    csp_vidx_t **x = NULL, *xt = NULL;
+    bcf_hdr_t *hdr = gs->out_bcf ? (is_cells ? gs->bcf_hdr_cells : gs->bcf_hdr_base) : NULL;
+    uint64_t *shift = NULL;
+    size_t lr;
+    off_t l;
+    int i, ret;
+    if (NULL == (x = (csp_vidx_t**) calloc(n, sizeof(csp_vidx_t*)))) { goto fail; }
+    for (i = 0; i < n; i++) { x[i] = is_cells ? td[i]->ic : td[i]->ib; }
+    if (NULL == in) {                // written directly by the only thread, which has recorded the index.
+        if (x[0] && csp_vidx_save(x, NULL, 1, out->fn, hdr) < 0) { goto fail; }
+        free(x);
+        return 0;
+    }
+    if (! gs->out_bcf) {
+        if (gs->is_out_zip) {
+            if (NULL == (xt = csp_vidx_init()) || merge_vcf_idx(out, in, n, xt) < 0) { goto fail; }
+            if (csp_vidx_save(&xt, NULL, 1, out->fn, NULL) < 0) { goto fail; }
+            csp_vidx_destroy(xt); xt = NULL;
+        } else {
+            if (jf_open(out, NULL) < 0) { goto fail; }
+            merge_vcf(out, in, n, &ret);
+            if (ret < 0) { goto fail; }
+            jf_close(out);
+        }
+        free(x);
+        return 0;
+    }
+    if (NULL == (shift = (uint64_t*) calloc(n, sizeof(uint64_t)))) { goto fail; }
+    if (NULL == (buf = (char*) malloc(TMP_BUFSIZE)) || NULL == (fo = fopen(out->fn, "ab"))) { goto fail; }
+    for (i = 0; i < n; i++) {
+        if (NULL == x[i] || fseeko(fo, 0, SEEK_END) < 0 || (l = ftello(fo)) < 0) { goto fail; }
+        shift[i] = l;
+        if (NULL == (fi = fopen(in[i]->fn, "rb"))) { goto fail; }
+        while ((lr = fread(buf, 1, TMP_BUFSIZE, fi)) > 0) {
+            if (fwrite(buf, 1, lr, fo) != lr) { goto fail; }
+        }
+        if (ferror(fi)) { goto fail; }
+        fclose(fi); fi = NULL;
+    }
+    free(buf); buf = NULL;
+    if (fclose(fo) != 0) { fo = NULL; goto fail; }
+    fo = NULL;
+    if (csp_vidx_save(x, shift, n, out->fn, hdr) < 0) { goto fail; }
+    free(x); free(shift);
+    return 0;
+  fail:
+    fprintf(stderr, "[E::%s] failed to merge vcf '%s'.\n", __func__, out->fn);
+    if (jf_isopen(out)) { jf_close(out); }
+    if (fi) { fclose(fi); }
+    if (fo) { fclose(fo); }
+    if (buf) { free(buf); }
+    if (xt) { csp_vidx_destroy(xt); }
+    free(x); free(shift);
+    return -1;
+#undef TMP_BUFSIZE
+}
+
+int csp_merge_h5(jfile_t *out, jfile_t **ad, jfile_t **dp, jfile_t **oth, jfile_t **site, const int n, size_t ns, 
+                 global_settings *gs) 
+{
+    char **smp;
+    int nsmp;
+    if (use_barcodes(gs)) { smp = gs->barcodes; nsmp = gs->nbarcode; }
+    else { smp = gs->sample_ids; nsmp = gs->nsid; }
+    if (csp_h5_write(out->fn, ad, dp, oth, site, n, ns, smp, nsmp, gs->is_genotype ? csp_npl(gs) : 0) < 0) {
+        fprintf(stderr, "[E::%s] failed to write HDF5 '%s'.\n", __func__, out->fn);
+        return -1;
+    }
+    return 0;
+}
+
+int csp_merge_arrow(jfile_t *tag, jfile_t *snp, jfile_t **ad, jfile_t **dp, jfile_t **oth, jfile_t **site, const int n, 
+                    size_t ns) 
+{
+    if (csp_arrow_write_tag(tag->fn, ad, dp, oth, n, ns) < 0 || csp_arrow_write_snp(snp->fn, site, n, ns) < 0) {
+        fprintf(stderr, "[E::%s] failed to write Arrow streams '%s' and '%s'.\n", __func__, tag->fn, snp->fn);
+        return -1;
+    }
+    return 0;
+}
+
 /*@note      1. When proc = 1, the origial outputed mtx file was not filled with stat info:
                 (totol SNPs, total samples, total records),
                 so use this function to fill and rewrite.
@@ -365,3 +1241,357 @@ int rewrite_mtx(jfile_t *fs, size_t ns, int nsmp, size_t nr) {
 #undef TMP_BUFSIZE
 }
 
+
+/*
+ * VCF Output Routine
+ */
+
+/*@abstract  Build one BCF header.
+@param lines Header lines besides the contigs and samples.
+@param is_cells  1 if the header is of vcf CELLS, whose samples are added.
+@return      Pointer of bcf_hdr_t if success, NULL otherwise.
+ */
+static bcf_hdr_t* bcf_hdr_build(global_settings *gs, const char *lines, sam_hdr_t *bh, const char **ctgs, int nctg, 
+                                int is_cells, kstring_t *s) 
+{
+    bcf_hdr_t *h;
+    char *p, *q, **smp;
+    int i, nsmp;
+    if (NULL == (h = bcf_hdr_init("w"))) { return NULL; }
+    kputs(lines, s);
+    for (i = 0; i < sam_hdr_nref(bh); i++) { 
+        ksprintf(s, "##contig=<ID=%s,length=%ld>\n", sam_hdr_tid2name(bh, i), (long) sam_hdr_tid2len(bh, i)); 
+    }
+    for (i = 0; i < nctg; i++) {
+        if (sam_hdr_name2tid(bh, ctgs[i]) < 0) { ksprintf(s, "##contig=<ID=%s>\n", ctgs[i]); }
+    }
+    for (p = ks_str(s); (q = strchr(p, '\n')) != NULL; p = q + 1) {
+        *q = '\0';
+        if (bcf_hdr_append(h, p) < 0) { goto fail; }
+    }
+    if (is_cells) {
+        if (use_barcodes(gs)) { smp = gs->barcodes; nsmp = gs->nbarcode; }
+        else { smp = gs->sample_ids; nsmp = gs->nsid; }
+        for (i = 0; i < nsmp; i++) {
+            if (bcf_hdr_add_sample(h, smp[i]) < 0) { goto fail; }
+        }
+    }
+    if (bcf_hdr_sync(h) < 0) { goto fail; }
+    ks_clear(s);
+    return h;
+  fail:
+    ks_clear(s);
+    bcf_hdr_destroy(h);
+    return NULL;
+}
+
+/*@abstract  Write the BCF header to a new file.
+@return      0 if success, -1 otherwise.
+ */
+static int bcf_hdr_output(bcf_hdr_t *h, const char *fn) {
+    htsFile *fp;
+    if (NULL == (fp = hts_open(fn, "wb"))) { return -1; }
+    if (bcf_hdr_write(fp, h) < 0) { hts_close(fp); return -1; }
+    return hts_close(fp) < 0 ? -1 : 0;
+}
+
+int csp_bcf_init(global_settings *gs, sam_hdr_t *bh, const char **ctgs, int nctg) {
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    if (NULL == (gs->bcf_hdr_base = bcf_hdr_build(gs, CSP_BCF_BASE_HEADER, bh, ctgs, nctg, 0, s))) {
+        fprintf(stderr, "[E::%s] failed to build the header of BCF BASE.\n", __func__);
+        goto fail;
+    }
+    if (csp_out_cells(gs) && NULL == (gs->bcf_hdr_cells = bcf_hdr_build(gs, CSP_BCF_CELLS_HEADER, bh, ctgs, nctg, 1, s))) {
+        fprintf(stderr, "[E::%s] failed to build the header of BCF CELLS.\n", __func__);
+        goto fail;
+    }
+    if (bcf_hdr_output(gs->bcf_hdr_base, gs->out_vcf_base->fn) < 0 || \
+        (csp_out_cells(gs) && bcf_hdr_output(gs->bcf_hdr_cells, gs->out_vcf_cells->fn) < 0)) { goto hdr_fail; }
+    if (gs->discover) {
+        if (bcf_hdr_output(gs->bcf_hdr_base, gs->disc_vcf_base->fn) < 0 || \
+            (csp_out_cells(gs) && bcf_hdr_output(gs->bcf_hdr_cells, gs->disc_vcf_cells->fn) < 0)) { goto hdr_fail; }
+    }
+    ks_free(s);
+    return 0;
+  hdr_fail:
+    fprintf(stderr, "[E::%s] failed to write the BCF headers.\n", __func__);
+  fail:
+    ks_free(s);
+    return -1;
+}
+
+int csp_mtx_open(thread_data *d) {
+    global_settings *gs = d->gs;
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    int i;
+    for (i = 0; i < CSP_NTAG; i++) {
+        if (d->out_mtx[i] && jf_open(d->out_mtx[i], NULL) <= 0) {
+            fprintf(stderr, "[E::%s] failed to open tmp mtx %s file '%s'.\n", __func__, csp_mtx_tag_name(i), d->out_mtx[i]->fn);
+            goto fail;
+        }
+        if (d->out_grp[i] && jf_open(d->out_grp[i], NULL) <= 0) {
+            fprintf(stderr, "[E::%s] failed to open tmp group mtx %s file '%s'.\n", __func__, csp_mtx_tag_name(i), d->out_grp[i]->fn);
+            goto fail;
+        }
+        if (gs->cell_major && d->out_mtx[i] && NULL == d->csc[i]) {
+            ks_clear(s); kputs(d->out_mtx[i]->fn, s); kputs(".csc", s);
+            if (NULL == (d->csc[i] = csp_csc_spill_init(ks_str(s), use_barcodes(gs) ? gs->nbarcode : gs->nsid))) {
+                fprintf(stderr, "[E::%s] failed to create cell-major spill file of '%s'.\n", __func__, d->out_mtx[i]->fn);
+                goto fail;
+            }
+        }
+    }
+    ks_free(s);
+    return 0;
+  fail:
+    ks_free(s);
+    return -1;
+}
+
+void csp_mtx_close(thread_data *d) {
+    int i;
+    for (i = 0; i < CSP_NTAG; i++) {
+        if (d->out_mtx[i] && jf_isopen(d->out_mtx[i])) { jf_close(d->out_mtx[i]); }
+        if (d->out_grp[i] && jf_isopen(d->out_grp[i])) { jf_close(d->out_grp[i]); }
+    }
+}
+
+/*@abstract  Create the index recorder if needed and start it for the file to be opened.
+@return      0 if success, -1 otherwise.
+ */
+static int vcf_idx_open(csp_vidx_t **x, const char *fn) {
+    if ((NULL == *x && NULL == (*x = csp_vidx_init())) || csp_vidx_open(*x, fn) < 0) {
+        fprintf(stderr, "[E::%s] failed to start the index of '%s'.\n", __func__, fn);
+        return -1;
+    }
+    return 0;
+}
+
+/*@abstract  Record one line of text vcf that has just been written.
+@return      0 if success, -1 otherwise.
+ */
+static int vcf_idx_line(csp_vidx_t *x, jfile_t *fp, int tid, hts_pos_t pos) {
+    if (tid < 0 || jf_flush(fp) < 0 || csp_vidx_push(x, tid, pos, fp->zfp) < 0) { return -1; }
+    return 0;
+}
+
+int csp_vcf_open(thread_data *d) {
+    global_settings *gs = d->gs;
+    csp_bcfw_t *w;
+    if (d->out_site && jf_open(d->out_site, NULL) <= 0) {
+        fprintf(stderr, "[E::%s] failed to open tmp site file '%s'.\n", __func__, d->out_site->fn);
+        return -1;
+    }
+    if (d->out_mtx_gt && jf_open(d->out_mtx_gt, NULL) <= 0) {
+        fprintf(stderr, "[E::%s] failed to open tmp sparse genotype file '%s'.\n", __func__, d->out_mtx_gt->fn);
+        return -1;
+    }
+    if (! gs->out_bcf) {
+        if (gs->is_out_zip && ! d->out_vcf_base->is_tmp) {      // the tmp files are indexed when merged.
+            if (vcf_idx_open(&d->ib, d->out_vcf_base->fn) < 0) { return -1; }
+            if (d->out_vcf_cells && vcf_idx_open(&d->ic, d->out_vcf_cells->fn) < 0) { return -1; }
+        }
+        if (jf_open(d->out_vcf_base, NULL) <= 0) { 
+            fprintf(stderr, "[E::%s] failed to open vcf BASE file '%s'.\n", __func__, d->out_vcf_base->fn);
+            return -1;
+        }
+        if (d->out_vcf_cells && jf_open(d->out_vcf_cells, NULL) <= 0) { 
+            fprintf(stderr, "[E::%s] failed to open vcf CELLS file '%s'.\n", __func__, d->out_vcf_cells->fn);
+            return -1;
+        }
+        return 0;
+    }
+    if (NULL == (d->bw = w = (csp_bcfw_t*) calloc(1, sizeof(csp_bcfw_t)))) {
+        fprintf(stderr, "[E::%s] could not initialize the BCF writer.\n", __func__);
+        return -1;
+    }
+    if (vcf_idx_open(&d->ib, d->out_vcf_base->fn) < 0) { return -1; }
+    if (NULL == (w->fb = hts_open(d->out_vcf_base->fn, "ab")) || NULL == (w->rb = bcf_init1())) {
+        fprintf(stderr, "[E::%s] failed to open BCF BASE file '%s'.\n", __func__, d->out_vcf_base->fn);
+        return -1;
+    }
+    if (d->out_vcf_cells) {
+        w->nsmp = bcf_hdr_nsamples(gs->bcf_hdr_cells);
+        w->npl = csp_npl(gs);
+        if (vcf_idx_open(&d->ic, d->out_vcf_cells->fn) < 0) { return -1; }
+        if (NULL == (w->fc = hts_open(d->out_vcf_cells->fn, "ab")) || NULL == (w->rc = bcf_init1())) {
+            fprintf(stderr, "[E::%s] failed to open BCF CELLS file '%s'.\n", __func__, d->out_vcf_cells->fn);
+            return -1;
+        }
+        if (NULL == (w->gt = (int32_t*) malloc((size_t) w->nsmp * (10 + w->npl) * sizeof(int32_t)))) {
+            fprintf(stderr, "[E::%s] could not allocate the FORMAT values.\n", __func__);
+            return -1;
+        }
+        w->ad = w->gt + 2 * w->nsmp; w->dp = w->ad + w->nsmp; w->oth = w->dp + w->nsmp;
+        w->pl = w->oth + w->nsmp; w->all = w->pl + w->npl * w->nsmp;
+    }
+    return 0;
+}
+
+int csp_vcf_close(thread_data *d) {
+    int ret;
+    if (d->out_site && jf_isopen(d->out_site)) { jf_close(d->out_site); }
+    if (d->out_mtx_gt && jf_isopen(d->out_mtx_gt)) { jf_close(d->out_mtx_gt); }
+    if (d->bw) { ret = bcfw_destroy(d->bw); d->bw = NULL; return ret; }
+    if (d->out_vcf_base && jf_isopen(d->out_vcf_base)) { jf_close(d->out_vcf_base); }
+    if (d->out_vcf_cells && jf_isopen(d->out_vcf_cells)) { jf_close(d->out_vcf_cells); }
+    return 0;
+}
+
+/*@abstract  Set the fixed fields and INFO of one BCF record.
+@param al    Alleles, "REF,ALT".
+@param info  Values of AD, DP and OTH.
+@return      0 if success, -1 otherwise.
+ */
+static int bcfw_site(bcf_hdr_t *h, bcf1_t *r, const char *chr, hts_pos_t pos, const char *al, int32_t *info) {
+    int32_t pass = 0;       // PASS is always the first FILTER of the header.
+    bcf_clear(r);
+    if ((r->rid = bcf_hdr_name2id(h, chr)) < 0) { return -1; }
+    r->pos = pos;
+    bcf_float_set_missing(r->qual);
+    if (bcf_update_alleles_str(h, r, al) < 0 || bcf_update_filter(h, r, &pass, 1) < 0) { return -1; }
+    if (bcf_update_info_int32(h, r, "AD", info, 1) < 0 || bcf_update_info_int32(h, r, "DP", info + 1, 1) < 0 || \
+        bcf_update_info_int32(h, r, "OTH", info + 2, 1) < 0) { return -1; }
+    return 0;
+}
+
+int csp_vcf_site(thread_data *d, const char *chr, hts_pos_t pos, int8_t ref_idx, int8_t alt_idx, 
+                 size_t ad, size_t dp, size_t oth, kstring_t *s) 
+{
+    global_settings *gs = d->gs;
+    csp_bcfw_t *w = d->bw;
+    int32_t info[3];
+    char al[4];
+    d->nplp = 0;
+    if (d->out_site) {
+        jf_printf(d->out_site, "%s\t%ld\t%c\t%c\t%ld\t%ld\t%ld\n", chr, (long) pos + 1, seq_nt16_int2char(ref_idx), 
+                  seq_nt16_int2char(alt_idx), (long) ad, (long) dp, (long) oth);
+        if (! gs->is_genotype) { jf_putc('\n', d->out_site); }
+    }
+    if (NULL == w) {
+        ksprintf(s, "%s\t%ld\t.\t%c\t%c\t.\tPASS\tAD=%ld;DP=%ld;OTH=%ld", chr, pos + 1, \
+                seq_nt16_int2char(ref_idx), seq_nt16_int2char(alt_idx), ad, dp, oth);
+        jf_puts(ks_str(s), d->out_vcf_base); jf_putc('\n', d->out_vcf_base);
+        if (d->ib && vcf_idx_line(d->ib, d->out_vcf_base, csp_vidx_tid(d->ib, chr), pos) < 0) { return -1; }
+        if (d->ic) {                 // recorded once the record is complete, see csp_vcf_end().
+            if ((d->ic->ptid = csp_vidx_tid(d->ic, chr)) < 0) { return -1; }
+            d->ic->ppos = pos;
+        }
+        if (d->out_vcf_cells) {
+            jf_puts(ks_str(s), d->out_vcf_cells);
+            jf_puts("\tGT:AD:DP:OTH:PL:ALL", d->out_vcf_cells);
+        }
+        ks_clear(s);
+        return 0;
+    }
+    al[0] = seq_nt16_int2char(ref_idx); al[1] = ','; al[2] = seq_nt16_int2char(alt_idx); al[3] = '\0';
+    info[0] = ad; info[1] = dp; info[2] = oth;
+    if (bcfw_site(gs->bcf_hdr_base, w->rb, chr, pos, al, info) < 0 || bcf_write(w->fb, gs->bcf_hdr_base, w->rb) < 0 || \
+        (d->ib && csp_vidx_push(d->ib, w->rb->rid, pos, hts_get_bgzfp(w->fb)) < 0)) {
+        fprintf(stderr, "[E::%s] failed to write %s:%ld to BCF BASE.\n", __func__, chr, (long) pos + 1);
+        return -1;
+    }
+    if (w->fc) {
+        if (bcfw_site(gs->bcf_hdr_cells, w->rc, chr, pos, al, info) < 0) {
+            fprintf(stderr, "[E::%s] failed to set %s:%ld of BCF CELLS.\n", __func__, chr, (long) pos + 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*@abstract  Get GT, PL and ALL of one covered sample.
+@param pl    Array of @p npl PL values, those missing are set to -1.
+@param all   Array of 5 base counts.
+@return      Num of ALT alleles of GT if success, -1 otherwise.
+ */
+static int plp_gt(csp_plp_t *p, int npl, int32_t *pl, int32_t *all) {
+    int32_t gt[2], ad, dp, oth;
+    int j;
+    if (csp_plp_to_bcf(p, gt, &ad, &dp, &oth, pl, npl, all) < 0) { return -1; }
+    for (j = 0; j < npl; j++) {
+        if (pl[j] == bcf_int32_missing || pl[j] == bcf_int32_vector_end) { pl[j] = -1; }
+    }
+    return bcf_gt_allele(gt[0]) + bcf_gt_allele(gt[1]);
+}
+
+/*@abstract  Write GT and PL of one covered sample to the tmp site file for the HDF5 output.
+@param i     Index of the sample.
+@return      0 if success, -1 otherwise.
+ */
+static int h5_plp(thread_data *d, csp_plp_t *p, int i) {
+    int32_t pl[5], all[5];
+    int j, m, npl = csp_npl(d->gs);
+    if (p->tc <= 0) { return 0; }
+    if ((m = plp_gt(p, npl, pl, all)) < 0) { return -1; }
+    jf_printf(d->out_site, "%d\t%d", i + 1, m);
+    for (j = 0; j < npl; j++) { jf_printf(d->out_site, "\t%d", pl[j]); }
+    jf_putc('\n', d->out_site);
+    return 0;
+}
+
+/*@abstract  Write GT, PL and ALL of one covered sample to the tmp sparse genotype file.
+@param i     Index of the sample.
+@return      0 if success, -1 otherwise.
+ */
+static int gt_plp(thread_data *d, csp_plp_t *p, int i) {
+    static const char *gts[] = {"0/0", "1/0", "1/1"};
+    int32_t pl[5], all[5];
+    int j, m, npl = csp_npl(d->gs);
+    if (p->tc <= 0) { return 0; }
+    if ((m = plp_gt(p, npl, pl, all)) < 0) { return -1; }
+    jf_printf(d->out_mtx_gt, "%d\t%s\t", i + 1, gts[m]);
+    for (j = 0; j < npl && pl[j] >= 0; j++) { jf_printf(d->out_mtx_gt, j ? ",%d" : "%d", pl[j]); }
+    jf_printf(d->out_mtx_gt, "\t%d,%d,%d,%d,%d\n", all[0], all[1], all[2], all[3], all[4]);
+    d->nr_gt++;
+    return 0;
+}
+
+int csp_vcf_plp(thread_data *d, csp_plp_t *p) {
+    csp_bcfw_t *w = d->bw;
+    int i = d->nplp++;
+    if (d->out_site && d->gs->out_hdf5 && h5_plp(d, p, i) < 0) { return -1; }
+    if (d->out_mtx_gt) { return gt_plp(d, p, i); }
+    if (NULL == w) {
+        jf_putc_('\t', d->out_vcf_cells);
+        return csp_plp_to_vcf(p, d->out_vcf_cells);
+    }
+    if (i >= w->nsmp) { return -1; }
+    if (csp_plp_to_bcf(p, w->gt + 2 * i, w->ad + i, w->dp + i, w->oth + i, w->pl + w->npl * i, w->npl, w->all + 5 * i) < 0) { 
+        return -1; 
+    }
+    return 0;
+}
+
+int csp_vcf_end(thread_data *d) {
+    bcf_hdr_t *h = d->gs->bcf_hdr_cells;
+    csp_bcfw_t *w = d->bw;
+    int n;
+    if (d->out_site) { jf_putc('\n', d->out_site); }
+    if (d->out_mtx_gt) { jf_putc('\n', d->out_mtx_gt); return 0; }
+    if (NULL == w) { 
+        jf_putc('\n', d->out_vcf_cells); 
+        return d->ic ? vcf_idx_line(d->ic, d->out_vcf_cells, d->ic->ptid, d->ic->ppos) : 0;
+    }
+    n = w->nsmp;
+    if (d->nplp != n || bcf_update_genotypes(h, w->rc, w->gt, 2 * n) < 0 || \
+        bcf_update_format_int32(h, w->rc, "AD", w->ad, n) < 0 || bcf_update_format_int32(h, w->rc, "DP", w->dp, n) < 0 || \
+        bcf_update_format_int32(h, w->rc, "OTH", w->oth, n) < 0 || bcf_update_format_int32(h, w->rc, "PL", w->pl, w->npl * n) < 0 || \
+        bcf_update_format_int32(h, w->rc, "ALL", w->all, 5 * n) < 0 || bcf_write(w->fc, h, w->rc) < 0 || \
+        (d->ic && csp_vidx_push(d->ic, w->rc->rid, w->rc->pos, hts_get_bgzfp(w->fc)) < 0)) {
+        fprintf(stderr, "[E::%s] failed to write %s:%ld to BCF CELLS.\n", __func__, bcf_hdr_id2name(h, w->rc->rid), 
+                (long) w->rc->pos + 1);
+        return -1;
+    }
+    return 0;
+}
+
+int csp_vcf_mplp(thread_data *d, const char *chr, hts_pos_t pos, csp_mplp_t *mplp, kstring_t *s) {
+    int i;
+    if (csp_vcf_site(d, chr, pos, mplp->ref_idx, mplp->alt_idx, mplp->ad, mplp->dp, mplp->oth, s) < 0) { return -1; }
+    if (! d->gs->is_genotype) { return 0; }
+    for (i = 0; i < mplp->nsg; i++) {
+        if (csp_vcf_plp(d, csp_map_sg_val(mplp->hsg, mplp->hsg_iter[i])) < 0) { return -1; }
+    }
+    return csp_vcf_end(d);
+}
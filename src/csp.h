@@ -6,11 +6,14 @@
 
 #include <stdio.h>
 #include "htslib/sam.h"
+#include "htslib/vcf.h"
 #include "htslib/kstring.h"
+#include "htslib/khash.h"
 #include "config.h"
 #include "mplp.h"
 #include "jfile.h"
 #include "snp.h"
+#include "region.h"
 #include "thpool.h"
 
 
@@ -18,6 +21,21 @@
  * Global settings
  */
 
+/*@abstract  HashMap from cell barcode to its index in the sorted barcode list.
+@note        The keys are the strings of global_settings::barcodes, so do not free the keys.
+ */
+KHASH_MAP_INIT_STR(bi, int)
+typedef khash_t(bi) csp_map_bi_t;
+#define csp_map_bi_iter khiter_t
+#define csp_map_bi_init() kh_init(bi)
+#define csp_map_bi_resize(h, s) kh_resize(bi, h, s)
+#define csp_map_bi_put(h, k, r) kh_put(bi, h, k, r)
+#define csp_map_bi_get(h, k) kh_get(bi, h, k)
+#define csp_map_bi_val(h, x) kh_val(h, x)
+#define csp_map_bi_end(h) kh_end(h)
+#define csp_map_bi_size(h) kh_size(h)
+#define csp_map_bi_destroy(h) kh_destroy(bi, h)
+
 /*Structure that stores global settings/options/parameters.
 Note:
 1. In current version, one and only one of barcode(s) and sample-ID(s) would exist and work, the other
@@ -29,7 +47,8 @@ struct _gll_settings {
     char **in_fns;         // Pointer to the array of names of input bam/sam/cram files.
     char *out_dir;         // Pointer to the path of dir containing the output files.
     jfile_t *out_vcf_cells, *out_vcf_base, *out_samples;
-    jfile_t *out_mtx_ad, *out_mtx_dp, *out_mtx_oth;
+    jfile_t *out_mtx[CSP_NTAG];  // Sparse matrices indexed by CSP_TAG_*, NULL for the tags not in @p out_tags.
+    int out_tags;          // Bit mask of the tags of the output sparse matrices, refer to CSP_TAG_MASK().
     int is_out_zip;        // If output files need to be zipped.
     int is_genotype;       // If need to do genotyping in addition to counting.
     char *snp_list_file;   // Name of file containing a list of SNPs, usually a vcf file.
@@ -37,6 +56,7 @@ struct _gll_settings {
     char *barcode_file;    // Name of the file containing a list of barcodes, one barcode per line.
     char **barcodes;       // Pointer to the array of barcodes.
     int nbarcode;          // Num of the barcodes.
+    csp_map_bi_t *hbc;     // Barcode index shared by all threads (read-only), built by csp_index_barcodes().
     char *sid_list_file;   // Name of the file containing a list of sample IDs, one sample-ID per line.
     char **sample_ids;     // Pointer to the array of sample IDs.
     int nsid;              // Num of sample IDs.
@@ -58,6 +78,42 @@ struct _gll_settings {
     int rflag_require;  // including flag mask, reads with all flag mask bit unset would be filtered.
     int plp_max_depth;      // max depth for one site of one file, 0 means highest possible value.
     int no_orphan;     // 0 or 1. 1: donot use orphan reads; 0: use orphan reads.
+    int plp_engine;    // Pileup engine of Mode 2, one of CSP_PLP_ENGINE_*.
+    int io_hint;       // 0 or 1. 1: open local input files with I/O hints of the access pattern, see csp_hts_open().
+    int max_open;      // Max num of input files open at the same time in each thread, 0 means auto by the ulimit.
+    char *hdr_cache;   // Dir of the on-disk cache of input headers, NULL means no cache.
+    char *refseq;      // Reference FASTA (faidx-indexed) of Mode 2, NULL means inferring ref from base counts.
+    char *targets;     // BED file of target regions of Mode 2, NULL means whole chromosomes.
+    csp_regidx_t *tgt; // Interval index of @p targets, shared by all threads (read-only).
+    int dense_len;     // Contigs no longer than it are pileup-ed by the dense engine in Mode 2, 0 means never.
+    int cell_cap;      // Max num of reads sampled for each cell in each pos before UMI collapsing, 0 means no cap.
+    int qual_cap;      // Max num of quals kept for each base of each cell in each pos for genotyping, 0 means no cap.
+    int cell_shards;   // Num of cell (sample in Mode 3) shards each SNP is split into among threads, 1 means no sharding.
+    int discover;      // 0 or 1. 1: with a SNP list, pileup whole chroms in one pass and output discovered sites besides the SNPs.
+    jfile_t *disc_vcf_cells, *disc_vcf_base, *disc_samples;   // Output files of discovered sites in the combined mode.
+    jfile_t *disc_mtx[CSP_NTAG];
+    int bin_mtx;       // 0 or 1. 1: output AD/DP/OTH as binary sparse matrices (bmtx.h) instead of mtx.
+    int out_bcf;       // 0 or 1. 1: output vcf BASE and CELLS in BCF format.
+    bcf_hdr_t *bcf_hdr_base, *bcf_hdr_cells;  // Headers of BCF BASE and CELLS, shared by all threads (read-only), see csp_bcf_init().
+    int out_hdf5;      // 0 or 1. 1: also output the counts and genotypes in one HDF5 file (h5out.h).
+    jfile_t *out_h5, *disc_h5;  // HDF5 files of the SNPs and the discovered sites, only their filenames are used.
+    int sparse_gt;     // 0 or 1. 1: output GT/PL/ALL of covered (SNP, cell) pairs as a sparse matrix instead of vcf CELLS.
+    jfile_t *out_mtx_gt, *disc_mtx_gt;   // Sparse genotype files of the SNPs and the discovered sites, see csp_merge_gt().
+    int out_arrow;     // 0 or 1. 1: also output the counts and the SNPs as Arrow IPC streams (arrowout.h).
+    jfile_t *out_arw_tag, *out_arw_snp, *disc_arw_tag, *disc_arw_snp;  // Arrow streams, only their filenames are used.
+    int cell_major;    // 0 or 1. 1: also output the sparse matrices sorted by cells (csc.h).
+    int cell_major_mem;   // Max size in MB of the records sorted in memory at the same time for @p cell_major.
+    jfile_t *out_csc[CSP_NTAG], *disc_csc[CSP_NTAG];  // Cell-major matrices indexed as @p out_mtx, NULL without --cellMajor.
+    char *grp_file;    // File of "<barcode>\t<group>" lines (sample IDs in Mode 3) of --cellGroups, NULL means no groups.
+    char **groups;     // Names of the groups, in the order of first appearance in @p grp_file.
+    int ngroup;        // Num of the groups.
+    int *sg_grp;       // Group index of each barcode (sample ID), -1 if it is in no group, built by csp_load_groups().
+    int cell_mtx;      // 0 or 1. 1: also output the cell-level sparse matrices with --cellGroups.
+    jfile_t *out_grp[CSP_NTAG], *disc_grp[CSP_NTAG];  // Group-level matrices indexed as @p out_mtx, NULL without groups.
+    jfile_t *out_groups, *disc_groups;   // Names of the groups, one per line.
+    int bin_depth;     // Size of the genomic bins of the per-cell read counts in Mode 2, 0 means no such output.
+    jfile_t *out_bin, *out_bins;   // Bins x cells matrix of the read counts and the bins in BED format.
+    size_t *kn_off;    // In the combined mode, SNPs of gs->chroms[i] are gs->pl.a[kn_off[i]] to gs->pl.a[kn_off[i+1]-1], sorted by pos.
 };
 
 /*@abstract  Whether to use barcodes for sample grouping during pileup.
@@ -66,6 +122,13 @@ struct _gll_settings {
 */
 #define use_barcodes(gs) ((gs)->cell_tag)
 
+/*@abstract  Whether a cell barcode is in the input barcode list.
+@param gs    Pointer of global settings structure [global_settings*].
+@param cb    Cell barcode [char*].
+@return      1, yes; 0, no.
+*/
+#define csp_is_valid_barcode(gs, cb) (csp_map_bi_get((gs)->hbc, cb) != csp_map_bi_end((gs)->hbc))
+
 /*@abstract  Whether to use sample IDs for sample grouping during pileup.
 @param gs    Pointer of global settings structure [global_settings*].
 @return      1, yes; 0, no.
@@ -81,6 +144,21 @@ struct _gll_settings {
 void gll_setting_free(global_settings *gs); 
 void gll_setting_print(FILE *fp, global_settings *gs, char *prefix);
 
+/*@abstract  Build the barcode index gs->hbc from gs->barcodes.
+@param gs    Pointer of global settings structure.
+@return      0 if success, -1 otherwise.
+ */
+int csp_index_barcodes(global_settings *gs);
+
+/*@abstract  Load the groups of --cellGroups into gs->groups and gs->sg_grp.
+@param gs    Pointer of global settings structure, whose barcodes or sample IDs have been loaded.
+@return      0 if success, -1 otherwise.
+@note        Each line of gs->grp_file is a barcode (sample ID) and its group separated by a tab or spaces. Lines of
+             barcodes not in the list are skipped, and the barcodes without a line are in no group. A barcode in
+             more than one line is an error.
+ */
+int csp_load_groups(global_settings *gs);
+
 /*
  * Mpileup processing
  */
@@ -92,6 +170,18 @@ void gll_setting_print(FILE *fp, global_settings *gs, char *prefix);
 */
 int csp_mplp_prepare(csp_mplp_t *mplp, global_settings *gs);
 
+/*@abstract  Same as csp_mplp_prepare() while only a range of the sample groups is set.
+@param mplp  Pointer of csp_mplp_t structure.
+@param beg   Index of the first sample group, in gs->barcodes or gs->sample_ids.
+@param end   Index of the last sample group plus 1.
+@param gs    Pointer of global_settings structure.
+@return      0 if success, -1 otherwise.
+
+@note        The i-th sample group of @p mplp is the (@p beg + i)-th one of all, and reads of the other sample 
+             groups are dropped by csp_mplp_get_plp(). It is used by the cell shards of Mode 1.
+*/
+int csp_mplp_prepare_part(csp_mplp_t *mplp, int beg, int end, global_settings *gs);
+
 /*@abstract    Push content of one csp_pileup_t structure into the csp_mplp_t structure.
 @param pileup  Pointer of csp_pileup_t structure to be pushed.
 @param mplp    Pointer of csp_mplp_t structure pushing into.
@@ -118,6 +208,67 @@ int csp_mplp_prepare(csp_mplp_t *mplp, global_settings *gs);
  */
 int csp_mplp_push(csp_pileup_t *pileup, csp_mplp_t *mplp, int sid, global_settings *gs);
 
+/*@abstract    Get the csp_plp_t of the sample group of one read.
+@param mplp    Pointer of csp_mplp_t structure.
+@param cb      Cell barcode of the read, used if barcodes are used.
+@param sid     Index of the sample (input file) of the read, used if sample IDs are used.
+@param gs      Pointer of global_settings structure.
+@return        Pointer of csp_plp_t if success, NULL if the barcode is not in the input barcode list.
+ */
+inline csp_plp_t* csp_mplp_get_plp(csp_mplp_t *mplp, const char *cb, int sid, global_settings *gs);
+
+/*@abstract    Buffer the base and qual of one read for the pos (phase 1 of counting).
+@param mplp    Pointer of csp_mplp_t structure.
+@param plp     Pointer of csp_plp_t of the sample group of the read.
+@param umi     UMI of the read, NULL if UMI is not used.
+@param copy_umi  If copy the UMI into the buffer. Set it if the read would be overwritten before the pos is done.
+@param base    The base, a 4-bit integer returned by bam_seqi().
+@param qual    The qual of the base.
+@param gs      Pointer of global_settings structure.
+@return        0 if success, -1 otherwise.
+
+@note          With gs->cell_cap > 0, the buffered reads of each sample group are a random subset of at most 
+               gs->cell_cap of all its reads, refer to global_settings::cell_cap.
+ */
+int csp_mplp_buf_push(csp_mplp_t *mplp, csp_plp_t *plp, const char *umi, int copy_umi, int8_t base, int8_t qual, global_settings *gs);
+
+/*@abstract    Check whether the pos could pass the filters of csp_mplp_stat() by the raw aggregate base counts.
+@param bc      Raw read count of each base of reads passing filters, before UMI collapsing, in the order of 'ACGTN'.
+@param ref_idx Index of the ref base in 'ACGTN' given by the reference genome, then the pos is rejected if all
+               reads match it; -1 if the ref is not from the reference genome.
+@param gs      Pointer of global_settings structure.
+@return        1 if the pos could not pass the filters, 0 if it may pass.
+ */
+int csp_mplp_precheck(size_t *bc, int8_t ref_idx, global_settings *gs);
+
+/*@abstract    Push all buffered reads of the pos into their sample groups (phase 2 of counting).
+@param mplp    Pointer of csp_mplp_t structure.
+@param gs      Pointer of global_settings structure.
+@return        0 if success, -1 otherwise.
+ */
+int csp_mplp_buf_flush(csp_mplp_t *mplp, global_settings *gs);
+
+/*@abstract    Push the base and qual of one read into the csp_plp_t of its sample group.
+@param plp     Pointer of csp_plp_t structure of the sample group.
+@param mplp    Pointer of csp_mplp_t structure, whose string pool keeps the UMIs.
+@param umi     UMI of the read, not used if UMI is not used.
+@param base    The base, a 4-bit integer returned by bam_seqi().
+@param qual    The qual of the base.
+@param gs      Pointer of global_settings structure.
+@return        0 if success, -2 if khash_put error.
+
+@note          This is the part of csp_mplp_push() after the sample group is resolved, so that callers which have
+               resolved the sample group of a read once could push all of its bases directly.
+ */
+int csp_plp_push(csp_plp_t *plp, csp_mplp_t *mplp, const char *umi, int8_t base, int8_t qual, global_settings *gs);
+
+/*@abstract    Add the qual vectors of all quals of one sample group into its qual matrix.
+@param plp     Pointer of csp_plp_t structure.
+@param qvec    A container of size 4 for the qual vector.
+@return        0 if success, -1 otherwise.
+ */
+int csp_plp_qmat(csp_plp_t *plp, double *qvec);
+
 /*@abstract    Do statistics and filtering after all pileup results have been pushed.
 @param mplp    Pointer of csp_mplp_t structure.
 @param gs      Pointer of global_settings structure.
@@ -129,6 +280,12 @@ int csp_mplp_push(csp_pileup_t *pileup, csp_mplp_t *mplp, int sid, global_settin
  */
 int csp_mplp_stat(csp_mplp_t *mplp, global_settings *gs);
 
+/*@abstract    Same as csp_mplp_stat() while --minCOUNT and --minMAF are not applied.
+@return        0 if success; -1 if error.
+@note          Used for the given SNPs in the combined mode, which are output whatever their counts.
+ */
+int csp_mplp_stat_all(csp_mplp_t *mplp, global_settings *gs);
+
 /*
 * BAM/SAM/CRAM File
  */
@@ -137,7 +294,9 @@ int csp_mplp_stat(csp_mplp_t *mplp, global_settings *gs);
 typedef struct {
     htsFile *fp;
     sam_hdr_t *hdr;   // hdr is needed by sam_read1().
-    hts_idx_t *idx;
+    hts_idx_t *idx;   // NULL for CRAM files loaded without htsFile, whose index is bound to each opened handle.
+    int *tids;        // tids[i] is the tid of the i-th contig of the caller's contig table, -1 if not in hdr.
+    int ntid;         // Size of @p tids.
 } csp_bam_fs;
 
 /*@abstract  Create a csp_bam_fs structure.
@@ -149,6 +308,172 @@ typedef struct {
 inline csp_bam_fs* csp_bam_fs_init(void);
 inline void csp_bam_fs_destroy(csp_bam_fs* p);
 
+/*@abstract  Build the table mapping contigs of the caller (e.g. the snplist or --chrom) to tids of the file.
+@param p     Pointer of csp_bam_fs structure whose hdr has been loaded.
+@param names Array of contig names.
+@param n     Size of @p names.
+@return      Num of contigs found in hdr if success, -1 otherwise.
+
+@note        The "chr" prefix rules of csp_sam_hdr_name2id() are applied here once, so that the hot loops
+             only need to index @p tids.
+ */
+int csp_bam_fs_set_tids(csp_bam_fs *p, const char **names, int n);
+
+/*@abstract    Load headers and indexes of all input files, in parallel on the thread pool if it exists.
+@param gs      Pointer of global_settings structure.
+@param keep_fp If keep the htsFile of each input file open in csp_bam_fs.
+@param hint    I/O hint passed to csp_hts_open().
+@return        Array of pointers to csp_bam_fs of size gs->nin if success, NULL otherwise.
+
+@note          1. If gs->hdr_cache is set, headers are loaded from the on-disk cache when possible and saved
+                  into the cache otherwise. The index is always loaded by sam_index_load(), so that BAI and CSI
+                  are both found.
+               2. For a CRAM file with @p keep_fp = 0, the index is not loaded here and @p idx is NULL, because a 
+                  CRAM index refers to the handle it is loaded with. Refer to csp_fp_cache_t.
+               3. When @p keep_fp = 1, the header may be loaded from cache while the htsFile is not positioned
+                  after the header, so the htsFile should only be read with iterators.
+               4. The returned array should be freed by csp_bam_fs_destroy() on each element and free().
+ */
+csp_bam_fs** csp_load_bam_fs(global_settings *gs, int keep_fp, int hint);
+
+/*@abstract  LRU cache of htsFile handles of input files, which opens input files lazily and keeps at most
+             @p m of them open at the same time.
+@param fps   Array of htsFile*, NULL if the file is not open. Size is @p n.
+@param prev  Array of prev index of each open file in the LRU list, -1 if none.
+@param next  Array of next index of each open file in the LRU list, -1 if none.
+@param head  Index of the most recently used file, -1 if no file is open.
+@param tail  Index of the least recently used file, -1 if no file is open.
+@param n     Num of input files.
+@param m     Max num of files open at the same time.
+@param nopen Num of files open now.
+@param ncram Num of CRAM files open now, i.e., with an index in @p idxs.
+@param fns   Names of input files. They come from global settings so do not free them.
+@param hint  I/O hint passed to csp_hts_open().
+@param idxs  Array of hts_idx_t* loaded with each open CRAM file, NULL for other formats. Size is @p n.
+
+@note        1. One cache is for one thread as htsFile cannot be shared among threads, while the headers and
+                indexes are shared by all threads through csp_bam_fs.
+             2. The htsFile pointer returned by csp_fp_cache_get() may be closed by later calls to 
+                csp_fp_cache_get(), so do not keep it across calls.
+             3. A CRAM index refers to the cram_fd it is loaded with, so it could neither be shared by other 
+                handles nor outlive its own handle. For CRAM, the index is loaded with sam_index_load() each time
+                the file is opened and is destroyed together with the handle, so a CRAM handle is only evicted
+                when all open files are CRAM, which keeps its index loaded as long as possible.
+ */
+typedef struct {
+    htsFile **fps;
+    hts_idx_t **idxs;
+    int *prev, *next;
+    int head, tail;
+    int n, m, nopen, ncram;
+    char **fns;
+    int hint;
+} csp_fp_cache_t;
+
+/*@abstract  Create the csp_fp_cache_t structure.
+@param fns   Names of input files.
+@param n     Num of input files.
+@param m     Max num of files open at the same time, must be positive.
+@param hint  I/O hint passed to csp_hts_open().
+@return      Pointer to the structure if success, NULL otherwise.
+ */
+csp_fp_cache_t* csp_fp_cache_init(char **fns, int n, int m, int hint);
+void csp_fp_cache_destroy(csp_fp_cache_t *p);
+
+/*@abstract  Get the htsFile of the i-th input file, opening it (and closing the least recently used one
+             if the cache is full) if needed.
+@return      Pointer to htsFile if success, NULL otherwise.
+ */
+htsFile* csp_fp_cache_get(csp_fp_cache_t *p, int i);
+
+/*@abstract    Calculate max num of input files each thread could open at the same time.
+@param gs      Pointer of global_settings structure.
+@param nthread Num of threads that would open input files at the same time.
+@return        A number in range [1, gs->nin].
+
+@note          If gs->max_open is not set, the value is derived from the soft limit of open files (ulimit -n), 
+               after reserving some descriptors for output and tmp files.
+ */
+int csp_fp_cache_cap(global_settings *gs, int nthread);
+
+/*@abstract  One record of the index of a vcf file.
+@param tid   Index of the contig, i.e., the rid in the BCF header or the order of appearance in text vcf.
+@param beg   Pos of the site, 0-based.
+@param off   Virtual offset of the end of the record in its own file.
+ */
+typedef struct {
+    int tid;
+    hts_pos_t beg;
+    uint64_t off;
+} csp_vidx_rec_t;
+
+/*@abstract  Recorder of the index of one vcf BASE or CELLS, filled as the records are written, so that the compressed
+             output needs no extra pass to be indexed (TBI for text vcf, CSI for BCF).
+@param a     Records in the order of writing.
+@param off0  Virtual offset where the first record begins.
+@param base  Size of the file when the current BGZF stream is opened for appending, which bgzf_tell() is relative to.
+@param names Contig names of text vcf in order of appearance, mapped to their tids by @p hn.
+@param ptid, ppos  The pending record of text vcf CELLS, which is complete only after all samples are written.
+ */
+typedef struct {
+    kvec_t(csp_vidx_rec_t) a;
+    uint64_t off0, base;
+    char **names;
+    int nname, mname;
+    csp_map_bi_t *hn;
+    int ptid;
+    hts_pos_t ppos;
+} csp_vidx_t;
+
+/*@abstract  Create the csp_vidx_t structure.
+@return      Pointer to the structure if success, NULL otherwise.
+ */
+csp_vidx_t* csp_vidx_init(void);
+void csp_vidx_destroy(csp_vidx_t *x);
+
+/*@abstract  Start a BGZF stream appended to the file, must be called before the file is opened.
+@param fn    Filename.
+@return      0 if success, -1 otherwise.
+ */
+int csp_vidx_open(csp_vidx_t *x, const char *fn);
+
+/*@abstract  Get the tid of a contig of text vcf, which is added if new.
+@return      The tid if success, -1 otherwise.
+ */
+int csp_vidx_tid(csp_vidx_t *x, const char *chr);
+
+/*@abstract  Add one record that has just been written.
+@param fp    The BGZF stream the record is written to, whose buffered data has been flushed into it.
+@return      0 if success, -1 otherwise.
+ */
+int csp_vidx_push(csp_vidx_t *x, int tid, hts_pos_t beg, BGZF *fp);
+
+/*@abstract  Build the index of one file from the recorders and save it as <fn>.tbi or, with @p hdr, <fn>.csi.
+@param x     Array of recorders, whose records are in the file in order.
+@param shift Offsets in the file where the files of the recorders are put, NULL means all 0.
+@param n     Size of @p x.
+@param hdr   The BCF header, NULL for text vcf, of which the contigs are taken from x[0].
+@return      0 if success or the records are not sorted (no index then), -1 otherwise.
+ */
+int csp_vidx_save(csp_vidx_t **x, const uint64_t *shift, int n, const char *fn, bcf_hdr_t *hdr);
+
+/*@abstract    BCF writer of the vcf BASE and CELLS of one thread.
+@param fb      File of vcf BASE.
+@param fc      File of vcf CELLS, NULL without genotyping.
+@param rb, rc  Records of vcf BASE and CELLS.
+@param nsmp    Num of samples.
+@param npl     Num of PL values of each sample, 3, or 5 with --doubletGL.
+@param gt, ad, dp, oth, pl, all  FORMAT values of all samples, 2, 1, 1, 1, @p npl and 5 values for each sample.
+@note          The thread files are BGZF streams of BCF records without header, so that they could be merged
+               by concatenation after the header written by csp_bcf_init().
+ */
+typedef struct {
+    htsFile *fb, *fc;
+    bcf1_t *rb, *rc;
+    int nsmp, npl;
+    int32_t *gt, *ad, *dp, *oth, *pl, *all;
+} csp_bcfw_t;
+
 /* 
  * Thread operatoins API/routine
  */
@@ -167,11 +492,27 @@ inline void csp_bam_fs_destroy(csp_bam_fs* p);
 @param m       Total size of elements to be used by certain thread, must not be changed.
 @param i       Id of the thread data.
 @param ret     Running state of the thread.
+@param max_open  Max num of input files the thread could open at the same time.
 @param ns      Num of SNPs that passed all filters.
-@param nr_*    Num of records for each output matrix file. 
-@param out_*   Pointers of output files.
+@param nr      Num of records for each output matrix file indexed by CSP_TAG_*.
+@param nr_gt   Num of records of the sparse genotypes.
+@param cap_*   Num of reads dropped by the per-cell cap and num of positions where it is hit, refer to csp_mplp_t.
+@param samp_sites  Num of positions where quals are sampled, refer to csp_mplp_t.
+@param out_*   Pointers of output files, @p out_mtx is indexed by CSP_TAG_* and NULL for the tags not selected.
+@param disc    Thread data of the discovered sites in the combined mode, NULL otherwise. Only its counters and
+               output files are used.
+@param bw      BCF writer of @p out_vcf_base and @p out_vcf_cells, only used with --bcf, see csp_vcf_open().
+@param out_site  Tmp site file for the HDF5 and Arrow outputs, NULL without --hdf5 or --arrow, see csp_h5_write().
+@param nplp    Num of samples that have been added to the current site, see csp_vcf_plp().
+@param ib, ic  Index recorders of @p out_vcf_base and @p out_vcf_cells, NULL if they are not indexed, see csp_vcf_open().
+@param csc     Spill files of the cell-major matrices indexed as @p out_mtx, NULL without --cellMajor, see csp_mtx_open().
+@param out_grp Tmp group-level matrices indexed as @p out_mtx, NULL without --cellGroups, see csp_mplp_to_grp().
+@param nr_grp  Num of records of each of @p out_grp.
+@param out_bin Tmp matrix of the read counts in bins, NULL without --binDepth. Only used in Mode 2.
+@param nbin, nr_bin  Num of bins and num of records of @p out_bin.
  */
-typedef struct {
+typedef struct _thread_data thread_data;
+struct _thread_data {
     global_settings *gs;
     csp_bam_fs **bfs;
     int nfs;
@@ -180,9 +521,22 @@ typedef struct {
     size_t m, n;   // for snp-list or chrom-list.
     int i;
     int ret;
-    size_t ns, nr_ad, nr_dp, nr_oth;
-    jfile_t *out_mtx_ad, *out_mtx_dp, *out_mtx_oth, *out_vcf_base, *out_vcf_cells;
-} thread_data;
+    int max_open;
+    size_t ns, nr[CSP_NTAG], nr_gt;
+    size_t cap_reads, cap_sites, samp_sites;
+    jfile_t *out_mtx[CSP_NTAG], *out_vcf_base, *out_vcf_cells;
+    jfile_t *out_mtx_gt;
+    thread_data *disc;
+    csp_bcfw_t *bw;
+    jfile_t *out_site;
+    int nplp;
+    csp_vidx_t *ib, *ic;
+    csp_csc_spill_t *csc[CSP_NTAG];
+    jfile_t *out_grp[CSP_NTAG];
+    size_t nr_grp[CSP_NTAG];
+    jfile_t *out_bin;
+    size_t nbin, nr_bin;
+};
 
 /*@abstract  Create the thread_data structure.
 @return      Pointer to the structure if success, NULL otherwise.
@@ -193,6 +547,14 @@ inline thread_data* thdata_init(void);
 inline void thdata_destroy(thread_data *p);
 inline void thdata_print(FILE *fp, thread_data *p);
 
+/*@abstract    Report the num of reads dropped by the per-cell cap and num of positions with sampled quals.
+@param td      Array of pointers of thread_data.
+@param n       Size of @p td.
+@param gs      Pointer to the global_settings structure.
+@return        Void.
+ */
+void thdata_report_cap(thread_data **td, int n, global_settings *gs);
+
 /*
  * File Routine
  */
@@ -234,6 +596,56 @@ inline int destroy_tmp_files(jfile_t **fs, const int n);
 */
 int merge_mtx(jfile_t *out, jfile_t **in, const int n, size_t *ns, size_t *nr, int *ret);
 
+/*@abstract   Merge several tmp sparse matrices files into a binary sparse matrix file, refer to bmtx.h.
+@param fn     Filename of the binary file.
+@param in     Pointer of array of tmp mtx files to be merged.
+@param n      Num of tmp mtx files.
+@param ns     Num of SNPs in all input mtx files.
+@param nsmp   Num of samples.
+@param nr     Num of records in all input mtx files.
+@return       0 if success, -1 otherwise.
+*/
+int merge_mtx_bin(const char *fn, jfile_t **in, const int n, size_t ns, int nsmp, size_t nr);
+
+/*@abstract   Write the final mtx file from the tmp mtx files, as text or binary by gs->bin_mtx.
+@param out    Pointer of the final mtx file, whose header has been written if text.
+@param in     Pointer of array of tmp mtx files to be merged.
+@param n      Num of tmp mtx files.
+@param ns     Num of SNPs in all input mtx files.
+@param nsmp   Num of samples.
+@param nr     Num of records in all input mtx files.
+@param gs     Pointer to the global_settings structure.
+@return       0 if success, -1 otherwise.
+*/
+int csp_merge_mtx(jfile_t *out, jfile_t **in, const int n, size_t ns, int nsmp, size_t nr, global_settings *gs);
+
+/*@abstract   Write the final cell-major matrices from the spill files of the threads, refer to csc.h.
+@param out    Array of the final files indexed by CSP_TAG_*, NULL for the tags not selected.
+@param td     Array of thread data, in the order of SNPs.
+@param n      Size of @p td.
+@param nsmp   Num of samples.
+@param gs     Pointer to the global_settings structure.
+@return       0 if success, -1 otherwise.
+@note         The text files are mtx of SNPs x samples sorted by samples, and the binary ones (--binMtx) are bmtx
+              whose rows are samples.
+*/
+int csp_merge_csc(jfile_t **out, thread_data **td, const int n, int nsmp, global_settings *gs);
+
+/*@abstract   Write the final sparse genotype file from the tmp files, as text or binary by gs->bin_mtx.
+@param out    Pointer of the final file, whose header has been written if text.
+@param in     Pointer of array of tmp files, one "<sample>\t<GT>\t<PL>\t<ALL>" line for each covered sample (PL and
+              ALL are comma separated as in vcf CELLS) and an empty line at the end of each SNP.
+@param n      Num of tmp files.
+@param ns     Num of SNPs.
+@param nsmp   Num of samples.
+@param nr     Num of records.
+@param gs     Pointer to the global_settings structure.
+@return       0 if success, -1 otherwise.
+@note         The text file is like the mtx files with GT, PL and ALL as the value. The binary file is a bmtx whose 
+              records have 1 + npl + 5 values: num of ALT alleles of GT, PL and ALL.
+*/
+int csp_merge_gt(jfile_t *out, jfile_t **in, const int n, size_t ns, int nsmp, size_t nr, global_settings *gs);
+
 /*@abstract   Merge several tmp vcf files.
 @param out    Pointer of file structure merged into.
 @param in     Pointer of array of tmp vcf files to be merged.
@@ -245,6 +657,145 @@ int merge_mtx(jfile_t *out, jfile_t **in, const int n, size_t *ns, size_t *nr, i
 */
 int merge_vcf(jfile_t *out, jfile_t **in, const int n, int *ret);
 
+/*@abstract   Write the final vcf file from the tmp vcf files, as text or BCF by gs->out_bcf, and index it if it
+              is compressed.
+@param out    Pointer of the final vcf file, whose header has been written.
+@param in     Pointer of array of tmp vcf files to be merged, NULL if the only thread has written @p out directly.
+@param n      Num of tmp vcf files, or 1 if @p in is NULL.
+@param td     Array of thread data that wrote the files, whose index recorders are used.
+@param is_cells  1 if @p out is the vcf CELLS, 0 the vcf BASE.
+@param gs     Pointer to the global_settings structure.
+@return       0 if success, -1 otherwise.
+@note         1. The BCF tmp files are appended to @p out byte by byte as they are BGZF streams, so the records
+                 recorded by the threads only need to be shifted by where their files are put.
+              2. The text tmp files are re-compressed, so @p out is indexed by this function line by line.
+*/
+int csp_merge_vcf(jfile_t *out, jfile_t **in, const int n, thread_data **td, int is_cells, global_settings *gs);
+
+/*@abstract   Write the final HDF5 file from the tmp files of the threads.
+@param out    Pointer of the final HDF5 file, only its filename is used.
+@param ad, dp, oth  Pointer of array of tmp mtx files.
+@param site   Pointer of array of tmp site files, see thread_data::out_site.
+@param n      Num of tmp files of each array.
+@param ns     Num of SNPs.
+@param gs     Pointer to the global_settings structure.
+@return       0 if success, -1 otherwise.
+*/
+int csp_merge_h5(jfile_t *out, jfile_t **ad, jfile_t **dp, jfile_t **oth, jfile_t **site, const int n, size_t ns, 
+                 global_settings *gs);
+
+/*@abstract   Write the final Arrow streams from the tmp files of the threads.
+@param tag    Pointer of the final stream of the counts, only its filename is used.
+@param snp    Pointer of the final stream of the SNPs, only its filename is used.
+@param ad, dp, oth  Pointer of array of tmp mtx files.
+@param site   Pointer of array of tmp site files, see thread_data::out_site.
+@param n      Num of tmp files of each array.
+@param ns     Num of SNPs.
+@return       0 if success, -1 otherwise.
+*/
+int csp_merge_arrow(jfile_t *tag, jfile_t *snp, jfile_t **ad, jfile_t **dp, jfile_t **oth, jfile_t **site, const int n, 
+                    size_t ns);
+
+/*@abstract  Whether to write the tmp site files, i.e., with --hdf5 or --arrow.
+@param gs    Pointer to the global_settings structure.
+ */
+#define csp_out_site(gs) ((gs)->out_hdf5 || (gs)->out_arrow)
+
+/*@abstract  The output file whose name the tmp site files are named after.
+@param h5    The HDF5 file, NULL without --hdf5.
+@param snp   The Arrow stream of the SNPs, NULL without --arrow.
+ */
+#define csp_site_fs(h5, snp) ((h5) ? (h5) : (snp))
+
+/*
+ * VCF Output Routine
+ * The vcf BASE and CELLS of one thread are written either as text through jfile_t or, with --bcf, as bcf1_t
+ * records through csp_bcfw_t. One site is written by csp_vcf_site(), then csp_vcf_plp() for each sample in
+ * order and csp_vcf_end() if genotyping.
+ * With --hdf5 or --arrow, the site is also written to thread_data::out_site, followed by the GT/PL of covered
+ * samples with --hdf5.
+ * With --sparseGT, the covered samples are written to thread_data::out_mtx_gt instead of vcf CELLS.
+ */
+
+/*@abstract  Num of PL values of each sample.
+@param gs    Pointer to the global_settings structure.
+ */
+#define csp_npl(gs) ((gs)->double_gl ? 5 : 3)
+
+/*@abstract  Whether to output vcf CELLS, i.e., genotyping without --sparseGT.
+@param gs    Pointer to the global_settings structure.
+ */
+#define csp_out_cells(gs) ((gs)->is_genotype && ! (gs)->sparse_gt)
+
+/*@abstract  Build the headers of BCF BASE and CELLS and write them to the final files.
+@param gs    Pointer to the global_settings structure.
+@param bh    Header of the first input file, whose contigs are put in the BCF headers.
+@param ctgs  Contigs of the SNPs or chroms to be output, those missing from @p bh are added without length.
+@param nctg  Size of @p ctgs.
+@return      0 if success, -1 otherwise.
+@note        The headers are kept in gs->bcf_hdr_base and gs->bcf_hdr_cells, shared by the threads.
+ */
+int csp_bcf_init(global_settings *gs, sam_hdr_t *bh, const char **ctgs, int nctg);
+
+/*@abstract  Open the tmp sparse matrices (cell-level and group-level) of the selected tags of the thread.
+@param d     Pointer to thread_data structure.
+@return      0 if success, -1 otherwise.
+@note        With --cellMajor, the spill files d->csc are also created, named after the tmp sparse matrices.
+ */
+int csp_mtx_open(thread_data *d);
+
+/*@abstract  Close the tmp sparse matrices of the thread that are open.
+@param d     Pointer to thread_data structure.
+ */
+void csp_mtx_close(thread_data *d);
+
+/*@abstract  Open the vcf BASE and CELLS (and tmp HDF5 site file) of the thread.
+@param d     Pointer to thread_data structure.
+@return      0 if success, -1 otherwise.
+ */
+int csp_vcf_open(thread_data *d);
+
+/*@abstract  Close the vcf BASE and CELLS (and tmp HDF5 site file) of the thread that are open.
+@param d     Pointer to thread_data structure.
+@return      0 if success, -1 otherwise.
+ */
+int csp_vcf_close(thread_data *d);
+
+/*@abstract    Write one site to vcf BASE and start the record of vcf CELLS.
+@param d       Pointer to thread_data structure.
+@param chr     Name of the chrom.
+@param pos     Pos of the site, 0-based.
+@param ref_idx, alt_idx  Index of ref and alt bases, see seq_nt16_int2char().
+@param ad, dp, oth  Aggregated counts of the site.
+@param s       Pointer of kstring_t used as buffer, cleared when return.
+@return        0 if success, -1 otherwise.
+ */
+int csp_vcf_site(thread_data *d, const char *chr, hts_pos_t pos, int8_t ref_idx, int8_t alt_idx, 
+                 size_t ad, size_t dp, size_t oth, kstring_t *s);
+
+/*@abstract  Add the next sample to the record of vcf CELLS.
+@param d     Pointer to thread_data structure.
+@param p     Pointer of csp_plp_t of the sample.
+@return      0 if success, -1 otherwise.
+ */
+int csp_vcf_plp(thread_data *d, csp_plp_t *p);
+
+/*@abstract  Finish the record of vcf CELLS after all samples are added.
+@param d     Pointer to thread_data structure.
+@return      0 if success, -1 otherwise.
+ */
+int csp_vcf_end(thread_data *d);
+
+/*@abstract    Write one site of csp_mplp_t to vcf BASE and CELLS.
+@param d       Pointer to thread_data structure.
+@param chr     Name of the chrom.
+@param pos     Pos of the site, 0-based.
+@param mplp    Pointer of csp_mplp_t structure that has passed csp_mplp_stat().
+@param s       Pointer of kstring_t used as buffer, cleared when return.
+@return        0 if success, -1 otherwise.
+ */
+int csp_vcf_mplp(thread_data *d, const char *chr, hts_pos_t pos, csp_mplp_t *mplp, kstring_t *s);
+
 /*@abstract  Rewrite mtx file to fill in the stat info.
 @param fs    Pointer of jfile_t that to be rewriten.
 @param ns    Num of SNPs.
@@ -4,9 +4,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "thpool.h"
 #include "htslib/sam.h"
+#include "htslib/khash.h"
+#include "kvec.h"
 #include "config.h"
 #include "csp.h"
 #include "jfile.h"
@@ -16,9 +19,118 @@
 #include "mplp.h"
 #include "snp.h"
 
+/*
+ * CIGAR Index Cache
+ */
+
+/*@abstract  Cached CIGAR index of one read.
+@param ci    The CIGAR index, refer to csp_cigar_idx_t.
+@param tid   tid of the alignment, used for evicting.
+@param pos   0-based start pos of the alignment.
+@param end   End pos of the alignment, used for evicting.
+@param cigar Copy of the CIGAR of the alignment, size @p ci.n.
+@param mcigar  Size of the array @p cigar.
+
+@note        The index only depends on @p pos and @p cigar, so it is reused only if both are the same as the read's.
+             One read name may have several alignments, and reads of different input files may share a name.
+ */
+typedef struct {
+    csp_cigar_idx_t ci;
+    int32_t tid;
+    hts_pos_t pos, end;
+    uint32_t *cigar;
+    int mcigar;
+} fetch_ce_t;
+
+static inline void fetch_ce_destroy(fetch_ce_t *e) {
+    csp_cigar_idx_free(&e->ci);
+    free(e->cigar);
+    free(e);
+}
+
+KHASH_MAP_INIT_STR(cigar, fetch_ce_t*)
+
+/*@abstract  The cache of CIGAR indexes of reads with many CIGAR ops, keyed by read name.
+@note        In fetch mode, a read is fetched again for each SNP it covers. A long read covering many SNPs would
+             have its CIGAR walked once per SNP, so its CIGAR index is built once and kept until the SNPs go past it.
+ */
+typedef khash_t(cigar) fetch_cc_t;
+
+static inline fetch_cc_t* fetch_cc_init(void) { return kh_init(cigar); }
+
+static void fetch_cc_destroy(fetch_cc_t *h) {
+    khiter_t k;
+    if (NULL == h) { return; }
+    for (k = kh_begin(h); k != kh_end(h); k++) {
+        if (! kh_exist(h, k)) { continue; }
+        free((char*) kh_key(h, k));
+        fetch_ce_destroy(kh_val(h, k));
+    }
+    kh_destroy(cigar, h);
+}
+
+/* drop the reads on other chroms than @p tid or ending at or before @p pos; all reads are dropped if @p tid < -1. */
+static void fetch_cc_sweep(fetch_cc_t *h, int32_t tid, hts_pos_t pos) {
+    fetch_ce_t *e;
+    khiter_t k;
+    for (k = kh_begin(h); k != kh_end(h); k++) {
+        if (! kh_exist(h, k)) { continue; }
+        e = kh_val(h, k);
+        if (tid < -1 || e->tid != tid || e->end <= pos) {
+            free((char*) kh_key(h, k));
+            fetch_ce_destroy(e);
+            kh_del(cigar, h, k);
+        }
+    }
+}
+
+/*@abstract  Get the CIGAR index of one read, which is built if not cached.
+@param h     Pointer of fetch_cc_t.
+@param b     Pointer of bam1_t.
+@param pos   0-based pos of the SNP being fetched.
+@return      Pointer of csp_cigar_idx_t if success, NULL otherwise.
+
+@note        At most CSP_CIGAR_CACHE_MAX reads are cached. When full, the reads the SNPs have gone past are dropped,
+             and all reads are dropped if it is still full.
+ */
+static const csp_cigar_idx_t* fetch_cc_get(fetch_cc_t *h, bam1_t *b, hts_pos_t pos) {
+    bam1_core_t *c = &(b->core);
+    uint32_t *cigar = bam_get_cigar(b), *t;
+    fetch_ce_t *e;
+    char *key;
+    khiter_t k;
+    int r;
+    if ((k = kh_get(cigar, h, bam_get_qname(b))) != kh_end(h)) {
+        e = kh_val(h, k);
+        if (e->pos == c->pos && e->ci.n == c->n_cigar && 0 == memcmp(e->cigar, cigar, c->n_cigar * sizeof(uint32_t))) { 
+            return &e->ci; 
+        }
+    } else {
+        if (kh_size(h) >= CSP_CIGAR_CACHE_MAX) {
+            fetch_cc_sweep(h, c->tid, pos);
+            if (kh_size(h) >= CSP_CIGAR_CACHE_MAX) { fetch_cc_sweep(h, -2, pos); }
+        }
+        if (NULL == (e = (fetch_ce_t*) calloc(1, sizeof(fetch_ce_t)))) { return NULL; }
+        if (NULL == (key = strdup(bam_get_qname(b)))) { free(e); return NULL; }
+        k = kh_put(cigar, h, key, &r);
+        if (r <= 0) { free(key); free(e); return NULL; }
+        kh_val(h, k) = e;
+    }
+    if (c->n_cigar > e->mcigar) {
+        if (NULL == (t = (uint32_t*) realloc(e->cigar, c->n_cigar * sizeof(uint32_t)))) { return NULL; }
+        e->cigar = t; e->mcigar = c->n_cigar;
+    }
+    if (csp_cigar_idx_build(&e->ci, b) < 0) { return NULL; }
+    memcpy(e->cigar, cigar, c->n_cigar * sizeof(uint32_t));
+    e->tid = c->tid; e->pos = c->pos;
+    e->end = e->ci.x[e->ci.n];
+    return &e->ci;
+}
+
 /*@abstract  Pileup one read obtained by sam_itr_next().
 @param pos   Pos of the reference sequence. 0-based.
 @param p     Pointer of csp_pileup_t structure coming from csp_pileup_init() or csp_pileup_reset().
+@param cc    Pointer of fetch_cc_t used for reads with at least CSP_CIGAR_IDX_MIN CIGAR ops, NULL if not used.
 @param gs    Pointer of global settings.
 @return      0 if success, -1 if error, 1 if the reads extracted are not in proper format, 2 if not passing filters.
 
@@ -34,7 +146,7 @@
                 the read would be filtered as being DEL in current version. So 'base' and 'qual' would not be misused for the moment.
                 But it's better to call csp_pileup_reset*() in case that we donot filter DEL.
  */
-static int fetch_read(hts_pos_t pos, csp_pileup_t *p, global_settings *gs) {
+static int fetch_read(hts_pos_t pos, csp_pileup_t *p, fetch_cc_t *cc, global_settings *gs) {
     /* Filter reads in order. For example, filtering according to umi tag and cell tag would speed up in the case
        that do not use UMI or Cell-barcode at all. */
     if (use_umi(gs) && NULL == (p->umi = get_bam_aux_str(p->b, gs->umi_tag))) { return 1; }
@@ -47,20 +159,28 @@ static int fetch_read(hts_pos_t pos, csp_pileup_t *p, global_settings *gs) {
     if (gs->rflag_require && ! (gs->rflag_require & c->flag)) { return 2; }
     if (gs->no_orphan && c->flag & BAM_FPAIRED && ! (c->flag & BAM_FPROPER_PAIR)) { return 2; }
     uint32_t *cigar = bam_get_cigar(p->b);
+    const csp_cigar_idx_t *ci = NULL;
     hts_pos_t x, px;       /* x is the coordinate of the reference. */
     int k, y, py, op, l;   /* y is the query coordinate. */
-    uint32_t laln;
+    uint32_t laln = 0;
     assert(c->pos <= pos);   // otherwise a bug.
     /* find the pos. */
     p->qpos = 0; p->is_refskip = p->is_del = 0;
-    for (k = 0, px = x = c->pos, py = y = 0, laln = 0; k < c->n_cigar; k++, px = x, py = y) {
+    if (cc && c->n_cigar >= CSP_CIGAR_IDX_MIN) {
+        if (NULL == (ci = fetch_cc_get(cc, p->b, pos))) { return -1; }
+        if ((k = csp_cigar_idx_locate(ci, pos)) < 0) { return 2; }
         op = get_cigar_op(cigar[k]);
-        l = get_cigar_len(cigar[k]);
-        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) { x += l; y += l; laln += l; }
-        else if (op == BAM_CDEL || op == BAM_CREF_SKIP) { x += l; }
-        else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) { y += l; }
-        // else, do nothing.
-        if (x > pos) { break; }
+        px = ci->x[k]; py = ci->y[k];
+    } else {
+        for (k = 0, px = x = c->pos, py = y = 0, laln = 0; k < c->n_cigar; k++, px = x, py = y) {
+            op = get_cigar_op(cigar[k]);
+            l = get_cigar_len(cigar[k]);
+            if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) { x += l; y += l; laln += l; }
+            else if (op == BAM_CDEL || op == BAM_CREF_SKIP) { x += l; }
+            else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) { y += l; }
+            // else, do nothing.
+            if (x > pos) { break; }
+        }
     }
     /* pileup */
     assert(k < c->n_cigar);   // otherwise a bug.
@@ -75,78 +195,130 @@ static int fetch_read(hts_pos_t pos, csp_pileup_t *p, global_settings *gs) {
     if (p->is_del) { return 2; }
     if (p->is_refskip) { return 2; }
     /* continue processing cigar string. */
-    for (k++; k < c->n_cigar; k++) {
-        op = get_cigar_op(cigar[k]);
-        l = get_cigar_len(cigar[k]);
-        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) { laln += l; }
+    if (ci) { laln = ci->laln; }
+    else {
+        for (k++; k < c->n_cigar; k++) {
+            op = get_cigar_op(cigar[k]);
+            l = get_cigar_len(cigar[k]);
+            if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) { laln += l; }
+        }
     }
     if (laln < gs->min_len) { return 2; }
     else { p->laln = laln; }
     return 0;
 }
 
-/*@abstract    Pileup one SNP with method fetch.
+/*@abstract    Fetch the reads of a range of input files covering one SNP and buffer them into csp_mplp_t.
 @param snp     Pointer of csp_snp_t structure.
 @param fs      Pointer of array of pointers to the csp_bam_fs structures.
-@param fp      Pointer of array of htsFile* of input files.
 @param nfs     Size of @p fs.
+@param fc      Pointer of csp_fp_cache_t structure holding htsFile* of input files.
+@param cc      Pointer of fetch_cc_t structure caching CIGAR indexes, NULL if not used.
+@param fbeg    Index of the first input file to fetch.
+@param fend    Index of the last input file to fetch plus 1.
 @param pileup  Pointer of csp_pileup_t structure.
 @param mplp    Pointer of csp_mplp_t structure.
 @param gs      Pointer of global_settings structure.
+@param npushed Pointer of num of reads buffered, set by this function.
 @return        0 if success, -1 if error, 1 if pileup failure without error.
 
-@note          1. This function is mainly called by csp_fetch_core(). Refer to csp_fetch_core() for notes.
-               2. The statistics results of all pileuped reads for one SNP is stored in the csp_mplp_t after calling this function.
+@note          1. An input file is opened only when its iterator for the SNP is not empty, so that input files without 
+                  reads overlapping the SNP do not occupy file handles. CRAM files whose index is not shared in
+                  @p fs are the exception, as their index is loaded with the handle, refer to csp_fp_cache_t.
+               2. If sample IDs are used, the i-th input file is pushed into the (i - @p fbeg)-th sample group of 
+                  @p mplp, refer to csp_mplp_prepare_part().
+               3. The SNP is rejected (return 1) if its contig is missing in any of the @p nfs input files, not only
+                  in those of [@p fbeg, @p fend), so that fetching a part of the input files (e.g. by a cell shard 
+                  in Mode 3) rejects the same SNPs as fetching all of them.
 */
-static int fetch_snp(csp_snp_t *snp, csp_bam_fs **fs, htsFile **fp, int nfs, csp_pileup_t *pileup, csp_mplp_t *mplp, global_settings *gs) 
+static int fetch_snp_reads(csp_snp_t *snp, csp_bam_fs **fs, int nfs, csp_fp_cache_t *fc, fetch_cc_t *cc, int fbeg, int fend, 
+                           csp_pileup_t *pileup, csp_mplp_t *mplp, global_settings *gs, size_t *npushed)
 {
     csp_bam_fs *bs = NULL;
+    csp_plp_t *plp = NULL;
     hts_itr_t *iter = NULL;
-    int i, tid, r, ret, st, state = -1;
-    size_t npushed = 0;
-    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    hts_idx_t *idx = NULL;
+    htsFile *fp = NULL;
+    int i, tid, ret, st, state = -1;
     #if DEBUG
         size_t npileup = 0;
     #endif
-    mplp->ref_idx = snp->ref ? seq_nt16_char2int(snp->ref) : -1;
-    mplp->alt_idx = snp->alt ? seq_nt16_char2int(snp->alt) : -1;
-    for (i = 0; i < nfs; i++) {
+    *npushed = 0;
+    for (i = 0; i < nfs; i++) { if (fs[i]->tids[snp->cid] < 0) { return 1; } }
+    for (i = fbeg; i < fend; i++) {
         bs = fs[i];
-        tid = csp_sam_hdr_name2id(bs->hdr, snp->chr, s);
-        ks_clear(s);
-        if (tid < 0) { state = 1; goto fail; }
-        if (NULL == (iter = sam_itr_queryi(bs->idx, tid, snp->pos, snp->pos + 1))) { state = 1; goto fail; }
-        while ((ret = sam_itr_next(fp[i], iter, pileup->b)) >= 0) {   // TODO: check if need to be reset in_fp?
+        tid = bs->tids[snp->cid];
+        fp = NULL;
+        if (NULL == (idx = bs->idx)) {     // CRAM, the index could only be used with its own handle.
+            if (NULL == (fp = csp_fp_cache_get(fc, i))) {
+                fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, fc->fns[i]);
+                state = -1; goto fail;
+            }
+            idx = fc->idxs[i];
+        }
+        if (NULL == (iter = sam_itr_queryi(idx, tid, snp->pos, snp->pos + 1))) { state = 1; goto fail; }
+        if (csp_itr_empty(iter)) { hts_itr_destroy(iter); iter = NULL; continue; }
+        if (NULL == fp && NULL == (fp = csp_fp_cache_get(fc, i))) {
+            fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, fc->fns[i]);
+            state = -1; goto fail;
+        }
+        while ((ret = sam_itr_next(fp, iter, pileup->b)) >= 0) {   // TODO: check if need to be reset in_fp?
             #if DEBUG
                 npileup++;
             #endif
-            if (0 == (st = fetch_read(snp->pos, pileup, gs))) { // no need to reset pileup as the values in it will be immediately overwritten.
-                if (use_barcodes(gs)) { r = csp_mplp_push(pileup, mplp, -1, gs); }
-                else if (use_sid(gs)) { r = csp_mplp_push(pileup, mplp, i, gs); }
-                else { state = -1; goto fail; }
-                if (r < 0) { state = -1; goto fail; }  // else if r == 1: pileuped barcode is not in the input barcode list.
-                else if (r == 0) { npushed++; }
+            if (0 == (st = fetch_read(snp->pos, pileup, cc, gs))) { // no need to reset pileup as the values in it will be immediately overwritten.
+                if (NULL == (plp = csp_mplp_get_plp(mplp, pileup->cb, i - fbeg, gs))) { continue; } // barcode is not in the input barcode list.
+                if (csp_mplp_buf_push(mplp, plp, use_umi(gs) ? pileup->umi : NULL, 1, pileup->base, pileup->qual, gs) < 0) { state = -1; goto fail; }
+                (*npushed)++;
             } else if (st < 0) { state = -1; goto fail; }
         }
         if (ret < -1) { state = -1; goto fail; } 
         else { hts_itr_destroy(iter); iter = NULL; }  // TODO: check if could reset iter?
     }
     #if DEBUG
-        fprintf(stderr, "[D::%s] before mplp statistics: npileup = %ld; npushed = %ld; the mplp is:\n", __func__, npileup, npushed);
+        fprintf(stderr, "[D::%s] npileup = %ld; npushed = %ld\n", __func__, npileup, *npushed);
+    #endif
+    return 0;
+  fail:
+    if (iter) { hts_itr_destroy(iter); }
+    return state;
+}
+
+/*@abstract    Pileup one SNP with method fetch.
+@param snp     Pointer of csp_snp_t structure.
+@param fs      Pointer of array of pointers to the csp_bam_fs structures.
+@param fc      Pointer of csp_fp_cache_t structure holding htsFile* of input files.
+@param cc      Pointer of fetch_cc_t structure caching CIGAR indexes, NULL if not used.
+@param nfs     Size of @p fs.
+@param pileup  Pointer of csp_pileup_t structure.
+@param mplp    Pointer of csp_mplp_t structure.
+@param gs      Pointer of global_settings structure.
+@return        0 if success, -1 if error, 1 if pileup failure without error.
+
+@note          1. This function is mainly called by csp_fetch_core(). Refer to csp_fetch_core() for notes.
+               2. The statistics results of all pileuped reads for one SNP is stored in the csp_mplp_t after calling this function.
+*/
+static int fetch_snp(csp_snp_t *snp, csp_bam_fs **fs, csp_fp_cache_t *fc, fetch_cc_t *cc, int nfs, csp_pileup_t *pileup, 
+                     csp_mplp_t *mplp, global_settings *gs) 
+{
+    int ret;
+    size_t npushed = 0;
+    mplp->ref_idx = snp->ref ? seq_nt16_char2int(snp->ref) : -1;
+    mplp->alt_idx = snp->alt ? seq_nt16_char2int(snp->alt) : -1;
+    if ((ret = fetch_snp_reads(snp, fs, nfs, fc, cc, 0, nfs, pileup, mplp, gs, &npushed)) != 0) { return ret; }
+    #if DEBUG
+        fprintf(stderr, "[D::%s] before mplp statistics: the mplp is:\n", __func__);
         csp_mplp_print_(stderr, mplp, "\t");
     #endif
-    if (npushed < gs->min_count) { state = 1; goto fail; }
-    if ((ret = csp_mplp_stat(mplp, gs)) != 0) { state = (ret > 0) ? 1 : -1; goto fail; }
+    if (npushed < gs->min_count) { return 1; }
+    if (csp_mplp_precheck(mplp->rbc, -1, gs)) { return 1; }
+    if (csp_mplp_buf_flush(mplp, gs) < 0) { return -1; }
+    if ((ret = csp_mplp_stat(mplp, gs)) != 0) { return (ret > 0) ? 1 : -1; }
     #if DEBUG
         fprintf(stderr, "[D::%s] after mplp statistics: the mplp is:\n", __func__);
         csp_mplp_print_(stderr, mplp, "\t");
     #endif
-    ks_free(s); s = NULL;
     return 0;
-  fail:
-    if (s) { ks_free(s); }
-    if (iter) { hts_itr_destroy(iter); }
-    return state;
 }
 
 /*@abstract  Pileup a region (a list of SNPs) with method of fetching.
@@ -167,53 +339,30 @@ static size_t csp_fetch_core(void *args) {
     size_t n = 0;             /* n is the num of SNPs that are successfully processed. */
     csp_bam_fs **bam_fs = d->bfs;
     int nfs = d->nfs;
-    htsFile **fp = NULL;
-    int nfp = 0;
+    csp_fp_cache_t *fc = NULL;
+    fetch_cc_t *cc = NULL;
     csp_pileup_t *pileup = NULL;
     csp_mplp_t *mplp = NULL;
-    int i, ret;
+    int ret;
     kstring_t ks = KS_INITIALIZE, *s = &ks;
 #if DEBUG
     fprintf(stderr, "[D::%s][Thread-%d] thread options:\n", __func__, d->i);
     thdata_print(stderr, d);
 #endif
     d->ret = -1;
-    d->ns = d->nr_ad = d->nr_dp = d->nr_oth = 0;
+    d->ns = d->nr_gt = 0;
+    memset(d->nr, 0, sizeof(d->nr)); memset(d->nr_grp, 0, sizeof(d->nr_grp));
+    d->cap_reads = d->cap_sites = d->samp_sites = 0;
     /* prepare data and structures. 
     */
-    if (jf_open(d->out_mtx_ad, NULL) <= 0) { 
-        fprintf(stderr, "[E::%s] failed to open tmp mtx AD file '%s'.\n", __func__, d->out_mtx_ad->fn);
-        goto fail;
-    }
-    if (jf_open(d->out_mtx_dp, NULL) <= 0) { 
-        fprintf(stderr, "[E::%s] failed to open tmp mtx DP file '%s'.\n", __func__, d->out_mtx_dp->fn);
+    if (csp_mtx_open(d) < 0) { goto fail; }
+    if (csp_vcf_open(d) < 0) { goto fail; }
+    /* input files are opened lazily by the handle cache. */ 
+    if (NULL == (fc = csp_fp_cache_init(gs->in_fns, gs->nin, d->max_open, gs->io_hint ? CSP_IO_RANDOM : CSP_IO_NONE))) {
+        fprintf(stderr, "[E::%s] failed to create file handle cache for input files.\n", __func__);
         goto fail;
     }
-    if (jf_open(d->out_mtx_oth, NULL) <= 0) { 
-        fprintf(stderr, "[E::%s] failed to open tmp mtx OTH file '%s'.\n", __func__, d->out_mtx_oth->fn);
-        goto fail;
-    }
-    if (jf_open(d->out_vcf_base, NULL) <= 0) { 
-        fprintf(stderr, "[E::%s] failed to open tmp vcf BASE file '%s'.\n", __func__, d->out_vcf_base->fn);
-        goto fail;
-    }
-    if (gs->is_genotype) {
-        if (jf_open(d->out_vcf_cells, NULL) <= 0) { 
-            fprintf(stderr, "[E::%s] failed to open tmp vcf CELLS file '%s'.\n", __func__, d->out_vcf_cells->fn);
-            goto fail;
-        }
-    }
-    /* open input files */ 
-    fp = (htsFile**) calloc(gs->nin, sizeof(htsFile*));
-    if (NULL == fp) { fprintf(stderr, "[E::%s] failed to open input files\n", __func__); goto fail; }                 
-    for (; nfp < gs->nin; ) {
-        if (d->i == 0) {               // the caller has opened input files for Thread-0 
-            fp[nfp] = bam_fs[nfp]->fp; nfp++;
-        } else if (NULL == (fp[nfp] = hts_open(gs->in_fns[nfp], "rb"))) {
-            fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, gs->in_fns[nfp]);
-            goto fail;
-        } else { nfp++; }
-    }
+    if (NULL == (cc = fetch_cc_init())) { fprintf(stderr, "[E::%s] failed to create CIGAR index cache.\n", __func__); goto fail; }
     /* prepare mplp for pileup. */
     if (NULL == (mplp = csp_mplp_init())) { fprintf(stderr, "[E::%s] could not init csp_mplp_t structure.\n", __func__); goto fail; }
     if (csp_mplp_prepare(mplp, gs) < 0) { fprintf(stderr, "[E::%s] could not prepare csp_mplp_t structure.\n", __func__); goto fail; }
@@ -240,7 +389,7 @@ static size_t csp_fetch_core(void *args) {
             fputc('\n', stderr);
             fprintf(stderr, "[D::%s] chr = %s; pos = %ld; ref = %c; alt = %c;\n", __func__, a[n]->chr, a[n]->pos + 1, a[n]->ref, a[n]->alt);
         #endif
-        if ((ret = fetch_snp(a[n], bam_fs, fp, nfs, pileup, mplp, gs)) != 0) {
+        if ((ret = fetch_snp(a[n], bam_fs, fc, cc, nfs, pileup, mplp, gs)) != 0) {
             if (ret < 0) {
                 fprintf(stderr, "[E::%s] failed to pileup snp (%s:%ld)\n", __func__, a[n]->chr, a[n]->pos + 1);
                 goto fail; 
@@ -251,48 +400,346 @@ static size_t csp_fetch_core(void *args) {
             csp_mplp_reset(mplp); ks_clear(s);
             continue;
         } else { d->ns++; }
-        d->nr_ad += mplp->nr_ad; d->nr_dp += mplp->nr_dp; d->nr_oth += mplp->nr_oth;
         /* output mplp to mtx and vcf. */
-        csp_mplp_to_mtx(mplp, d->out_mtx_ad, d->out_mtx_dp, d->out_mtx_oth, d->ns);
-        ksprintf(s, "%s\t%ld\t.\t%c\t%c\t.\tPASS\tAD=%ld;DP=%ld;OTH=%ld", a[n]->chr, a[n]->pos + 1, \
-                seq_nt16_int2char(mplp->ref_idx), seq_nt16_int2char(mplp->alt_idx), mplp->ad, mplp->dp, mplp->oth);
-        jf_puts(ks_str(s), d->out_vcf_base); jf_putc('\n', d->out_vcf_base);
-        if (gs->is_genotype) {
-            jf_puts(ks_str(s), d->out_vcf_cells);
-            jf_puts("\tGT:AD:DP:OTH:PL:ALL", d->out_vcf_cells);
-            csp_mplp_to_vcf(mplp, d->out_vcf_cells);
-            jf_putc('\n', d->out_vcf_cells);
-        }
-        csp_mplp_reset(mplp); ks_clear(s);
+        if (csp_mplp_to_mtx(mplp, d->out_mtx, d->csc, d->nr, d->ns) < 0) { goto fail; }
+        if (gs->ngroup > 0 && csp_mplp_to_grp(mplp, d->out_grp, d->nr_grp) < 0) { goto fail; }
+        if (csp_vcf_mplp(d, a[n]->chr, a[n]->pos, mplp, s) < 0) { goto fail; }
+        csp_mplp_reset(mplp);
     }
     // clean
     ks_free(s); s = NULL;
-    jf_close(d->out_mtx_ad); jf_close(d->out_mtx_dp); jf_close(d->out_mtx_oth);
-    jf_close(d->out_vcf_base); if (gs->is_genotype) { jf_close(d->out_vcf_cells); }
-    if (d->i > 0) {
-        for (i = 0; i < nfp; i++) { hts_close(fp[i]); }
-    } free(fp); fp = NULL;
+    csp_mtx_close(d);
+    if (csp_vcf_close(d) < 0) { fprintf(stderr, "[E::%s] failed to close vcf files.\n", __func__); goto fail; }
+    csp_fp_cache_destroy(fc); fc = NULL;
+    fetch_cc_destroy(cc); cc = NULL;
     csp_pileup_destroy(pileup);
+    d->cap_reads = mplp->cap_reads; d->cap_sites = mplp->cap_sites; d->samp_sites = mplp->samp_sites;
     csp_mplp_destroy(mplp);
     d->ret = 0;
     return n;
   fail:
     if (s) { ks_free(s); }
-    if (jf_isopen(d->out_mtx_ad)) { jf_close(d->out_mtx_ad); }
-    if (jf_isopen(d->out_mtx_dp)) { jf_close(d->out_mtx_dp); }
-    if (jf_isopen(d->out_mtx_oth)) { jf_close(d->out_mtx_oth); }
-    if (jf_isopen(d->out_vcf_base)) { jf_close(d->out_vcf_base); }
-    if (gs->is_genotype && jf_isopen(d->out_vcf_cells)) { jf_close(d->out_vcf_cells); }
-    if (fp) {
-        if (d->i > 0) {
-            for (i = 0; i < nfp; i++) { hts_close(fp[i]); }
-        } free(fp);
-    }
+    csp_mtx_close(d);
+    csp_vcf_close(d);
+    if (fc) { csp_fp_cache_destroy(fc); }
+    if (cc) { fetch_cc_destroy(cc); }
     if (pileup) csp_pileup_destroy(pileup);
     if (mplp) { csp_mplp_destroy(mplp); }
     return n;
 }
 
+/*
+ * Cell shards
+ */
+
+/*@abstract  Base counts of one cell (sample in Mode 3) at one SNP, collected by one cell shard.
+@param sid   Index of the cell in gs->barcodes, or of the sample in gs->sample_ids.
+@param bc    Read count of each base, in the order of 'ACGTN'.
+ */
+typedef struct {
+    int sid;
+    size_t bc[5];
+} fs_cell_t;
+
+/*@abstract  One task of Mode 1 or 3 with cell shards, i.e. one cell shard of one block of SNPs.
+@param gs      Pointer of global settings.
+@param bfs     Pointer of array of pointers to the csp_bam_fs structures.
+@param nfs     Size of @p bfs.
+@param beg     Index of the first cell of the shard in gs->barcodes (gs->sample_ids in Mode 3).
+@param fbeg    Index of the first input file the shard fetches.
+@param fend    Index of the last input file the shard fetches plus 1.
+@param n       Index of the first SNP of the block in gs->pl, set for each round.
+@param m       Num of SNPs of the block, no more than CSP_SHARD_NSNP, set for each round.
+@param fc      Pointer of csp_fp_cache_t, kept across rounds.
+@param cc      Pointer of fetch_cc_t, kept across rounds.
+@param pileup  Pointer of csp_pileup_t, kept across rounds.
+@param mplp    Pointer of csp_mplp_t holding the sample groups of the shard only, kept across rounds.
+@param c       Cells with reads of all SNPs of the block, in the order of SNPs and then cells.
+@param q       Qual matrix of each cell in @p c, 20 values each, only used for genotyping.
+@param off     Cells of the j-th SNP of the block are in [off[j], off[j+1]) of @p c.
+@param st      State of fetch_snp_reads() of each SNP of the block, 1 if the SNP is rejected, e.g. its contig is
+               missing in an input file, 0 otherwise.
+@param np      Num of reads of the shard buffered for each SNP of the block, i.e. npushed of fetch_snp_reads().
+@param rbc     Raw read count of each base of the shard for each SNP of the block, i.e. csp_mplp_t::rbc.
+@param ret     Running state of the task, 0 if success, -1 otherwise.
+
+@note          1. The cells of one shard are a contiguous range of gs->barcodes, so that concatenating the cells of
+                  the shards in order gives the cells of one SNP sorted by index.
+               2. In Mode 3, each sample is one input file, so a shard only fetches the input files of its samples
+                  and the input files of one SNP are processed in parallel.
+ */
+typedef struct {
+    global_settings *gs;
+    csp_bam_fs **bfs;
+    int nfs, beg, fbeg, fend;
+    size_t n, m;
+    csp_fp_cache_t *fc;
+    fetch_cc_t *cc;
+    csp_pileup_t *pileup;
+    csp_mplp_t *mplp;
+    kvec_t(fs_cell_t) c;
+    kvec_t(double) q;
+    size_t off[CSP_SHARD_NSNP + 1];
+    int st[CSP_SHARD_NSNP];
+    size_t np[CSP_SHARD_NSNP];
+    size_t rbc[CSP_SHARD_NSNP][5];
+    int ret;
+} fs_shard_t;
+
+static void fs_shard_destroy(fs_shard_t *p) {
+    if (NULL == p) { return; }
+    if (p->fc) { csp_fp_cache_destroy(p->fc); }
+    if (p->cc) { fetch_cc_destroy(p->cc); }
+    if (p->pileup) { csp_pileup_destroy(p->pileup); }
+    if (p->mplp) { csp_mplp_destroy(p->mplp); }
+    kv_destroy(p->c); kv_destroy(p->q);
+    free(p);
+}
+
+/*@abstract  Create the task of one cell shard.
+@param beg   Index of the first cell of the shard in gs->barcodes (gs->sample_ids in Mode 3).
+@param end   Index of the last cell of the shard plus 1.
+@param max_open  Max num of input files the task keeps open.
+@return      Pointer of fs_shard_t if success, NULL otherwise.
+ */
+static fs_shard_t* fs_shard_init(global_settings *gs, csp_bam_fs **bfs, int nfs, int beg, int end, int max_open) {
+    fs_shard_t *p;
+    if (NULL == (p = (fs_shard_t*) calloc(1, sizeof(fs_shard_t)))) { return NULL; }
+    p->gs = gs; p->bfs = bfs; p->nfs = nfs; p->beg = beg;
+    if (use_barcodes(gs)) { p->fbeg = 0; p->fend = nfs; }
+    else { p->fbeg = beg; p->fend = end; }
+    kv_init(p->c); kv_init(p->q);
+    if (NULL == (p->fc = csp_fp_cache_init(gs->in_fns, gs->nin, max_open, gs->io_hint ? CSP_IO_RANDOM : CSP_IO_NONE))) { goto fail; }
+    if (NULL == (p->cc = fetch_cc_init())) { goto fail; }
+    if (NULL == (p->pileup = csp_pileup_init())) { goto fail; }
+    if (NULL == (p->mplp = csp_mplp_init())) { goto fail; }
+    if (csp_mplp_prepare_part(p->mplp, beg, end, gs) < 0) { goto fail; }
+    return p;
+  fail:
+    fs_shard_destroy(p);
+    return NULL;
+}
+
+/*@abstract  Collect the base counts of the cells of the shard at the SNP that is just pushed.
+@return      0 if success, -1 otherwise.
+ */
+static int fs_shard_collect(fs_shard_t *p) {
+    csp_mplp_t *mplp = p->mplp;
+    csp_plp_t *plp;
+    fs_cell_t x;
+    int i, j, k;
+    for (i = 0; i < mplp->nsg; i++) {
+        plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[i]);
+        if (0 == plp->bc[0] + plp->bc[1] + plp->bc[2] + plp->bc[3] + plp->bc[4]) { continue; }
+        x.sid = p->beg + i;
+        memcpy(x.bc, plp->bc, sizeof(x.bc));
+        kv_push(fs_cell_t, p->c, x);
+        if (p->gs->is_genotype) {
+            if (csp_plp_qmat(plp, mplp->qvec) < 0) { return -1; }
+            for (j = 0; j < 5; j++) {
+                for (k = 0; k < 4; k++) { kv_push(double, p->q, plp->qmat[j][k]); }
+            }
+        }
+    }
+    return 0;
+}
+
+/*@abstract  Fetch the reads of one block of SNPs and count them for the cells of one shard.
+@param args  Pointer of fs_shard_t.
+@return      Void.
+
+@note        The filters on the aggregate counts of a SNP, i.e. --minCOUNT and --minMAF, and the pre-check could 
+             only be applied after the counts of all shards are merged, refer to fs_shard_merge().
+ */
+static void fs_shard_run(void *args) {
+    fs_shard_t *p = (fs_shard_t*) args;
+    global_settings *gs = p->gs;
+    csp_snp_t **a = gs->pl.a + p->n;
+    size_t j, npushed;
+    int ret;
+    p->ret = -1;
+    kv_size(p->c) = kv_size(p->q) = 0;
+    for (j = 0; j < p->m; j++) {
+        p->off[j] = kv_size(p->c);
+        if ((ret = fetch_snp_reads(a[j], p->bfs, p->nfs, p->fc, p->cc, p->fbeg, p->fend, p->pileup, p->mplp, gs, &npushed)) < 0) {
+            fprintf(stderr, "[E::%s] failed to pileup snp (%s:%ld)\n", __func__, a[j]->chr, a[j]->pos + 1);
+            csp_mplp_reset(p->mplp);
+            return;
+        }
+        p->st[j] = ret; p->np[j] = npushed;
+        memcpy(p->rbc[j], p->mplp->rbc, sizeof(p->rbc[j]));
+        if (0 == ret && npushed > 0) {
+            if (csp_mplp_buf_flush(p->mplp, gs) < 0 || fs_shard_collect(p) < 0) { csp_mplp_reset(p->mplp); return; }
+        }
+        csp_mplp_reset(p->mplp);
+    }
+    p->off[j] = kv_size(p->c);
+    p->ret = 0;
+}
+
+/*@abstract    Merge the counts of all shards of one block at one SNP, then filter and output the SNP.
+@param d       Pointer of thread_data holding the output files.
+@param sh      Pointer of array of the shards of the block, in the order of cells.
+@param nsh     Size of @p sh.
+@param j       Index of the SNP in the block.
+@param mplp    Pointer of csp_mplp_t holding all sample groups, which should be reset by the caller after each SNP.
+@param s       Pointer of kstring_t used as a buffer.
+@return        0 if the SNP is output, 1 if it is filtered, -1 if error.
+
+@note          1. The counts of the cells are copied from @p sh into @p mplp, then the SNP is filtered and output the 
+                  same way as fetch_snp() and csp_fetch_core(), with the num of reads and raw counts summed over the 
+                  shards for --minCOUNT and the pre-check.
+               2. The qual lists of the sample groups are left empty while their qual matrices are copied from the 
+                  shards, so csp_mplp_stat() genotypes with the qual matrices as they are.
+ */
+static int fs_shard_merge(thread_data *d, fs_shard_t **sh, int nsh, size_t j, csp_mplp_t *mplp, kstring_t *s) {
+    global_settings *gs = d->gs;
+    csp_snp_t *snp = gs->pl.a[sh[0]->n + j];
+    csp_plp_t *plp;
+    fs_cell_t *x;
+    size_t rbc[5] = {0, 0, 0, 0, 0}, npushed = 0, l;
+    int k, b, ret;
+    for (k = 0; k < nsh; k++) {
+        if (sh[k]->st[j]) { return 1; }
+        npushed += sh[k]->np[j];
+        for (b = 0; b < 5; b++) { rbc[b] += sh[k]->rbc[j][b]; }
+    }
+    if (npushed < gs->min_count) { return 1; }
+    if (csp_mplp_precheck(rbc, -1, gs)) { return 1; }
+    mplp->ref_idx = snp->ref ? seq_nt16_char2int(snp->ref) : -1;
+    mplp->alt_idx = snp->alt ? seq_nt16_char2int(snp->alt) : -1;
+    mplp->pushed = 1;
+    for (k = 0; k < nsh; k++) {
+        for (l = sh[k]->off[j]; l < sh[k]->off[j + 1]; l++) {
+            x = &kv_A(sh[k]->c, l);
+            plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[x->sid]);
+            memcpy(plp->bc, x->bc, sizeof(plp->bc));
+            if (gs->is_genotype) { memcpy(plp->qmat, sh[k]->q.a + l * 20, sizeof(plp->qmat)); }
+        }
+    }
+    if ((ret = csp_mplp_stat(mplp, gs)) != 0) { return (ret > 0) ? 1 : -1; }
+    d->ns++;
+    if (csp_mplp_to_mtx(mplp, d->out_mtx, d->csc, d->nr, d->ns) < 0) { return -1; }
+    if (gs->ngroup > 0 && csp_mplp_to_grp(mplp, d->out_grp, d->nr_grp) < 0) { return -1; }
+    if (csp_vcf_mplp(d, snp->chr, snp->pos, mplp, s) < 0) { return -1; }
+    return 0;
+}
+
+/*@abstract  Pileup all SNPs with method of fetching, where each SNP is shared by the cell shards.
+@param d     Pointer to thread_data structure holding all SNPs and the output files.
+@param nsh   Num of cell shards, > 1.
+@return      Num of SNPs, including those filtered, that are processed.
+
+@note        1. The SNPs are processed in rounds. In each round, the threads are grouped into blocks of @p nsh
+                threads, each block takes CSP_SHARD_NSNP SNPs and each thread of it counts the reads of one shard.
+                After all tasks of the round finish, the counts of the shards are merged and output per SNP.
+             2. In Mode 1, each thread still reads all reads covering the SNPs of its block, but the UMI grouping, 
+                counting and qual processing, which dominate for deep SNPs with many cells, are split by the shards.
+                In Mode 3, the input files, i.e. the samples, are split by the shards.
+             3. As csp_fetch_core(), the "ret" in thread_data saves the running state, 0 if success, -1 otherwise.
+ */
+static size_t csp_fetch_shards(thread_data *d, int nsh) {
+    global_settings *gs = d->gs;
+    fs_shard_t **sh = NULL;
+    csp_mplp_t *mplp = NULL;
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    size_t n = 0, npos, j, mpos;
+    int nsample = use_barcodes(gs) ? gs->nbarcode : gs->nsid;
+    int nblk, ntask, i, b, k, ret, max_open;
+    d->ret = -1;
+    d->ns = d->nr_gt = 0;
+    memset(d->nr, 0, sizeof(d->nr)); memset(d->nr_grp, 0, sizeof(d->nr_grp));
+    d->cap_reads = d->cap_sites = d->samp_sites = 0;
+    nblk = max2(gs->nthread / nsh, 1);
+    nblk = min2((size_t) nblk, (d->m + CSP_SHARD_NSNP - 1) / CSP_SHARD_NSNP);
+    ntask = nblk * nsh;
+    if (csp_mtx_open(d) < 0) { goto fail; }
+    if (csp_vcf_open(d) < 0) { goto fail; }
+    if (NULL == (mplp = csp_mplp_init())) { fprintf(stderr, "[E::%s] could not init csp_mplp_t structure.\n", __func__); goto fail; }
+    if (csp_mplp_prepare(mplp, gs) < 0) { fprintf(stderr, "[E::%s] could not prepare csp_mplp_t structure.\n", __func__); goto fail; }
+    /* create the tasks, the k-th shard of each block takes the k-th range of the barcodes (sample IDs). */
+    max_open = csp_fp_cache_cap(gs, ntask);
+    if (NULL == (sh = (fs_shard_t**) calloc(ntask, sizeof(fs_shard_t*)))) {
+        fprintf(stderr, "[E::%s] could not initialize the array of cell shards.\n", __func__);
+        goto fail;
+    }
+    for (i = 0; i < ntask; i++) {
+        k = i % nsh;
+        if (NULL == (sh[i] = fs_shard_init(gs, d->bfs, d->nfs, (int) ((long) nsample * k / nsh), 
+                                           (int) ((long) nsample * (k + 1) / nsh), max_open))) {
+            fprintf(stderr, "[E::%s] could not initialize the cell shard (No. %d).\n", __func__, i);
+            goto fail;
+        }
+    }
+    #if VERBOSE
+        fprintf(stderr, "[I::%s] %d blocks of %d cell shards, each thread keeps at most %d input files open.\n", 
+                __func__, nblk, nsh, max_open);
+        double pos_m, pos_n, nprints = 50;
+        pos_n = pos_m = d->m / nprints;
+    #endif
+    /* process SNPs in rounds. */
+    for (npos = d->n; npos < d->n + d->m; npos += mpos) {
+        mpos = min2(d->n + d->m - npos, (size_t) nblk * CSP_SHARD_NSNP);
+        for (b = 0; b < nblk; b++) {
+            for (k = 0; k < nsh; k++) {
+                i = b * nsh + k;
+                sh[i]->n = npos + (size_t) b * CSP_SHARD_NSNP;
+                sh[i]->m = (size_t) b * CSP_SHARD_NSNP < mpos ? min2(mpos - (size_t) b * CSP_SHARD_NSNP, CSP_SHARD_NSNP) : 0;
+                sh[i]->ret = 0;
+                if (sh[i]->m && thpool_add_work(gs->tp, fs_shard_run, sh[i]) < 0) {
+                    fprintf(stderr, "[E::%s] could not add thread work (No. %d)\n", __func__, i);
+                    thpool_wait(gs->tp);
+                    goto fail;
+                }
+            }
+        }
+        thpool_wait(gs->tp);
+        for (i = 0; i < ntask; i++) { if (sh[i]->ret < 0) goto fail; }
+        for (b = 0; b < nblk; b++) {
+            for (j = 0; j < sh[b * nsh]->m; j++) {
+                ret = fs_shard_merge(d, sh + b * nsh, nsh, j, mplp, s);
+                csp_mplp_reset(mplp);
+                if (ret < 0) {
+                    fprintf(stderr, "[E::%s] failed to merge cell shards of snp (%s:%ld)\n", __func__, 
+                            gs->pl.a[sh[b * nsh]->n + j]->chr, gs->pl.a[sh[b * nsh]->n + j]->pos + 1);
+                    goto fail;
+                }
+                ks_clear(s);
+            }
+        }
+        n += mpos;
+        #if VERBOSE
+            if (n >= pos_n) {
+                fprintf(stderr, "[I::%s] %.2f%% SNPs processed.\n", __func__, 100.0 * n / d->m);
+                while (pos_n <= n) { pos_n += pos_m; }
+            }
+        #endif
+    }
+    // clean
+    ks_free(s); s = NULL;
+    csp_mtx_close(d);
+    if (csp_vcf_close(d) < 0) { fprintf(stderr, "[E::%s] failed to close vcf files.\n", __func__); goto fail; }
+    for (i = 0; i < ntask; i++) {
+        d->cap_reads += sh[i]->mplp->cap_reads; d->cap_sites += sh[i]->mplp->cap_sites; 
+        d->samp_sites += sh[i]->mplp->samp_sites;
+        fs_shard_destroy(sh[i]);
+    }
+    free(sh);
+    csp_mplp_destroy(mplp);
+    d->ret = 0;
+    return n;
+  fail:
+    if (s) { ks_free(s); }
+    csp_mtx_close(d);
+    csp_vcf_close(d);
+    if (sh) {
+        for (i = 0; i < ntask; i++) { fs_shard_destroy(sh[i]); }
+        free(sh);
+    }
+    if (mplp) { csp_mplp_destroy(mplp); }
+    return n;
+}
+
 /*abstract  Run cellSNP Mode with method of fetching.
 @param gs   Pointer to the global_settings structure.
 @return     0 if success, -1 otherwise.
@@ -311,26 +758,38 @@ int csp_fetch(global_settings *gs) {
     int ntd = 0, mtd; // ntd: num of thread-data structures that have been created. mtd: size of td array.
     csp_bam_fs **bam_fs = NULL;       /* use array instead of single element to compatible with multi-input-files. */
     int nfs = 0;
-    csp_bam_fs *bs = NULL;
-    int i, ret;
-    size_t npos, mpos, rpos, tpos, ns, nr_ad, nr_dp, nr_oth, ns_merge, nr_merge;
-    jfile_t **out_tmp_mtx_ad, **out_tmp_mtx_dp, **out_tmp_mtx_oth, **out_tmp_vcf_base, **out_tmp_vcf_cells;
-    out_tmp_mtx_ad = out_tmp_mtx_dp = out_tmp_mtx_oth = out_tmp_vcf_base = out_tmp_vcf_cells = NULL;
-    /* calc number of threads and number of SNPs for each thread. */
-    mtd = min2(csp_snplist_size(gs->pl), nthread);
+    int i, t, max_open, nctg, nshard;
+    const char **ctgs = NULL;
+    size_t npos, mpos, rpos, tpos, ns, nr[CSP_NTAG], nr_grp[CSP_NTAG];
+    size_t nr_gt;
+    jfile_t **out_tmp_mtx[CSP_NTAG], **out_tmp_grp[CSP_NTAG], **out_tmp_vcf_base, **out_tmp_vcf_cells, **out_tmp_site;
+    jfile_t **out_tmp_mtx_gt = NULL;
+    out_tmp_vcf_base = out_tmp_vcf_cells = out_tmp_site = NULL;
+    for (t = 0; t < CSP_NTAG; t++) { out_tmp_mtx[t] = out_tmp_grp[t] = NULL; }
+    /* calc number of threads and number of SNPs for each thread. 
+       With cell shards, all SNPs are given to one thread_data, whose output files are shared by the shards. */
+    nshard = min2(min2(gs->cell_shards, nthread), nsample);
+    mtd = nshard > 1 ? 1 : min2(csp_snplist_size(gs->pl), nthread);
     mpos = csp_snplist_size(gs->pl) / mtd;
     rpos = csp_snplist_size(gs->pl) - mpos * mtd;     // number of remaining positions
     /* create output tmp filenames. */
-    if (NULL == (out_tmp_mtx_ad = create_tmp_files(gs->out_mtx_ad, mtd, CSP_TMP_ZIP))) {
-        fprintf(stderr, "[E::%s] fail to create tmp files for mtx_AD.\n", __func__);
-        goto fail;
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (gs->out_mtx[t] && NULL == (out_tmp_mtx[t] = create_tmp_files(gs->out_mtx[t], mtd, CSP_TMP_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for mtx_%s.\n", __func__, csp_mtx_tag_name(t));
+            goto fail;
+        }
+        if (gs->out_grp[t] && NULL == (out_tmp_grp[t] = create_tmp_files(gs->out_grp[t], mtd, CSP_TMP_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for group mtx_%s.\n", __func__, csp_mtx_tag_name(t));
+            goto fail;
+        }
     }
-    if (NULL == (out_tmp_mtx_dp = create_tmp_files(gs->out_mtx_dp, mtd, CSP_TMP_ZIP))) {
-        fprintf(stderr, "[E::%s] fail to create tmp files for mtx_DP.\n", __func__);
+    if (gs->sparse_gt && NULL == (out_tmp_mtx_gt = create_tmp_files(gs->out_mtx_gt, mtd, CSP_TMP_ZIP))) {
+        fprintf(stderr, "[E::%s] fail to create tmp files for sparse genotypes.\n", __func__);
         goto fail;
     }
-    if (NULL == (out_tmp_mtx_oth = create_tmp_files(gs->out_mtx_oth, mtd, CSP_TMP_ZIP))) {
-        fprintf(stderr, "[E::%s] fail to create tmp files for mtx_OTH.\n", __func__);
+    if (csp_out_site(gs) && \
+        NULL == (out_tmp_site = create_tmp_files(csp_site_fs(gs->out_h5, gs->out_arw_snp), mtd, CSP_TMP_ZIP))) {
+        fprintf(stderr, "[E::%s] fail to create tmp site files.\n", __func__);
         goto fail;
     }
     if (mtd > 1) {
@@ -338,30 +797,34 @@ int csp_fetch(global_settings *gs) {
             fprintf(stderr, "[E::%s] fail to create tmp files for vcf_BASE.\n", __func__);
             goto fail;
         }
-        if (gs->is_genotype && NULL == (out_tmp_vcf_cells = create_tmp_files(gs->out_vcf_cells, mtd, CSP_TMP_ZIP))) {
+        if (csp_out_cells(gs) && NULL == (out_tmp_vcf_cells = create_tmp_files(gs->out_vcf_cells, mtd, CSP_TMP_ZIP))) {
             fprintf(stderr, "[E::%s] fail to create tmp files for vcf_CELLS.\n", __func__);
             goto fail;
         }
     }
     /* construct bam_fs */
-    bam_fs = (csp_bam_fs**) calloc(gs->nin, sizeof(csp_bam_fs*));
-    if (NULL == bam_fs) { fprintf(stderr, "[E::%s] could not initialize csp_bam_fs array.\n", __func__); goto fail; }
-    for (nfs = 0; nfs < gs->nin; nfs++) {
-        if (NULL == (bs = csp_bam_fs_init())) { fprintf(stderr, "[E::%s] failed to create csp_bam_fs.\n", __func__); goto fail; }
-        if (NULL == (bs->fp = hts_open(gs->in_fns[nfs], "rb"))) {
-            fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, gs->in_fns[nfs]); 
+    if (NULL == (bam_fs = csp_load_bam_fs(gs, 0, gs->io_hint ? CSP_IO_RANDOM : CSP_IO_NONE))) {
+        fprintf(stderr, "[E::%s] failed to load headers and indexes of input files.\n", __func__);
+        goto fail;
+    }
+    nfs = gs->nin;
+    /* translate contigs of the snplist into tids of each input file. */
+    if ((nctg = csp_snplist_contigs(&gs->pl, &ctgs)) < 0) {
+        fprintf(stderr, "[E::%s] failed to build contig table of the SNP list.\n", __func__);
+        goto fail;
+    }
+    for (i = 0; i < nfs; i++) {
+        if (csp_bam_fs_set_tids(bam_fs[i], ctgs, nctg) < 0) {
+            fprintf(stderr, "[E::%s] failed to translate contigs for %s.\n", __func__, gs->in_fns[i]);
             goto fail;
         }
-        if (NULL == (bs->hdr = sam_hdr_read(bs->fp))) {
-            fprintf(stderr, "[E::%s] failed to read header for %s.\n", __func__, gs->in_fns[nfs]);
-            goto fail; 
-        }
-        if (NULL == (bs->idx = sam_index_load(bs->fp, gs->in_fns[nfs]))) {
-            fprintf(stderr, "[E::%s] failed to load index for %s.\n", __func__, gs->in_fns[nfs]);
-            goto fail; 
-        }
-        bam_fs[nfs] = bs;
-    } bs = NULL;
+    }
+    if (gs->out_bcf && csp_bcf_init(gs, bam_fs[0]->hdr, ctgs, nctg) < 0) { goto fail; }
+    free(ctgs); ctgs = NULL;
+    max_open = csp_fp_cache_cap(gs, mtd);
+    #if VERBOSE
+        fprintf(stderr, "[I::%s] each thread keeps at most %d input files open.\n", __func__, max_open);
+    #endif
     /* prepare data for thread pool. */
     td = (thread_data**) calloc(mtd, sizeof(thread_data*));
     if (NULL == td) { fprintf(stderr, "[E::%s] could not initialize the array of thread_data structure.\n", __func__); goto fail; }
@@ -372,16 +835,23 @@ int csp_fetch(global_settings *gs) {
         }
         tpos = ntd < rpos ? mpos + 1 : mpos;
         d->i = ntd; d->gs = gs; d->bfs = bam_fs; d->nfs = nfs; d->n = npos; d->m = tpos;
-        d->out_mtx_ad = out_tmp_mtx_ad[ntd]; d->out_mtx_dp = out_tmp_mtx_dp[ntd]; d->out_mtx_oth = out_tmp_mtx_oth[ntd];
+        d->max_open = max_open;
+        for (t = 0; t < CSP_NTAG; t++) {
+            d->out_mtx[t] = out_tmp_mtx[t] ? out_tmp_mtx[t][ntd] : NULL;
+            d->out_grp[t] = out_tmp_grp[t] ? out_tmp_grp[t][ntd] : NULL;
+        }
+        d->out_site = out_tmp_site ? out_tmp_site[ntd] : NULL;
+        d->out_mtx_gt = out_tmp_mtx_gt ? out_tmp_mtx_gt[ntd] : NULL;
         if (mtd > 1) {
-            d->out_vcf_base = out_tmp_vcf_base[ntd]; d->out_vcf_cells = gs->is_genotype ? out_tmp_vcf_cells[ntd] : NULL;
+            d->out_vcf_base = out_tmp_vcf_base[ntd]; d->out_vcf_cells = csp_out_cells(gs) ? out_tmp_vcf_cells[ntd] : NULL;
         } else {
-            d->out_vcf_base = gs->out_vcf_base; d->out_vcf_cells = gs->is_genotype ? gs->out_vcf_cells : NULL;
+            d->out_vcf_base = gs->out_vcf_base; d->out_vcf_cells = csp_out_cells(gs) ? gs->out_vcf_cells : NULL;
         }
         td[ntd] = d;
     } d = NULL;
     // run the threads
-    if (mtd > 1) {
+    if (nshard > 1) { csp_fetch_shards(td[0], nshard); }
+    else if (mtd > 1) {
         for (i = 0; i < ntd; i++) {
             if (thpool_add_work(gs->tp, (void*) csp_fetch_core, td[i]) < 0) {
                 fprintf(stderr, "[E::%s] could not add thread work (No. %d)\n", __func__, i);
@@ -396,61 +866,57 @@ int csp_fetch(global_settings *gs) {
     #endif
     for (i = 0; i < mtd; i++) { if (td[i]->ret < 0) goto fail; }
     /* merge tmp files. */
-    ns = nr_ad = nr_dp = nr_oth = 0;
+    ns = nr_gt = 0;
+    memset(nr, 0, sizeof(nr)); memset(nr_grp, 0, sizeof(nr_grp));
     for (i = 0; i < mtd; i++) {
-        nr_ad += td[i]->nr_ad; nr_dp += td[i]->nr_dp; nr_oth += td[i]->nr_oth;
+        for (t = 0; t < CSP_NTAG; t++) { nr[t] += td[i]->nr[t]; nr_grp[t] += td[i]->nr_grp[t]; }
+        nr_gt += td[i]->nr_gt;
         ns += td[i]->ns;
     }
-    if (jf_open(gs->out_mtx_ad, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx AD.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_ad, "%ld\t%d\t%ld\n", ns, nsample, nr_ad);
-    merge_mtx(gs->out_mtx_ad, out_tmp_mtx_ad, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_ad) { fprintf(stderr, "[E::%s] failed to merge mtx AD.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_ad);
-
-    if (jf_open(gs->out_mtx_dp, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx DP.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_dp, "%ld\t%d\t%ld\n", ns, nsample, nr_dp);
-    merge_mtx(gs->out_mtx_dp, out_tmp_mtx_dp, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_dp) { fprintf(stderr, "[E::%s] failed to merge mtx DP.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_dp);
-
-    if (jf_open(gs->out_mtx_oth, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx OTH.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_oth, "%ld\t%d\t%ld\n", ns, nsample, nr_oth);
-    merge_mtx(gs->out_mtx_oth, out_tmp_mtx_oth, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_oth) { fprintf(stderr, "[E::%s] failed to merge mtx OTH.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_oth);
-
-    if (mtd > 1) {
-        if (jf_open(gs->out_vcf_base, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf BASE.\n", __func__); goto fail; }
-        merge_vcf(gs->out_vcf_base, out_tmp_vcf_base, mtd, &ret);
-        if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf BASE.\n", __func__); goto fail; }
-        jf_close(gs->out_vcf_base);
-
-        if (gs->is_genotype) {
-            if (jf_open(gs->out_vcf_cells, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf CELLS.\n", __func__); goto fail; }
-            merge_vcf(gs->out_vcf_cells, out_tmp_vcf_cells, mtd, &ret);
-            if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf CELLS.\n", __func__); goto fail; }    
-            jf_close(gs->out_vcf_cells);     
+    thdata_report_cap(td, mtd, gs);
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (gs->out_mtx[t] && csp_merge_mtx(gs->out_mtx[t], out_tmp_mtx[t], mtd, ns, nsample, nr[t], gs) < 0) { goto fail; }
+        if (gs->out_grp[t] && csp_merge_mtx(gs->out_grp[t], out_tmp_grp[t], mtd, ns, gs->ngroup, nr_grp[t], gs) < 0) { 
+            goto fail; 
         }
     }
+    if (gs->cell_major && csp_merge_csc(gs->out_csc, td, mtd, nsample, gs) < 0) { goto fail; }
+    if (out_tmp_mtx_gt && csp_merge_gt(gs->out_mtx_gt, out_tmp_mtx_gt, mtd, ns, nsample, nr_gt, gs) < 0) { goto fail; }
+    if (gs->out_hdf5 && csp_merge_h5(gs->out_h5, out_tmp_mtx[CSP_TAG_AD], out_tmp_mtx[CSP_TAG_DP], out_tmp_mtx[CSP_TAG_OTH], 
+                                     out_tmp_site, mtd, ns, gs) < 0) {
+        goto fail;
+    }
+    if (gs->out_arrow && csp_merge_arrow(gs->out_arw_tag, gs->out_arw_snp, out_tmp_mtx[CSP_TAG_AD], out_tmp_mtx[CSP_TAG_DP], 
+                                         out_tmp_mtx[CSP_TAG_OTH], out_tmp_site, mtd, ns) < 0) {
+        goto fail;
+    }
+
+    if (csp_merge_vcf(gs->out_vcf_base, out_tmp_vcf_base, mtd, td, 0, gs) < 0) { goto fail; }
+    if (csp_out_cells(gs) && csp_merge_vcf(gs->out_vcf_cells, out_tmp_vcf_cells, mtd, td, 1, gs) < 0) { goto fail; }
     /* clean */
     for (i = 0; i < mtd; i++) { thdata_destroy(td[i]); }
     free(td); td = NULL;
     for (i = 0; i < nfs; i++) { csp_bam_fs_destroy(bam_fs[i]); }
     free(bam_fs); bam_fs = NULL;
-    if (destroy_tmp_files(out_tmp_mtx_ad, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx AD files.\n", __func__);
-    } out_tmp_mtx_ad = NULL;
-    if (destroy_tmp_files(out_tmp_mtx_dp, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx DP files.\n", __func__);
-    } out_tmp_mtx_dp = NULL;
-    if (destroy_tmp_files(out_tmp_mtx_oth, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx OTH files.\n", __func__);
-    } out_tmp_mtx_oth = NULL;
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (out_tmp_mtx[t] && destroy_tmp_files(out_tmp_mtx[t], mtd) < 0) {
+            fprintf(stderr, "[W::%s] failed to remove tmp mtx %s files.\n", __func__, csp_mtx_tag_name(t));
+        } out_tmp_mtx[t] = NULL;
+        if (out_tmp_grp[t] && destroy_tmp_files(out_tmp_grp[t], mtd) < 0) {
+            fprintf(stderr, "[W::%s] failed to remove tmp group mtx %s files.\n", __func__, csp_mtx_tag_name(t));
+        } out_tmp_grp[t] = NULL;
+    }
+    if (out_tmp_mtx_gt && destroy_tmp_files(out_tmp_mtx_gt, mtd) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp sparse genotype files.\n", __func__);
+    } out_tmp_mtx_gt = NULL;
+    if (out_tmp_site && destroy_tmp_files(out_tmp_site, mtd) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp site files.\n", __func__);
+    } out_tmp_site = NULL;
     if (mtd > 1) {
         if (destroy_tmp_files(out_tmp_vcf_base, mtd) < 0) {
             fprintf(stderr, "[W::%s] failed to remove tmp vcf BASE files.\n", __func__);
         } out_tmp_vcf_base = NULL;
-        if (gs->is_genotype) {         
+        if (csp_out_cells(gs)) {         
             if (destroy_tmp_files(out_tmp_vcf_cells, mtd) < 0) {
                 fprintf(stderr, "[W::%s] failed to remove tmp vcf CELLS files.\n", __func__);
             } out_tmp_vcf_cells = NULL;
@@ -463,19 +929,24 @@ int csp_fetch(global_settings *gs) {
         free(td);
     }
     if (d) { thdata_destroy(d); }
+    if (ctgs) { free(ctgs); }
     if (bam_fs) {
         for (i = 0; i < nfs; i++) { csp_bam_fs_destroy(bam_fs[i]); }
         free(bam_fs);
     }
-    if (bs) { csp_bam_fs_destroy(bs); }
-    if (out_tmp_mtx_ad && destroy_tmp_files(out_tmp_mtx_ad, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx AD files.\n", __func__);
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (out_tmp_mtx[t] && destroy_tmp_files(out_tmp_mtx[t], mtd) < 0) {
+            fprintf(stderr, "[W::%s] failed to remove tmp mtx %s files.\n", __func__, csp_mtx_tag_name(t));
+        }
+        if (out_tmp_grp[t] && destroy_tmp_files(out_tmp_grp[t], mtd) < 0) {
+            fprintf(stderr, "[W::%s] failed to remove tmp group mtx %s files.\n", __func__, csp_mtx_tag_name(t));
+        }
     }
-    if (out_tmp_mtx_dp && destroy_tmp_files(out_tmp_mtx_dp, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx DP files.\n", __func__);
+    if (out_tmp_mtx_gt && destroy_tmp_files(out_tmp_mtx_gt, mtd) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp sparse genotype files.\n", __func__);
     }
-    if (out_tmp_mtx_oth && destroy_tmp_files(out_tmp_mtx_oth, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx OTH files.\n", __func__);
+    if (out_tmp_site && destroy_tmp_files(out_tmp_site, mtd) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp site files.\n", __func__);
     }
     if (mtd > 1) {
         if (out_tmp_vcf_base && destroy_tmp_files(out_tmp_vcf_base, mtd) < 0) {
@@ -485,11 +956,12 @@ int csp_fetch(global_settings *gs) {
             fprintf(stderr, "[W::%s] failed to remove tmp vcf CELLS files.\n", __func__);
         }
     }
-    if (jf_isopen(gs->out_mtx_ad)) { jf_close(gs->out_mtx_ad); }
-    if (jf_isopen(gs->out_mtx_dp)) { jf_close(gs->out_mtx_dp); }
-    if (jf_isopen(gs->out_mtx_oth)) { jf_close(gs->out_mtx_oth); }
+    for (t = 0; t < CSP_NTAG; t++) { 
+        if (gs->out_mtx[t] && jf_isopen(gs->out_mtx[t])) { jf_close(gs->out_mtx[t]); } 
+        if (gs->out_grp[t] && jf_isopen(gs->out_grp[t])) { jf_close(gs->out_grp[t]); } 
+    }
     if (jf_isopen(gs->out_vcf_base)) { jf_close(gs->out_vcf_base); }
-    if (gs->is_genotype && jf_isopen(gs->out_vcf_cells)) { jf_close(gs->out_vcf_cells); }
+    if (csp_out_cells(gs) && jf_isopen(gs->out_vcf_cells)) { jf_close(gs->out_vcf_cells); }
     return -1;
 }
 
@@ -4,9 +4,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <ctype.h>
 #include "thpool.h"
 #include "htslib/sam.h"
+#include "htslib/faidx.h"
 #include "config.h"
 #include "csp.h"
 #include "jfile.h"
@@ -15,12 +18,227 @@
 #include "mplp.h"
 #include "snp.h"
 
+/*
+* Bin Depth
+*/
+KHASH_MAP_INIT_INT(bd_cnt, uint32_t)
+KHASH_SET_INIT_STR(bd_mol)
+
+/*@abstract    Read counts of the sample groups in one genomic bin of --binDepth.
+@param hc      HashMap mapping sid to the read count of the sample group in the bin, NULL before the first read.
+@param hm      HashSet of "<sid>\t<UMI>" that have been counted in the bin, NULL before the first read or if UMI is
+               not used.
+ */
+typedef struct {
+    khash_t(bd_cnt) *hc;
+    khash_t(bd_mol) *hm;
+} bd_bin_t;
+
+static void bd_bin_clear(bd_bin_t *x) {
+    khiter_t k;
+    if (x->hm) {
+        for (k = kh_begin(x->hm); k != kh_end(x->hm); k++) {
+            if (kh_exist(x->hm, k)) { free((char*) kh_key(x->hm, k)); }
+        }
+        kh_clear(bd_mol, x->hm);
+    }
+    if (x->hc) { kh_clear(bd_cnt, x->hc); }
+}
+
+static void bd_bin_destroy(bd_bin_t *x) {
+    bd_bin_clear(x);
+    if (x->hm) { kh_destroy(bd_mol, x->hm); x->hm = NULL; }
+    if (x->hc) { kh_destroy(bd_cnt, x->hc); x->hc = NULL; }
+}
+
+/*@abstract    Read counts of the sample groups in genomic bins of --binDepth, collected from the reads passing mp_func().
+@param size    Size of the bins.
+@param nfs     Num of input files.
+@param umi     If UMI is used.
+@param pos     Start pos of the last read of each input file, @p rend if the file has no more reads of the block.
+@param rbeg    Reads starting before it are not counted, as the dense engine reads them again in the next block.
+@param rend    End pos of the block being read, HTS_POS_MAX if not in the dense engine.
+@param b0      Index of the first bin of the chrom that has not been output.
+@param nbin    Num of bins of the chrom.
+@param bins    Ring of the bins [@p b0, @p b0 + @p mbin), the bin b is stored in bins[b % mbin].
+@param mbin    Size of @p bins.
+@param ks      Buffer of the keys of bd_bin_t::hm.
+@param keys    Buffer of the sids of the bin being output.
+@param d       Pointer of thread_data, whose out_bin, nbin and nr_bin are used.
+
+@note          1. Each read is counted in the bin of its start pos, once for each UMI of each sample group in each bin.
+               2. Reads of one input file come in coordinate order in all engines, so the bins before the minimum of
+                  @p pos could not get more reads and are output, which keeps only the bins around the pileup front
+                  in memory and lets each flush only visit the finished bins.
+ */
+typedef struct {
+    int size, nfs, umi;
+    hts_pos_t *pos, rbeg, rend;
+    int64_t b0, nbin;
+    bd_bin_t *bins;
+    int64_t mbin;
+    kstring_t ks;
+    uint32_t *keys;
+    size_t mkey;
+    thread_data *d;
+} bd_counter_t;
+
+static void bd_counter_destroy(bd_counter_t *p) {
+    int64_t i;
+    if (NULL == p) { return; }
+    for (i = 0; i < p->mbin; i++) { bd_bin_destroy(p->bins + i); }
+    free(p->bins);
+    free(p->pos); free(p->keys);
+    ks_free(&p->ks);
+    free(p);
+}
+
+/*@abstract  Create the bin counter of one thread.
+@param d     Pointer of thread_data, whose out_bin has been set.
+@param nfs   Num of input files.
+@return      Pointer of bd_counter_t if success, NULL otherwise.
+ */
+static bd_counter_t* bd_counter_init(thread_data *d, int nfs) {
+    bd_counter_t *p;
+    if (NULL == (p = (bd_counter_t*) calloc(1, sizeof(bd_counter_t)))) { return NULL; }
+    p->size = d->gs->bin_depth; p->nfs = nfs; p->d = d;
+    p->umi = use_umi(d->gs) ? 1 : 0;
+    if (NULL == (p->pos = (hts_pos_t*) calloc(nfs, sizeof(hts_pos_t)))) { goto fail; }
+    return p;
+  fail:
+    bd_counter_destroy(p);
+    return NULL;
+}
+
+/*@abstract  Start counting one chrom of length @p len, dropping the counts left by the previous chrom. */
+static void bd_counter_chrom(bd_counter_t *p, hts_pos_t len) {
+    int64_t i;
+    for (i = 0; i < p->mbin; i++) { bd_bin_clear(p->bins + i); }
+    for (i = 0; i < p->nfs; i++) { p->pos[i] = 0; }
+    p->rbeg = 0; p->rend = HTS_POS_MAX; p->b0 = 0;
+    p->nbin = (len + p->size - 1) / p->size;
+}
+
+/*@abstract  Start counting the block [@p beg, @p end) of the dense engine, whose files are read one by one. */
+static void bd_counter_block(bd_counter_t *p, hts_pos_t beg, hts_pos_t end) {
+    int i;
+    for (i = 0; i < p->nfs; i++) { p->pos[i] = beg; }
+    p->rbeg = beg; p->rend = end;
+}
+
+/*@abstract  Get the bin @p bin (>= p->b0) from the ring, which is enlarged if needed.
+@return      Pointer of bd_bin_t if success, NULL otherwise.
+ */
+static bd_bin_t* bd_counter_bin(bd_counter_t *p, int64_t bin) {
+    bd_bin_t *a;
+    int64_t m, b;
+    if (bin - p->b0 >= p->mbin) {
+        for (m = p->mbin ? p->mbin << 1 : 16; bin - p->b0 >= m; m <<= 1);
+        if (NULL == (a = (bd_bin_t*) calloc(m, sizeof(bd_bin_t)))) { return NULL; }
+        for (b = p->b0; b < p->b0 + p->mbin; b++) { a[b % m] = p->bins[b % p->mbin]; }
+        free(p->bins);
+        p->bins = a; p->mbin = m;
+    }
+    return p->bins + bin % p->mbin;
+}
+
+static int cmp_bd_key(const void *x, const void *y) {
+    uint32_t a = *((const uint32_t*) x), b = *((const uint32_t*) y);
+    return a < b ? -1 : a > b;
+}
+
+/*@abstract  Output the bins [p->b0, @p upto) of the chrom, including empty ones, and remove their counts.
+@return      0 if success, -1 otherwise.
+ */
+static int bd_counter_flush(bd_counter_t *p, int64_t upto) {
+    thread_data *d = p->d;
+    bd_bin_t *x;
+    uint32_t *t;
+    khiter_t k;
+    size_t i, n;
+    int64_t b;
+    if (upto > p->nbin) { upto = p->nbin; }
+    if (upto <= p->b0) { return 0; }
+    for (b = p->b0; b < upto; b++) {
+        x = b - p->b0 < p->mbin ? p->bins + b % p->mbin : NULL;   // bins beyond the ring have no reads.
+        if (x && x->hc && kh_size(x->hc)) {
+            if (kh_size(x->hc) > p->mkey) {
+                p->mkey = kh_size(x->hc);
+                kroundup32(p->mkey);
+                if (NULL == (t = (uint32_t*) realloc(p->keys, p->mkey * sizeof(uint32_t)))) { return -1; }
+                p->keys = t;
+            }
+            for (n = 0, k = kh_begin(x->hc); k != kh_end(x->hc); k++) {
+                if (kh_exist(x->hc, k)) { p->keys[n++] = kh_key(x->hc, k); }
+            }
+            if (n > 1) { qsort(p->keys, n, sizeof(uint32_t), cmp_bd_key); }
+            for (i = 0; i < n; i++) {
+                k = kh_get(bd_cnt, x->hc, p->keys[i]);
+                jf_printf(d->out_bin, "%u\t%u\n", p->keys[i] + 1, kh_val(x->hc, k));
+            }
+            d->nr_bin += n;
+        }
+        if (x) { bd_bin_clear(x); }
+        jf_putc('\n', d->out_bin);
+    }
+    d->nbin += upto - p->b0;
+    p->b0 = upto;
+    return 0;
+}
+
+/*@abstract  Count one read passing mp_func() and output the bins that are finished.
+@param p     Pointer of bd_counter_t.
+@param b     The read, NULL if the input file has no more reads of the chrom or of the block of the dense engine.
+@param fid   Index of the input file.
+@param gs    Pointer of global_settings structure.
+@return      0 if success, -1 otherwise.
+ */
+static int bd_counter_add(bd_counter_t *p, bam1_t *b, int fid, global_settings *gs) {
+    csp_map_bi_iter k;
+    khiter_t kc;
+    bd_bin_t *x;
+    hts_pos_t m;
+    int64_t bin;
+    char *umi;
+    int i, r, sid;
+    if (NULL == b) { p->pos[fid] = p->rend; }
+    else if ((p->pos[fid] = b->core.pos) >= p->rbeg && (bin = b->core.pos / p->size) < p->nbin && bin >= p->b0) {
+        if (use_barcodes(gs)) {
+            if ((k = csp_map_bi_get(gs->hbc, get_bam_aux_str(b, gs->cell_tag))) == csp_map_bi_end(gs->hbc)) { return 0; }
+            sid = csp_map_bi_val(gs->hbc, k);
+        } else { sid = fid; }
+        if (NULL == (x = bd_counter_bin(p, bin))) { return -1; }
+        if (NULL == x->hc && NULL == (x->hc = kh_init(bd_cnt))) { return -1; }
+        if (p->umi && NULL != (umi = get_bam_aux_str(b, gs->umi_tag))) {
+            if (NULL == x->hm && NULL == (x->hm = kh_init(bd_mol))) { return -1; }
+            ks_clear(&p->ks); kputw(sid, &p->ks); kputc('\t', &p->ks); kputs(umi, &p->ks);
+            kc = kh_put(bd_mol, x->hm, ks_str(&p->ks), &r);
+            if (r < 0) { return -1; }
+            else if (r > 0) {
+                if (NULL == (kh_key(x->hm, kc) = strdup(ks_str(&p->ks)))) { kh_del(bd_mol, x->hm, kc); return -1; }
+            } else { bin = -1; }        // the molecule has been counted in this bin.
+        }
+        if (bin >= 0) {
+            kc = kh_put(bd_cnt, x->hc, (uint32_t) sid, &r);
+            if (r < 0) { return -1; }
+            else if (r > 0) { kh_val(x->hc, kc) = 0; }
+            kh_val(x->hc, kc)++;
+        }
+    }
+    if (p->pos[fid] / p->size <= p->b0) { return 0; }
+    for (m = p->pos[0], i = 1; i < p->nfs; i++) { if (p->pos[i] < m) { m = p->pos[i]; } }
+    return bd_counter_flush(p, m / p->size);
+}
+
 /* auxiliary data used by @func mp_func. */
 typedef struct {
     htsFile *fp;
     //sam_hdr_t *hdr;
     hts_itr_t *itr;
     global_settings *gs;
+    int cid;        // index of the chrom being pileup-ed in gs->chroms.
+    int fid;        // index of the input file.
+    bd_counter_t *bd;   // bin counter of --binDepth shared by the input files of the thread, NULL if not used.
 } mp_aux_t;
 
 /*@return   Pointer to mp_aux_t structure if success, NULL otherwise. */
@@ -40,13 +258,21 @@ static inline void mp_aux_reset(mp_aux_t *p) { }
 @param b     Pointer to bam1_t structure.
 @return      0 on success, -1 on end, < -1 on non-recoverable errors. refer to htslib/sam.h @func bam_plp_init.
 
-@note        This function refers to @func mplp_func in samtools/bam_plcmd.c.   
+@note        1. This function refers to @func mplp_func in samtools/bam_plcmd.c.   
+             2. The tid of each read is replaced by the chrom index @p cid, which is the same for all input 
+                files, so that bam_mplp_auto() could merge reads from files whose headers have different tids.
+             3. Reads without cell/UMI tags or from barcodes not in the input list are rejected here, before 
+                being pushed into the pileup buffer, rather than at every position they cover.
+             4. With --binDepth, the reads passing the filters are also counted in bins here, which is shared by
+                all engines, so the bin depth needs no more pass over the input files.
 */
 static int mp_func(void *data, bam1_t *b) {
     int ret;
     mp_aux_t *dat = (mp_aux_t*) data;
     global_settings *gs = dat->gs;
     bam1_core_t *c;
+    char *cb;
+    if (NULL == dat->itr) { ret = -1; goto end; }     // the chrom is not in the input file, refer to csp_pileup().
     do {
         if ((ret = sam_itr_next(dat->fp, dat->itr, b)) < 0) { break; }
         c = &(b->core);
@@ -56,11 +282,33 @@ static int mp_func(void *data, bam1_t *b) {
         if (gs->rflag_filter && gs->rflag_filter & c->flag ) { continue; }
         if (gs->rflag_require && ! (gs->rflag_require & c->flag)) { continue; }
         if (gs->no_orphan && c->flag & BAM_FPAIRED && ! (c->flag & BAM_FPROPER_PAIR)) { continue; }
+        if (use_barcodes(gs)) {
+            if (NULL == (cb = get_bam_aux_str(b, gs->cell_tag))) { continue; }
+            if (gs->hbc && ! csp_is_valid_barcode(gs, cb)) { continue; }
+        }
+        if (use_umi(gs) && NULL == get_bam_aux_str(b, gs->umi_tag)) { continue; }
+        c->tid = dat->cid;
         break;
     } while (1);
+  end:
+    if (dat->bd && ret >= -1 && bd_counter_add(dat->bd, ret >= 0 ? b : NULL, dat->fid, gs) < 0) { return -2; }
     return ret;
 }
 
+/*@abstract  Constructor of the bam_mplp_t, called once when a read enters the pileup buffer.
+@param data  Pointer to auxiliary data.
+@param b     Pointer to bam1_t structure.
+@param cd    Pointer of the client data of the read, set to the num of aligned bases of the read.
+@return      0.
+
+@note        The read covers each pos of its span, so computing the num of aligned bases here rather than in
+             pileup_read() saves walking the CIGAR at every pos, which is quadratic for long reads.
+ */
+static int mp_cd_init(void *data, const bam1_t *b, bam_pileup_cd *cd) {
+    cd->i = csp_bam_laln(b);
+    return 0;
+}
+
 /*@abstract  Pileup one read.
 @param pos   Pos of the reference sequence. 0-based.
 @param bp    Pointer of bam_pileup1_t containing pileup-ed results.
@@ -81,21 +329,13 @@ static int pileup_read(hts_pos_t pos, const bam_pileup1_t *bp, csp_pileup_t *p,
     if (use_umi(gs) && NULL == (p->umi = get_bam_aux_str(p->b, gs->umi_tag))) { return 1; }
     if (use_barcodes(gs) && NULL == (p->cb = get_bam_aux_str(p->b, gs->cell_tag))) { return 1; }
     bam1_core_t *c = &(p->b->core);
-    uint32_t *cigar = bam_get_cigar(p->b);
-    int k, op, l;  
-    uint32_t laln;
     assert(c->pos <= pos);   // otherwise a bug.
     if (bp->is_del) { return 2; }
     if (bp->is_refskip) { return 2; }
-    /* processing cigar string to get number of mapped positions. */
+    /* the num of mapped positions is computed once per read by mp_cd_init(). */
     if (gs->min_len > 0) {
-        for (k = 0, laln = 0; k < c->n_cigar; k++) {
-            op = get_cigar_op(cigar[k]);
-            l = get_cigar_len(cigar[k]);
-            if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) { laln += l; }
-        }
-        if (laln < gs->min_len) { return 2; }
-        else { p->laln = laln; }
+        if (bp->cd.i < gs->min_len) { return 2; }
+        else { p->laln = (uint32_t) bp->cd.i; }
     }
     p->qpos = bp->qpos; 
     p->is_del = bp->is_del; p->is_refskip = bp->is_refskip;
@@ -106,6 +346,85 @@ static int pileup_read(hts_pos_t pos, const bam_pileup1_t *bp, csp_pileup_t *p,
     return 0;
 }
 
+/*@abstract  Reference bases of a window of one chrom, loaded from gs->refseq.
+@param fai   Pointer of faidx_t of the reference FASTA.
+@param chr   Name of the chrom being pileup-ed in the FASTA, NULL if the chrom is not in the FASTA.
+@param len   Length of the chrom.
+@param beg   0-based start pos of the window.
+@param end   0-based end pos of the window, exclusive.
+@param seq   Bases of the window.
+@param ks    Buffer holding @p chr.
+
+@note        The window is reloaded only when a pos out of it is queried. As positions are queried in ascending
+             order, each base of the chrom is read from the FASTA once.
+ */
+typedef struct {
+    faidx_t *fai;
+    const char *chr;
+    hts_pos_t len, beg, end;
+    char *seq;
+    kstring_t ks;
+} ref_win_t;
+
+#define REF_WINDOW_SIZE (1 << 20)
+
+static void ref_win_destroy(ref_win_t *p) {
+    if (NULL == p) { return; }
+    if (p->fai) { fai_destroy(p->fai); }
+    free(p->seq);
+    ks_free(&p->ks);
+    free(p);
+}
+
+static ref_win_t* ref_win_init(const char *fn) {
+    ref_win_t *p;
+    if (NULL == (p = (ref_win_t*) calloc(1, sizeof(ref_win_t)))) { return NULL; }
+    if (NULL == (p->fai = fai_load(fn))) { free(p); return NULL; }
+    return p;
+}
+
+/*@abstract  Set the chrom to be queried.
+@return      0 if the chrom is in the FASTA, 1 otherwise.
+
+@note        The "chr" prefix rules of csp_sam_hdr_name2id() are applied if @p chr is not in the FASTA.
+ */
+static int ref_win_set_chrom(ref_win_t *p, const char *chr) {
+    free(p->seq); p->seq = NULL;
+    p->beg = p->end = 0;
+    p->chr = NULL; p->len = 0;
+    ks_clear(&p->ks);
+    if (faidx_has_seq(p->fai, chr)) { kputs(chr, &p->ks); }
+    else if (0 == strncmp(chr, "chr", 3)) { kputs(chr + 3, &p->ks); }
+    else { kputs("chr", &p->ks); kputs(chr, &p->ks); }
+    if (! faidx_has_seq(p->fai, ks_str(&p->ks))) { return 1; }
+    p->chr = ks_str(&p->ks);
+    p->len = faidx_seq_len64(p->fai, p->chr);
+    return 0;
+}
+
+/*@abstract  Get the reference base of one pos.
+@return      Index of the base in 'ACGT' if success, -1 if the base is unknown (e.g. N or out of chrom), -2 if error.
+ */
+static int8_t ref_win_base(ref_win_t *p, hts_pos_t pos) {
+    hts_pos_t len;
+    int8_t i;
+    if (NULL == p->chr || pos < 0 || pos >= p->len) { return -1; }
+    if (pos < p->beg || pos >= p->end) {
+        free(p->seq);
+        p->beg = p->end = pos;
+        if (NULL == (p->seq = faidx_fetch_seq64(p->fai, p->chr, pos, pos + REF_WINDOW_SIZE - 1, &len)) || len <= 0) { return -2; }
+        p->end = pos + len;
+    }
+    i = seq_nt16_char2int(toupper(p->seq[pos - p->beg]));
+    return i < 4 ? i : -1;
+}
+
+/*@abstract  Set the alleles of the mplp from a given SNP, -1 if missing in the SNP list, same as fetch_snp(). */
+static inline void known_set_allele(const csp_snp_t *snp, csp_mplp_t *mplp) {
+    mplp->ref_idx = snp->ref ? seq_nt16_char2int(snp->ref) : -1;
+    mplp->alt_idx = snp->alt ? seq_nt16_char2int(snp->alt) : -1;
+}
+
 /*@abstract    Pileup One SNP.
 @param pos     Pos of pileup-ed snp.
 @param mp_n    Pointer of array containing numbers of bam_pileup1_t* pileup-ed from each file.
@@ -113,16 +432,22 @@ static int pileup_read(hts_pos_t pos, const bam_pileup1_t *bp, csp_pileup_t *p,
 @param nfs     Size of @p mp_nplp and @p mp_plp.
 @param pileup  Pointer of csp_pileup_t structure.
 @param mplp    Pointer of csp_mplp_t structure.
+@param rw      Pointer of ref_win_t structure, NULL if no reference FASTA.
+@param snp     Pointer of the given SNP at @p pos in the combined mode, NULL if not a given SNP.
 @param gs      Pointer of global_settings structure.
 @return        0 if success, -1 if error, 1 if pileup failure without error.
 
 @note          1. This function is mainly called by csp_pileup_core(). Refer to csp_pileup_core() for notes.
                2. The statistics result of all pileuped reads for one SNP is stored in the csp_mplp_t after calling this function.
+               3. The reference base is only looked up for positions passing --minCOUNT.
+               4. No filters are applied to a given SNP, whose alleles are taken from the SNP list if exist.
 */
-static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, int nfs, csp_pileup_t *pileup, csp_mplp_t *mplp, global_settings *gs) 
+static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, int nfs, csp_pileup_t *pileup, csp_mplp_t *mplp, 
+                      ref_win_t *rw, const csp_snp_t *snp, global_settings *gs) 
 {
     const bam_pileup1_t *bp = NULL;
-    int i, j, r, ret, st, state = -1;
+    csp_plp_t *plp = NULL;
+    int i, j, ret, st, state = -1;
     size_t npushed = 0;
     #if DEBUG
         size_t npileup = 0;
@@ -136,11 +461,9 @@ static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, in
                 npileup++;
             #endif
             if (0 == (st = pileup_read(pos, bp, pileup, gs))) { // no need to reset pileup as the values in it will be immediately overwritten.
-                if (use_barcodes(gs)) { r = csp_mplp_push(pileup, mplp, -1, gs); }
-                else if (use_sid(gs)) { r = csp_mplp_push(pileup, mplp, i, gs); }
-                else { state = -1; goto fail; }
-                if (r < 0) { state = -1; goto fail; }  // else if r == 1: pileuped barcode is not in the input barcode list.
-                else if (r == 0) { npushed++; }
+                if (NULL == (plp = csp_mplp_get_plp(mplp, pileup->cb, i, gs))) { continue; } // barcode is not in the input barcode list.
+                if (csp_mplp_buf_push(mplp, plp, use_umi(gs) ? pileup->umi : NULL, 0, pileup->base, pileup->qual, gs) < 0) { state = -1; goto fail; }
+                npushed++;
             } else if (st < 0) { state = -1; goto fail; }
         }
     }
@@ -148,8 +471,15 @@ static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, in
         fprintf(stderr, "[D::%s] before mplp statistics: npileup = %ld; npushed = %ld; the mplp is:\n", __func__, npileup, npushed);
         csp_mplp_print_(stderr, mplp, "\t");
     #endif
-    if (npushed < gs->min_count) { state = 1; goto fail; }
-    if ((ret = csp_mplp_stat(mplp, gs)) != 0) { state = (ret > 0) ? 1 : -1; goto fail; }
+    if (snp) { known_set_allele(snp, mplp); }
+    else if (npushed < gs->min_count) { state = 1; goto fail; }
+    if (rw && mplp->ref_idx < 0 && (mplp->ref_idx = ref_win_base(rw, pos)) < -1) {
+        fprintf(stderr, "[E::%s] failed to fetch ref base of %s:%ld\n", __func__, rw->chr, (long) pos + 1);
+        state = -1; goto fail;
+    }
+    if (NULL == snp && csp_mplp_precheck(mplp->rbc, mplp->ref_idx, gs)) { state = 1; goto fail; }
+    if (csp_mplp_buf_flush(mplp, gs) < 0) { state = -1; goto fail; }
+    if ((ret = snp ? csp_mplp_stat_all(mplp, gs) : csp_mplp_stat(mplp, gs)) != 0) { state = (ret > 0) ? 1 : -1; goto fail; }
     #if DEBUG
         fprintf(stderr, "[D::%s] after mplp statistics: the mplp is:\n", __func__);
         csp_mplp_print_(stderr, mplp, "\t");
@@ -159,6 +489,772 @@ static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, in
     return state;
 }
 
+/*@abstract    Output the statistics of one SNP to the tmp mtx and vcf files of the thread.
+@param d       Pointer of thread_data structure.
+@param chr     Name of the chrom.
+@param pos     Pos of the SNP, 0-based.
+@param mplp    Pointer of csp_mplp_t structure that has passed csp_mplp_stat().
+@param s       Pointer of kstring_t used as buffer, cleared when return.
+@return        0 if success, -1 otherwise.
+ */
+static int pileup_output_snp(thread_data *d, const char *chr, hts_pos_t pos, csp_mplp_t *mplp, kstring_t *s) {
+    d->ns++;
+    if (csp_mplp_to_mtx(mplp, d->out_mtx, d->csc, d->nr, d->ns) < 0) { return -1; }
+    if (d->gs->ngroup > 0 && csp_mplp_to_grp(mplp, d->out_grp, d->nr_grp) < 0) { return -1; }
+    return csp_vcf_mplp(d, chr, pos, mplp, s);
+}
+
+/*
+ * Given SNPs of the combined mode (--discover).
+ * The SNPs of each chrom are sorted by pos, see index_known_snps() in cellsnp.c, so that they are visited by a cursor
+ * as the pileup-ed positions ascend. They are output to the thread data itself and other sites to its @p disc.
+ */
+
+/*@abstract  Thread data that the discovered sites are output to. */
+#define pileup_site_td(d) ((d)->disc ? (d)->disc : (d))
+
+/*@abstract  Cursor of the given SNPs of one chrom.
+@param a     Array of the SNPs, sorted by pos, at most one for each pos.
+@param n     Size of @p a.
+@param i     Index of the next SNP to be visited.
+ */
+typedef struct {
+    csp_snp_t **a;
+    size_t n, i;
+} known_cur_t;
+
+/*@abstract  Set the cursor to the SNPs of one chrom.
+@param kc    Pointer of known_cur_t.
+@param cid   Index of the chrom in gs->chroms.
+@param gs    Pointer of global_settings structure.
+ */
+static void known_cur_set(known_cur_t *kc, int cid, global_settings *gs) {
+    kc->i = 0;
+    if (gs->kn_off) {
+        kc->a = &csp_snplist_A(gs->pl, gs->kn_off[cid]);
+        kc->n = gs->kn_off[cid + 1] - gs->kn_off[cid];
+    } else { kc->a = NULL; kc->n = 0; }
+}
+
+/*@abstract  Output the given SNPs before a pos, which are not covered by any pileup-ed read.
+@param kc    Pointer of known_cur_t.
+@param pos   The pos, 0-based.
+@param chr   Name of the chrom.
+@param mplp  Pointer of csp_mplp_t structure, which has been reset.
+@param d     Pointer of thread_data structure.
+@param s     Pointer of kstring_t used as buffer.
+@return      0 if success, -1 otherwise.
+
+@note        The SNPs are output with zero counts, as the given SNPs are output whatever the filters.
+ */
+static int known_flush(known_cur_t *kc, hts_pos_t pos, const char *chr, csp_mplp_t *mplp, thread_data *d, kstring_t *s) {
+    csp_snp_t *snp;
+    for (; kc->i < kc->n && (snp = kc->a[kc->i])->pos < pos; kc->i++) {
+        known_set_allele(snp, mplp);
+        if (csp_mplp_stat_all(mplp, d->gs) < 0) { return -1; }
+        if (pileup_output_snp(d, chr, snp->pos, mplp, s) < 0) { return -1; }
+        csp_mplp_reset(mplp);
+    }
+    return 0;
+}
+
+/*@abstract  Get the given SNP at a pos, after outputting the uncovered ones before it.
+@param snp   Pointer of the SNP at @p pos, set to NULL if @p pos is not a given SNP.
+@return      0 if success, -1 otherwise.
+@note        Refer to known_flush() for other parameters.
+ */
+static int known_at(known_cur_t *kc, hts_pos_t pos, const char *chr, csp_mplp_t *mplp, thread_data *d, kstring_t *s, csp_snp_t **snp) {
+    *snp = NULL;
+    if (kc->i >= kc->n) { return 0; }
+    if (known_flush(kc, pos, chr, mplp, d, s) < 0) { return -1; }
+    if (kc->i < kc->n && kc->a[kc->i]->pos == pos) { *snp = kc->a[kc->i++]; }
+    return 0;
+}
+
+/*
+ * Streaming pileup engine.
+ * Each read is visited once: its aligned bases are appended to a sliding window of positions, and a position
+ * is flushed to statistics and output as soon as the next read starts after it, as reads are sorted by pos.
+ */
+
+/*@abstract  UMI of one read in the window, shared by all bases of the read.
+@param umi   The UMI string.
+@param m     Size of memory allocated for @p umi.
+@param nref  Num of bases in the window still referring to this UMI.
+ */
+typedef struct {
+    char *umi;
+    size_t m;
+    int nref;
+} ps_umi_t;
+
+/*@abstract  One aligned base of one read waiting in the window.
+@param plp   The csp_plp_t of the sample group of the read.
+@param u     UMI of the read, NULL if UMI is not used.
+@param fid   Index of the input file of the read.
+@param base  The base, a 4-bit integer returned by bam_seqi().
+@param qual  The qual of the base.
+ */
+typedef struct {
+    csp_plp_t *plp;
+    ps_umi_t *u;
+    int fid;
+    int8_t base, qual;
+} ps_entry_t;
+
+/*@abstract  One position of the window.
+@param a, n, m  Array of bases, num of bases and size of the array.
+@param covered  If any read covers the position, including deletions and ref-skips. Only used when min_count <= 0.
+@param unsorted If the bases of @p a are not in the order of the input files, as reads of several files cover it.
+@param dep      Num of reads covering the position for each input file. Only used when max depth is set.
+ */
+typedef struct {
+    ps_entry_t *a;
+    int n, m;
+    int covered;
+    int unsorted;
+    int *dep;
+} ps_slot_t;
+
+/*@abstract  The streaming pileup engine of one thread.
+@param slot   Ring buffer of positions, size @p m (power of 2); position p is in slot[p & (m - 1)].
+@param beg    The first position in the window that has not been flushed.
+@param end    One past the last position in the window that has data.
+@param fu     Free list of ps_umi_t.
+@param tmp    Buffer of size @p mtmp used to sort the bases of one position by ps_slot_sort().
+@param b      The next read of each input file.
+@param has    If the next read of each input file exists.
+@param nfs    Num of input files.
+@param rw     Pointer of ref_win_t of the reference FASTA, NULL if no reference.
+@param rc     Pointer of csp_regchr_t of targets of the chrom, NULL if no targets.
+@param ri     Hint of csp_regchr_cover() for @p rc.
+@param kc     Pointer of known_cur_t of the given SNPs of the chrom, NULL if not in the combined mode.
+ */
+typedef struct {
+    ps_slot_t *slot;
+    int m;
+    hts_pos_t beg, end;
+    ps_umi_t **fu;
+    int nfu, mfu;
+    ps_entry_t *tmp;
+    int mtmp;
+    bam1_t **b;
+    int *has;
+    int nfs;
+    ref_win_t *rw;
+    const csp_regchr_t *rc;
+    int ri;
+    known_cur_t *kc;
+} ps_engine_t;
+
+static void ps_engine_destroy(ps_engine_t *p) {
+    int i;
+    if (NULL == p) { return; }
+    if (p->slot) {
+        for (i = 0; i < p->m; i++) { free(p->slot[i].a); free(p->slot[i].dep); }
+        free(p->slot);
+    }
+    if (p->fu) {
+        for (i = 0; i < p->nfu; i++) { free(p->fu[i]->umi); free(p->fu[i]); }
+        free(p->fu);
+    }
+    free(p->tmp);
+    if (p->b) {
+        for (i = 0; i < p->nfs; i++) { if (p->b[i]) bam_destroy1(p->b[i]); }
+        free(p->b);
+    }
+    free(p->has);
+    free(p);
+}
+
+static ps_engine_t* ps_engine_init(int nfs) {
+#define PS_WINDOW_SIZE 1024
+    ps_engine_t *p;
+    int i;
+    if (NULL == (p = (ps_engine_t*) calloc(1, sizeof(ps_engine_t)))) { return NULL; }
+    p->nfs = nfs;
+    p->m = PS_WINDOW_SIZE;
+    if (NULL == (p->slot = (ps_slot_t*) calloc(p->m, sizeof(ps_slot_t)))) { goto fail; }
+    if (NULL == (p->b = (bam1_t**) calloc(nfs, sizeof(bam1_t*)))) { goto fail; }
+    if (NULL == (p->has = (int*) calloc(nfs, sizeof(int)))) { goto fail; }
+    for (i = 0; i < nfs; i++) { if (NULL == (p->b[i] = bam_init1())) { goto fail; } }
+    p->beg = p->end = 0;
+    return p;
+  fail:
+    ps_engine_destroy(p);
+    return NULL;
+#undef PS_WINDOW_SIZE
+}
+
+/* make the window big enough to hold positions in [p->beg, end). */
+static int ps_engine_reserve(ps_engine_t *p, hts_pos_t end) {
+    ps_slot_t *slot;
+    hts_pos_t i;
+    int m;
+    if (end - p->beg <= p->m) { return 0; }
+    for (m = p->m; m < end - p->beg; m <<= 1) {
+        if (m >= (1 << 30)) { return -1; }
+    }
+    if (NULL == (slot = (ps_slot_t*) calloc(m, sizeof(ps_slot_t)))) { return -1; }
+    for (i = p->beg; i < p->beg + p->m; i++) {   // slots out of [beg, end) are empty but may hold memory.
+        slot[i & (m - 1)] = p->slot[i & (p->m - 1)];
+    }
+    free(p->slot);
+    p->slot = slot; p->m = m;
+    return 0;
+}
+
+static inline ps_umi_t* ps_umi_get(ps_engine_t *p, const char *umi) {
+    ps_umi_t *u;
+    size_t l = strlen(umi) + 1;
+    char *t;
+    if (p->nfu > 0) { u = p->fu[--p->nfu]; }
+    else if (NULL == (u = (ps_umi_t*) calloc(1, sizeof(ps_umi_t)))) { return NULL; }
+    if (l > u->m) {
+        if (NULL == (t = (char*) realloc(u->umi, l))) { free(u->umi); free(u); return NULL; }
+        u->umi = t; u->m = l;
+    }
+    memcpy(u->umi, umi, l);
+    u->nref = 0;
+    return u;
+}
+
+static inline int ps_umi_put(ps_engine_t *p, ps_umi_t *u) {
+    ps_umi_t **t;
+    if (p->nfu >= p->mfu) {
+        p->mfu = p->mfu ? p->mfu << 1 : 64;
+        if (NULL == (t = (ps_umi_t**) realloc(p->fu, p->mfu * sizeof(ps_umi_t*)))) { free(u->umi); free(u); return -1; }
+        p->fu = t;
+    }
+    p->fu[p->nfu++] = u;
+    return 0;
+}
+
+static inline int ps_slot_push(ps_slot_t *t, csp_plp_t *plp, ps_umi_t *u, int fid, int8_t base, int8_t qual) {
+    ps_entry_t *e;
+    if (t->n >= t->m) {
+        t->m = t->m ? t->m << 1 : 16;
+        if (NULL == (e = (ps_entry_t*) realloc(t->a, t->m * sizeof(ps_entry_t)))) { return -1; }
+        t->a = e;
+    }
+    if (t->n > 0 && t->a[t->n - 1].fid > fid) { t->unsorted = 1; }
+    e = t->a + t->n++;
+    e->plp = plp; e->u = u; e->fid = fid; e->base = base; e->qual = qual;
+    return 0;
+}
+
+/*@abstract  Sort the bases of one position by the input file, keeping the order of the reads of each file.
+@param p     Pointer of ps_engine_t, whose buffer @p tmp is used.
+@param t     Pointer of ps_slot_t of the position.
+@return      0 if success, -1 otherwise.
+
+@note        It is a bottom-up merge sort, as the bases of each file are already in order.
+ */
+static int ps_slot_sort(ps_engine_t *p, ps_slot_t *t) {
+    ps_entry_t *a = t->a, *b, *x;
+    int w, i, j, k, l, m, r;
+    if (t->n > p->mtmp) {
+        if (NULL == (x = (ps_entry_t*) realloc(p->tmp, t->m * sizeof(ps_entry_t)))) { return -1; }
+        p->tmp = x; p->mtmp = t->m;
+    }
+    b = p->tmp;
+    for (w = 1; w < t->n; w <<= 1) {
+        for (l = 0; l < t->n; l += w << 1) {
+            m = l + w < t->n ? l + w : t->n;
+            r = m + w < t->n ? m + w : t->n;
+            for (i = l, j = m, k = l; k < r; k++) { b[k] = i < m && (j >= r || a[i].fid <= a[j].fid) ? a[i++] : a[j++]; }
+        }
+        x = a; a = b; b = x;
+    }
+    if (a != t->a) { memcpy(t->a, a, t->n * sizeof(ps_entry_t)); }
+    t->unsorted = 0;
+    return 0;
+}
+
+/*@abstract    Add one read into the window.
+@param p       Pointer of ps_engine_t.
+@param b       The read, which has passed the filters of mp_func().
+@param fid     Index of the input file of the read.
+@param mplp    Pointer of csp_mplp_t structure.
+@param gs      Pointer of global_settings structure.
+@return        0 if success, -1 otherwise.
+
+@note          The filters follow bam_mplp_auto() + pileup_read(): the max depth is checked at the start pos of
+               the read among reads of the same file, then the length of bases within alignment is checked.
+               Bases in deletions and ref-skips are never pushed, as pileup_read() rejects them.
+ */
+static int ps_engine_add(ps_engine_t *p, bam1_t *b, int fid, csp_mplp_t *mplp, global_settings *gs) {
+    bam1_core_t *c = &(b->core);
+    uint32_t *cigar = bam_get_cigar(b);
+    uint8_t *seq = bam_get_seq(b), *qual = bam_get_qual(b);
+    csp_map_sg_iter k;
+    csp_plp_t *plp;
+    ps_umi_t *u = NULL;
+    ps_slot_t *t;
+    hts_pos_t rpos, end, i;
+    int32_t qpos;
+    int j, op, l, mask;
+    end = bam_endpos(b);
+    if (end <= c->pos) { end = c->pos + 1; }
+    if (ps_engine_reserve(p, end) < 0) { return -1; }
+    mask = p->m - 1;
+    if (gs->plp_max_depth > 0) {
+        t = p->slot + (c->pos & mask);
+        if (t->dep && t->dep[fid] > gs->plp_max_depth) { return 0; }
+        for (i = c->pos; i < end; i++) {
+            t = p->slot + (i & mask);
+            if (NULL == t->dep && NULL == (t->dep = (int*) calloc(p->nfs, sizeof(int)))) { return -1; }
+            t->dep[fid]++;
+        }
+    }
+    if (gs->min_count <= 0) {     // positions covered only by deletions/ref-skips are also reported by bam_mplp_auto().
+        for (i = c->pos; i < end; i++) { p->slot[i & mask].covered = 1; }
+    }
+    if (end > p->end) { p->end = end; }
+    if (gs->min_len > 0 && csp_bam_laln(b) < gs->min_len) { return 0; }
+    if (use_barcodes(gs)) {
+        if ((k = csp_map_sg_get(mplp->hsg, get_bam_aux_str(b, gs->cell_tag))) == csp_map_sg_end(mplp->hsg)) { return 0; }
+        plp = csp_map_sg_val(mplp->hsg, k);
+    } else { plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[fid]); }
+    if (use_umi(gs) && NULL == (u = ps_umi_get(p, get_bam_aux_str(b, gs->umi_tag)))) { return -1; }
+    for (j = 0, rpos = c->pos, qpos = 0; j < c->n_cigar; j++) {
+        op = get_cigar_op(cigar[j]);
+        l = get_cigar_len(cigar[j]);
+        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+            for (i = 0; i < l; i++, rpos++, qpos++) {
+                if (qpos < c->l_qseq) { 
+                    if (ps_slot_push(p->slot + (rpos & mask), plp, u, fid, bam_seqi(seq, qpos), qual[qpos]) < 0) { return -1; }
+                } else if (ps_slot_push(p->slot + (rpos & mask), plp, u, fid, seq_nt16_char2idx('N'), 0) < 0) { return -1; }
+                if (u) { u->nref++; }
+            }
+        } else if (op == BAM_CDEL || op == BAM_CREF_SKIP) { rpos += l; }
+        else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) { qpos += l; }
+    }
+    if (u && 0 == u->nref && ps_umi_put(p, u) < 0) { return -1; }
+    return 0;
+}
+
+/*@abstract    Flush positions before @p upto from the window.
+@param p       Pointer of ps_engine_t.
+@param upto    Positions in [p->beg, upto) are flushed.
+@param chr     Name of the chrom.
+@param mplp    Pointer of csp_mplp_t structure.
+@param d       Pointer of thread_data structure.
+@param s       Pointer of kstring_t used as buffer.
+@return        Num of SNPs passing filters if success, -1 otherwise.
+
+@note          Bases of one position are pushed file by file and read by read within each file, the same order as
+               pileup_snp() with bam_mplp_auto(), so that the UMI deduplication and the genotyping give the same results.
+               The bases are sorted by the file only if reads of several files are interleaved, see ps_slot_sort().
+               Positions failing csp_mplp_precheck() by the raw base counts are dropped before any base is pushed.
+               The given SNPs of the combined mode are not filtered. With a per-cell cap, the bases go through
+               csp_mplp_buf_push() so that cells are sampled the same way as the other engines.
+ */
+static long ps_engine_flush(ps_engine_t *p, hts_pos_t upto, const char *chr, csp_mplp_t *mplp, thread_data *d, kstring_t *s) {
+    global_settings *gs = d->gs;
+    csp_snp_t *snp = NULL;
+    ps_slot_t *t;
+    ps_entry_t *e;
+    hts_pos_t pos, last;
+    long nsnp = 0;
+    int i, ret, mask = p->m - 1;
+    last = upto < p->end ? upto : p->end;
+    for (pos = p->beg; pos < last; pos++) {
+        t = p->slot + (pos & mask);
+        if (t->n <= 0 && ! t->covered) { goto next; }
+        if (p->kc && known_at(p->kc, pos, chr, mplp, d, s, &snp) < 0) { return -1; }
+        if (NULL == snp) {
+            if (t->n < gs->min_count) { goto next; }
+            if (p->rc && ! csp_regchr_cover(p->rc, pos, &p->ri)) { goto next; }
+        }
+        if (t->unsorted && ps_slot_sort(p, t) < 0) { return -1; }
+        if (gs->cell_cap > 0) {       // sample the reads of each cell in the same order as they are pushed below.
+            for (i = 0; i < t->n; i++) {
+                e = t->a + i;
+                if (csp_mplp_buf_push(mplp, e->plp, e->u ? e->u->umi : NULL, 0, e->base, e->qual, gs) < 0) { return -1; }
+            }
+        } else {
+            for (i = 0; i < t->n; i++) { mplp->rbc[seq_nt16_idx2int(t->a[i].base)]++; }
+        }
+        if (snp) { known_set_allele(snp, mplp); }
+        else { mplp->ref_idx = -1; mplp->alt_idx = -1; }
+        if (p->rw && mplp->ref_idx < 0 && (mplp->ref_idx = ref_win_base(p->rw, pos)) < -1) {
+            fprintf(stderr, "[E::%s] failed to fetch ref base of %s:%ld\n", __func__, chr, (long) pos + 1);
+            return -1;
+        }
+        if (NULL == snp && csp_mplp_precheck(mplp->rbc, mplp->ref_idx, gs)) { csp_mplp_reset(mplp); goto next; }
+        if (gs->cell_cap > 0) {
+            if (csp_mplp_buf_flush(mplp, gs) < 0) { return -1; }
+        } else {
+            for (i = 0; i < t->n; i++) {
+                e = t->a + i;
+                if (csp_plp_push(e->plp, mplp, e->u ? e->u->umi : NULL, e->base, e->qual, gs) < 0) { return -1; }
+            }
+        }
+        if ((ret = snp ? csp_mplp_stat_all(mplp, gs) : csp_mplp_stat(mplp, gs)) < 0) { return -1; }
+        else if (0 == ret) {
+            if (pileup_output_snp(snp ? d : pileup_site_td(d), chr, pos, mplp, s) < 0) { return -1; }
+            nsnp++;
+        }
+        csp_mplp_reset(mplp);
+      next:
+        for (i = 0; i < t->n; i++) {
+            e = t->a + i;
+            if (e->u && 0 == --e->u->nref && ps_umi_put(p, e->u) < 0) { return -1; }
+        }
+        t->n = 0; t->covered = 0; t->unsorted = 0;
+        if (t->dep) { memset(t->dep, 0, p->nfs * sizeof(int)); }
+    }
+    p->beg = upto;
+    if (p->end < upto) { p->end = upto; }
+    return nsnp;
+}
+
+/*@abstract    Pileup one chrom with the streaming engine.
+@param p       Pointer of ps_engine_t.
+@param data    Array of mp_aux_t of all input files, whose iterators have been set to the chrom.
+@param chr     Name of the chrom.
+@param mplp    Pointer of csp_mplp_t structure.
+@param d       Pointer of thread_data structure.
+@param s       Pointer of kstring_t used as buffer.
+@return        Num of SNPs passing filters if success, -1 otherwise.
+
+@note          Reads of all input files are merged by their start pos; positions before the start pos of the
+               next read could not be covered by any remaining reads and are flushed.
+ */
+static long pileup_chrom_stream(ps_engine_t *p, mp_aux_t **data, const char *chr, csp_mplp_t *mplp, thread_data *d, kstring_t *s) {
+    hts_pos_t pos;
+    long nsnp = 0, r;
+    int i, f, ret, started = 0;
+    for (i = 0; i < p->nfs; i++) {
+        if ((ret = mp_func(data[i], p->b[i])) < -1) { return -1; }
+        p->has[i] = ret >= 0;
+    }
+    while (1) {
+        for (i = 0, f = -1; i < p->nfs; i++) {
+            if (p->has[i] && (f < 0 || p->b[i]->core.pos < p->b[f]->core.pos)) { f = i; }
+        }
+        if (f < 0) { break; }
+        pos = p->b[f]->core.pos;
+        if (! started) { p->beg = p->end = pos; started = 1; }
+        else if (pos > p->beg) {
+            if ((r = ps_engine_flush(p, pos, chr, mplp, d, s)) < 0) { return -1; }
+            nsnp += r;
+        }
+        if (ps_engine_add(p, p->b[f], f, mplp, d->gs) < 0) { return -1; }
+        if ((ret = mp_func(data[f], p->b[f])) < -1) { return -1; }
+        p->has[f] = ret >= 0;
+    }
+    if (started) {
+        if ((r = ps_engine_flush(p, p->end, chr, mplp, d, s)) < 0) { return -1; }
+        nsnp += r;
+    }
+    return nsnp;
+}
+
+/*
+* Dense Engine
+*/
+KHASH_MAP_INIT_STR(ds_mol, int)
+
+/*@abstract    The dense engine of Mode 2 for small contigs, e.g. chrM.
+@param cnt     Counters of each base of each sample group in each pos of the block, cnt[(off * nsg + sid) * 5 + base].
+@param agg     Aggregate counters of each base in each pos of the block, agg[off * 5 + base].
+@param cov     If any read covers the pos of the block, including deletions and ref-skips. Only used when min_count <= 0.
+@param m       Num of positions of one block, a multiple of 64.
+@param nsg     Num of sample groups.
+@param hm      HashMap mapping "<sid>\t<UMI>" to the index of the molecule, NULL if UMI is not used.
+@param bits    Bitsets of molecules, m bits for each, marking the positions of the block where the molecule is counted.
+@param nmol    Num of molecules.
+@param mmol    Num of molecules that @p bits could hold.
+@param ks      Buffer of the keys of @p hm.
+@param b       Buffer of reads.
+
+@note          1. The contig is processed block by block, the size of @p cnt being limited by CSP_DENSE_MAX_MEM. Reads
+                  overlapping a block are counted directly into @p cnt in one pass, without going through the pileup
+                  stack and the HashMaps of sample groups and UMIs at each pos.
+               2. Input files are read one by one and reads in coordinate order, the same order as the other engines
+                  push reads, so that with UMI the first read of each molecule is counted in each pos as csp_plp_push().
+ */
+typedef struct {
+    uint32_t *cnt;
+    size_t *agg;
+    uint8_t *cov;
+    int m, nsg;
+    khash_t(ds_mol) *hm;
+    uint64_t *bits;
+    int nmol, mmol;
+    kstring_t ks;
+    bam1_t *b;
+} ds_engine_t;
+
+static void ds_engine_reset_mol(ds_engine_t *p) {
+    khiter_t k;
+    if (p->hm) {
+        for (k = kh_begin(p->hm); k != kh_end(p->hm); k++) {
+            if (kh_exist(p->hm, k)) { free((char*) kh_key(p->hm, k)); }
+        }
+        kh_clear(ds_mol, p->hm);
+    }
+    p->nmol = 0;
+}
+
+static void ds_engine_destroy(ds_engine_t *p) {
+    if (NULL == p) { return; }
+    ds_engine_reset_mol(p);
+    if (p->hm) { kh_destroy(ds_mol, p->hm); }
+    free(p->cnt); free(p->agg); free(p->cov); free(p->bits);
+    ks_free(&p->ks);
+    if (p->b) { bam_destroy1(p->b); }
+    free(p);
+}
+
+/*@abstract  Create the dense engine.
+@param nsg   Num of sample groups.
+@param len   Max length of the contigs to be processed.
+@param umi   If UMI is used.
+@return      Pointer of ds_engine_t if success, NULL otherwise.
+ */
+static ds_engine_t* ds_engine_init(int nsg, hts_pos_t len, int umi) {
+    ds_engine_t *p;
+    size_t m;
+    if (NULL == (p = (ds_engine_t*) calloc(1, sizeof(ds_engine_t)))) { return NULL; }
+    p->nsg = nsg;
+    m = CSP_DENSE_MAX_MEM / ((size_t) nsg * 5 * sizeof(uint32_t));
+    if (m > (size_t) len) { m = len; }
+    m = (m + 63) & ~((size_t) 63);
+    p->m = m < 64 ? 64 : m;
+    if (NULL == (p->cnt = (uint32_t*) calloc((size_t) p->m * nsg * 5, sizeof(uint32_t)))) { goto fail; }
+    if (NULL == (p->agg = (size_t*) calloc((size_t) p->m * 5, sizeof(size_t)))) { goto fail; }
+    if (NULL == (p->cov = (uint8_t*) calloc(p->m, sizeof(uint8_t)))) { goto fail; }
+    if (umi && NULL == (p->hm = kh_init(ds_mol))) { goto fail; }
+    if (NULL == (p->b = bam_init1())) { goto fail; }
+    return p;
+  fail:
+    ds_engine_destroy(p);
+    return NULL;
+}
+
+/*@abstract  Count one read into the block [beg, beg + m).
+@param p     Pointer of ds_engine_t.
+@param b     Pointer of the read that has passed mp_func().
+@param beg   0-based start pos of the block.
+@param sid   Index of the sample group of the read.
+@param umi   UMI of the read, NULL if UMI is not used.
+@param gs    Pointer of global_settings structure.
+@return      0 if success, -1 otherwise.
+ */
+static int ds_engine_add(ds_engine_t *p, bam1_t *b, hts_pos_t beg, int sid, const char *umi, global_settings *gs) {
+    bam1_core_t *c = &(b->core);
+    uint32_t *cigar = bam_get_cigar(b);
+    uint8_t *seq = bam_get_seq(b);
+    uint64_t *w = NULL, *t;
+    hts_pos_t rpos, end = beg + p->m, i;
+    int32_t qpos;
+    khiter_t k;
+    int j, op, l, r, off, base, nw = p->m >> 6;
+    if (gs->min_count <= 0) {     // positions covered only by deletions/ref-skips are also reported by bam_mplp_auto().
+        for (i = c->pos < beg ? beg : c->pos, rpos = bam_endpos(b); i < rpos && i < end; i++) { p->cov[i - beg] = 1; }
+    }
+    if (gs->min_len > 0 && csp_bam_laln(b) < gs->min_len) { return 0; }
+    if (p->hm && umi) {
+        ks_clear(&p->ks); kputw(sid, &p->ks); kputc('\t', &p->ks); kputs(umi, &p->ks);
+        k = kh_put(ds_mol, p->hm, ks_str(&p->ks), &r);
+        if (r < 0) { return -1; }
+        else if (r > 0) {
+            if (NULL == (kh_key(p->hm, k) = strdup(ks_str(&p->ks)))) { kh_del(ds_mol, p->hm, k); return -1; }
+            if (p->nmol >= p->mmol) {
+                p->mmol = p->mmol ? p->mmol << 1 : 1024;
+                if (NULL == (t = (uint64_t*) realloc(p->bits, (size_t) p->mmol * nw * sizeof(uint64_t)))) { return -1; }
+                p->bits = t;
+            }
+            memset(p->bits + (size_t) p->nmol * nw, 0, nw * sizeof(uint64_t));
+            kh_val(p->hm, k) = p->nmol++;
+        }
+        w = p->bits + (size_t) kh_val(p->hm, k) * nw;
+    }
+    for (j = 0, rpos = c->pos, qpos = 0; j < c->n_cigar && rpos < end; j++) {
+        op = get_cigar_op(cigar[j]);
+        l = get_cigar_len(cigar[j]);
+        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+            for (i = 0; i < l && rpos < end; i++, rpos++, qpos++) {
+                if (rpos < beg) { continue; }
+                off = rpos - beg;
+                if (w) {
+                    if (w[off >> 6] >> (off & 63) & 1) { continue; }    // the molecule has been counted in this pos.
+                    w[off >> 6] |= (uint64_t) 1 << (off & 63);
+                }
+                base = qpos < c->l_qseq ? seq_nt16_idx2int(bam_seqi(seq, qpos)) : seq_nt16_char2int('N');
+                p->cnt[((size_t) off * p->nsg + sid) * 5 + base]++;
+                p->agg[off * 5 + base]++;
+            }
+        } else if (op == BAM_CDEL || op == BAM_CREF_SKIP) { rpos += l; }
+        else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) { qpos += l; }
+    }
+    return 0;
+}
+
+/*@abstract    Output positions of the block [beg, beg + m) passing filters and clear the counters.
+@param p       Pointer of ds_engine_t.
+@param beg     0-based start pos of the block.
+@param len     Length of the contig.
+@param chr     Name of the contig.
+@param mplp    Pointer of csp_mplp_t structure.
+@param rw      Pointer of ref_win_t, NULL if no reference FASTA.
+@param rc      Pointer of csp_regchr_t of targets of the contig, NULL if no targets.
+@param ri      Pointer of hint of csp_regchr_cover() for @p rc.
+@param d       Pointer of thread_data structure.
+@param s       Pointer of kstring_t used as buffer.
+@return        Num of SNPs passing filters if success, -1 otherwise.
+
+@note          Counters of a pos are copied into the csp_plp_t of sample groups only if the pos passes 
+               csp_mplp_precheck(), then the statistics and output are the same as the other engines.
+ */
+static long ds_engine_flush(ds_engine_t *p, hts_pos_t beg, hts_pos_t len, const char *chr, csp_mplp_t *mplp, 
+                            ref_win_t *rw, const csp_regchr_t *rc, int *ri, thread_data *d, kstring_t *s) {
+    global_settings *gs = d->gs;
+    csp_plp_t *plp;
+    uint32_t *a;
+    size_t *bc, tc;
+    hts_pos_t pos;
+    long nsnp = 0;
+    int i, j, off, ret;
+    for (off = 0, pos = beg; off < p->m && pos < len; off++, pos++) {
+        bc = p->agg + off * 5;
+        a = p->cnt + (size_t) off * p->nsg * 5;
+        tc = bc[0] + bc[1] + bc[2] + bc[3] + bc[4];
+        if (0 == tc && ! p->cov[off]) { continue; }
+        if (tc < gs->min_count) { goto next; }
+        if (rc && ! csp_regchr_cover(rc, pos, ri)) { goto next; }
+        mplp->ref_idx = -1; mplp->alt_idx = -1;
+        if (rw && (mplp->ref_idx = ref_win_base(rw, pos)) < -1) {
+            fprintf(stderr, "[E::%s] failed to fetch ref base of %s:%ld\n", __func__, chr, (long) pos + 1);
+            return -1;
+        }
+        if (csp_mplp_precheck(bc, mplp->ref_idx, gs)) { goto next; }
+        for (i = 0; i < p->nsg; i++) {
+            plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[i]);
+            for (j = 0; j < 5; j++) { plp->bc[j] = a[i * 5 + j]; }
+        }
+        mplp->pushed = 1;
+        if ((ret = csp_mplp_stat(mplp, gs)) < 0) { return -1; }
+        else if (0 == ret) {
+            if (pileup_output_snp(d, chr, pos, mplp, s) < 0) { return -1; }
+            nsnp++;
+        }
+        csp_mplp_reset(mplp);
+      next:
+        if (tc) { memset(a, 0, (size_t) p->nsg * 5 * sizeof(uint32_t)); }
+    }
+    memset(p->agg, 0, (size_t) p->m * 5 * sizeof(size_t));
+    memset(p->cov, 0, p->m * sizeof(uint8_t));
+    ds_engine_reset_mol(p);
+    return nsnp;
+}
+
+/*@abstract    Pileup one small contig with the dense engine.
+@param p       Pointer of ds_engine_t.
+@param data    Array of mp_aux_t of all input files.
+@param bfs     Array of csp_bam_fs of all input files, whose indexes are kept.
+@param cid     Index of the contig in gs->chroms.
+@param chr     Name of the contig.
+@param len     Length of the contig.
+@param mplp    Pointer of csp_mplp_t structure.
+@param rw      Pointer of ref_win_t, NULL if no reference FASTA.
+@param rc      Pointer of csp_regchr_t of targets of the contig, NULL if no targets.
+@param d       Pointer of thread_data structure.
+@param s       Pointer of kstring_t used as buffer.
+@return        Num of SNPs passing filters if success, -1 otherwise.
+ */
+static long pileup_chrom_dense(ds_engine_t *p, mp_aux_t **data, csp_bam_fs **bfs, int cid, const char *chr, hts_pos_t len,
+                               csp_mplp_t *mplp, ref_win_t *rw, const csp_regchr_t *rc, thread_data *d, kstring_t *s) {
+    global_settings *gs = d->gs;
+    csp_map_bi_iter k;
+    hts_itr_t *itr;
+    hts_pos_t beg;
+    long nsnp = 0, r;
+    int i, ret, sid, ri = 0;
+    for (beg = 0; beg < len; beg += p->m) {
+        if (data[0]->bd) { bd_counter_block(data[0]->bd, beg, beg + p->m); }
+        for (i = 0; i < d->nfs; i++) {
+            if (bfs[i]->tids[cid] < 0) { itr = NULL; }     // the contig is not in the file, mp_func() ends at once.
+            else if (NULL == (itr = sam_itr_queryi(bfs[i]->idx, bfs[i]->tids[cid], beg, beg + p->m))) { return -1; }
+            data[i]->itr = itr;
+            while ((ret = mp_func(data[i], p->b)) >= 0) {
+                if (use_barcodes(gs)) {
+                    if ((k = csp_map_bi_get(gs->hbc, get_bam_aux_str(p->b, gs->cell_tag))) == csp_map_bi_end(gs->hbc)) { continue; }
+                    sid = csp_map_bi_val(gs->hbc, k);
+                } else { sid = i; }
+                if (ds_engine_add(p, p->b, beg, sid, use_umi(gs) ? get_bam_aux_str(p->b, gs->umi_tag) : NULL, gs) < 0) { ret = -2; break; }
+            }
+            hts_itr_destroy(itr); data[i]->itr = NULL;
+            if (ret < -1) { return -1; }
+        }
+        if ((r = ds_engine_flush(p, beg, len, chr, mplp, rw, rc, &ri, d, s)) < 0) { return -1; }
+        nsnp += r;
+    }
+    return nsnp;
+}
+
+/*@abstract  Create the iterator of one chrom of one input file that only visits bins overlapping the targets.
+@param bs    Pointer of csp_bam_fs of the input file, whose header and index have been loaded.
+@param tid   Tid of the chrom in the header of the input file.
+@param c     Pointer of csp_regchr_t of targets of the chrom.
+@return      Pointer of hts_itr_t if success, NULL otherwise.
+
+@note        The hts_reglist_t passed to sam_itr_regions() is owned and freed by the iterator, so the intervals
+             are copied rather than shared with @p c.
+ */
+static hts_itr_t* pileup_itr_targets(csp_bam_fs *bs, int tid, const csp_regchr_t *c) {
+    hts_reglist_t *rl;
+    if (NULL == (rl = (hts_reglist_t*) calloc(1, sizeof(hts_reglist_t)))) { return NULL; }
+    if (NULL == (rl->intervals = (hts_pair_pos_t*) malloc(c->n * sizeof(hts_pair_pos_t)))) { free(rl); return NULL; }
+    memcpy(rl->intervals, c->a, c->n * sizeof(hts_pair_pos_t));
+    rl->reg = sam_hdr_tid2name(bs->hdr, tid);
+    rl->tid = tid;
+    rl->count = c->n;
+    rl->min_beg = c->a[0].beg;
+    rl->max_end = c->a[c->n - 1].end;
+    return sam_itr_regions(bs->idx, bs->hdr, rl, 1);
+}
+
+/*@abstract  Open the output files of the thread.
+@param d     Pointer to thread_data structure.
+@return      0 if success, -1 otherwise.
+ */
+static int pileup_open_files(thread_data *d) {
+    if (csp_mtx_open(d) < 0) { return -1; }
+    if (d->out_bin && jf_open(d->out_bin, NULL) <= 0) {
+        fprintf(stderr, "[E::%s] failed to open tmp bin depth file '%s'.\n", __func__, d->out_bin->fn);
+        return -1;
+    }
+    return csp_vcf_open(d);
+}
+
+/*@abstract  Close the output files of the thread that are open.
+@return      0 if success, -1 otherwise.
+ */
+static int pileup_close_files(thread_data *d) {
+    csp_mtx_close(d);
+    if (d->out_bin && jf_isopen(d->out_bin)) { jf_close(d->out_bin); }
+    return csp_vcf_close(d);
+}
+
+/*@abstract  Length of one chrom, the max among the headers of the input files.
+@param bfs   Array of csp_bam_fs of the input files, whose tids have been set.
+@param nfs   Size of @p bfs.
+@param cid   Index of the chrom in gs->chroms.
+@return      Length of the chrom, 0 if it is in none of the headers.
+ */
+static hts_pos_t pileup_chrom_len(csp_bam_fs **bfs, int nfs, int cid) {
+    hts_pos_t len, m = 0;
+    int i;
+    for (i = 0; i < nfs; i++) {
+        if (bfs[i]->tids[cid] >= 0 && (len = sam_hdr_tid2len(bfs[i]->hdr, bfs[i]->tids[cid])) > m) { m = len; }
+    }
+    return m;
+}
+
 /*@abstract  Pileup regions (several chromosomes).
 @param args  Pointer to thread_data structure.
 @return      Num of SNPs, including those filtered, that are processed.
@@ -170,12 +1266,13 @@ static int pileup_snp(hts_pos_t pos, int *mp_n, const bam_pileup1_t **mp_plp, in
              3. Refering to @func mpileup from bam_plcmd.c in @repo samtools, the @p mp_iter, @p mp_plp and
                 @p mp_n do not need to be reset every time calling bam_mplp_auto(). Guess that there may be 
                 memory pools inside bam_mplp_* for these structures.
-             4. TODO: check consistency among headers. For now not sure the pileup-ed @p tid from @func 
-                  bam_mplp_auto() is corresponded to which file's header for different files may have different 
-                  target_names in their headers.
+             4. The pileup-ed @p tid from @func bam_mplp_auto() is the index of the chrom in gs->chroms rather
+                  than the tid of any header, refer to mp_func().
              5. TODO: Refering to @func mpileup from bam_plcmd.c in @repo samtools, the hts_itr_t* structure is
                   reused directly without destroying-creating again. is it a good way? it may speed up if 
                   donot repeat the create-destroy-create-... process.
+             6. In the combined mode, the given SNPs of each chrom are output to @p d whether covered or not and
+                the other sites passing filters to d->disc, refer to known_at().
  */
 static int csp_pileup_core(void *args) {
     thread_data *d = (thread_data*) args;
@@ -195,8 +1292,16 @@ static int csp_pileup_core(void *args) {
     int ndat = 0;                 // num of elements in array of mp_aux_t data.
     int tid, max_depth;
     int pos;
-    int i, r, ret;
-    size_t msnp, nsnp, unit = 200000;
+    ps_engine_t *ps = NULL;
+    ref_win_t *rw = NULL;
+    const csp_regchr_t *rc = NULL;
+    ds_engine_t *ds = NULL;
+    bd_counter_t *bd = NULL;
+    hts_pos_t len;
+    known_cur_t kc;
+    csp_snp_t *snp = NULL;
+    int i, r, ret, ri;
+    long msnp, nsnp, unit = 200000;
     kstring_t ks = KS_INITIALIZE, *s = &ks;
 #if DEBUG
     fprintf(stderr, "[D::%s][Thread-%d] thread options:\n", __func__, d->i);
@@ -206,38 +1311,25 @@ static int csp_pileup_core(void *args) {
     assert(d->niter == d->m);
     assert(d->nitr == gs->nin);
     d->ret = -1;
-    d->ns = d->nr_ad = d->nr_dp = d->nr_oth = 0;
+    d->ns = d->nr_gt = 0;
+    memset(d->nr, 0, sizeof(d->nr)); memset(d->nr_grp, 0, sizeof(d->nr_grp));
+    d->nbin = d->nr_bin = 0;
+    d->cap_reads = d->cap_sites = d->samp_sites = 0;
+    if (d->disc) { 
+        d->disc->ns = d->disc->nr_gt = 0; 
+        memset(d->disc->nr, 0, sizeof(d->disc->nr)); memset(d->disc->nr_grp, 0, sizeof(d->disc->nr_grp));
+    }
     /* prepare data and structures. 
     */
-    if (jf_open(d->out_mtx_ad, NULL) <= 0) { 
-        fprintf(stderr, "[E::%s] failed to open tmp mtx AD file '%s'.\n", __func__, d->out_mtx_ad->fn);
-        goto fail;
-    }
-    if (jf_open(d->out_mtx_dp, NULL) <= 0) { 
-        fprintf(stderr, "[E::%s] failed to open tmp mtx DP file '%s'.\n", __func__, d->out_mtx_dp->fn);
-        goto fail;
-    }
-    if (jf_open(d->out_mtx_oth, NULL) <= 0) { 
-        fprintf(stderr, "[E::%s] failed to open tmp mtx OTH file '%s'.\n", __func__, d->out_mtx_oth->fn);
-        goto fail;
-    }
-    if (jf_open(d->out_vcf_base, NULL) <= 0) { 
-        fprintf(stderr, "[E::%s] failed to open tmp vcf BASE file '%s'.\n", __func__, d->out_vcf_base->fn);
-        goto fail;
-    }
-    if (gs->is_genotype) {
-        if (jf_open(d->out_vcf_cells, NULL) <= 0) { 
-            fprintf(stderr, "[E::%s] failed to open tmp vcf CELLS file '%s'.\n", __func__, d->out_vcf_cells->fn);
-            goto fail;
-        }
-    }
+    if (pileup_open_files(d) < 0) { goto fail; }
+    if (d->disc && pileup_open_files(d->disc) < 0) { goto fail; }
     /* open input files */ 
     fp = (htsFile**) calloc(gs->nin, sizeof(htsFile*));
     if (NULL == fp) { fprintf(stderr, "[E::%s] failed to open input files\n", __func__); goto fail; }                 
     for (; nfp < gs->nin; ) {
         if (d->i == 0) {               // the caller has opened input files for Thread-0 
             fp[nfp] = bam_fs[nfp]->fp; nfp++;
-        } else if (NULL == (fp[nfp] = hts_open(gs->in_fns[nfp], "rb"))) {
+        } else if (NULL == (fp[nfp] = csp_hts_open(gs->in_fns[nfp], "rb", gs->io_hint ? CSP_IO_SEQ : CSP_IO_NONE))) {
             fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, gs->in_fns[nfp]);
             goto fail;
         } else { nfp++; }
@@ -258,7 +1350,14 @@ static int csp_pileup_core(void *args) {
         if (NULL == (data[ndat] = mp_aux_init())) {
             fprintf(stderr, "[E::%s] failed to allocate space for mp_aux_t.\n", __func__);
             goto fail;
-        } else { data[ndat]->fp = fp[ndat]; data[ndat]->gs = gs; }
+        } else { data[ndat]->fp = fp[ndat]; data[ndat]->gs = gs; data[ndat]->fid = ndat; }
+    }
+    if (d->out_bin) {
+        if (NULL == (bd = bd_counter_init(d, nfs))) {
+            fprintf(stderr, "[E::%s] failed to create the bin counter.\n", __func__);
+            goto fail;
+        }
+        for (i = 0; i < ndat; i++) { data[i]->bd = bd; }
     }
     if (NULL == (mp_plp = (const bam_pileup1_t**) calloc(nfs, sizeof(bam_pileup1_t*)))) {
         fprintf(stderr, "[E::%s] failed to allocate space for mp_plp.\n", __func__);
@@ -268,6 +1367,17 @@ static int csp_pileup_core(void *args) {
         fprintf(stderr, "[E::%s] failed to allocate space for mp_nplp.\n", __func__);
         goto fail;
     }
+    if (CSP_PLP_ENGINE_STREAM == gs->plp_engine && NULL == (ps = ps_engine_init(nfs))) {
+        fprintf(stderr, "[E::%s] failed to create the streaming pileup engine.\n", __func__);
+        goto fail;
+    }
+    if (gs->refseq) {
+        if (NULL == (rw = ref_win_init(gs->refseq))) {
+            fprintf(stderr, "[E::%s] failed to load reference FASTA '%s'.\n", __func__, gs->refseq);
+            goto fail;
+        }
+        if (ps) { ps->rw = rw; }
+    }
     /* pileup each SNP. 
     */
     // init mpileup 
@@ -284,36 +1394,65 @@ static int csp_pileup_core(void *args) {
         #if VERBOSE
             fprintf(stderr, "[I::%s][Thread-%d] processing chrom %s ...\n", __func__, d->i, a[n]);
         #endif
+        for (i = 0; i < ndat; i++) { data[i]->itr = d->iter[n][i]; data[i]->cid = d->n + n; }
+        if (rw && ref_win_set_chrom(rw, a[n]) > 0) {
+            fprintf(stderr, "[W::%s] chrom %s is not in the reference FASTA, infer ref from base counts.\n", __func__, a[n]);
+        }
+        rc = gs->tgt ? csp_regidx_get(gs->tgt, a[n]) : NULL; ri = 0;
+        known_cur_set(&kc, d->n + n, gs);
+        len = pileup_chrom_len(bam_fs, nfs, d->n + n);
+        if (bd) { bd_counter_chrom(bd, len); }
+        if (gs->dense_len > 0 && len > 0 && len <= gs->dense_len) {
+            if (NULL == ds && NULL == (ds = ds_engine_init(mplp->nsg, gs->dense_len, use_umi(gs) != NULL))) {
+                fprintf(stderr, "[E::%s] failed to create the dense pileup engine.\n", __func__);
+                goto fail;
+            }
+            if ((nsnp = pileup_chrom_dense(ds, data, bam_fs, d->n + n, a[n], len, mplp, rw, rc, d, s)) < 0) {
+                fprintf(stderr, "[E::%s] failed to pileup chrom %s\n", __func__, a[n]);
+                goto fail;
+            }
+            if (bd && bd_counter_flush(bd, bd->nbin) < 0) { goto fail; }
+            #if VERBOSE
+                fprintf(stderr, "[I::%s][Thread-%d] has pileup-ed in total %ld SNPs for chrom %s\n", __func__, d->i, nsnp, a[n]);
+            #endif
+            continue;
+        }
+        if (ps) {
+            ps->rc = rc; ps->ri = 0; ps->kc = kc.n ? &kc : NULL;
+            if ((nsnp = pileup_chrom_stream(ps, data, a[n], mplp, d, s)) < 0) {
+                fprintf(stderr, "[E::%s] failed to pileup chrom %s\n", __func__, a[n]);
+                goto fail;
+            }
+            for (i = 0; i < ndat; i++) { mp_aux_reset(data[i]); }
+            if (known_flush(&kc, HTS_POS_MAX, a[n], mplp, d, s) < 0) { goto fail; }
+            if (bd && bd_counter_flush(bd, bd->nbin) < 0) { goto fail; }
+            #if VERBOSE
+                fprintf(stderr, "[I::%s][Thread-%d] has pileup-ed in total %ld SNPs for chrom %s\n", __func__, d->i, nsnp, a[n]);
+            #endif
+            continue;
+        }
         /* create bam_mplp_* mpileup structure from htslib */
-        for (i = 0; i < ndat; i++) { data[i]->itr = d->iter[n][i]; }
         if (NULL == (mp_iter = bam_mplp_init(nfs, mp_func, (void**) data))) {
             fprintf(stderr, "[E::%s] failed to create mp_iter for chrom %s.\n", __func__, a[n]);
             goto fail;
         }
         bam_mplp_set_maxcnt(mp_iter, max_depth);
+        bam_mplp_constructor(mp_iter, mp_cd_init);
         // As each query region is a chrom, so no need to call bam_mplp_init_overlaps() here?
         /* begin mpileup */
         while ((ret = bam_mplp_auto(mp_iter, &tid, &pos, mp_n, mp_plp)) > 0) {
             if (tid < 0) { break; }
-            if ((r = pileup_snp(pos, mp_n, mp_plp, nfs, pileup, mplp, gs)) != 0) {
+            if (rc && ! csp_regchr_cover(rc, pos, &ri)) { continue; }   // reads overlapping targets may cover positions outside.
+            if (known_at(&kc, pos, a[n], mplp, d, s, &snp) < 0) { goto fail; }
+            if ((r = pileup_snp(pos, mp_n, mp_plp, nfs, pileup, mplp, rw, snp, gs)) != 0) {
                 if (r < 0) {
                     fprintf(stderr, "[E::%s] failed to pileup snp for %s:%d\n", __func__, a[n], pos);
                     goto fail; 
                 } else { csp_mplp_reset(mplp); continue; }
-            } else { d->ns++; }
-            d->nr_ad += mplp->nr_ad; d->nr_dp += mplp->nr_dp; d->nr_oth += mplp->nr_oth;
-            /* output mplp to mtx and vcf. */
-            csp_mplp_to_mtx(mplp, d->out_mtx_ad, d->out_mtx_dp, d->out_mtx_oth, d->ns);
-            ksprintf(s, "%s\t%d\t.\t%c\t%c\t.\tPASS\tAD=%ld;DP=%ld;OTH=%ld", a[n], pos + 1, \
-                    seq_nt16_int2char(mplp->ref_idx), seq_nt16_int2char(mplp->alt_idx), mplp->ad, mplp->dp, mplp->oth);
-            jf_puts(ks_str(s), d->out_vcf_base); jf_putc('\n', d->out_vcf_base);
-            if (gs->is_genotype) {
-                jf_puts(ks_str(s), d->out_vcf_cells);
-                jf_puts("\tGT:AD:DP:OTH:PL:ALL", d->out_vcf_cells);
-                csp_mplp_to_vcf(mplp, d->out_vcf_cells);
-                jf_putc('\n', d->out_vcf_cells);
             }
-            csp_mplp_reset(mplp); ks_clear(s);
+            /* output mplp to mtx and vcf. */
+            if (pileup_output_snp(snp ? d : pileup_site_td(d), a[n], pos, mplp, s) < 0) { goto fail; }
+            csp_mplp_reset(mplp);
             #if VERBOSE
                 if ((++nsnp) - msnp >= unit) {
                     fprintf(stderr, "[I::%s][Thread-%d] has pileup-ed %.2fM SNPs for chrom %s\n", __func__, d->i, nsnp / 1000000.0, a[n]);
@@ -326,33 +1465,39 @@ static int csp_pileup_core(void *args) {
             goto fail;
         }
         for (i = 0; i < ndat; i++) { mp_aux_reset(data[i]); }
+        if (known_flush(&kc, HTS_POS_MAX, a[n], mplp, d, s) < 0) { goto fail; }
+        if (bd && bd_counter_flush(bd, bd->nbin) < 0) { goto fail; }
         #if VERBOSE
             fprintf(stderr, "[I::%s][Thread-%d] has pileup-ed in total %ld SNPs for chrom %s\n", __func__, d->i, nsnp, a[n]);
         #endif
     }
     ks_free(s); s = NULL;
-    jf_close(d->out_mtx_ad); jf_close(d->out_mtx_dp); jf_close(d->out_mtx_oth);
-    jf_close(d->out_vcf_base); if (gs->is_genotype) { jf_close(d->out_vcf_cells); }
+    if (pileup_close_files(d) < 0 || (d->disc && pileup_close_files(d->disc) < 0)) {
+        fprintf(stderr, "[E::%s] failed to close output files.\n", __func__);
+        goto fail;
+    }
     for (i = 0; i < ndat; i++) { mp_aux_destroy(data[i]); }
     free(data);
     if (d->i > 0) {
         for (i = 0; i < nfp; i++) { hts_close(fp[i]); }
     } free(fp); fp = NULL;
     free(mp_plp); free(mp_n);
+    ps_engine_destroy(ps);
+    ds_engine_destroy(ds);
+    bd_counter_destroy(bd);
+    ref_win_destroy(rw);
     // do not free mp_iter here, otherwise will lead to double free error!!!
     // seems bam_mplp_* will free the mp_iter by default.
     //bam_mplp_destroy(mp_iter);   
     csp_pileup_destroy(pileup);
+    d->cap_reads = mplp->cap_reads; d->cap_sites = mplp->cap_sites; d->samp_sites = mplp->samp_sites;
     csp_mplp_destroy(mplp);
     d->ret = 0;
     return n;
   fail:
     if (s) { ks_free(s); }
-    if (jf_isopen(d->out_mtx_ad)) { jf_close(d->out_mtx_ad); }
-    if (jf_isopen(d->out_mtx_dp)) { jf_close(d->out_mtx_dp); }
-    if (jf_isopen(d->out_mtx_oth)) { jf_close(d->out_mtx_oth); }
-    if (jf_isopen(d->out_vcf_base)) { jf_close(d->out_vcf_base); }
-    if (gs->is_genotype && jf_isopen(d->out_vcf_cells)) { jf_close(d->out_vcf_cells); }
+    pileup_close_files(d);
+    if (d->disc) { pileup_close_files(d->disc); }
     if (data) {
         for (i = 0; i < ndat; i++) { mp_aux_destroy(data[i]); }
         free(data); 
@@ -364,14 +1509,233 @@ static int csp_pileup_core(void *args) {
     }
     if (mp_plp) free(mp_plp);
     if (mp_n) free(mp_n);
+    if (ps) { ps_engine_destroy(ps); }
+    if (ds) { ds_engine_destroy(ds); }
+    if (bd) { bd_counter_destroy(bd); }
+    if (rw) { ref_win_destroy(rw); }
     if (pileup) csp_pileup_destroy(pileup);
     if (mplp) { csp_mplp_destroy(mplp); }
     return n;
 }
 
+/*@abstract  Order of the thread works of chroms to be added into the thread pool.
+@param gs    Pointer to the global_settings structure.
+@param n     Num of thread works, one for each chrom.
+@return      Array of indexes of chroms if success, NULL otherwise.
+
+@note        With targets, chroms with more targeted bases go first so that the largest works do not start last
+             and keep one thread busy after the others finish. Otherwise the chroms are kept in their order.
+             The output order is not affected as the tmp files are merged by the index of chroms.
+ */
+static int* pileup_task_order(global_settings *gs, int n) {
+    const csp_regchr_t *c;
+    hts_pos_t *w = NULL;
+    int *ord = NULL;
+    int i, j, k;
+    if (NULL == (ord = (int*) malloc(n * sizeof(int)))) { return NULL; }
+    for (i = 0; i < n; i++) { ord[i] = i; }
+    if (NULL == gs->tgt) { return ord; }
+    if (NULL == (w = (hts_pos_t*) malloc(n * sizeof(hts_pos_t)))) { free(ord); return NULL; }
+    for (i = 0; i < n; i++) { w[i] = (c = csp_regidx_get(gs->tgt, gs->chroms[i])) ? c->nbase : 0; }
+    for (i = 1; i < n; i++) {     // insertion sort, stable, the num of chroms is small.
+        for (k = ord[i], j = i - 1; j >= 0 && w[ord[j]] < w[k]; j--) { ord[j + 1] = ord[j]; }
+        ord[j + 1] = k;
+    }
+    free(w);
+    return ord;
+}
+
+/*@abstract  One set of output files of csp_pileup(): the final files and the tmp files of each thread.
+@param out_*   Pointers of the final output files, @p out_mtx, @p out_csc and @p out_grp are the arrays indexed by CSP_TAG_*.
+@param tmp_*   Arrays of tmp files, one for each thread, @p tmp_mtx and @p tmp_grp are indexed by CSP_TAG_* as @p out_mtx. The vcf ones are NULL if only one thread, which writes
+               into the final vcf files directly. @p tmp_mtx_gt is NULL without --sparseGT and @p tmp_site
+               without --hdf5 or --arrow. @p tmp_bin is NULL without --binDepth or for the discovered sites.
+@param n       Num of threads.
+
+@note          Mode 2 has one output set, while the combined mode has another one for the discovered sites.
+ */
+typedef struct {
+    jfile_t **out_mtx, *out_vcf_base, *out_vcf_cells, *out_h5, *out_mtx_gt;
+    jfile_t *out_arw_tag, *out_arw_snp, **out_csc, **out_grp, *out_bin;
+    jfile_t **tmp_mtx[CSP_NTAG], **tmp_grp[CSP_NTAG], **tmp_vcf_base, **tmp_vcf_cells, **tmp_site, **tmp_mtx_gt;
+    jfile_t **tmp_bin;
+    int n;
+} pileup_outset_t;
+
+/*@abstract  Create tmp files of one output set.
+@param o     Pointer of pileup_outset_t, whose out_* have been set.
+@param n     Num of threads.
+@param gs    Pointer to the global_settings structure.
+@return      0 if success, -1 otherwise.
+ */
+static int pileup_outset_init(pileup_outset_t *o, int n, global_settings *gs) {
+    int t;
+    o->tmp_vcf_base = o->tmp_vcf_cells = o->tmp_site = o->tmp_mtx_gt = o->tmp_bin = NULL;
+    for (t = 0; t < CSP_NTAG; t++) { o->tmp_mtx[t] = o->tmp_grp[t] = NULL; }
+    o->n = n;
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (o->out_mtx[t] && NULL == (o->tmp_mtx[t] = create_tmp_files(o->out_mtx[t], n, CSP_TMP_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for mtx_%s.\n", __func__, csp_mtx_tag_name(t));
+            return -1;
+        }
+        if (o->out_grp[t] && NULL == (o->tmp_grp[t] = create_tmp_files(o->out_grp[t], n, CSP_TMP_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for group mtx_%s.\n", __func__, csp_mtx_tag_name(t));
+            return -1;
+        }
+    }
+    if (gs->sparse_gt && NULL == (o->tmp_mtx_gt = create_tmp_files(o->out_mtx_gt, n, CSP_TMP_ZIP))) {
+        fprintf(stderr, "[E::%s] fail to create tmp files for sparse genotypes.\n", __func__);
+        return -1;
+    }
+    if (o->out_bin && NULL == (o->tmp_bin = create_tmp_files(o->out_bin, n, CSP_TMP_ZIP))) {
+        fprintf(stderr, "[E::%s] fail to create tmp files for bin depth.\n", __func__);
+        return -1;
+    }
+    if (csp_out_site(gs) && \
+        NULL == (o->tmp_site = create_tmp_files(csp_site_fs(o->out_h5, o->out_arw_snp), n, CSP_TMP_ZIP))) {
+        fprintf(stderr, "[E::%s] fail to create tmp site files.\n", __func__);
+        return -1;
+    }
+    if (n > 1) {
+        if (NULL == (o->tmp_vcf_base = create_tmp_files(o->out_vcf_base, n, CSP_TMP_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for vcf_BASE.\n", __func__);
+            return -1;
+        }
+        if (csp_out_cells(gs) && NULL == (o->tmp_vcf_cells = create_tmp_files(o->out_vcf_cells, n, CSP_TMP_ZIP))) {
+            fprintf(stderr, "[E::%s] fail to create tmp files for vcf_CELLS.\n", __func__);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*@abstract  Set the output files of one thread.
+@param o     Pointer of pileup_outset_t.
+@param i     Index of the thread.
+@param d     Pointer to thread_data structure.
+@param gs    Pointer to the global_settings structure.
+ */
+static void pileup_outset_assign(pileup_outset_t *o, int i, thread_data *d, global_settings *gs) {
+    int t;
+    for (t = 0; t < CSP_NTAG; t++) {
+        d->out_mtx[t] = o->tmp_mtx[t] ? o->tmp_mtx[t][i] : NULL;
+        d->out_grp[t] = o->tmp_grp[t] ? o->tmp_grp[t][i] : NULL;
+    }
+    d->out_site = o->tmp_site ? o->tmp_site[i] : NULL;
+    d->out_mtx_gt = o->tmp_mtx_gt ? o->tmp_mtx_gt[i] : NULL;
+    d->out_bin = o->tmp_bin ? o->tmp_bin[i] : NULL;
+    if (o->n > 1) {
+        d->out_vcf_base = o->tmp_vcf_base[i]; d->out_vcf_cells = csp_out_cells(gs) ? o->tmp_vcf_cells[i] : NULL;
+    } else {
+        d->out_vcf_base = o->out_vcf_base; d->out_vcf_cells = csp_out_cells(gs) ? o->out_vcf_cells : NULL;
+    }
+}
+
+/*@abstract  Merge the tmp files of one output set into the final files.
+@param o        Pointer of pileup_outset_t.
+@param td       Array of thread data, one for each thread, whose outputs are in @p o.
+@param nsample  Num of samples.
+@param gs       Pointer to the global_settings structure.
+@return         0 if success, -1 otherwise.
+ */
+static int pileup_outset_merge(pileup_outset_t *o, thread_data **td, int nsample, global_settings *gs) {
+    size_t ns, nr[CSP_NTAG], nr_grp[CSP_NTAG], nr_gt, nbin, nr_bin;
+    int i, t;
+    ns = nr_gt = nbin = nr_bin = 0;
+    memset(nr, 0, sizeof(nr)); memset(nr_grp, 0, sizeof(nr_grp));
+    for (i = 0; i < o->n; i++) {
+        for (t = 0; t < CSP_NTAG; t++) { nr[t] += td[i]->nr[t]; nr_grp[t] += td[i]->nr_grp[t]; }
+        nr_gt += td[i]->nr_gt;
+        ns += td[i]->ns;
+        nbin += td[i]->nbin; nr_bin += td[i]->nr_bin;
+    }
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (o->out_mtx[t] && csp_merge_mtx(o->out_mtx[t], o->tmp_mtx[t], o->n, ns, nsample, nr[t], gs) < 0) { return -1; }
+        if (o->out_grp[t] && csp_merge_mtx(o->out_grp[t], o->tmp_grp[t], o->n, ns, gs->ngroup, nr_grp[t], gs) < 0) { return -1; }
+    }
+    if (gs->cell_major && csp_merge_csc(o->out_csc, td, o->n, nsample, gs) < 0) { return -1; }
+    if (o->tmp_mtx_gt && csp_merge_gt(o->out_mtx_gt, o->tmp_mtx_gt, o->n, ns, nsample, nr_gt, gs) < 0) { return -1; }
+    if (o->tmp_bin && csp_merge_mtx(o->out_bin, o->tmp_bin, o->n, nbin, nsample, nr_bin, gs) < 0) { return -1; }
+    if (gs->out_hdf5 && csp_merge_h5(o->out_h5, o->tmp_mtx[CSP_TAG_AD], o->tmp_mtx[CSP_TAG_DP], o->tmp_mtx[CSP_TAG_OTH], 
+                                     o->tmp_site, o->n, ns, gs) < 0) { 
+        return -1; 
+    }
+    if (gs->out_arrow && csp_merge_arrow(o->out_arw_tag, o->out_arw_snp, o->tmp_mtx[CSP_TAG_AD], o->tmp_mtx[CSP_TAG_DP], 
+                                         o->tmp_mtx[CSP_TAG_OTH], o->tmp_site, o->n, ns) < 0) { 
+        return -1; 
+    }
+
+    if (csp_merge_vcf(o->out_vcf_base, o->tmp_vcf_base, o->n, td, 0, gs) < 0) { return -1; }
+    if (csp_out_cells(gs) && csp_merge_vcf(o->out_vcf_cells, o->tmp_vcf_cells, o->n, td, 1, gs) < 0) { return -1; }
+    return 0;
+}
+
+/*@abstract  Remove the tmp files of one output set and close the final files if still open.
+@param o     Pointer of pileup_outset_t.
+@param gs    Pointer to the global_settings structure.
+ */
+static void pileup_outset_clean(pileup_outset_t *o, global_settings *gs) {
+    int t;
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (o->tmp_mtx[t] && destroy_tmp_files(o->tmp_mtx[t], o->n) < 0) {
+            fprintf(stderr, "[W::%s] failed to remove tmp mtx %s files.\n", __func__, csp_mtx_tag_name(t));
+        } o->tmp_mtx[t] = NULL;
+        if (o->tmp_grp[t] && destroy_tmp_files(o->tmp_grp[t], o->n) < 0) {
+            fprintf(stderr, "[W::%s] failed to remove tmp group mtx %s files.\n", __func__, csp_mtx_tag_name(t));
+        } o->tmp_grp[t] = NULL;
+    }
+    if (o->tmp_mtx_gt && destroy_tmp_files(o->tmp_mtx_gt, o->n) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp sparse genotype files.\n", __func__);
+    } o->tmp_mtx_gt = NULL;
+    if (o->tmp_bin && destroy_tmp_files(o->tmp_bin, o->n) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp bin depth files.\n", __func__);
+    } o->tmp_bin = NULL;
+    if (o->tmp_site && destroy_tmp_files(o->tmp_site, o->n) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp site files.\n", __func__);
+    } o->tmp_site = NULL;
+    if (o->tmp_vcf_base && destroy_tmp_files(o->tmp_vcf_base, o->n) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp vcf BASE files.\n", __func__);
+    } o->tmp_vcf_base = NULL;
+    if (o->tmp_vcf_cells && destroy_tmp_files(o->tmp_vcf_cells, o->n) < 0) {
+        fprintf(stderr, "[W::%s] failed to remove tmp vcf CELLS files.\n", __func__);
+    } o->tmp_vcf_cells = NULL;
+    for (t = 0; t < CSP_NTAG; t++) { 
+        if (o->out_mtx[t] && jf_isopen(o->out_mtx[t])) { jf_close(o->out_mtx[t]); } 
+        if (o->out_grp[t] && jf_isopen(o->out_grp[t])) { jf_close(o->out_grp[t]); } 
+    }
+    if (o->out_vcf_base && jf_isopen(o->out_vcf_base)) { jf_close(o->out_vcf_base); }
+    if (o->out_mtx_gt && jf_isopen(o->out_mtx_gt)) { jf_close(o->out_mtx_gt); }
+    if (o->out_bin && jf_isopen(o->out_bin)) { jf_close(o->out_bin); }
+    if (o->out_vcf_cells && jf_isopen(o->out_vcf_cells)) { jf_close(o->out_vcf_cells); }
+}
+
+/*@abstract  Write the bins of --binDepth of all chroms in BED format, in the order of the rows of the bin matrix.
+@param out   Pointer of the output file.
+@param bfs   Array of csp_bam_fs of the input files, whose tids have been set.
+@param nfs   Size of @p bfs.
+@param gs    Pointer to the global_settings structure.
+@return      0 if success, -1 otherwise.
+ */
+static int pileup_write_bins(jfile_t *out, csp_bam_fs **bfs, int nfs, global_settings *gs) {
+    hts_pos_t len, beg, end;
+    int i;
+    if (jf_open(out, "wb") <= 0) { fprintf(stderr, "[E::%s] failed to open '%s'.\n", __func__, out->fn); return -1; }
+    for (i = 0; i < gs->nchrom; i++) {
+        len = pileup_chrom_len(bfs, nfs, i);
+        for (beg = 0; beg < len; beg = end) {
+            end = beg + gs->bin_depth < len ? beg + gs->bin_depth : len;
+            jf_printf(out, "%s\t%ld\t%ld\n", gs->chroms[i], (long) beg, (long) end);
+        }
+    }
+    return jf_close(out) < 0 ? -1 : 0;
+}
+
 /*abstract  Run cellSNP Mode with method of pileuping.
 @param gs   Pointer to the global_settings structure.
 @return     0 if success, -1 otherwise.
+
+@note       In the combined mode (--discover), the given SNPs are output to gs->out_* and the discovered sites
+            to gs->disc_*, refer to csp_pileup_core().
  */
 int csp_pileup(global_settings *gs) {
     /* check options (input) */
@@ -382,68 +1746,46 @@ int csp_pileup(global_settings *gs) {
     }
     int nsample = use_barcodes(gs) ? gs->nbarcode : gs->nin;
     /* core part. */
-    thread_data **td = NULL, *d = NULL;
+    thread_data **td = NULL, **tdd = NULL, *d = NULL;
     int ntd = 0, mtd;            // ntd: num of thread-data structures that have been created. mtd: size of td array.
     csp_bam_fs **bam_fs = NULL;       /* use array instead of single element to compatible with multi-input-files. */
-    csp_bam_fs *bs = NULL;
     int nfs = 0;
     hts_itr_t ****titer = NULL;
     hts_itr_t ***iter = NULL;
     hts_itr_t **itr = NULL;
     int ntiter = 0, niter = 0, nitr = 0;
-    const char *ref = NULL;
     char **a = NULL;
-    kstring_t ks = KS_INITIALIZE, *s = &ks;
-    int i, j, k, ret;
-    size_t ns, nr_ad, nr_dp, nr_oth, ns_merge, nr_merge;
-    jfile_t **out_tmp_mtx_ad, **out_tmp_mtx_dp, **out_tmp_mtx_oth, **out_tmp_vcf_base, **out_tmp_vcf_cells;
-    out_tmp_mtx_ad = out_tmp_mtx_dp = out_tmp_mtx_oth = out_tmp_vcf_base = out_tmp_vcf_cells = NULL;
+    int *ord = NULL;
+    int i, j, k, tid;
+    pileup_outset_t out = {.out_mtx = gs->out_mtx, .out_vcf_base = gs->out_vcf_base, .out_vcf_cells = gs->out_vcf_cells,
+                           .out_h5 = gs->out_h5, .out_mtx_gt = gs->out_mtx_gt, .out_arw_tag = gs->out_arw_tag, 
+                           .out_arw_snp = gs->out_arw_snp, .out_csc = gs->out_csc, .out_grp = gs->out_grp, 
+                           .out_bin = gs->out_bin};
+    pileup_outset_t dout = {.out_mtx = gs->disc_mtx, .out_vcf_base = gs->disc_vcf_base, .out_vcf_cells = gs->disc_vcf_cells,
+                            .out_h5 = gs->disc_h5, .out_mtx_gt = gs->disc_mtx_gt, .out_arw_tag = gs->disc_arw_tag, 
+                            .out_arw_snp = gs->disc_arw_snp, .out_csc = gs->disc_csc, .out_grp = gs->disc_grp};
     /* calc number of threads and number of chroms for each thread. */
     mtd = gs->nthread > 1 ? gs->nchrom : 1;
     /* create output tmp filenames. */
-    if (NULL == (out_tmp_mtx_ad = create_tmp_files(gs->out_mtx_ad, mtd, CSP_TMP_ZIP))) {
-        fprintf(stderr, "[E::%s] fail to create tmp files for mtx_AD.\n", __func__);
-        goto fail;
-    }
-    if (NULL == (out_tmp_mtx_dp = create_tmp_files(gs->out_mtx_dp, mtd, CSP_TMP_ZIP))) {
-        fprintf(stderr, "[E::%s] fail to create tmp files for mtx_DP.\n", __func__);
-        goto fail;
-    }
-    if (NULL == (out_tmp_mtx_oth = create_tmp_files(gs->out_mtx_oth, mtd, CSP_TMP_ZIP))) {
-        fprintf(stderr, "[E::%s] fail to create tmp files for mtx_OTH.\n", __func__);
-        goto fail;
-    }
-    if (mtd > 1) {
-        if (NULL == (out_tmp_vcf_base = create_tmp_files(gs->out_vcf_base, mtd, CSP_TMP_ZIP))) {
-            fprintf(stderr, "[E::%s] fail to create tmp files for vcf_BASE.\n", __func__);
-            goto fail;
-        }
-        if (gs->is_genotype && NULL == (out_tmp_vcf_cells = create_tmp_files(gs->out_vcf_cells, mtd, CSP_TMP_ZIP))) {
-            fprintf(stderr, "[E::%s] fail to create tmp files for vcf_CELLS.\n", __func__);
-            goto fail;
-        }
-    }
+    if (pileup_outset_init(&out, mtd, gs) < 0) { goto fail; }
+    if (gs->discover && pileup_outset_init(&dout, mtd, gs) < 0) { goto fail; }
     /* create csp_bam_fs structures */
     // open input files and construct hdr for Thread-0 and 
     // other threads would use directly hdr of Thread-0 and by themselves open input files.
-    bam_fs = (csp_bam_fs**) calloc(gs->nin, sizeof(csp_bam_fs*));
-    if (NULL == bam_fs) { fprintf(stderr, "[E::%s] could not initialize csp_bam_fs* array.\n", __func__); goto fail; }
-    for (nfs = 0; nfs < gs->nin; nfs++) {
-        if (NULL == (bs = csp_bam_fs_init())) { fprintf(stderr, "[E::%s] failed to create csp_bam_fs.\n", __func__); goto fail; }
-        if (NULL == (bs->fp = hts_open(gs->in_fns[nfs], "rb"))) {
-            fprintf(stderr, "[E::%s] failed to open %s.\n", __func__, gs->in_fns[nfs]);
-            goto fail;
-        }
-        if (NULL == (bs->hdr = sam_hdr_read(bs->fp))) {
-            fprintf(stderr, "[E::%s] failed to read header for %s.\n", __func__, gs->in_fns[nfs]);
-            goto fail;
-        }
-        if (NULL == (bs->idx = sam_index_load(bs->fp, gs->in_fns[nfs]))) {
-            fprintf(stderr, "[E::%s] failed to load index for %s.\n", __func__, gs->in_fns[nfs]);
+    if (NULL == (bam_fs = csp_load_bam_fs(gs, 1, gs->io_hint ? CSP_IO_SEQ : CSP_IO_NONE))) {
+        fprintf(stderr, "[E::%s] failed to load headers and indexes of input files.\n", __func__);
+        goto fail;
+    }
+    nfs = gs->nin;
+    /* translate chroms into tids of each input file. */
+    for (i = 0; i < nfs; i++) {
+        if (csp_bam_fs_set_tids(bam_fs[i], (const char**) gs->chroms, gs->nchrom) < 0) {
+            fprintf(stderr, "[E::%s] failed to translate chroms for %s.\n", __func__, gs->in_fns[i]);
             goto fail;
         }
-        bam_fs[nfs] = bs;
-    } bs = NULL;
+    }
+    if (gs->out_bcf && csp_bcf_init(gs, bam_fs[0]->hdr, (const char**) gs->chroms, gs->nchrom) < 0) { goto fail; }
+    if (gs->out_bin && pileup_write_bins(gs->out_bins, bam_fs, nfs, gs) < 0) { goto fail; }
     /* prepare hts_itr_t */
     titer = (hts_itr_t****) calloc(mtd, sizeof(hts_itr_t***));
     if (NULL == titer) { fprintf(stderr, "[E::%s] could not initialize hts_itr_t*** array.\n", __func__); goto fail; }
@@ -467,11 +1809,14 @@ int csp_pileup(global_settings *gs) {
             itr = (hts_itr_t**) calloc(gs->nin, sizeof(hts_itr_t*));
             if (NULL == itr) { fprintf(stderr, "[E::%s] failed to allocate space for hts_itr_t**\n", __func__); goto fail; }
             for (nitr = 0; nitr < gs->nin; nitr++) {
-                if (NULL == (ref = csp_fmt_chr_name(a[niter], bam_fs[nitr]->hdr, s))) {
+                if ((tid = bam_fs[nitr]->tids[d->n + niter]) < 0) {
+                    if (gs->discover) { continue; }    // the chroms of given SNPs may be missing, whose SNPs have zero counts.
                     fprintf(stderr, "[E::%s] could not parse name for chrom %s.\n", __func__, a[niter]);
                     goto fail;
-                } else { ks_clear(s); }
-                if (NULL == (itr[nitr] = sam_itr_querys(bam_fs[nitr]->idx, bam_fs[nitr]->hdr, ref))) {
+                }
+                if (gs->tgt) { itr[nitr] = pileup_itr_targets(bam_fs[nitr], tid, csp_regidx_get(gs->tgt, a[niter])); }
+                else { itr[nitr] = sam_itr_queryi(bam_fs[nitr]->idx, tid, 0, HTS_POS_MAX); }
+                if (NULL == itr[nitr]) {
                     fprintf(stderr, "[E::%s] could not parse region for chrom %s.\n", __func__, a[niter]);
                     goto fail;
                 }
@@ -485,24 +1830,32 @@ int csp_pileup(global_settings *gs) {
             assert(nitr == gs->nin);
         #endif
         // construct thdata
-        d->out_mtx_ad = out_tmp_mtx_ad[ntd]; d->out_mtx_dp = out_tmp_mtx_dp[ntd]; d->out_mtx_oth = out_tmp_mtx_oth[ntd];
-        if (mtd > 1) {
-            d->out_vcf_base = out_tmp_vcf_base[ntd]; d->out_vcf_cells = gs->is_genotype ? out_tmp_vcf_cells[ntd] : NULL;
-        } else {
-            d->out_vcf_base = gs->out_vcf_base; d->out_vcf_cells = gs->is_genotype ? gs->out_vcf_cells : NULL;
+        pileup_outset_assign(&out, ntd, d, gs);
+        if (gs->discover) {
+            if (NULL == (d->disc = thdata_init())) {
+                fprintf(stderr, "[E::%s] could not initialize the thread_data structure.\n", __func__); 
+                goto fail; 
+            }
+            d->disc->i = ntd; d->disc->gs = gs;
+            pileup_outset_assign(&dout, ntd, d->disc, gs);
         }
         td[ntd] = d;
     } d = NULL;
-    // clean idx
-    for (i = 0; i < nfs; i++) { hts_idx_destroy(bam_fs[i]->idx); bam_fs[i]->idx = NULL; }
+    // clean idx, which is kept for the dense engine to query blocks of small contigs.
+    if (gs->dense_len <= 0) {
+        for (i = 0; i < nfs; i++) { hts_idx_destroy(bam_fs[i]->idx); bam_fs[i]->idx = NULL; }
+    }
     // run threads
     if (mtd > 1) {
+        if (NULL == (ord = pileup_task_order(gs, mtd))) { fprintf(stderr, "[E::%s] could not order thread works.\n", __func__); goto fail; }
         for (i = 0; i < mtd; i++) {
-            if (thpool_add_work(gs->tp, (void*) csp_pileup_core, td[i]) < 0) {
-                fprintf(stderr, "[E::%s] could not add thread work (No. %d)\n", __func__, i);
+            if (thpool_add_work(gs->tp, (void*) csp_pileup_core, td[ord[i]]) < 0) {
+                fprintf(stderr, "[E::%s] could not add thread work (No. %d)\n", __func__, ord[i]);
+                free(ord);
                 goto fail;
             }
         }
+        free(ord); ord = NULL;
         thpool_wait(gs->tp);
     } else { csp_pileup_core(td[0]); }
     /* check running status of threads. */
@@ -511,46 +1864,20 @@ int csp_pileup(global_settings *gs) {
     #endif
     for (i = 0; i < mtd; i++) { if (td[i]->ret < 0) goto fail; }
     /* merge tmp files. */
-    ns = nr_ad = nr_dp = nr_oth = 0;
-    for (i = 0; i < mtd; i++) {
-        nr_ad += td[i]->nr_ad; nr_dp += td[i]->nr_dp; nr_oth += td[i]->nr_oth;
-        ns += td[i]->ns;
-    }
-    if (jf_open(gs->out_mtx_ad, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx AD.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_ad, "%ld\t%d\t%ld\n", ns, nsample, nr_ad);
-    merge_mtx(gs->out_mtx_ad, out_tmp_mtx_ad, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_ad) { fprintf(stderr, "[E::%s] failed to merge mtx AD.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_ad);
-
-    if (jf_open(gs->out_mtx_dp, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx DP.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_dp, "%ld\t%d\t%ld\n", ns, nsample, nr_dp);
-    merge_mtx(gs->out_mtx_dp, out_tmp_mtx_dp, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_dp) { fprintf(stderr, "[E::%s] failed to merge mtx DP.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_dp);
-
-    if (jf_open(gs->out_mtx_oth, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open mtx OTH.\n", __func__); goto fail; }
-    jf_printf(gs->out_mtx_oth, "%ld\t%d\t%ld\n", ns, nsample, nr_oth);
-    merge_mtx(gs->out_mtx_oth, out_tmp_mtx_oth, mtd, &ns_merge, &nr_merge, &ret);
-    if (ret < 0 || ns_merge != ns || nr_merge != nr_oth) { fprintf(stderr, "[E::%s] failed to merge mtx OTH.\n", __func__); goto fail; }
-    jf_close(gs->out_mtx_oth);
-
-    if (mtd > 1) {
-        if (jf_open(gs->out_vcf_base, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf BASE.\n", __func__); goto fail; }
-        merge_vcf(gs->out_vcf_base, out_tmp_vcf_base, mtd, &ret);
-        if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf BASE.\n", __func__); goto fail; }
-        jf_close(gs->out_vcf_base);
-
-        if (gs->is_genotype) {
-            if (jf_open(gs->out_vcf_cells, NULL) < 0) { fprintf(stderr, "[E::%s] failed to open vcf CELLS.\n", __func__); goto fail; }
-            merge_vcf(gs->out_vcf_cells, out_tmp_vcf_cells, mtd, &ret);
-            if (ret < 0) { fprintf(stderr, "[E::%s] failed to merge vcf CELLS.\n", __func__); goto fail; }    
-            jf_close(gs->out_vcf_cells);     
+    thdata_report_cap(td, mtd, gs);
+    if (pileup_outset_merge(&out, td, nsample, gs) < 0) { goto fail; }
+    if (gs->discover) {
+        if (NULL == (tdd = (thread_data**) malloc(mtd * sizeof(thread_data*)))) {
+            fprintf(stderr, "[E::%s] could not allocate the array of thread data of discovered sites.\n", __func__);
+            goto fail;
         }
+        for (i = 0; i < mtd; i++) { tdd[i] = td[i]->disc; }
+        if (pileup_outset_merge(&dout, tdd, nsample, gs) < 0) { goto fail; }
+        free(tdd); tdd = NULL;
     }
     /* clean */
     for (i = 0; i < mtd; i++) { thdata_destroy(td[i]); }
     free(td); td = NULL;
-    ks_free(s); s = NULL;
     for (i = 0; i < ntiter; i++) {
         for (j = 0; j < niter; j++) {
             for (k = 0; k < nitr; k++) { hts_itr_destroy(titer[i][j][k]); }
@@ -563,33 +1890,16 @@ int csp_pileup(global_settings *gs) {
     // otherwise will cause double free error!
     for (j = 0; j < nfs; j++) { csp_bam_fs_destroy(bam_fs[j]); }
     free(bam_fs); bam_fs = NULL;
-    if (destroy_tmp_files(out_tmp_mtx_ad, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx AD files.\n", __func__);
-    } out_tmp_mtx_ad = NULL;
-    if (destroy_tmp_files(out_tmp_mtx_dp, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx DP files.\n", __func__);
-    } out_tmp_mtx_dp = NULL;
-    if (destroy_tmp_files(out_tmp_mtx_oth, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx OTH files.\n", __func__);
-    } out_tmp_mtx_oth = NULL;
-    if (mtd > 1) {
-        if (destroy_tmp_files(out_tmp_vcf_base, mtd) < 0) {
-            fprintf(stderr, "[W::%s] failed to remove tmp vcf BASE files.\n", __func__);
-        } out_tmp_vcf_base = NULL;
-        if (gs->is_genotype) {         
-            if (destroy_tmp_files(out_tmp_vcf_cells, mtd) < 0) {
-                fprintf(stderr, "[W::%s] failed to remove tmp vcf CELLS files.\n", __func__);
-            } out_tmp_vcf_cells = NULL;
-        }
-    }
+    pileup_outset_clean(&out, gs);
+    pileup_outset_clean(&dout, gs);
     return 0;
   fail:
     if (td) {
         for (i = 0; i < mtd; i++) { thdata_destroy(td[i]); }
         free(td);
     }
+    if (tdd) { free(tdd); }
     if (d) { thdata_destroy(d); }
-    if (s) { ks_free(s); }
     if (titer) {
         for (i = 0; i < ntiter; i++) {
             for (j = 0; j < niter; j++) {
@@ -611,34 +1921,11 @@ int csp_pileup(global_settings *gs) {
         for (k = 0; k < nitr; k++) { hts_itr_destroy(itr[k]); }
         free(itr);
     }
-    if (bs) { csp_bam_fs_destroy(bs); }
     if (bam_fs) {
         for (j = 0; j < nfs; j++) { csp_bam_fs_destroy(bam_fs[j]); }
         free(bam_fs);
     }
-    if (out_tmp_mtx_ad && destroy_tmp_files(out_tmp_mtx_ad, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx AD files.\n", __func__);
-    }
-    if (out_tmp_mtx_dp && destroy_tmp_files(out_tmp_mtx_dp, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx DP files.\n", __func__);
-    }
-    if (out_tmp_mtx_oth && destroy_tmp_files(out_tmp_mtx_oth, mtd) < 0) {
-        fprintf(stderr, "[W::%s] failed to remove tmp mtx OTH files.\n", __func__);
-    }
-    if (mtd > 1) {
-        if (out_tmp_vcf_base && destroy_tmp_files(out_tmp_vcf_base, mtd) < 0) {
-            fprintf(stderr, "[W::%s] failed to remove tmp vcf BASE files.\n", __func__);
-        }
-        if (out_tmp_vcf_cells && destroy_tmp_files(out_tmp_vcf_cells, mtd) < 0) {
-            fprintf(stderr, "[W::%s] failed to remove tmp vcf CELLS files.\n", __func__);
-        }
-    }
-    if (jf_isopen(gs->out_mtx_ad)) { jf_close(gs->out_mtx_ad); }
-    if (jf_isopen(gs->out_mtx_dp)) { jf_close(gs->out_mtx_dp); }
-    if (jf_isopen(gs->out_mtx_oth)) { jf_close(gs->out_mtx_oth); }
-    if (jf_isopen(gs->out_vcf_base)) { jf_close(gs->out_vcf_base); }
-    if (gs->is_genotype && jf_isopen(gs->out_vcf_cells)) { jf_close(gs->out_vcf_cells); }
+    pileup_outset_clean(&out, gs);
+    pileup_outset_clean(&dout, gs);
     return -1;
 }
-
-
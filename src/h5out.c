@@ -0,0 +1,374 @@
+/* HDF5 output API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "htslib/kstring.h"
+#include "config.h"
+#include "jfile.h"
+#include "h5out.h"
+
+#ifdef WITH_HDF5
+
+#include "hdf5.h"
+
+/*
+ * HDF5 Output API
+ */
+
+/*@abstract    Dataset that is appended by rows through a buffer of CSP_H5_CHUNK rows.
+@param ds      The dataset.
+@param mtype   Memory type of the elements.
+@param size    Size of one element in memory.
+@param ncol    Num of columns of 2-D dataset, 0 for 1-D dataset.
+@param n       Num of rows that have been written.
+@param buf     Buffer of rows.
+@param nbuf    Num of rows in the buffer.
+@param is_str  1 if the elements are variable-length strings, which are owned by the buffer.
+ */
+typedef struct {
+    hid_t ds, mtype;
+    size_t size;
+    int ncol;
+    hsize_t n;
+    uint8_t *buf;
+    size_t nbuf;
+    int is_str;
+} h5_ds_t;
+
+static int h5_ds_close(h5_ds_t *d);
+
+/*@abstract  Create an empty, extendible and chunked dataset.
+@return      Pointer of h5_ds_t if success, NULL otherwise.
+@note        Strings are not filtered as only their heap IDs would be compressed.
+ */
+static h5_ds_t* h5_ds_create(hid_t loc, const char *name, hid_t ftype, hid_t mtype, size_t size, int ncol) {
+    h5_ds_t *d;
+    hsize_t dims[2], maxdims[2], chunk[2];
+    hid_t sp = -1, pl = -1;
+    int rank = ncol ? 2 : 1;
+    if (NULL == (d = (h5_ds_t*) calloc(1, sizeof(h5_ds_t)))) { return NULL; }
+    d->ds = -1; d->mtype = mtype; d->size = size; d->ncol = ncol;
+    d->is_str = H5Tis_variable_str(mtype) > 0;
+    dims[0] = 0; maxdims[0] = H5S_UNLIMITED; chunk[0] = CSP_H5_CHUNK;
+    dims[1] = maxdims[1] = chunk[1] = ncol;
+    if (NULL == (d->buf = (uint8_t*) malloc((size_t) CSP_H5_CHUNK * size * (ncol ? ncol : 1)))) { goto fail; }
+    if ((sp = H5Screate_simple(rank, dims, maxdims)) < 0 || (pl = H5Pcreate(H5P_DATASET_CREATE)) < 0) { goto fail; }
+    if (H5Pset_chunk(pl, rank, chunk) < 0) { goto fail; }
+    if (! d->is_str && (H5Pset_shuffle(pl) < 0 || H5Pset_deflate(pl, CSP_H5_DEFLATE) < 0)) { goto fail; }
+    if ((d->ds = H5Dcreate2(loc, name, ftype, sp, H5P_DEFAULT, pl, H5P_DEFAULT)) < 0) { goto fail; }
+    H5Sclose(sp); H5Pclose(pl);
+    return d;
+  fail:
+    fprintf(stderr, "[E::%s] failed to create dataset '%s'.\n", __func__, name);
+    if (sp >= 0) { H5Sclose(sp); }
+    if (pl >= 0) { H5Pclose(pl); }
+    h5_ds_close(d);
+    return NULL;
+}
+
+/*@abstract  Write the buffered rows to the dataset.
+@return      0 if success, -1 otherwise.
+ */
+static int h5_ds_flush(h5_ds_t *d) {
+    hsize_t off[2], cnt[2], dims[2];
+    hid_t fs = -1, ms = -1;
+    size_t i;
+    int rank = d->ncol ? 2 : 1, ret = -1;
+    if (0 == d->nbuf) { return 0; }
+    off[0] = d->n; cnt[0] = d->nbuf; dims[0] = d->n + d->nbuf;
+    off[1] = 0; cnt[1] = dims[1] = d->ncol;
+    if (H5Dset_extent(d->ds, dims) < 0 || (fs = H5Dget_space(d->ds)) < 0 || (ms = H5Screate_simple(rank, cnt, NULL)) < 0) { goto clean; }
+    if (H5Sselect_hyperslab(fs, H5S_SELECT_SET, off, NULL, cnt, NULL) < 0) { goto clean; }
+    if (H5Dwrite(d->ds, d->mtype, ms, fs, H5P_DEFAULT, d->buf) < 0) { goto clean; }
+    d->n += d->nbuf;
+    ret = 0;
+  clean:
+    if (d->is_str) {
+        for (i = 0; i < d->nbuf; i++) { free(((char**) d->buf)[i]); }
+    }
+    d->nbuf = 0;
+    if (fs >= 0) { H5Sclose(fs); }
+    if (ms >= 0) { H5Sclose(ms); }
+    return ret;
+}
+
+/*@abstract  Append one row.
+@param x     Pointer of the row of @p ncol (1 for 1-D) elements.
+@return      0 if success, -1 otherwise.
+ */
+static int h5_ds_push(h5_ds_t *d, const void *x) {
+    size_t l = d->size * (d->ncol ? d->ncol : 1);
+    memcpy(d->buf + d->nbuf * l, x, l);
+    if (++d->nbuf >= CSP_H5_CHUNK) { return h5_ds_flush(d); }
+    return 0;
+}
+
+/*@abstract  Append one string to the dataset of variable-length strings.
+@return      0 if success, -1 otherwise.
+ */
+static int h5_ds_push_str(h5_ds_t *d, const char *s) {
+    char *t;
+    if (NULL == (t = strdup(s))) { return -1; }
+    ((char**) d->buf)[d->nbuf] = t;
+    if (++d->nbuf >= CSP_H5_CHUNK) { return h5_ds_flush(d); }
+    return 0;
+}
+
+/*@abstract  Flush the buffer, close the dataset and free the structure.
+@return      0 if success, -1 otherwise.
+ */
+static int h5_ds_close(h5_ds_t *d) {
+    int ret = 0;
+    if (NULL == d) { return 0; }
+    if (d->ds >= 0) {
+        if (h5_ds_flush(d) < 0) { ret = -1; }
+        if (H5Dclose(d->ds) < 0) { ret = -1; }
+    }
+    free(d->buf);
+    free(d);
+    return ret;
+}
+
+/*@abstract  Write an attribute of uint64 array.
+@return      0 if success, -1 otherwise.
+ */
+static int h5_attr_u64(hid_t loc, const char *name, const uint64_t *v, int n) {
+    hsize_t dims[1];
+    hid_t sp, a;
+    int ret = -1;
+    dims[0] = n;
+    if ((sp = H5Screate_simple(1, dims, NULL)) < 0) { return -1; }
+    if ((a = H5Acreate2(loc, name, H5T_STD_U64LE, sp, H5P_DEFAULT, H5P_DEFAULT)) >= 0) {
+        if (H5Awrite(a, H5T_NATIVE_UINT64, v) >= 0) { ret = 0; }
+        H5Aclose(a);
+    }
+    H5Sclose(sp);
+    return ret;
+}
+
+/*@abstract  Create a group of CSR sparse matrix with datasets data, indices and indptr.
+@param type  File and memory types and the size of the data.
+@return      Id of the group if success, -1 otherwise.
+
+@note        On failure, the datasets already created are closed and @p data, @p idx and @p ptr are set to NULL.
+ */
+static hid_t h5_csr_create(hid_t f, const char *name, const uint64_t *shape, hid_t ftype, hid_t mtype, size_t size,
+                           h5_ds_t **data, h5_ds_t **idx, h5_ds_t **ptr)
+{
+    hid_t g;
+    *data = *idx = *ptr = NULL;
+    if ((g = H5Gcreate2(f, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT)) < 0) { return -1; }
+    if (h5_attr_u64(g, "shape", shape, 2) < 0 || \
+        NULL == (*data = h5_ds_create(g, "data", ftype, mtype, size, 0)) || \
+        NULL == (*idx = h5_ds_create(g, "indices", H5T_STD_U32LE, H5T_NATIVE_UINT32, sizeof(uint32_t), 0)) || \
+        NULL == (*ptr = h5_ds_create(g, "indptr", H5T_STD_U64LE, H5T_NATIVE_UINT64, sizeof(uint64_t), 0))) {
+        h5_ds_close(*data); h5_ds_close(*idx);
+        *data = *idx = NULL;
+        H5Gclose(g);
+        return -1;
+    }
+    return g;
+}
+
+/*@abstract  Write one matrix (AD, DP or OTH) from the tmp mtx files.
+@return      0 if success, -1 otherwise.
+ */
+static int h5_write_mtx(hid_t f, const char *name, jfile_t **in, int n, size_t ns, const uint64_t *shape, kstring_t *s) {
+    h5_ds_t *data = NULL, *idx = NULL, *ptr = NULL;
+    hid_t g;
+    uint64_t nnz = 0;
+    uint32_t smp, val;
+    size_t k = 0;
+    char *p;
+    int i = 0, ret = -1;
+    if ((g = h5_csr_create(f, name, shape, H5T_STD_U32LE, H5T_NATIVE_UINT32, sizeof(uint32_t), &data, &idx, &ptr)) < 0) {
+        goto clean;
+    }
+    if (h5_ds_push(ptr, &nnz) < 0) { goto clean; }
+    for (; i < n; i++) {
+        if (jf_open(in[i], "rb") <= 0) { goto clean; }
+        while (jf_getln(in[i], s) >= 0) {
+            if (0 == ks_len(s)) {         // empty line, meaning ending of a SNP.
+                k++;
+                if (h5_ds_push(ptr, &nnz) < 0) { goto clean; }
+                continue;
+            }
+            smp = strtoul(ks_str(s), &p, 10);
+            val = strtoul(p, NULL, 10);
+            if (smp < 1 || smp > shape[1]) { goto clean; }
+            smp--;
+            if (h5_ds_push(idx, &smp) < 0 || h5_ds_push(data, &val) < 0) { goto clean; }
+            nnz++;
+            ks_clear(s);
+        }
+        jf_close(in[i]);
+    }
+    if (k == ns) { ret = 0; }
+  clean:
+    if (i < n && jf_isopen(in[i])) { jf_close(in[i]); }
+    if (h5_ds_close(data) < 0) { ret = -1; }
+    if (h5_ds_close(idx) < 0) { ret = -1; }
+    if (h5_ds_close(ptr) < 0) { ret = -1; }
+    if (g >= 0) { H5Gclose(g); }
+    ks_clear(s);
+    if (ret < 0) { fprintf(stderr, "[E::%s] failed to write matrix '%s'.\n", __func__, name); }
+    return ret;
+}
+
+/*@abstract  Split a line by tabs in place.
+@return      Num of fields, at most @p m.
+ */
+static int h5_split(char *s, char **a, int m) {
+    int n = 0;
+    char *p;
+    while (n < m) {
+        a[n++] = s;
+        if (NULL == (p = strchr(s, '\t'))) { break; }
+        *p = '\0'; s = p + 1;
+    }
+    return n;
+}
+
+/*@abstract  Write the SNP info and, if @p npl > 0, GT and PL from the tmp site files.
+@return      0 if success, -1 otherwise.
+ */
+static int h5_write_site(hid_t f, jfile_t **in, int n, size_t ns, const uint64_t *shape, int npl, kstring_t *s) {
+#define H5_NSITE  7
+    h5_ds_t *ds[H5_NSITE], *gt = NULL, *idx = NULL, *ptr = NULL, *pl = NULL;
+    const char *names[H5_NSITE] = {"chrom", "pos", "ref", "alt", "AD", "DP", "OTH"};
+    hid_t g = -1, gg = -1, str_t = -1, ch_t = -1;
+    char *a[H5_NSITE + 5];
+    int32_t v[5];
+    int64_t pos;
+    uint64_t nnz = 0;
+    uint32_t u, smp;
+    uint8_t c;
+    size_t k = 0;
+    int i = 0, j, nf, in_snp = 0, ret = -1;
+    memset(ds, 0, sizeof(ds));
+    if ((str_t = H5Tcopy(H5T_C_S1)) < 0 || H5Tset_size(str_t, H5T_VARIABLE) < 0) { goto clean; }
+    if ((ch_t = H5Tcopy(H5T_C_S1)) < 0 || H5Tset_size(ch_t, 1) < 0 || H5Tset_strpad(ch_t, H5T_STR_NULLPAD) < 0) { goto clean; }
+    if ((g = H5Gcreate2(f, "snp", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT)) < 0) { goto clean; }
+    if (NULL == (ds[0] = h5_ds_create(g, names[0], str_t, str_t, sizeof(char*), 0)) || \
+        NULL == (ds[1] = h5_ds_create(g, names[1], H5T_STD_I64LE, H5T_NATIVE_INT64, sizeof(int64_t), 0)) || \
+        NULL == (ds[2] = h5_ds_create(g, names[2], ch_t, ch_t, 1, 0)) || \
+        NULL == (ds[3] = h5_ds_create(g, names[3], ch_t, ch_t, 1, 0))) { goto clean; }
+    for (j = 4; j < H5_NSITE; j++) {
+        if (NULL == (ds[j] = h5_ds_create(g, names[j], H5T_STD_U32LE, H5T_NATIVE_UINT32, sizeof(uint32_t), 0))) { goto clean; }
+    }
+    if (npl > 0) {
+        if ((gg = h5_csr_create(f, "GT", shape, H5T_STD_U8LE, H5T_NATIVE_UINT8, sizeof(uint8_t), &gt, &idx, &ptr)) < 0) { goto clean; }
+        if (NULL == (pl = h5_ds_create(gg, "PL", H5T_STD_I32LE, H5T_NATIVE_INT32, sizeof(int32_t), npl))) { goto clean; }
+        if (h5_ds_push(ptr, &nnz) < 0) { goto clean; }
+    }
+    for (; i < n; i++) {
+        if (jf_open(in[i], "rb") <= 0) { goto clean; }
+        while (jf_getln(in[i], s) >= 0) {
+            if (0 == ks_len(s)) {         // empty line, meaning ending of a SNP.
+                if (! in_snp) { goto clean; }
+                k++; in_snp = 0;
+                if (ptr && h5_ds_push(ptr, &nnz) < 0) { goto clean; }
+                continue;
+            }
+            if (! in_snp) {               // the first line of a SNP is its info.
+                if (h5_split(ks_str(s), a, H5_NSITE) < H5_NSITE) { goto clean; }
+                pos = strtol(a[1], NULL, 10);
+                if (h5_ds_push_str(ds[0], a[0]) < 0 || h5_ds_push(ds[1], &pos) < 0 || \
+                    h5_ds_push(ds[2], a[2]) < 0 || h5_ds_push(ds[3], a[3]) < 0) { goto clean; }
+                for (j = 4; j < H5_NSITE; j++) {
+                    u = strtoul(a[j], NULL, 10);
+                    if (h5_ds_push(ds[j], &u) < 0) { goto clean; }
+                }
+                in_snp = 1;
+            } else {
+                if (NULL == gt || (nf = h5_split(ks_str(s), a, npl + 2)) < npl + 2) { goto clean; }
+                smp = strtoul(a[0], NULL, 10);
+                if (smp < 1 || smp > shape[1]) { goto clean; }
+                smp--;
+                c = strtoul(a[1], NULL, 10);
+                for (j = 0; j < npl; j++) { v[j] = strtol(a[j + 2], NULL, 10); }
+                if (h5_ds_push(idx, &smp) < 0 || h5_ds_push(gt, &c) < 0 || h5_ds_push(pl, v) < 0) { goto clean; }
+                nnz++;
+            }
+            ks_clear(s);
+        }
+        jf_close(in[i]);
+    }
+    if (k == ns) { ret = 0; }
+  clean:
+    if (i < n && jf_isopen(in[i])) { jf_close(in[i]); }
+    for (j = 0; j < H5_NSITE; j++) {
+        if (h5_ds_close(ds[j]) < 0) { ret = -1; }
+    }
+    if (h5_ds_close(gt) < 0) { ret = -1; }
+    if (h5_ds_close(idx) < 0) { ret = -1; }
+    if (h5_ds_close(ptr) < 0) { ret = -1; }
+    if (h5_ds_close(pl) < 0) { ret = -1; }
+    if (g >= 0) { H5Gclose(g); }
+    if (gg >= 0) { H5Gclose(gg); }
+    if (str_t >= 0) { H5Tclose(str_t); }
+    if (ch_t >= 0) { H5Tclose(ch_t); }
+    ks_clear(s);
+    if (ret < 0) { fprintf(stderr, "[E::%s] failed to write SNPs.\n", __func__); }
+    return ret;
+#undef H5_NSITE
+}
+
+/*@abstract  Write the names of samples.
+@return      0 if success, -1 otherwise.
+ */
+static int h5_write_samples(hid_t f, char **samples, int nsmp) {
+    h5_ds_t *d;
+    hid_t str_t;
+    int i, ret = -1;
+    if ((str_t = H5Tcopy(H5T_C_S1)) < 0) { return -1; }
+    if (H5Tset_size(str_t, H5T_VARIABLE) >= 0 && NULL != (d = h5_ds_create(f, "samples", str_t, str_t, sizeof(char*), 0))) {
+        for (i = 0; i < nsmp; i++) {
+            if (h5_ds_push_str(d, samples[i]) < 0) { break; }
+        }
+        if (h5_ds_close(d) >= 0 && i == nsmp) { ret = 0; }
+    }
+    H5Tclose(str_t);
+    return ret;
+}
+
+int csp_h5_write(const char *fn, jfile_t **ad, jfile_t **dp, jfile_t **oth, jfile_t **site, int n, size_t ns,
+                 char **samples, int nsmp, int npl)
+{
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    uint64_t shape[2], ver = CSP_H5_VERSION;
+    hid_t f;
+    int ret = -1;
+    if (npl > 5) { return -1; }
+    shape[0] = ns; shape[1] = nsmp;
+    if ((f = H5Fcreate(fn, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT)) < 0) {
+        fprintf(stderr, "[E::%s] failed to create '%s'.\n", __func__, fn);
+        return -1;
+    }
+    if (h5_attr_u64(f, "version", &ver, 1) < 0 || h5_attr_u64(f, "shape", shape, 2) < 0) { goto clean; }
+    if (h5_write_samples(f, samples, nsmp) < 0) { goto clean; }
+    if (h5_write_site(f, site, n, ns, shape, npl, s) < 0) { goto clean; }
+    if (h5_write_mtx(f, "AD", ad, n, ns, shape, s) < 0 || h5_write_mtx(f, "DP", dp, n, ns, shape, s) < 0 || \
+        h5_write_mtx(f, "OTH", oth, n, ns, shape, s) < 0) { goto clean; }
+    ret = 0;
+  clean:
+    if (H5Fclose(f) < 0) { ret = -1; }
+    ks_free(s);
+    if (ret < 0) { fprintf(stderr, "[E::%s] failed to write '%s'.\n", __func__, fn); }
+    return ret;
+}
+
+#else
+
+int csp_h5_write(const char *fn, jfile_t **ad, jfile_t **dp, jfile_t **oth, jfile_t **site, int n, size_t ns,
+                 char **samples, int nsmp, int npl)
+{
+    fprintf(stderr, "[E::%s] HDF5 output is not supported by this build, rebuild with 'make WITH_HDF5=1'.\n", __func__);
+    return -1;
+}
+
+#endif
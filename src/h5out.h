@@ -0,0 +1,37 @@
+/* HDF5 output API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#ifndef CSP_H5OUT_H
+#define CSP_H5OUT_H
+
+#include <stdio.h>
+#include "jfile.h"
+
+/*
+ * HDF5 Output API
+ * The counts of one output set are written into one HDF5 file, refer to doc/hdf5.rst for the layout.
+ * The HDF5 library is optional, the API is only functional when built with WITH_HDF5 (make WITH_HDF5=1).
+ */
+
+#define CSP_H5_VERSION  1
+#define CSP_H5_CHUNK    (1 << 16)   // num of rows of each chunk of the datasets.
+#define CSP_H5_DEFLATE  4           // gzip level of the datasets.
+
+/*@abstract    Write the HDF5 file from the tmp files of the threads.
+@param fn      Filename of the HDF5 file.
+@param ad, dp, oth  Arrays of tmp mtx files, one for each thread, whose records are "<sample>\t<value>" and each
+                    SNP ends with an empty line.
+@param site    Array of tmp site files, one for each thread. Each SNP is one line of
+               "<chrom>\t<pos>\t<ref>\t<alt>\t<AD>\t<DP>\t<OTH>", followed by lines of
+               "<sample>\t<GT>\t<PL>..." of covered samples if @p npl > 0, and ends with an empty line.
+@param n       Size of the arrays.
+@param ns      Num of SNPs.
+@param samples Names of the samples.
+@param nsmp    Num of samples.
+@param npl     Num of PL values of each sample, 0 means no GT/PL.
+@return        0 if success, -1 otherwise.
+ */
+int csp_h5_write(const char *fn, jfile_t **ad, jfile_t **dp, jfile_t **oth, jfile_t **site, int n, size_t ns,
+                 char **samples, int nsmp, int npl);
+
+#endif
@@ -4,7 +4,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "htslib/sam.h"
+#include "htslib/hfile.h"
 #include "htslib/kstring.h"
 #include "htslib/hts.h"
 #include "jsam.h"
@@ -35,6 +39,103 @@ inline const char* csp_fmt_chr_name(const char *name, sam_hdr_t *hdr, kstring_t
     else { return sam_hdr_tid2name(hdr, tid); }
 }
 
+#define CSP_IO_SEQ_BLOCK_SIZE  4194304     // size of hFILE buffer for sequential reading.
+#define CSP_IO_RAND_CACHE_SIZE 16777216    // size of BGZF block cache for random reading.
+
+htsFile* csp_hts_open(const char *fn, const char *mode, int hint) {
+    htsFile *fp = NULL;
+    hFILE *hfp = NULL;
+    int fd;
+    if (CSP_IO_NONE == hint || 0 == strcmp(fn, "-") || strstr(fn, "://")) { return hts_open(fn, mode); }
+    if ((fd = open(fn, O_RDONLY)) < 0) { return hts_open(fn, mode); }
+#if defined(POSIX_FADV_SEQUENTIAL) && defined(POSIX_FADV_RANDOM)
+    posix_fadvise(fd, 0, 0, CSP_IO_SEQ == hint ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM);
+#endif
+    if (NULL == (hfp = hdopen(fd, "r"))) { close(fd); return hts_open(fn, mode); }
+    if (NULL == (fp = hts_hopen(hfp, fn, mode))) { hclose(hfp); return NULL; }
+    if (CSP_IO_SEQ == hint) { hts_set_opt(fp, HTS_OPT_BLOCK_SIZE, CSP_IO_SEQ_BLOCK_SIZE); }
+    else { hts_set_opt(fp, HTS_OPT_CACHE_SIZE, CSP_IO_RAND_CACHE_SIZE); }
+    return fp;
+}
+#undef CSP_IO_SEQ_BLOCK_SIZE
+#undef CSP_IO_RAND_CACHE_SIZE
+
+#define CSP_HDR_CACHE_MAGIC "CSPHDR2"
+
+/* format the name of cache file of the @p idx-th input file into @p s. */
+static void csp_hdr_cache_fn(const char *dir, int idx, kstring_t *s) {
+    ksprintf(s, "%s/%d.hdr", dir, idx);
+}
+
+/*@note      1. The cache file consists of one key line 
+                "CSPHDR2\t<fmt>\t<dev>\t<ino>\t<size>\t<mtime>\t<nref>\t<l_text>\t<fn>" followed by the header
+                text. The cache is valid only if the device, inode, size and mtime of @p fn all match, whatever
+                the path used to reach the file. The filename is only kept for reference.
+             2. The header is rebuilt from text, so the num of references is checked to guard against
+                BAM files whose binary reference list is not fully described by the @SQ lines.
+ */
+sam_hdr_t* csp_hdr_cache_load(const char *dir, int idx, const char *fn, int *fmt) {
+    struct stat st;
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    FILE *fp = NULL;
+    char *line = NULL, *text = NULL;
+    size_t mline = 0;
+    unsigned long l_text;
+    unsigned long long dev, ino;
+    long long size, mtime;
+    int f, nref;
+    ssize_t n;
+    sam_hdr_t *hdr = NULL;
+    if (NULL == dir || strstr(fn, "://") || stat(fn, &st) < 0) { return NULL; }
+    csp_hdr_cache_fn(dir, idx, s);
+    if (NULL == (fp = fopen(ks_str(s), "r"))) { goto clean; }
+    if ((n = getline(&line, &mline, fp)) <= 0) { goto clean; }
+    if (sscanf(line, CSP_HDR_CACHE_MAGIC "\t%d\t%llu\t%llu\t%lld\t%lld\t%d\t%lu\t", &f, &dev, &ino, &size, &mtime, &nref, &l_text) != 7) { goto clean; }
+    if (dev != (unsigned long long) st.st_dev || ino != (unsigned long long) st.st_ino || size != (long long) st.st_size \
+        || mtime != (long long) st.st_mtime) { goto clean; }
+    if (NULL == (text = (char*) malloc(l_text + 1))) { goto clean; }
+    if (fread(text, 1, l_text, fp) != l_text) { goto clean; }
+    text[l_text] = '\0';
+    if (NULL == (hdr = sam_hdr_parse(l_text, text))) { goto clean; }
+    if (sam_hdr_nref(hdr) != nref) { sam_hdr_destroy(hdr); hdr = NULL; goto clean; }
+    *fmt = f;
+  clean:
+    if (fp) { fclose(fp); }
+    free(line); free(text); ks_free(s);
+    return hdr;
+}
+
+/*@note      The cache file is written into a tmp file first and then renamed, so that concurrent runs sharing
+             the same cache dir never see partial files. */
+int csp_hdr_cache_save(const char *dir, int idx, const char *fn, sam_hdr_t *hdr, int fmt) {
+    struct stat st;
+    kstring_t ks = KS_INITIALIZE, *s = &ks, kt = KS_INITIALIZE, *t = &kt;
+    FILE *fp = NULL;
+    const char *text;
+    size_t l_text;
+    int ret = -1;
+    if (NULL == dir || strstr(fn, "://") || stat(fn, &st) < 0) { return -1; }
+    if (NULL == (text = sam_hdr_str(hdr))) { text = ""; l_text = 0; }
+    else { l_text = sam_hdr_length(hdr); }
+    csp_hdr_cache_fn(dir, idx, s);
+    ksprintf(t, "%s.tmp.%d", ks_str(s), (int) getpid());
+    if (NULL == (fp = fopen(ks_str(t), "w"))) { goto clean; }
+    if (fprintf(fp, CSP_HDR_CACHE_MAGIC "\t%d\t%llu\t%llu\t%lld\t%lld\t%d\t%lu\t%s\n", fmt, (unsigned long long) st.st_dev, \
+            (unsigned long long) st.st_ino, (long long) st.st_size, (long long) st.st_mtime, sam_hdr_nref(hdr), \
+            (unsigned long) l_text, fn) < 0) { goto clean; }
+    if (fwrite(text, 1, l_text, fp) != l_text) { goto clean; }
+    if (fclose(fp) < 0) { fp = NULL; goto clean; }
+    fp = NULL;
+    if (rename(ks_str(t), ks_str(s)) < 0) { goto clean; }
+    ret = 0;
+  clean:
+    if (fp) { fclose(fp); }
+    if (ret < 0) { remove(ks_str(t)); }
+    ks_free(s); ks_free(t);
+    return ret;
+}
+#undef CSP_HDR_CACHE_MAGIC
+
 /*@note 1. To speed up, the caller should guarantee parameters b and tag are valid. 
         2. The data of the pointer returned by this function is part of bam1_t, so do not double free!
  */
@@ -44,3 +145,59 @@ inline char* get_bam_aux_str(bam1_t *b, const char tag[2]) {
     return bam_aux2Z(data);
 }
 
+uint32_t csp_bam_laln(const bam1_t *b) {
+    const uint32_t *cigar = bam_get_cigar(b);
+    uint32_t laln = 0;
+    int k, op;
+    for (k = 0; k < b->core.n_cigar; k++) {
+        op = get_cigar_op(cigar[k]);
+        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) { laln += get_cigar_len(cigar[k]); }
+    }
+    return laln;
+}
+
+/*
+* CIGAR Index API
+*/
+void csp_cigar_idx_free(csp_cigar_idx_t *p) {
+    if (NULL == p) { return; }
+    free(p->x); free(p->y);
+    p->x = NULL; p->y = NULL;
+    p->n = p->m = 0;
+}
+
+int csp_cigar_idx_build(csp_cigar_idx_t *p, const bam1_t *b) {
+    const uint32_t *cigar = bam_get_cigar(b);
+    int n = b->core.n_cigar, k, op, l, y;
+    hts_pos_t x, *tx;
+    int *ty;
+    if (n + 1 > p->m) {
+        if (NULL == (tx = (hts_pos_t*) realloc(p->x, (n + 1) * sizeof(hts_pos_t)))) { return -1; }
+        p->x = tx;
+        if (NULL == (ty = (int*) realloc(p->y, (n + 1) * sizeof(int)))) { return -1; }
+        p->y = ty;
+        p->m = n + 1;
+    }
+    for (k = 0, x = b->core.pos, y = 0, p->laln = 0; k < n; k++) {
+        p->x[k] = x; p->y[k] = y;
+        op = get_cigar_op(cigar[k]);
+        l = get_cigar_len(cigar[k]);
+        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) { x += l; y += l; p->laln += l; }
+        else if (op == BAM_CDEL || op == BAM_CREF_SKIP) { x += l; }
+        else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) { y += l; }
+    }
+    p->x[n] = x; p->y[n] = y;
+    p->n = n;
+    return 0;
+}
+
+int csp_cigar_idx_locate(const csp_cigar_idx_t *p, hts_pos_t pos) {
+    int lo = 0, hi = p->n - 1, mid, k = -1;
+    while (lo <= hi) {       // the last op starting at or before pos.
+        mid = lo + ((hi - lo) >> 1);
+        if (p->x[mid] <= pos) { k = mid; lo = mid + 1; }
+        else { hi = mid - 1; }
+    }
+    return k >= 0 && pos < p->x[k + 1] ? k : -1;
+}
+
@@ -29,6 +29,58 @@ inline int csp_sam_hdr_name2id(sam_hdr_t *hdr, const char *name, kstring_t *s);
 */
 inline const char* csp_fmt_chr_name(const char *name, sam_hdr_t *hdr, kstring_t *s);
 
+/*@abstract  Access patterns used as I/O hints when opening input files. */
+#define CSP_IO_NONE    0    // no hint, use the default hts_open().
+#define CSP_IO_SEQ     1    // mostly sequential reads, e.g. Mode 2 scanning whole chromosomes.
+#define CSP_IO_RANDOM  2    // mostly random reads, e.g. Mode 1&3 fetching a list of SNPs.
+
+/*@abstract  Open bam/sam/cram file with I/O hints according to the access pattern.
+@param fn    Filename.
+@param mode  Open mode as in hts_open().
+@param hint  Access pattern, one of CSP_IO_*.
+@return      Pointer to htsFile if success, NULL otherwise.
+
+@note        1. Only local files are affected. The file is opened by ourselves so that posix_fadvise() could be
+                applied to its descriptor before passing it to htslib with hdopen() and hts_hopen(); remote files
+                (e.g. "s3://", "https://") and "-" would fall back to hts_open().
+             2. For CSP_IO_SEQ, the hFILE buffer is enlarged to cut down the num of read() syscalls.
+                For CSP_IO_RANDOM, a BGZF block cache is enabled so that nearby SNPs reuse decompressed blocks.
+             3. The returned htsFile should be closed by hts_close() as usual.
+ */
+htsFile* csp_hts_open(const char *fn, const char *mode, int hint);
+
+/*@abstract  Load the header of a bam/sam/cram file from the on-disk header cache.
+@param dir   Dir of the header cache.
+@param idx   Index of the file in the input files, i.e., gs->in_fns.
+@param fn    Name of the bam/sam/cram file.
+@param fmt   Pointer of int, set to the format of the file (enum htsExactFormat) if cache hit.
+@return      Pointer to sam_hdr_t if cache hit, NULL otherwise.
+
+@note        The cache entry is keyed by @p idx and is valid only if the device, inode, size and mtime of the
+             file are the same as when the entry was saved, so a file replaced or listed in another order
+             misses the cache rather than gets a stale header. Remote files are never cached.
+ */
+sam_hdr_t* csp_hdr_cache_load(const char *dir, int idx, const char *fn, int *fmt);
+
+/*@abstract  Save the header of a bam/sam/cram file into the on-disk header cache.
+@param dir   Dir of the header cache, must exist.
+@param idx   Index of the file in the input files, i.e., gs->in_fns.
+@param fn    Name of the bam/sam/cram file.
+@param hdr   Pointer of sam_hdr_t of the file.
+@param fmt   Format of the file (enum htsExactFormat).
+@return      0 if success, -1 otherwise.
+ */
+int csp_hdr_cache_save(const char *dir, int idx, const char *fn, sam_hdr_t *hdr, int fmt);
+
+/*@abstract  Check whether an iterator returned by sam_itr_queryi() would return no reads.
+@param iter  Pointer of hts_itr_t.
+@return      Non-zero if the iterator is empty, 0 otherwise.
+
+@note        The check is exact only for BAM, where the index tells whether any chunks overlap the region;
+             CRAM iterators are always treated as non-empty.
+ */
+#define csp_itr_empty(iter) ((iter)->finished || (! (iter)->is_cram && 0 == (iter)->n_off))
+
 /*@abstract   The two functions below convert raw cigar op/len value to real value.
 @param c      Raw cigar op/len value stored in bam1_t, can be an element of cigar array obtained by bam_get_cigar(b) [uint32_t].
 @return       An integer [int].
@@ -84,4 +136,50 @@ const char csp_nt5_str[5];
  */
 inline char* get_bam_aux_str(bam1_t *b, const char tag[2]);
 
+/*@abstract   Get the num of bases aligned to the reference, i.e. the total length of M/=/X CIGAR ops.
+@param b      Pointer to the bam1_t structure.
+@return       The num of aligned bases.
+ */
+uint32_t csp_bam_laln(const bam1_t *b);
+
+/*
+* CIGAR Index API
+*/
+/*@abstract   Cumulative reference/query offsets of the CIGAR ops of one read, so that any reference pos could be
+              located by binary search rather than by walking the CIGAR from the first op.
+@param n      Num of CIGAR ops.
+@param m      Size of @p x and @p y.
+@param x      x[k] is the 0-based reference pos where the k-th op starts, and x[n] is the end pos of the read.
+@param y      y[k] is the query pos where the k-th op starts.
+@param laln   Num of bases aligned to the reference, refer to csp_bam_laln().
+
+@note         It is worth building only for reads with many CIGAR ops that are located many times, e.g. long reads.
+ */
+typedef struct {
+    int n, m;
+    hts_pos_t *x;
+    int *y;
+    uint32_t laln;
+} csp_cigar_idx_t;
+
+/*@abstract   Free the internal arrays of csp_cigar_idx_t. The structure itself is not freed. */
+void csp_cigar_idx_free(csp_cigar_idx_t *p);
+
+/*@abstract   Build the CIGAR index of one read.
+@param p      Pointer of csp_cigar_idx_t, whose arrays are reused.
+@param b      Pointer to the bam1_t structure.
+@return       0 if success, -1 otherwise.
+ */
+int csp_cigar_idx_build(csp_cigar_idx_t *p, const bam1_t *b);
+
+/*@abstract   Locate the CIGAR op covering one reference pos.
+@param p      Pointer of csp_cigar_idx_t.
+@param pos    0-based reference pos.
+@return       Index of the op if success, -1 if the pos is not covered by the read.
+
+@note         Ops not consuming the reference, e.g. I and S, never cover a pos. So the result is the same as walking 
+              the CIGAR until the reference end of the op passes @p pos.
+ */
+int csp_cigar_idx_locate(const csp_cigar_idx_t *p, hts_pos_t pos);
+
 #endif
@@ -9,11 +9,13 @@
 #include "htslib/sam.h"
 #include "htslib/kstring.h"
 #include "htslib/khash.h"
+#include "htslib/vcf.h"
 #include "kvec.h"
 #include "jnumeric.h"
 #include "jfile.h"
 #include "jmemory.h"
 #include "config.h"
+#include "csc.h"
 #include "mplp.h"
 
 /*
@@ -137,6 +139,7 @@ inline void csp_plp_destroy(csp_plp_t *p) {
         int i;
         for (i = 0; i < 5; i++) { csp_list_qu_destroy(p->qu[i]); }
         if (p->hug) { csp_map_ug_destroy(p->hug); }
+        csp_list_ri_destroy(p->ri);
         free(p); 
     }
 }
@@ -216,12 +219,32 @@ int csp_plp_to_vcf(csp_plp_t *p, jfile_t *s) {
     return 0;
 }
 
+int csp_plp_to_bcf(csp_plp_t *p, int32_t *gt, int32_t *ad, int32_t *dp, int32_t *oth, int32_t *pl, int npl, int32_t *all) {
+    double tmp = -10 / log(10);
+    int i, m;
+    if (p->tc <= 0) {
+        gt[0] = bcf_gt_missing; gt[1] = bcf_int32_vector_end;
+        *ad = *dp = *oth = bcf_int32_missing;
+        for (i = 0; i < npl; i++) { pl[i] = i ? bcf_int32_vector_end : bcf_int32_missing; }
+        for (i = 0; i < 5; i++) { all[i] = i ? bcf_int32_vector_end : bcf_int32_missing; }
+        return 0;
+    }
+    if (p->ngl > npl) { return -1; }
+    m = get_idx_of_max(cu_d, p->gl, 3);
+    gt[0] = bcf_gt_unphased(m > 0); gt[1] = bcf_gt_unphased(m > 1);    // 0/0, 1/0 or 1/1 as csp_plp_to_vcf().
+    *ad = p->ad; *dp = p->dp; *oth = p->oth;
+    for (i = 0; i < npl; i++) { pl[i] = i < p->ngl ? (int32_t) lrint(p->gl[i] * tmp) : (i ? bcf_int32_vector_end : bcf_int32_missing); }
+    for (i = 0; i < 5; i++) { all[i] = p->bc[i]; }
+    return 0;
+}
+
 /*@note      1. The kstring_t s is also initialized inside this function.   
              2. The valid pointer returned by this function should be freed by csp_mplp_destroy() function
                    when no longer used.
  */
 inline csp_mplp_t* csp_mplp_init(void) { 
     csp_mplp_t *p = (csp_mplp_t*) calloc(1, sizeof(csp_mplp_t));
+    if (p) { p->rng = CSP_MPLP_SEED; }
     return p;
 }
 
@@ -232,6 +255,9 @@ inline void csp_mplp_destroy(csp_mplp_t *p) {
         if (p->pu) { csp_pool_uu_destroy(p->pu); }
         if (p->pl) { csp_pool_ul_destroy(p->pl); }
         if (p->su) { csp_pool_ps_destroy(p->su); }
+        csp_list_pu_destroy(p->ru);
+        ks_free(&p->rs);
+        free(p->gbc);
         free(p); 
     }
 }
@@ -240,12 +266,22 @@ inline void csp_mplp_reset(csp_mplp_t *p) {
     if (p) {
         memset(p->bc, 0, sizeof(p->bc));
         p->tc = p->ad = p->dp = p->oth = 0;
-        p->nr_ad = p->nr_dp = p->nr_oth = 0;
-        if (p->hsg) { csp_map_sg_reset_val(p->hsg); }
-        if (p->pu) { csp_pool_uu_reset(p->pu); }
-        if (p->pl) { csp_pool_ul_reset(p->pl); }
-        if (p->su) { csp_pool_ps_reset(p->su); }
+        if (p->gbc) { memset(p->gbc, 0, p->ngrp * 5 * sizeof(size_t)); }
+        if (p->pushed) {     // sample groups are untouched if nothing was pushed, e.g. the pos is rejected by pre-check.
+            if (p->hsg) { csp_map_sg_reset_val(p->hsg); }
+            if (p->pu) { csp_pool_uu_reset(p->pu); }
+            if (p->pl) { csp_pool_ul_reset(p->pl); }
+            if (p->su) { csp_pool_ps_reset(p->su); }
+            p->pushed = 0;
+        }
         memset(p->qvec, 0, sizeof(p->qvec));
+        memset(p->rbc, 0, sizeof(p->rbc));
+        csp_list_pu_reset(p->ru);
+        ks_clear(&p->rs);
+        if (p->ncap) { p->cap_reads += p->ncap; p->cap_sites++; p->ncap = 0; }
+        if (p->nsamp) { p->samp_sites++; p->nsamp = 0; }
+        p->rng = CSP_MPLP_SEED;
+        p->stamp++;
     }
 }
 
@@ -329,45 +365,55 @@ inline int csp_mplp_to_vcf(csp_mplp_t *mplp, jfile_t *s) {
     return 0;
 }
 
-inline int csp_mplp_str_mtx(csp_mplp_t *mplp, kstring_t *ks_ad, kstring_t *ks_dp, kstring_t *ks_oth, size_t idx) {
-    csp_plp_t *plp;
-    int i;
-    for (i = 1; i <= mplp->nsg; i++) {
-        plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[i]);
-        if (plp->ad) ksprintf(ks_ad, "%ld\t%d\t%ld\n", idx, i, plp->ad);
-        if (plp->dp) ksprintf(ks_dp, "%ld\t%d\t%ld\n", idx, i, plp->dp);
-        if (plp->oth) ksprintf(ks_oth, "%ld\t%d\t%ld\n", idx, i, plp->oth);        
+static const char *csp_mtx_tags[CSP_NTAG] = {"AD", "DP", "OTH", "REF", "A", "C", "G", "T", "N"};
+
+const char* csp_mtx_tag_name(int tag) { return csp_mtx_tags[tag]; }
+
+int csp_mtx_tags_parse(const char *s) {
+    const char *p, *q;
+    int mask = 0, t;
+    for (p = s; ; p = q + 1) {
+        if (NULL == (q = strchr(p, ','))) { q = p + strlen(p); }
+        for (t = 0; t < CSP_NTAG; t++) {
+            if (strlen(csp_mtx_tags[t]) == (size_t) (q - p) && 0 == strncmp(p, csp_mtx_tags[t], q - p)) { break; }
+        }
+        if (t >= CSP_NTAG) { return -1; }
+        mask |= CSP_TAG_MASK(t);
+        if ('\0' == *q) { break; }
     }
-    return 0; 
+    return mask;
 }
 
-/*@note          This function is used for tmp files.
- */
-inline int csp_mplp_str_mtx_tmp(csp_mplp_t *mplp, kstring_t *ks_ad, kstring_t *ks_dp, kstring_t *ks_oth) {
-    csp_plp_t *plp;
-    int i;
-    for (i = 1; i <= mplp->nsg; i++) {
-        plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[i]);
-        if (plp->ad) ksprintf(ks_ad, "%d\t%ld\n", i, plp->ad);
-        if (plp->dp) ksprintf(ks_dp, "%d\t%ld\n", i, plp->dp);
-        if (plp->oth) ksprintf(ks_oth, "%d\t%ld\n", i, plp->oth);        
+int csp_mplp_to_grp(csp_mplp_t *mplp, jfile_t **fs, size_t *nr) {
+    size_t v;
+    int i, t;
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (NULL == fs[t]) { continue; }
+        for (i = 0; i < mplp->ngrp; i++) {
+            if (0 == (v = csp_mtx_value(t, mplp->gbc + i * 5, mplp->ref_idx, mplp->alt_idx))) { continue; }
+            jf_printf(fs[t], "%d\t%ld\n", i + 1, v);
+            nr[t]++;
+        }
+        jf_putc('\n', fs[t]);
     }
-    kputc('\n', ks_ad); kputc('\n', ks_dp); kputc('\n', ks_oth);
-    return 0; 
+    return 0;
 }
 
-int csp_mplp_to_mtx(csp_mplp_t *mplp, jfile_t *fs_ad, jfile_t *fs_dp, jfile_t *fs_oth, size_t idx) {
+int csp_mplp_to_mtx(csp_mplp_t *mplp, jfile_t **fs, csp_csc_spill_t **csc, size_t *nr, size_t idx) {
     csp_plp_t *plp;
-    int i;
-    for (i = 1; i <= mplp->nsg; i++) {
-        plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[i - 1]);
-        if (plp->ad) fs_ad->is_tmp ? jf_printf(fs_ad, "%d\t%ld\n", i, plp->ad) : jf_printf(fs_ad, "%ld\t%d\t%ld\n", idx, i, plp->ad);
-        if (plp->dp) fs_dp->is_tmp ? jf_printf(fs_dp, "%d\t%ld\n", i, plp->dp) : jf_printf(fs_dp, "%ld\t%d\t%ld\n", idx, i, plp->dp);
-        if (plp->oth) fs_oth->is_tmp ? jf_printf(fs_oth, "%d\t%ld\n", i, plp->oth) : jf_printf(fs_oth, "%ld\t%d\t%ld\n", idx, i, plp->oth);      
+    size_t v;
+    int i, t;
+    for (t = 0; t < CSP_NTAG; t++) {
+        if (NULL == fs[t]) { continue; }
+        for (i = 1; i <= mplp->nsg; i++) {
+            plp = csp_map_sg_val(mplp->hsg, mplp->hsg_iter[i - 1]);
+            if (0 == (v = csp_mtx_value(t, plp->bc, mplp->ref_idx, mplp->alt_idx))) { continue; }
+            fs[t]->is_tmp ? jf_printf(fs[t], "%d\t%ld\n", i, v) : jf_printf(fs[t], "%ld\t%d\t%ld\n", idx, i, v);
+            if (csc && csc[t] && csp_csc_spill_push(csc[t], idx - 1, i - 1, v) < 0) { return -1; }
+            nr[t]++;
+        }
+        if (fs[t]->is_tmp) jf_putc('\n', fs[t]);
     }
-    if (fs_ad->is_tmp) jf_putc('\n', fs_ad);
-    if (fs_dp->is_tmp) jf_putc('\n', fs_dp);
-    if (fs_oth->is_tmp) jf_putc('\n', fs_oth);
     return 0; 
 }
 
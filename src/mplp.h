@@ -13,6 +13,7 @@
 #include "jfile.h"
 #include "jmemory.h"
 #include "config.h"
+#include "csc.h"
 
 /*
 * Pileup and MPileup API
@@ -194,6 +195,17 @@ typedef kvec_t(int8_t) csp_list_qu_t;
 #define csp_list_qu_destroy(v) kv_destroy(v)
 #define csp_list_qu_reset(v) ((v).n = 0)
 
+/* Struct csp_list_ri_t APIs 
+@abstract  The structure stores indexes of the buffered reads of one sample for certain query pos.
+@param v   The csp_list_ri_t structure [csp_list_ri_t].
+ */
+typedef kvec_t(size_t) csp_list_ri_t;
+#define csp_list_ri_push(v, x) kv_push(size_t, v, x)
+#define csp_list_ri_A(v, i) kv_A(v, i)
+#define csp_list_ri_size(v) kv_size(v)
+#define csp_list_ri_destroy(v) kv_destroy(v)
+#define csp_list_ri_reset(v) ((v).n = 0)
+
 /*@abstract    Internal function to convert the base call quality score to related values for different genotypes.
 @param qual    Qual value for the query pos in the read of the UMI gruop. The value is extracted by calling bam_get_qual() and 
                could be translated to qual char by plusing 33.
@@ -248,6 +260,9 @@ inline void csp_infer_allele(size_t *bc, int8_t *ref_idx, int8_t *alt_idx);
                GL2-GL5: L(ra|..), L(aa|..), L(rr+ra|..), L(ra+aa|..).
 @param ngl   Num of valid elements in the array gl.
 @param hug   Pointer of hash table that stores stat info of UMI groups.
+@param nraw  Num of reads of the sample seen by csp_mplp_buf_push() for the pos, only used with a per-cell cap.
+@param ri    Indexes of the buffered reads of the sample in csp_mplp_t::ru, only used with a per-cell cap.
+@param rstamp  Value of csp_mplp_t::stamp when @p nraw and @p ri were last used. They are stale if it differs.
  */
 typedef struct {
     size_t bc[5];
@@ -257,6 +272,9 @@ typedef struct {
     double gl[5];
     int ngl;
     csp_map_ug_t *hug;
+    size_t nraw;
+    csp_list_ri_t ri;
+    uint64_t rstamp;
 } csp_plp_t;
 
 /* note that the @p qu is also initialized after calling calloc(). */
@@ -282,6 +300,46 @@ int csp_plp_str_vcf(csp_plp_t *p, kstring_t *s);
 
 int csp_plp_to_vcf(csp_plp_t *p, jfile_t *s);
 
+/*@abstract     Fill the BCF FORMAT values of one cell/sample, the binary counterpart of csp_plp_to_vcf().
+@param p        Pointer of csp_plp_t structure corresponding to the pos.
+@param gt       Pointer of 2 values of GT, encoded by bcf_gt_unphased().
+@param ad, dp, oth  Pointers of 1 value of AD, DP and OTH.
+@param pl       Pointer of @p npl values of PL, padded by bcf_int32_vector_end.
+@param npl      Num of values of PL.
+@param all      Pointer of 5 values of ALL.
+@return         0 if success, -1 otherwise.
+ */
+int csp_plp_to_bcf(csp_plp_t *p, int32_t *gt, int32_t *ad, int32_t *dp, int32_t *oth, int32_t *pl, int npl, int32_t *all);
+
+/*@abstract  One base of one read for certain query pos, whose sample group has been resolved but which has not 
+             been pushed into the sample group yet.
+@param plp   Pointer of csp_plp_t of the sample group.
+@param umi   Pointer of UMI of the read, NULL if UMI is not used or the UMI is kept in a buffer at @p uoff.
+@param uoff  Offset of the UMI in the string buffer of csp_mplp_t, CSP_PU_NO_UOFF if the UMI is not copied.
+@param base  The base, a 4-bit integer returned by bam_seqi().
+@param qual  The qual of the base.
+ */
+typedef struct {
+    csp_plp_t *plp;
+    const char *umi;
+    size_t uoff;
+    int8_t base, qual;
+} csp_plp_unit_t;
+
+#define CSP_PU_NO_UOFF ((size_t)-1)
+
+/* Struct csp_list_pu_t APIs
+@abstract  The list of csp_plp_unit_t waiting to be pushed for certain query pos.
+@param v   The csp_list_pu_t structure [csp_list_pu_t].
+ */
+typedef kvec_t(csp_plp_unit_t) csp_list_pu_t;
+#define csp_list_pu_init(v) kv_init(v)
+#define csp_list_pu_push(v, x) kv_push(csp_plp_unit_t, v, x)
+#define csp_list_pu_A(v, i) kv_A(v, i)
+#define csp_list_pu_size(v) kv_size(v)
+#define csp_list_pu_destroy(v) kv_destroy(v)
+#define csp_list_pu_reset(v) ((v).n = 0)
+
 /*@abstract    The HashMap maps sample-group-name (char*) to csp_plp_t (*).
 @example       Refer to a simple example in khash.h.
  */
@@ -328,7 +386,6 @@ typedef khash_t(sg) csp_map_sg_t;
 @param ad    Read count of alt.
 @param dp    Read count of alt + ref.
 @param oth   Read count of bases except alt and ref.
-@param nr_*  Num of records/lines outputed to mtx file for certain SNP/pos.
 @param hsg   HashMap that stores the stat info of all sample groups for the pos.
 @param hsg_iter Pointer of array of csp_map_sg_iter. The iter in the array is in the same order of sg names.
 @param nsg   Size of csp_map_sg_iter array hsg_iter.
@@ -336,12 +393,32 @@ typedef khash_t(sg) csp_map_sg_t;
 @param pl    Pool of csp_list_uu_t structures.
 @param su    Pool of UMI strings.
 @param qvec  A container for the qual vector returned by get_qual_vector().
+@param rbc   Raw read count of each base, before UMI collapsing, of the reads in @p ru, in the order of 'ACGTN'.
+@param ru    Buffer of bases of reads that are waiting to be pushed into sample groups, refer to csp_mplp_buf_push().
+@param rs    Buffer of the UMI strings of @p ru.
+@param pushed  If any read has been pushed into sample groups since last reset.
+@param ncap  Num of reads dropped by the per-cell cap for the pos, refer to global_settings::cell_cap.
+@param nsamp Num of quals not kept by the reservoir sampling for the pos, refer to global_settings::qual_cap.
+@param rng   State of the random generator of the reservoir sampling, reset to CSP_MPLP_SEED for each pos so that
+             the sampling of a pos does not depend on which positions were processed before.
+@param cap_reads  Accumulated @p ncap of all positions, not cleared by csp_mplp_reset().
+@param cap_sites  Num of positions where @p ncap > 0, not cleared by csp_mplp_reset().
+@param samp_sites Num of positions where @p nsamp > 0, not cleared by csp_mplp_reset().
+@param grp   Group index of each sample group in the order of @p hsg_iter, -1 if it is in no group, NULL without
+             --cellGroups. Shared with global_settings::sg_grp and not freed by csp_mplp_destroy().
+@param ngrp  Num of groups.
+@param gbc   Read count of each base of each group, @p ngrp x 5 in the order of 'ACGTN', summed by csp_mplp_stat()
+             from the UMI-collapsed counts of the sample groups.
+@param stamp Increased by csp_mplp_reset(), so that the per-pos reservoirs of the sample groups (csp_plp_t::nraw 
+             and csp_plp_t::ri) are cleared lazily, even for positions where nothing is pushed into the groups.
+
+@note        The reads of a pos are first buffered in @p ru with aggregate counts in @p rbc, so that a pos that could
+             not pass filters is rejected without the per sample group work, refer to csp_mplp_precheck().
  */
 typedef struct {
     int8_t ref_idx, alt_idx, inf_rid, inf_aid;
     size_t bc[5];
     size_t tc, ad, dp, oth;
-    size_t nr_ad, nr_dp, nr_oth;
     csp_map_sg_t *hsg;
     csp_map_sg_iter *hsg_iter;
     int nsg;
@@ -349,8 +426,31 @@ typedef struct {
     csp_pool_ul_t *pl;
     csp_pool_ps_t *su;
     double qvec[4];
+    size_t rbc[5];
+    csp_list_pu_t ru;
+    kstring_t rs;
+    int pushed;
+    size_t ncap, nsamp;
+    uint64_t rng;
+    size_t cap_reads, cap_sites, samp_sites;
+    const int *grp;
+    int ngrp;
+    size_t *gbc;
+    uint64_t stamp;
 } csp_mplp_t;
 
+#define CSP_MPLP_SEED 0x9E3779B97F4A7C15ULL
+
+/*@abstract  Get a random integer in [0, n) by the xorshift64* generator of csp_mplp_t.
+@param p     Pointer of csp_mplp_t.
+@param n     The upper bound, should be > 0.
+@return      The random integer.
+ */
+static inline size_t csp_mplp_rand(csp_mplp_t *p, size_t n) {
+    p->rng ^= p->rng >> 12; p->rng ^= p->rng << 25; p->rng ^= p->rng >> 27;
+    return (size_t) ((p->rng * 0x2545F4914F6CDD1DULL) >> 11) % n;
+}
+
 /*@abstract  Initialize the csp_mplp_t structure.
 @return      Pointer to the csp_mplp_t structure if success, NULL otherwise.
 
@@ -394,84 +494,74 @@ inline int csp_mplp_str_vcf(csp_mplp_t *mplp, kstring_t *s);
 
 inline int csp_mplp_to_vcf(csp_mplp_t *mplp, jfile_t *s);
 
-/*@abstract    Format the content of csp_mplp_t of certain query pos to string in the output sparse matrices file.
-@param mplp    Pointer of the csp_mplp_t structure corresponding to the pos.
-@param ks_ad   Pointer of kstring_t which is to store formatted AD string.
-@param ks_dp   Pointer of kstring_t which is to store formatted DP string.
-@param ks_oth  Pointer of kstring_t which is to store formatted OTH string.
-@param idx     Index of the SNP/mplp (1-based).
-@return        0 if success, -1 otherwise.
- */
-inline int csp_mplp_str_mtx(csp_mplp_t *mplp, kstring_t *ks_ad, kstring_t *ks_dp, kstring_t *ks_oth, size_t idx);
-
-/*@abstract    Format the content of csp_mplp_t of certain query pos to string in the tmp output sparse matrices file.
-@param mplp    Pointer of the csp_mplp_t structure corresponding to the pos.
-@param ks_ad   Pointer of kstring_t which is to store formatted AD string.
-@param ks_dp   Pointer of kstring_t which is to store formatted DP string.
-@param ks_oth  Pointer of kstring_t which is to store formatted OTH string.
-@return        0 if success, -1 otherwise.
-
-@note          This function is used for tmp files.
- */
-inline int csp_mplp_str_mtx_tmp(csp_mplp_t *mplp, kstring_t *ks_ad, kstring_t *ks_dp, kstring_t *ks_oth);
-
-int csp_mplp_to_mtx(csp_mplp_t *mplp, jfile_t *fs_ad, jfile_t *fs_dp, jfile_t *fs_oth, size_t idx); 
-
-#if DEVELOP
-/* 
-* Tags for sparse matrices
-* It's useful when the input tags are optional.
+/*
+* Tags of sparse matrices
+* Each tag is one matrix of SNPs x samples whose values are computed from the base counts of each sample,
+* only the tags selected by --outTags are formatted, written and merged, refer to global_settings::out_tags.
 */
-typedef size_t csp_mtx_value_t;
-typedef int csp_mtx_iter_t;
-typedef csp_mtx_value_t (*csp_mtx_value_func_t)(csp_mplp_t*, csp_plp_t*);
-
-inline csp_mtx_value_t csp_mtx_value_AD(csp_mplp_t *mplp, csp_plp_t *plp) {
-    return plp->ad;
-}
-
-inline csp_mtx_value_t csp_mtx_value_DP(csp_mplp_t *mplp, csp_plp_t *plp) {
-    return plp->dp;
-}
-
-inline csp_mtx_value_t csp_mtx_value_OTH(csp_mplp_t *mplp, csp_plp_t *plp) {
-    return plp->oth;
+#define CSP_TAG_AD    0
+#define CSP_TAG_DP    1
+#define CSP_TAG_OTH   2
+#define CSP_TAG_REF   3
+#define CSP_TAG_A     4     // A, C, G, T and N are in the same order as csp_plp_t::bc.
+#define CSP_TAG_C     5
+#define CSP_TAG_G     6
+#define CSP_TAG_T     7
+#define CSP_TAG_N     8
+#define CSP_NTAG      9
+
+#define CSP_TAG_MASK(t) (1 << (t))
+
+/*@abstract    Value of one tag of one sample.
+@param tag     One of CSP_TAG_*.
+@param bc      Read count of each base of the sample, in the order of 'ACGTN'.
+@param ref_idx Index of ref in "ACGTN".
+@param alt_idx Index of alt in "ACGTN".
+@return        The value.
+ */
+static inline size_t csp_mtx_value(int tag, const size_t *bc, int8_t ref_idx, int8_t alt_idx) {
+    switch (tag) {
+        case CSP_TAG_AD: return bc[alt_idx];
+        case CSP_TAG_DP: return bc[ref_idx] + bc[alt_idx];
+        case CSP_TAG_OTH: return bc[0] + bc[1] + bc[2] + bc[3] + bc[4] - bc[ref_idx] - bc[alt_idx];
+        case CSP_TAG_REF: return bc[ref_idx];
+        default: return bc[tag - CSP_TAG_A];
+    }
 }
 
-static csp_mtx_iter_t csp_mtx_ntags = 3;
-static char *csp_mtx_tags[] = {"AD", "DP", "OTH"};
-static csp_mtx_value_func_t csp_mtx_value_funcs[] = { &csp_mtx_value_AD, &csp_mtx_value_DP, &csp_mtx_value_OTH };
-
-inline char* csp_get_mtx_fn(char *tag) {
-    kstring_t ks = KS_INITIALIZE;
-    ksprintf(&ks, "cellSNP.tag.%s.mtx", tag);
-    char *p = strdup(ks_str(&ks));
-    ks_free(&ks);
-    return p;
-}
+/*@abstract  Name of one tag, e.g., "AD" for CSP_TAG_AD.
+@param tag   One of CSP_TAG_*.
+@return      The name.
+ */
+const char* csp_mtx_tag_name(int tag);
 
-inline csp_mtx_iter_t csp_get_mtx_idx(char *tag) {
-    csp_mtx_iter_t i;
-    for (i = 0; i < csp_mtx_ntags; i++) {
-        if (0 == strcmp(tag, csp_mtx_tags[i])) { return i; }
-    } 
-    return -1;
-}
+/*@abstract  Parse the comma separated names of tags, e.g., "AD,DP".
+@param s     The names.
+@return      Bit mask of the tags, refer to CSP_TAG_MASK(), if success, -1 otherwise.
+ */
+int csp_mtx_tags_parse(const char *s);
 
-inline csp_mtx_value_func_t csp_get_mtx_value_func(csp_mtx_iter_t i) { return csp_mtx_value_funcs[i]; }
+/*@abstract    Output the values of the selected tags of certain query pos to the sparse matrices files.
+@param mplp    Pointer of the csp_mplp_t structure corresponding to the pos.
+@param fs      Array of the files indexed by CSP_TAG_*, NULL for the tags not selected.
+@param csc     Array of the spill files of the cell-major copies indexed as @p fs, NULL without --cellMajor.
+@param nr      Array of the num of records indexed by CSP_TAG_*, increased by the records outputed.
+@param idx     Index of the SNP/mplp (1-based), only used by the non-tmp files and @p csc.
+@return        0 if success, -1 otherwise.
 
-typedef struct {
-    char *out_fn;
-    csp_mtx_value_func_t vfunc;
-} csp_mtx_tag_fs;
+@note          Records of tmp files are "<sample>\t<value>" and each SNP ends with an empty line.
+ */
+int csp_mplp_to_mtx(csp_mplp_t *mplp, jfile_t **fs, csp_csc_spill_t **csc, size_t *nr, size_t idx);
 
-inline csp_mtx_tag_fs* csp_mtx_tag_fs_init(void) {
-    return (csp_mtx_tag_fs*) calloc(1, sizeof(csp_mtx_tag_fs));
-}
+/*@abstract    Output the values of the selected tags of the groups (--cellGroups) of certain query pos.
+@param mplp    Pointer of the csp_mplp_t structure corresponding to the pos, whose @p gbc has been summed.
+@param fs      Array of the tmp files indexed by CSP_TAG_*, NULL for the tags not selected.
+@param nr      Array of the num of records indexed by CSP_TAG_*, increased by the records outputed.
+@return        0 if success, -1 otherwise.
 
-inline void sp_mtx_tag_fs_destroy(csp_mtx_tag_fs *p) {
-    if (p) { free(p->out_fn); free(p); }
-}
-#endif
+@note          Records are "<group>\t<value>" and each SNP ends with an empty line, as the tmp files of
+               csp_mplp_to_mtx().
+ */
+int csp_mplp_to_grp(csp_mplp_t *mplp, jfile_t **fs, size_t *nr);
 
 #endif
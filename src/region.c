@@ -0,0 +1,157 @@
+/* Target region operations API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "htslib/hts.h"
+#include "htslib/kseq.h"
+#include "htslib/kstring.h"
+#include "htslib/khash.h"
+#include "region.h"
+
+/*
+* Target Region API
+*/
+
+void csp_regidx_destroy(csp_regidx_t *p) {
+    int i;
+    if (NULL == p) { return; }
+    if (p->c) {
+        for (i = 0; i < p->n; i++) { free(p->c[i].chr); free(p->c[i].a); }
+        free(p->c);
+    }
+    if (p->h) { kh_destroy(reg, p->h); }
+    free(p);
+}
+
+/*@abstract  Push one interval into the index.
+@return      0 if success, -1 otherwise.
+ */
+static int csp_regidx_push(csp_regidx_t *p, const char *chr, hts_pos_t beg, hts_pos_t end) {
+    csp_regchr_t *c, *t;
+    hts_pair_pos_t *a;
+    khiter_t k;
+    int r;
+    k = kh_put(reg, p->h, chr, &r);
+    if (r < 0) { return -1; }
+    else if (r > 0) {
+        if (p->n >= p->m) {
+            p->m = p->m ? p->m << 1 : 32;
+            if (NULL == (t = (csp_regchr_t*) realloc(p->c, p->m * sizeof(csp_regchr_t)))) { kh_del(reg, p->h, k); return -1; }
+            p->c = t;
+        }
+        c = p->c + p->n;
+        memset(c, 0, sizeof(csp_regchr_t));
+        if (NULL == (c->chr = strdup(chr))) { kh_del(reg, p->h, k); return -1; }
+        kh_key(p->h, k) = c->chr;        // the key should live as long as the hash.
+        kh_val(p->h, k) = p->n++;
+    } else { c = p->c + kh_val(p->h, k); }
+    if (c->n >= c->m) {
+        c->m = c->m ? c->m << 1 : 16;
+        if (NULL == (a = (hts_pair_pos_t*) realloc(c->a, c->m * sizeof(hts_pair_pos_t)))) { return -1; }
+        c->a = a;
+    }
+    c->a[c->n].beg = beg; c->a[c->n].end = end; c->n++;
+    return 0;
+}
+
+static int cmp_pair_pos(const void *x, const void *y) {
+    const hts_pair_pos_t *a = (const hts_pair_pos_t*) x, *b = (const hts_pair_pos_t*) y;
+    if (a->beg != b->beg) { return a->beg < b->beg ? -1 : 1; }
+    return a->end < b->end ? -1 : (a->end > b->end);
+}
+
+/*@abstract  Sort and merge the intervals of one chrom. */
+static void csp_regchr_merge(csp_regchr_t *c) {
+    int i, j;
+    if (c->n <= 0) { return; }
+    qsort(c->a, c->n, sizeof(hts_pair_pos_t), cmp_pair_pos);
+    for (i = 1, j = 0; i < c->n; i++) {
+        if (c->a[i].beg <= c->a[j].end) {
+            if (c->a[i].end > c->a[j].end) { c->a[j].end = c->a[i].end; }
+        } else { c->a[++j] = c->a[i]; }
+    }
+    c->n = j + 1;
+    for (i = 0, c->nbase = 0; i < c->n; i++) { c->nbase += c->a[i].end - c->a[i].beg; }
+}
+
+csp_regidx_t* csp_regidx_load(const char *fn) {
+    csp_regidx_t *p = NULL;
+    htsFile *fp = NULL;
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    char *chr, *q, *e;
+    hts_pos_t beg, end;
+    long nl = 0;
+    int i, ret;
+    if (NULL == (p = (csp_regidx_t*) calloc(1, sizeof(csp_regidx_t)))) { return NULL; }
+    if (NULL == (p->h = kh_init(reg))) { goto fail; }
+    if (NULL == (fp = hts_open(fn, "r"))) {
+        fprintf(stderr, "[E::%s] failed to open '%s'.\n", __func__, fn);
+        goto fail;
+    }
+    while ((ret = hts_getline(fp, KS_SEP_LINE, s)) >= 0) {
+        nl++;
+        if (0 == ks_len(s) || '#' == s->s[0] || 0 == strncmp(s->s, "track", 5) || 0 == strncmp(s->s, "browser", 7)) { continue; }
+        chr = s->s;
+        if (NULL == (q = strchr(chr, '\t'))) { goto parse_fail; }
+        *q++ = '\0';
+        beg = strtoll(q, &e, 10);
+        if (e == q || '\t' != *e) { goto parse_fail; }
+        q = e + 1;
+        end = strtoll(q, &e, 10);
+        if (e == q || ('\0' != *e && '\t' != *e && '\r' != *e)) { goto parse_fail; }
+        if (beg < 0 || end <= beg) { continue; }     // empty interval.
+        if (csp_regidx_push(p, chr, beg, end) < 0) {
+            fprintf(stderr, "[E::%s] failed to add line %ld of '%s'.\n", __func__, nl, fn);
+            goto fail;
+        }
+    }
+    if (ret < -1) { fprintf(stderr, "[E::%s] failed to read '%s'.\n", __func__, fn); goto fail; }
+    for (i = 0; i < p->n; i++) { csp_regchr_merge(p->c + i); }
+    hts_close(fp);
+    ks_free(s);
+    return p;
+  parse_fail:
+    fprintf(stderr, "[E::%s] failed to parse line %ld of '%s'.\n", __func__, nl, fn);
+  fail:
+    if (fp) { hts_close(fp); }
+    ks_free(s);
+    csp_regidx_destroy(p);
+    return NULL;
+}
+
+/*@note          Same as csp_sam_hdr_name2id(), the name with "chr" prefix removed or added is tried if the name 
+                 itself is not found.
+ */
+csp_regchr_t* csp_regidx_get(csp_regidx_t *p, const char *chr) {
+    kstring_t ks = KS_INITIALIZE, *s = &ks;
+    khiter_t k;
+    if (NULL == p) { return NULL; }
+    if ((k = kh_get(reg, p->h, chr)) == kh_end(p->h)) {
+        if (0 == strncmp(chr, "chr", 3)) { k = kh_get(reg, p->h, chr + 3); }
+        else {
+            kputs("chr", s); kputs(chr, s);
+            k = kh_get(reg, p->h, ks_str(s));
+            ks_free(s);
+        }
+        if (k == kh_end(p->h)) { return NULL; }
+    }
+    return p->c + kh_val(p->h, k);
+}
+
+int csp_regchr_cover(const csp_regchr_t *c, hts_pos_t pos, int *hint) {
+    int i = *hint, lo, hi, mid;
+    if (c->n <= 0) { return 0; }
+    if (i < 0 || i >= c->n || (i > 0 && pos < c->a[i - 1].end)) {   // not ascending, binary search the last interval with beg <= pos.
+        for (lo = 0, hi = c->n - 1, i = 0; lo <= hi; ) {
+            mid = lo + ((hi - lo) >> 1);
+            if (c->a[mid].beg <= pos) { i = mid; lo = mid + 1; }
+            else { hi = mid - 1; }
+        }
+    }
+    while (i < c->n - 1 && c->a[i].end <= pos) { i++; }
+    *hint = i;
+    return i < c->n && pos >= c->a[i].beg && pos < c->a[i].end;
+}
@@ -0,0 +1,74 @@
+/* Target region operations API/routine
+ * Author: Xianjie Huang <hxj5@hku.hk>
+ */
+#ifndef CSP_REGION_H
+#define CSP_REGION_H
+
+#include "htslib/sam.h"
+#include "htslib/khash.h"
+
+/*
+* Target Region API
+*/
+/*@abstract    Sorted and merged target intervals of one chrom.
+@param chr     Name of the chrom.
+@param a       Array of intervals, 0-based and half-open as in BED, sorted by beg and non-overlapping.
+@param n       Num of intervals in @p a.
+@param m       Size of @p a.
+@param nbase   Num of targeted bases, i.e. the total length of the intervals.
+ */
+typedef struct {
+    char *chr;
+    hts_pair_pos_t *a;
+    int n, m;
+    hts_pos_t nbase;
+} csp_regchr_t;
+
+KHASH_MAP_INIT_STR(reg, int)
+
+/*@abstract    The interval index of target regions, e.g. loaded from a BED file.
+@param c       Array of csp_regchr_t, one for each chrom, in the order of their first appearance.
+@param n       Num of chroms in @p c.
+@param m       Size of @p c.
+@param h       HashMap mapping chrom name to its index in @p c.
+
+@note          The structure should be created by csp_regidx_load() and freed by csp_regidx_destroy().
+ */
+typedef struct {
+    csp_regchr_t *c;
+    int n, m;
+    khash_t(reg) *h;
+} csp_regidx_t;
+
+void csp_regidx_destroy(csp_regidx_t *p);
+
+/*@abstract    Load target regions from a BED file (plain or gzipped).
+@param fn      Filename of the BED file.
+@return        Pointer of csp_regidx_t if success, NULL otherwise.
+
+@note          1. Only the first 3 columns are used. Header lines starting with '#', "track" or "browser" are skipped.
+               2. The intervals of each chrom are sorted and overlapping or adjacent ones are merged.
+ */
+csp_regidx_t* csp_regidx_load(const char *fn);
+
+/*@abstract    Get the targets of one chrom.
+@param p       Pointer of csp_regidx_t.
+@param chr     Name of the chrom.
+@return        Pointer of csp_regchr_t if the chrom has targets, NULL otherwise.
+@note          The name with "chr" prefix removed or added is also tried.
+ */
+csp_regchr_t* csp_regidx_get(csp_regidx_t *p, const char *chr);
+
+/*@abstract    Whether a pos is covered by the targets of one chrom.
+@param c       Pointer of csp_regchr_t.
+@param pos     0-based pos.
+@param hint    Pointer of index of the interval to start searching from, updated by this function. Set it to 0
+               before querying a new chrom.
+@return        1 if covered, 0 otherwise.
+
+@note          The search moves forward from @p hint for ascending queries, which is the usual case during pileup,
+               and falls back to binary search otherwise.
+ */
+int csp_regchr_cover(const csp_regchr_t *c, hts_pos_t pos, int *hint);
+
+#endif
@@ -7,6 +7,7 @@
 #include <string.h>
 #include "htslib/vcf.h"
 #include "htslib/sam.h"
+#include "htslib/khash.h"
 #include "kvec.h"
 #include "jstring.h"
 #include "snp.h"
@@ -28,6 +29,42 @@ inline void csp_snp_reset(csp_snp_t *p) {
     if (p) { free(p->chr); memset(p, 0, sizeof(csp_snp_t)); }
 }
 
+KHASH_MAP_INIT_STR(snp_ctg, int)
+
+/*@note          The names are the chr of the SNPs themselves, so only the array, not the names, should be freed 
+                 and the array should not be used after the snplist is destroyed.
+ */
+int csp_snplist_contigs(csp_snplist_t *pl, const char ***names) {
+    khash_t(snp_ctg) *h = NULL;
+    khiter_t k;
+    const char **a = NULL, **t;
+    csp_snp_t *p, *q = NULL;
+    size_t i;
+    int n = 0, m = 0, r;
+    *names = NULL;
+    if (NULL == (h = kh_init(snp_ctg))) { return -1; }
+    for (i = 0; i < csp_snplist_size(*pl); i++, q = p) {
+        p = csp_snplist_A(*pl, i);
+        if (q && 0 == strcmp(p->chr, q->chr)) { p->cid = q->cid; continue; }   // SNPs are usually sorted by chr.
+        k = kh_put(snp_ctg, h, p->chr, &r);
+        if (r < 0) { goto fail; }
+        else if (r == 0) { p->cid = kh_val(h, k); continue; }
+        if (n >= m) {
+            m = m ? m << 1 : 32;
+            if (NULL == (t = (const char**) realloc(a, m * sizeof(const char*)))) { goto fail; }
+            a = t;
+        }
+        a[n] = p->chr; kh_val(h, k) = p->cid = n; n++;
+    }
+    kh_destroy(snp_ctg, h);
+    *names = a;
+    return n;
+  fail:
+    kh_destroy(snp_ctg, h);
+    free(a);
+    return -1;
+}
+
 /*@note        If length of Ref or Alt is larger than 1, then the SNP would be skipped.
                If length of Ref or Alt is 0, then their values would be infered during pileup.
  */
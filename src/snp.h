@@ -15,11 +15,14 @@
 @param pos     0-based coordinate in the reference sequence.
 @param ref     Ref base (a letter). 0 means no ref in the input SNP file for the pos.
 @param alt     Alt base (a letter). 0 means no alt in the input SNP file for the pos.
+@param cid     Id of @p chr in the contig table of the snplist, valid only after calling csp_snplist_contigs(), or
+               index of @p chr in gs->chroms in the combined mode.
  */
 typedef struct {
     char *chr;   
     hts_pos_t pos; 
     int8_t ref, alt;
+    int cid;
 } csp_snp_t;
 
 /*@abstract  Initilize the csp_snp_t structure.
@@ -59,6 +62,16 @@ typedef kvec_t(csp_snp_t*) csp_snplist_t;   /* kvec_t from kvec.h */
     kv_destroy(v);										\
 }
 
+/*@abstract    Build the contig table of the snplist and set the cid of each SNP.
+@param pl      Pointer of csp_snplist_t.
+@param names   Pointer to array of contig names, set by this function. Contig i has name (*names)[i].
+@return        Num of contigs if success, -1 otherwise.
+
+@note          The names are the chr of the SNPs themselves, so only the array, not the names, should be freed 
+               and the array should not be used after the snplist is destroyed.
+ */
+int csp_snplist_contigs(csp_snplist_t *pl, const char ***names);
+
 /*@abstract    Extract SNP info from bcf/vcf file.
 @param fn      Filename of bcf/vcf.
 @param pl      Pointer to client data used to store the extracted SNP info.
@@ -0,0 +1,354 @@
+#!/bin/sh
+
+## Regression tests on small simulated data, no download needed.
+## Usage: sh test_regression.sh [BIN_DIR]
+##   BIN_DIR is where cellsnp-lite and cellsnp-lite-bmtx are, the repo root by default.
+## Needs samtools. Some cases also need bcftools, or python3 with h5py or pyarrow, and are
+## skipped otherwise. Each case below is one feature, compared with the reference outputs.
+
+BIN_DIR=${1:-$(cd "$(dirname "$0")/.." && pwd)}
+CSP=$BIN_DIR/cellsnp-lite
+BMTX=$BIN_DIR/cellsnp-lite-bmtx
+DAT_DIR=${TMPDIR:-/tmp}/test_cellsnp_regression
+NFAIL=0
+
+rm -rf $DAT_DIR
+mkdir -p $DAT_DIR
+cd $DAT_DIR
+
+ok() { echo "[PASS] $1"; }
+ko() { echo "[FAIL] $1"; NFAIL=$((NFAIL + 1)); }
+run() { $CSP "$@" > /dev/null 2>&1; }
+
+## Compare two output dirs, ignoring the header lines (## of vcf, % of mtx) that record the command line.
+same_out() {
+    for f in $(cd $1 && ls); do
+        [ -f $1/$f ] || continue
+        [ -f $2/$f ] || return 1
+        case $f in *.bmtx|*.h5|*.arrows|*.gz|*.tbi|*.bcf|*.csi) cmp -s $1/$f $2/$f || return 1; continue ;; esac
+        grep -v '^##\|^%' $1/$f > $DAT_DIR/a.tmp
+        grep -v '^##\|^%' $2/$f > $DAT_DIR/b.tmp
+        cmp -s $DAT_DIR/a.tmp $DAT_DIR/b.tmp || return 1
+    done
+    return 0
+}
+
+## Records of a mtx file, sorted, without the header and the dims line.
+mtx_records() {
+    grep -v '^%' $1 | tail -n +2 | sort
+}
+
+## Same records in the mtx files of tag AD, DP and OTH of two output dirs.
+same_mtx() {
+    for t in AD DP OTH; do
+        [ -f $1/cellSNP.tag.$t.mtx ] && [ -f $2/cellSNP.tag.$t.mtx ] || return 1
+        [ "$(mtx_records $1/cellSNP.tag.$t.mtx)" = "$(mtx_records $2/cellSNP.tag.$t.mtx)" ] || return 1
+    done
+    return 0
+}
+
+## CHROM and POS of the records of a vcf.
+snp_pos() {
+    grep -v '^#' $1 | cut -f1,2
+}
+
+### Simulate data
+## chr1 (3000 bp) with 5 SNPs and chrM (20000 bp) with 4 SNPs, 4 cells with CB/UB tags.
+## Cells 0 and 1 carry the ALT allele in half of their reads, plus random reads on chrM.
+awk -v dir=$DAT_DIR 'BEGIN {
+    srand(7); split("A C G T", B, " ");
+    len["chr1"] = 3000; len["chrM"] = 20000;
+    split("chr1:500 chr1:1000 chr1:1500 chr1:2000 chr1:2500 chrM:100 chrM:5000 chrM:9000 chrM:15000", S, " ");
+    fa = dir "/ref.fa"; vcf = dir "/snp.vcf"; sam = dir "/all.sam"; bc = dir "/barcodes.tsv";
+    print "##fileformat=VCFv4.2" > vcf;
+    print "@HD\tVN:1.6\tSO:unsorted" > sam;
+    split("chr1 chrM", C, " ");
+    for (c = 1; c <= 2; c++) {
+        chr = C[c]; seq[chr] = "";
+        for (i = 0; i < len[chr]; i++) { seq[chr] = seq[chr] B[int(rand() * 4) + 1]; }
+        print ">" chr > fa;
+        for (i = 1; i <= len[chr]; i += 60) { print substr(seq[chr], i, 60) > fa; }
+        print "##contig=<ID=" chr ",length=" len[chr] ">" > vcf;
+        print "@SQ\tSN:" chr "\tLN:" len[chr] > sam;
+    }
+    print "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO" > vcf;
+    for (cell = 0; cell < 4; cell++) { print "cell" cell "-1" > bc; }
+    q = ""; for (i = 0; i < 50; i++) { q = q "I"; }
+    nr = 0;
+    for (s = 1; s <= 9; s++) {
+        split(S[s], x, ":"); chr = x[1]; pos = x[2] + 0;
+        ref = substr(seq[chr], pos, 1); alt = (ref == "A") ? "G" : "A";
+        print chr "\t" pos "\t.\t" ref "\t" alt "\t.\tPASS\t." > vcf;
+        for (cell = 0; cell < 4; cell++) {
+            for (j = 0; j < 8; j++) {
+                beg = pos - 1 - int(rand() * 45);
+                r = substr(seq[chr], beg + 1, 50);
+                if (cell < 2 && j % 2 == 0) { r = substr(r, 1, pos - beg - 1) alt substr(r, pos - beg + 1); }
+                print "r" (++nr) "\t0\t" chr "\t" beg + 1 "\t60\t50M\t*\t0\t0\t" r "\t" q "\tCB:Z:cell" cell "-1\tUB:Z:U" nr > sam;
+            }
+        }
+    }
+    for (i = 0; i < 2000; i++) {
+        beg = int(rand() * (len["chrM"] - 50)); cell = int(rand() * 4);
+        u = (i % 5 == 0) ? "D" int(i / 5) : "U" (++nr);     # some reads share one UMI.
+        print "r" (++nr) "\t0\tchrM\t" beg + 1 "\t60\t50M\t*\t0\t0\t" substr(seq["chrM"], beg + 1, 50) "\t" q "\tCB:Z:cell" cell "-1\tUB:Z:" u > sam;
+    }
+}'
+samtools faidx ref.fa && samtools sort -o all.bam all.sam && samtools index all.bam || { echo "failed to simulate data."; exit 1; }
+## mode 3: a.bam has cells 0 and 1, b.bam has cells 2 and 3 and no chrM in its header.
+samtools view -h all.bam | awk '$1 ~ /^@/ || /CB:Z:cell[01]-1/' | samtools view -b -o a.bam - && samtools index a.bam
+samtools view -h all.bam chr1 | awk '$0 !~ /^@SQ.*SN:chrM/ && ($1 ~ /^@/ || /CB:Z:cell[23]-1/)' | \
+    samtools view -b -o b.bam - && samtools index b.bam
+
+### Reference outputs
+## m1: mode 1, m3: mode 3, m2: mode 2 whose filters keep exactly the 9 SNPs.
+run -s all.bam -b barcodes.tsv -R snp.vcf -O m1 --minCOUNT 1 -p 3 || { echo "failed to run mode 1."; exit 1; }
+run -s a.bam,b.bam -I A,B -R snp.vcf -O m3 --minCOUNT 1 --cellTAG None --UMItag None -p 2 || \
+    { echo "failed to run mode 3."; exit 1; }
+run -s all.bam -b barcodes.tsv -O m2 --chrom chr1,chrM --minCOUNT 20 --minMAF 0.1 -p 2 || \
+    { echo "failed to run mode 2."; exit 1; }
+
+### --ioHint (user-026): the outputs are the same with the I/O hints
+run -s all.bam -b barcodes.tsv -R snp.vcf -O io --minCOUNT 1 -p 3 --ioHint && same_out m1 io && \
+    ok "--ioHint" || ko "--ioHint"
+
+### --maxOpen (user-027): mode 3 with one open file per thread, from BAM and CRAM inputs
+run -s a.bam,b.bam -I A,B -R snp.vcf -O m3_open1 --minCOUNT 1 --cellTAG None --UMItag None -p 2 --maxOpen 1 && \
+    same_out m3 m3_open1 && ok "--maxOpen 1" || ko "--maxOpen 1"
+for f in a b; do
+    samtools view -C -T ref.fa --output-fmt-option embed_ref=1 -o $f.cram $f.bam && samtools index $f.cram
+done
+run -s a.cram,b.cram -I A,B -R snp.vcf -O m3_cram --minCOUNT 1 --cellTAG None --UMItag None -p 2 --maxOpen 1 && \
+    same_out m3 m3_cram && ok "--maxOpen 1 with CRAM" || ko "--maxOpen 1 with CRAM"
+
+### --hdrCache (user-028): the cached headers give the same outputs, entries follow the input order
+mkdir hc
+run -s a.bam,b.bam -I A,B -R snp.vcf -O hc1 --minCOUNT 1 --cellTAG None --UMItag None -p 2 --hdrCache hc && \
+run -s a.bam,b.bam -I A,B -R snp.vcf -O hc2 --minCOUNT 1 --cellTAG None --UMItag None -p 2 --hdrCache hc && \
+    [ -s hc/0.hdr ] && [ -s hc/1.hdr ] && same_out m3 hc1 && same_out m3 hc2 && \
+    ok "--hdrCache" || ko "--hdrCache"
+run -s b.bam,a.bam -I B,A -R snp.vcf -O hc3 --minCOUNT 1 --cellTAG None --UMItag None -p 2 --hdrCache hc && \
+    head -1 hc/0.hdr | grep -q 'b\.bam$' && ok "--hdrCache with the inputs reordered" || \
+    ko "--hdrCache with the inputs reordered"
+
+### Contig names (user-029): SNPs named without "chr" are found in the BAM with "chr"
+sed 's/^chr//; s/ID=chr/ID=/' snp.vcf > snp.nochr.vcf
+run -s all.bam -b barcodes.tsv -R snp.nochr.vcf -O nochr --minCOUNT 1 -p 3 && same_mtx m1 nochr && \
+    ok "contigs without chr" || ko "contigs without chr"
+
+### Barcode filter (user-030): reads of cells not in the list do not change the counts in mode 2
+head -2 barcodes.tsv > barcodes.01.tsv
+run -s all.bam -b barcodes.01.tsv -O m2_01 --chrom chr1,chrM --minCOUNT 10 --minMAF 0.1 -p 2 && \
+run -s a.bam -b barcodes.01.tsv -O m2_01a --chrom chr1,chrM --minCOUNT 10 --minMAF 0.1 -p 2 && \
+    same_out m2_01 m2_01a && ok "mode 2 barcode filter" || ko "mode 2 barcode filter"
+
+### --plpEngine stream (user-031): the same outputs as htslib, also with reads of two files interleaved
+for e in htslib stream; do
+    run -s all.bam -b barcodes.tsv -O m2_$e --chrom chr1,chrM --minCOUNT 1 --minMAF 0 -p 2 --plpEngine $e
+    run -s a.bam,b.bam -I A,B -O m2s_$e --chrom chr1,chrM --minCOUNT 1 --minMAF 0 --cellTAG None --UMItag None \
+        -p 2 --plpEngine $e
+done
+[ -s m2_htslib/cellSNP.base.vcf ] && same_out m2_htslib m2_stream && ok "--plpEngine stream" || \
+    ko "--plpEngine stream"
+[ -s m2s_htslib/cellSNP.base.vcf ] && same_out m2s_htslib m2s_stream && ok "--plpEngine stream, two files" || \
+    ko "--plpEngine stream, two files"
+
+### Two-phase counting (user-032): mode 2 keeps exactly the SNPs, with the counts of mode 1
+[ "$(snp_pos m2/cellSNP.base.vcf)" = "$(snp_pos snp.vcf)" ] && same_mtx m1 m2 && \
+    ok "mode 2 filters and counts" || ko "mode 2 filters and counts"
+
+### --refseq (user-033): positions matching the reference are skipped, also with contigs named without "chr"
+sed 's/^>chr/>/' ref.fa > ref.nochr.fa && samtools faidx ref.nochr.fa
+for r in ref ref.nochr; do
+    run -s all.bam -b barcodes.tsv -O rs_$r --chrom chr1,chrM --minCOUNT 1 --minMAF 0 -p 2 --refseq $r.fa && \
+        [ "$(snp_pos rs_$r/cellSNP.base.vcf)" = "$(snp_pos snp.vcf)" ] && ok "--refseq $r.fa" || ko "--refseq $r.fa"
+done
+
+### --targets (user-034): only the SNPs in the target regions are output
+printf "chr1\t900\t1100\nchrM\t4900\t5100\n" > targets.bed
+printf "chr1\t1000\nchrM\t5000\n" > targets.pos
+run -s all.bam -b barcodes.tsv -O tgt --chrom chr1,chrM --minCOUNT 20 --minMAF 0.1 -p 2 --targets targets.bed && \
+    [ "$(snp_pos tgt/cellSNP.base.vcf)" = "$(cat targets.pos)" ] && ok "--targets" || ko "--targets"
+
+### --denseLen (user-035): the dense engine gives the same outputs, also when an input file lacks the contig
+for s in a.bam,b.bam b.bam,a.bam; do
+    run -s $s -I A,B -O ds_$s --chrom chr1,chrM --minCOUNT 1 --minMAF 0 --cellTAG None --UMItag None -p 2 && \
+    run -s $s -I A,B -O ds_dense_$s --chrom chr1,chrM --minCOUNT 1 --minMAF 0 --cellTAG None --UMItag None -p 2 \
+        --denseLen 20000 && same_out ds_$s ds_dense_$s && ok "--denseLen, inputs $s" || ko "--denseLen, inputs $s"
+done
+
+### --cellCap (user-036): at most the cap of reads per cell, no change by a cap above the depth
+run -s all.bam -b barcodes.tsv -R snp.vcf -O cap2 --minCOUNT 1 -p 3 --cellCap 2 && \
+    [ "$(mtx_records cap2/cellSNP.tag.DP.mtx | awk '$3 > 2' | wc -l)" -eq 0 ] && \
+    [ -n "$(mtx_records cap2/cellSNP.tag.DP.mtx)" ] && ok "--cellCap 2" || ko "--cellCap 2"
+run -s all.bam -b barcodes.tsv -R snp.vcf -O cap1000 --minCOUNT 1 -p 3 --cellCap 1000 && same_out m1 cap1000 && \
+    ok "--cellCap 1000" || ko "--cellCap 1000"
+
+### --cellShards (user-037): sharded and unsharded outputs are the same in mode 1
+run -s all.bam -b barcodes.tsv -R snp.vcf -O m1_shard --minCOUNT 1 --cellShards 3 -p 3 && \
+    same_out m1 m1_shard && ok "mode 1 --cellShards" || ko "mode 1 --cellShards"
+
+### --cellShards in mode 3 (user-038): the same outputs, with one input file lacking a contig
+run -s a.bam,b.bam -I A,B -R snp.vcf -O m3_shard --minCOUNT 1 --cellTAG None --UMItag None --cellShards 2 -p 2 && \
+    same_out m3 m3_shard && ok "mode 3 --cellShards, one file lacking a contig" || \
+    ko "mode 3 --cellShards, one file lacking a contig"
+
+### Long reads (user-039): reads with the same pos and CIGAR, or the same pos and another CIGAR, are counted right
+## 5 reads of each cell from pos 1 (CIGAR 400M3D400M2I400M) or pos 11 (the same CIGAR, or 1200M), cells 0 and 1
+## carry the ALT of chr1:500 and chr1:1000.
+awk -v dir=$DAT_DIR 'BEGIN {
+    while ((getline l < (dir "/ref.fa")) > 0) { if (l ~ /^>/) { c = substr(l, 2); } else if (c == "chr1") { s = s l; } }
+    while ((getline l < (dir "/snp.vcf")) > 0) { split(l, x, "\t"); if (x[1] == "chr1") { alt[x[2] - 1] = x[5]; } }
+    print "@HD\tVN:1.6\tSO:unsorted\n@SQ\tSN:chr1\tLN:" length(s) "\n@SQ\tSN:chrM\tLN:20000";
+    for (cell = 0; cell < 4; cell++) {
+        for (j = 0; j < 5; j++) {
+            b = j < 3 ? 0 : 10; cg = j < 4 ? "400M3D400M2I400M" : "1200M";
+            if (j < 4) { r = substr(s, b + 1, 400) substr(s, b + 404, 400) "AC" substr(s, b + 804, 400); }
+            else { r = substr(s, b + 1, 1200); }
+            for (p in alt) {
+                if (cell > 1) { continue; }
+                if (j == 4) { o = p - b; }
+                else if (p >= b + 403 && p < b + 803) { o = 400 + p - b - 403; }
+                else if (p >= b + 803 && p < b + 1203) { o = 802 + p - b - 803; }
+                else { continue; }
+                if (o >= 0 && o < 1200 + (j < 4 ? 2 : 0)) { r = substr(r, 1, o) alt[p] substr(r, o + 2); }
+            }
+            q = r; gsub(/./, "I", q);
+            print "l" cell "_" j "\t0\tchr1\t" b + 1 "\t60\t" cg "\t*\t0\t0\t" r "\t" q "\tCB:Z:cell" cell "-1\tUB:Z:L" cell "_" j;
+        }
+    }
+}' > long.sam
+samtools sort -o long.bam long.sam && samtools index long.bam
+printf "1\t1\t5\n1\t2\t5\n2\t1\t5\n2\t2\t5\n" | sort > long.ad
+run -s long.bam -b barcodes.tsv -R snp.vcf -O long --minCOUNT 1 -p 2 && \
+    [ "$(mtx_records long/cellSNP.tag.AD.mtx)" = "$(cat long.ad)" ] && ok "long reads" || ko "long reads"
+
+### --discover (user-040): the given SNPs in OUTDIR, other sites in OUTDIR/discover
+run -s all.bam -b barcodes.tsv -R snp.vcf -O disc --chrom chr1,chrM --minCOUNT 1 --minMAF 0 --discover -p 2 && \
+    [ "$(snp_pos disc/cellSNP.base.vcf)" = "$(snp_pos snp.vcf)" ] && same_mtx m1 disc && \
+    [ -s disc/discover/cellSNP.base.vcf ] && [ -s disc/discover/cellSNP.tag.AD.mtx ] && \
+    ok "--discover" || ko "--discover"
+
+### --binMtx (user-041): converted back with cellsnp-lite-bmtx
+run -s all.bam -b barcodes.tsv -R snp.vcf -O bmtx --minCOUNT 1 --binMtx -p 2
+r=$?
+for t in AD DP OTH; do
+    [ $r -eq 0 ] && $BMTX bmtx/cellSNP.tag.$t.bmtx bmtx.$t.mtx && \
+    [ "$(grep -v '^%' bmtx.$t.mtx | head -1)" = "$(grep -v '^%' m1/cellSNP.tag.$t.mtx | head -1)" ] && \
+    [ "$(mtx_records bmtx.$t.mtx)" = "$(mtx_records m1/cellSNP.tag.$t.mtx)" ] && \
+    ok "--binMtx $t" || ko "--binMtx $t"
+done
+
+### --bcf (user-042): the indexed BCF has the SNPs of the vcf
+if run -s all.bam -b barcodes.tsv -R snp.vcf -O bcf --minCOUNT 1 --bcf -p 2 && \
+    [ -s bcf/cellSNP.base.bcf ] && [ -s bcf/cellSNP.base.bcf.csi ] && same_mtx m1 bcf; then
+    if command -v bcftools > /dev/null 2>&1; then
+        [ "$(bcftools query -f '%CHROM\t%POS\n' bcf/cellSNP.base.bcf)" = "$(snp_pos m1/cellSNP.base.vcf)" ] && \
+            ok "--bcf" || ko "--bcf"
+    else
+        ok "--bcf (records not checked, no bcftools)"
+    fi
+else
+    ko "--bcf"
+fi
+
+### --hdf5 (user-043): the CSR matrices have the records of the mtx
+if python3 -c "import h5py" 2> /dev/null; then
+    if run -s all.bam -b barcodes.tsv -R snp.vcf -O h5 --minCOUNT 1 --hdf5 -p 2; then
+        for t in AD DP OTH; do
+            python3 - h5/cellSNP.h5 $t > h5.$t.txt << 'EOF'
+import sys, h5py
+with h5py.File(sys.argv[1], "r") as f:
+    g = f[sys.argv[2]]
+    p, c, v = g["indptr"][:], g["indices"][:], g["data"][:]
+    for r in range(len(p) - 1):
+        for j in range(p[r], p[r + 1]):
+            print("%d\t%d\t%d" % (r + 1, c[j] + 1, v[j]))
+EOF
+            [ "$(sort h5.$t.txt)" = "$(mtx_records h5/cellSNP.tag.$t.mtx)" ] && ok "--hdf5 $t" || ko "--hdf5 $t"
+        done
+    else
+        echo "[SKIP] --hdf5, not built with WITH_HDF5=1"
+    fi
+else
+    echo "[SKIP] --hdf5, no h5py"
+fi
+
+### --sparseGT (user-044): one genotype for each (SNP, cell) pair with reads, i.e., in DP or OTH
+run -s all.bam -b barcodes.tsv -R snp.vcf -O sgt --minCOUNT 1 --genotype --sparseGT -p 2 && \
+    [ "$(grep -v '^%' sgt/cellSNP.tag.GT.tsv | cut -f1,2 | sort)" = \
+      "$({ mtx_records sgt/cellSNP.tag.DP.mtx; mtx_records sgt/cellSNP.tag.OTH.mtx; } | cut -f1,2 | sort -u)" ] && \
+    ok "--sparseGT" || ko "--sparseGT"
+
+### --arrow (user-045): the streams have the records of the mtx and the SNPs of the vcf
+if python3 -c "import pyarrow" 2> /dev/null; then
+    run -s all.bam -b barcodes.tsv -R snp.vcf -O arw --minCOUNT 1 --arrow -p 2 && \
+    python3 - arw > arw.txt << 'EOF'
+import sys, pyarrow as pa
+tag = pa.ipc.open_stream(sys.argv[1] + "/cellSNP.tag.arrows").read_all().to_pydict()
+snp = pa.ipc.open_stream(sys.argv[1] + "/cellSNP.snp.arrows").read_all().to_pydict()
+print(len(snp["pos"]))
+for i in range(len(tag["snp_idx"])):
+    if tag["ad"][i]:
+        print("%d\t%d\t%d" % (tag["snp_idx"][i] + 1, tag["cell_idx"][i] + 1, tag["ad"][i]))
+EOF
+    [ $? -eq 0 ] && [ "$(head -1 arw.txt)" = "$(grep -vc '^#' arw/cellSNP.base.vcf)" ] && \
+    [ "$(tail -n +2 arw.txt | sort)" = "$(mtx_records arw/cellSNP.tag.AD.mtx)" ] && ok "--arrow" || ko "--arrow"
+else
+    echo "[SKIP] --arrow, no pyarrow"
+fi
+
+### --gzip (user-046): the indexed vcf.gz and the other zipped outputs have the records of the plain ones
+if run -s all.bam -b barcodes.tsv -R snp.vcf -O gz --minCOUNT 1 --gzip -p 2 && \
+    [ -s gz/cellSNP.base.vcf.gz ] && [ -s gz/cellSNP.base.vcf.gz.tbi ]; then
+    mkdir gz_plain
+    for f in gz/*; do
+        case $f in
+            *.tbi) ;;
+            *.gz) gzip -dc $f > gz_plain/$(basename $f .gz) ;;
+            *) cp $f gz_plain/ ;;
+        esac
+    done
+    same_out m1 gz_plain && ok "--gzip" || ko "--gzip"
+else
+    ko "--gzip"
+fi
+
+### --outTags (user-047): only the selected matrices, whose records do not depend on the other tags or --genotype
+run -s all.bam -b barcodes.tsv -R snp.vcf -O tags --minCOUNT 1 --outTags AD,REF -p 2 && \
+    [ "$(mtx_records tags/cellSNP.tag.AD.mtx)" = "$(mtx_records m1/cellSNP.tag.AD.mtx)" ] && \
+    [ -s tags/cellSNP.tag.REF.mtx ] && [ ! -e tags/cellSNP.tag.DP.mtx ] && ok "--outTags" || ko "--outTags"
+run -s all.bam -b barcodes.tsv -R snp.vcf -O gt --minCOUNT 1 --genotype -p 2 && same_mtx m1 gt && \
+    ok "cell matrices with --genotype" || ko "cell matrices with --genotype"
+
+### --cellMajor (user-048): the records of the matrices, sorted by cell then SNP
+run -s all.bam -b barcodes.tsv -R snp.vcf -O cm --minCOUNT 1 --cellMajor -p 2 && \
+    [ "$(mtx_records cm/cellSNP.tag.AD.cell.mtx)" = "$(mtx_records m1/cellSNP.tag.AD.mtx)" ] && \
+    grep -v '^%' cm/cellSNP.tag.AD.cell.mtx | tail -n +2 | sort -c -s -k2,2n -k1,1n 2> /dev/null && \
+    ok "--cellMajor" || ko "--cellMajor"
+
+### --cellGroups (user-049): the group matrices are the sums of their cells, a barcode listed twice is an error
+printf "cell0-1\tg1\ncell1-1\tg1\ncell2-1\tg2\ncell3-1\tg2\n" > groups.tsv
+run -s all.bam -b barcodes.tsv -R snp.vcf -O grp --minCOUNT 1 --cellGroups groups.tsv -p 2
+r=$?
+for t in AD DP OTH; do
+    [ $r -eq 0 ] && [ "$(mtx_records grp/cellSNP.group.tag.$t.mtx)" = "$(mtx_records m1/cellSNP.tag.$t.mtx | \
+        awk '{ s[$1 "\t" ($2 <= 2 ? 1 : 2)] += $3 } END { for (k in s) if (s[k]) print k "\t" s[k] }' | sort)" ] && \
+        ok "--cellGroups $t" || ko "--cellGroups $t"
+done
+printf "cell0-1\tg2\n" | cat groups.tsv - > groups.dup.tsv
+run -s all.bam -b barcodes.tsv -R snp.vcf -O grp_dup --minCOUNT 1 --cellGroups groups.dup.tsv -p 2 && \
+    ko "--cellGroups with a barcode listed twice" || ok "--cellGroups with a barcode listed twice"
+
+### --binDepth (user-050): chrM pileup-ed block by block by the dense engine gives the same bins as the htslib engine
+## many barcodes, so that chrM is split into several blocks by the dense engine.
+awk 'BEGIN { for (i = 0; i < 6000; i++) { print "cell" i "-1"; } }' > barcodes.6000.tsv
+run -s all.bam -b barcodes.6000.tsv -O bd --chrom chr1,chrM --minCOUNT 1 --binDepth 100 -p 2 && \
+run -s all.bam -b barcodes.6000.tsv -O bd_dense --chrom chr1,chrM --minCOUNT 1 --binDepth 100 -p 2 --denseLen 20000 && \
+    [ $(grep -c chrM bd/cellSNP.bins.bed) -eq 200 ] && cmp -s bd/cellSNP.bins.bed bd_dense/cellSNP.bins.bed && \
+    [ "$(mtx_records bd/cellSNP.bin.mtx)" = "$(mtx_records bd_dense/cellSNP.bin.mtx)" ] && \
+    ok "--binDepth with --denseLen" || ko "--binDepth with --denseLen"
+
+rm -f a.tmp b.tmp
+echo "$NFAIL test(s) failed."
+[ $NFAIL -eq 0 ]